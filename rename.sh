@@ -19,11 +19,13 @@ ORG=$(ls *.sln)
 ORG="${ORG%.*}"
 echo "Renaming '$ORG' to '$NEW'..."
 
-sed -b -i "s/$ORG/$NEW/g" $ORG.sln README.md .vs/*.vcxproj* src/*.c
+sed -b -i "s/$ORG/$NEW/g" $ORG.sln README.md .vs/*.vcxproj* src/*.c src/*.h
 git mv $ORG.sln $NEW.sln
 git mv .vs/$ORG.vcxproj .vs/$NEW.vcxproj
 git mv .vs/$ORG.vcxproj.filters .vs/$NEW.vcxproj.filters
 git mv .vs/$ORG.vcxproj.user .vs/$NEW.vcxproj.user
+git mv .vs/$ORG-lib.vcxproj .vs/$NEW-lib.vcxproj
+git mv .vs/$ORG-dll.vcxproj .vs/$NEW-dll.vcxproj
 git mv src/$ORG.c src/$NEW.c
 # Delete existing tags
 git tag | xargs git tag -d
@@ -0,0 +1,318 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Hash aggregation
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aggregate.h"
+#include "cpu.h"
+#include "pool.h"
+
+// How full the local tables get before they are spilled
+#define AGG_LOCAL_LOAD		(AGG_LOCAL_SLOTS * 3 / 4)
+// Slots of the table a partition gets merged in, past which it gets split further
+#define AGG_MERGE_SLOTS		8192
+// Groups a partition list starts with
+#define AGG_LIST_MIN		256
+
+typedef struct {
+	agg_group_t* group;
+	size_t count, size;
+} agg_list_t;
+
+typedef struct {
+	const uint64_t* keys;
+	const uint64_t* values;
+	size_t n, block, blocks;
+	agg_group_t* local;		// AGG_LOCAL_SLOTS per worker
+	agg_list_t* list;		// AGG_PARTITIONS per block
+	size_t* offset;			// Where the groups of each partition go in out, which has room for all of their lists
+	size_t* found;			// Groups each partition ends up with
+	agg_group_t* out;
+	volatile LONG errors;
+} agg_range_t;
+
+// The finalizer of MurmurHash3, so that every bit of the key affects the top and bottom ones
+static FORCE_INLINE uint64_t agg_hash(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ULL;
+	key ^= key >> 33;
+	return key;
+}
+
+// Add to the group of key in an open addressing table, and return whether it is a new one
+static FORCE_INLINE BOOL agg_add(agg_group_t* table, size_t mask, uint64_t hash, uint64_t key,
+	uint64_t count, uint64_t sum)
+{
+	size_t i;
+
+	// Groups always have a count, so an empty slot has none
+	for (i = (size_t)hash & mask; table[i].count != 0; i = (i + 1) & mask) {
+		if (table[i].key == key) {
+			table[i].count += count;
+			table[i].sum += sum;
+			return FALSE;
+		}
+	}
+	table[i].key = key;
+	table[i].count = count;
+	table[i].sum = sum;
+	return TRUE;
+}
+
+static FORCE_INLINE BOOL agg_append(agg_list_t* list, const agg_group_t* group)
+{
+	agg_group_t* g;
+	agg_list_t* l = &list[agg_hash(group->key) >> (64 - AGG_PARTITION_BITS)];
+	size_t size;
+
+	if (l->count == l->size) {
+		size = max(2 * l->size, AGG_LIST_MIN);
+		g = (agg_group_t*)realloc(l->group, size * sizeof(agg_group_t));
+		if (g == NULL)
+			return FALSE;
+		l->group = g;
+		l->size = size;
+	}
+	l->group[l->count++] = *group;
+	return TRUE;
+}
+
+// Move the groups of a local table to the lists of the block, by the top bits of their hash
+static void AggregateSpill(agg_range_t* range, agg_list_t* list, agg_group_t* local)
+{
+	size_t i;
+
+	for (i = 0; i < AGG_LOCAL_SLOTS; i++) {
+		if ((local[i].count != 0) && !agg_append(list, &local[i])) {
+			InterlockedIncrement(&range->errors);
+			break;
+		}
+	}
+	memset(local, 0, AGG_LOCAL_SLOTS * sizeof(agg_group_t));
+}
+
+static void AggregateBlockRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	agg_range_t* range = (agg_range_t*)ctx;
+	agg_group_t group, *local = &range->local[(size_t)worker * AGG_LOCAL_SLOTS];
+	agg_list_t* list;
+	size_t i, since, last, used;
+	uint64_t b;
+
+	for (b = begin; b < end; b++) {
+		list = &range->list[b * AGG_PARTITIONS];
+		since = (size_t)b * range->block;
+		last = min(since + range->block, range->n);
+		for (used = 0, i = since; i < last; i++) {
+			if (agg_add(local, AGG_LOCAL_SLOTS - 1, agg_hash(range->keys[i]), range->keys[i], 1,
+				(range->values == NULL) ? 0 : range->values[i]) && (++used == AGG_LOCAL_LOAD)) {
+				AggregateSpill(range, list, local);
+				used = 0;
+				// If the table did not even halve what went through it, the keys are mostly
+				// unique, and it is cheaper to partition the rest of them as they come
+				if (i + 1 - since < 2 * AGG_LOCAL_LOAD)
+					break;
+				since = i + 1;
+			}
+		}
+		for (group.count = 1, group.sum = 0, i++; i < last; i++) {
+			group.key = range->keys[i];
+			if (range->values != NULL)
+				group.sum = range->values[i];
+			if (!agg_append(list, &group)) {
+				InterlockedIncrement(&range->errors);
+				break;
+			}
+		}
+		AggregateSpill(range, list, local);
+	}
+}
+
+// Move the groups of a table to out, leaving it empty, and return how many there were
+static size_t agg_collect(agg_group_t* table, size_t size, agg_group_t* out)
+{
+	size_t i, count = 0;
+
+	for (i = 0; i < size; i++) {
+		if (table[i].count != 0)
+			out[count++] = table[i];
+	}
+	memset(table, 0, size * sizeof(agg_group_t));
+	return count;
+}
+
+/*
+ * Merge the lists of a partition. If they are too large for a table that
+ * fits the cache, they first get split further, by the next bits of the
+ * hash, so that the merge isn't a cache miss per group.
+ */
+static void AggregateMergeRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	agg_range_t* range = (agg_range_t*)ctx;
+	agg_group_t *table, *tmp, *out, *g;
+	agg_list_t* l;
+	size_t b, i, s, bits, shift, size, total, largest, *count;
+	uint64_t p;
+
+	for (p = begin; p < end; p++) {
+		for (total = 0, b = 0; b < range->blocks; b++)
+			total += range->list[b * AGG_PARTITIONS + p].count;
+		for (bits = 0; (total >> bits) > AGG_MERGE_SLOTS / 2; bits++);
+		shift = 64 - AGG_PARTITION_BITS - bits;
+		table = NULL;
+		tmp = NULL;
+		out = &range->out[range->offset[p]];
+		count = (size_t*)calloc(((size_t)1 << bits) + 1, sizeof(size_t));
+		if (count == NULL)
+			goto next;
+
+		if (bits == 0) {
+			// Everything goes in a single part, straight from the lists
+			largest = total;
+		} else {
+			tmp = (agg_group_t*)malloc(total * sizeof(agg_group_t));
+			if (tmp == NULL)
+				goto next;
+			for (b = 0; b < range->blocks; b++) {
+				l = &range->list[b * AGG_PARTITIONS + p];
+				for (i = 0, g = l->group; i < l->count; i++, g++)
+					count[((agg_hash(g->key) >> shift) & ((1 << bits) - 1)) + 1]++;
+			}
+			for (largest = 0, s = 0; s < ((size_t)1 << bits); s++) {
+				largest = max(largest, count[s + 1]);
+				count[s + 1] += count[s];
+			}
+			// count[s] goes from the start of part s to its end, which is the start of the next one
+			for (b = 0; b < range->blocks; b++) {
+				l = &range->list[b * AGG_PARTITIONS + p];
+				for (i = 0, g = l->group; i < l->count; i++, g++)
+					tmp[count[(agg_hash(g->key) >> shift) & ((1 << bits) - 1)]++] = *g;
+			}
+		}
+		for (size = 16; size < 2 * largest; size <<= 1);
+		table = (agg_group_t*)calloc(size, sizeof(agg_group_t));
+		if (table == NULL)
+			goto next;
+
+		if (bits == 0) {
+			for (b = 0; b < range->blocks; b++) {
+				l = &range->list[b * AGG_PARTITIONS + p];
+				for (i = 0, g = l->group; i < l->count; i++, g++)
+					agg_add(table, size - 1, agg_hash(g->key), g->key, g->count, g->sum);
+			}
+			range->found[p] = agg_collect(table, size, out);
+		} else {
+			for (s = 0; s < ((size_t)1 << bits); s++) {
+				for (i = (s == 0) ? 0 : count[s - 1], g = &tmp[i]; i < count[s]; i++, g++)
+					agg_add(table, size - 1, agg_hash(g->key), g->key, g->count, g->sum);
+				range->found[p] += agg_collect(table, size, &out[range->found[p]]);
+			}
+		}
+
+next:
+		if ((count == NULL) || ((bits != 0) && (tmp == NULL)) || (table == NULL))
+			InterlockedIncrement(&range->errors);
+		for (b = 0; b < range->blocks; b++) {
+			l = &range->list[b * AGG_PARTITIONS + p];
+			free(l->group);
+			l->group = NULL;
+			l->count = 0;
+		}
+		free(table);
+		free(tmp);
+		free(count);
+	}
+}
+
+BOOL ParallelAggregate(pool_t* pool, const uint64_t* keys, const uint64_t* values, size_t n,
+	agg_group_t** groups, size_t* num_groups)
+{
+	agg_range_t range = { 0 };
+	size_t i, p, total, workers = PoolSize(pool);
+	BOOL r = FALSE;
+
+	*groups = NULL;
+	*num_groups = 0;
+	if (n == 0)
+		return TRUE;
+
+	range.keys = keys;
+	range.values = values;
+	range.n = n;
+	range.block = max(n / (workers * AGG_BLOCKS_PER_WORKER), AGG_LOCAL_SLOTS);
+	range.blocks = (n + range.block - 1) / range.block;
+	range.local = (agg_group_t*)calloc(workers * AGG_LOCAL_SLOTS, sizeof(agg_group_t));
+	range.list = (agg_list_t*)calloc(range.blocks * AGG_PARTITIONS, sizeof(agg_list_t));
+	range.offset = (size_t*)malloc(AGG_PARTITIONS * sizeof(size_t));
+	range.found = (size_t*)calloc(AGG_PARTITIONS, sizeof(size_t));
+	if ((range.local == NULL) || (range.list == NULL) || (range.offset == NULL) || (range.found == NULL)) {
+		fprintf(stderr, "Could not allocate aggregation tables\n");
+		goto out;
+	}
+
+	// Pre-aggregate every block, then merge every partition in its share of out, then close the gaps
+	if (!ParallelFor(pool, 0, range.blocks, 1, AggregateBlockRange, &range) || (range.errors != 0))
+		goto out;
+	for (total = 0, p = 0; p < AGG_PARTITIONS; p++) {
+		range.offset[p] = total;
+		for (i = 0; i < range.blocks; i++)
+			total += range.list[i * AGG_PARTITIONS + p].count;
+	}
+	range.out = (agg_group_t*)malloc(total * sizeof(agg_group_t));
+	if (range.out == NULL) {
+		fprintf(stderr, "Could not allocate aggregation results\n");
+		goto out;
+	}
+	if (!ParallelFor(pool, 0, AGG_PARTITIONS, 1, AggregateMergeRange, &range) || (range.errors != 0)) {
+		free(range.out);
+		goto out;
+	}
+	for (total = 0, p = 0; p < AGG_PARTITIONS; p++) {
+		memmove(&range.out[total], &range.out[range.offset[p]], range.found[p] * sizeof(agg_group_t));
+		total += range.found[p];
+	}
+	*groups = (agg_group_t*)realloc(range.out, total * sizeof(agg_group_t));
+	if (*groups == NULL)
+		*groups = range.out;
+	*num_groups = total;
+	r = TRUE;
+
+out:
+	if (range.errors != 0)
+		fprintf(stderr, "Could not allocate aggregation lists\n");
+	if (range.list != NULL) {
+		for (i = 0; i < range.blocks * AGG_PARTITIONS; i++)
+			free(range.list[i].group);
+	}
+	free(range.local);
+	free(range.list);
+	free(range.offset);
+	free(range.found);
+	return r;
+}
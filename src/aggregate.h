@@ -0,0 +1,53 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Hash aggregation
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+// Slots of the table each worker pre-aggregates into, which should fit its share of the cache
+#define AGG_LOCAL_SLOTS		4096
+// Partitions the groups get spread over, by the top bits of their hash
+#define AGG_PARTITION_BITS	6
+#define AGG_PARTITIONS		(1 << AGG_PARTITION_BITS)
+// How many blocks per worker the input gets split into
+#define AGG_BLOCKS_PER_WORKER	4
+
+typedef struct {
+	uint64_t key;
+	uint64_t count;
+	uint64_t sum;
+} agg_group_t;
+
+/*
+ * Group the n keys, counting them and adding up their values, which can be
+ * NULL to only count them. The workers aggregate their blocks into a table
+ * of their own, which they spill into one list per partition whenever it
+ * gets full, or that they skip once it shows that the keys barely repeat.
+ * Each partition then gets merged by a single worker, so that no table is
+ * ever shared. groups gets allocated with the num_groups results, in no
+ * particular order, and must be freed by the caller.
+ */
+extern BOOL ParallelAggregate(pool_t* pool, const uint64_t* keys, const uint64_t* values, size_t n,
+	agg_group_t** groups, size_t* num_groups);
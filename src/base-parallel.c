@@ -30,6 +30,20 @@
 #include <stdlib.h>
 
 #include "msapi_utf8.h"
+#include "bench.h"
+#include "cpu.h"
+#include "crc.h"
+#include "daemon.h"
+#include "net.h"
+#include "pool.h"
+#include "popcnt.h"
+#include "prefix.h"
+#include "proc.h"
+#include "rng.h"
+#include "run.h"
+#include "scan.h"
+#include "search.h"
+#include "utf.h"
 
 #pragma warning(disable: 6258)		// I know what I'm using TerminateThread for
 
@@ -50,6 +64,8 @@
 #define SPARE_THREADS		0
 // Number of iterations for our dummy loop
 #define MAX_ITERATIONS		100
+// Longest command line that CreateProcess() accepts, for -r
+#define MAX_COMMAND_LINE	32768
 
 // The following is used to indicate cancellation
 volatile BOOL cancel_requested = FALSE;
@@ -59,6 +75,8 @@ DWORD num_threads = 0;
 DWORD_PTR* thread_affinity = NULL;
 HANDLE *data_ready = NULL, *thread_ready = NULL;
 uint32_t* thread_data = NULL;
+// Pool of workers, for the parallel kernels
+pool_t* pool = NULL;
 
 static __inline char* appname(const char* path)
 {
@@ -67,17 +85,6 @@ static __inline char* appname(const char* path)
 	return appname;
 }
 
-static __inline uint8_t popcnt64(register uint64_t u)
-{
-	u = (u & 0x5555555555555555) + ((u >> 1) & 0x5555555555555555);
-	u = (u & 0x3333333333333333) + ((u >> 2) & 0x3333333333333333);
-	u = (u & 0x0f0f0f0f0f0f0f0f) + ((u >> 4) & 0x0f0f0f0f0f0f0f0f);
-	u = (u & 0x00ff00ff00ff00ff) + ((u >> 8) & 0x00ff00ff00ff00ff);
-	u = (u & 0x0000ffff0000ffff) + ((u >> 16) & 0x0000ffff0000ffff);
-	u = (u & 0x00000000ffffffff) + ((u >> 32) & 0x00000000ffffffff);
-	return (uint8_t)u;
-}
-
 /*
  * This call (loosely) detects the number of logical processors on the
  * system, sets the number of threads accordingly and then affixes each
@@ -233,6 +240,80 @@ out:
 	ExitThread(r);
 }
 
+// Write what a command run with -r printed, in the order the commands were given
+static BOOL PrintCommandOutput(void* ctx, const run_result_t* result)
+{
+	fwrite(result->out, 1, result->out_len, stdout);
+	fwrite(result->err, 1, result->err_len, stderr);
+	if (result->error != ERROR_SUCCESS)
+		fprintf(stderr, "Could not run '%s': error %lu\n", result->command, result->error);
+	return TRUE;
+}
+
+// Run the command lines read from stdin, max_processes at a time, like xargs -P
+static int RunCommands(DWORD max_processes)
+{
+	static char line[MAX_COMMAND_LINE];
+	char** commands = NULL, **new_commands;
+	size_t len, count = 0, size = 0;
+	run_stats_t stats;
+	int r = 1;
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		len = strlen(line);
+		while ((len > 0) && ((line[len - 1] == '\n') || (line[len - 1] == '\r')))
+			line[--len] = 0;
+		if (len == 0)
+			continue;
+		if (count == size) {
+			size = max(2 * size, 256);
+			new_commands = realloc(commands, size * sizeof(char*));
+			if (new_commands == NULL) {
+				fprintf(stderr, "Could not alloc commands.\n");
+				goto out;
+			}
+			commands = new_commands;
+		}
+		commands[count] = _strdup(line);
+		if (commands[count] == NULL) {
+			fprintf(stderr, "Could not alloc command.\n");
+			goto out;
+		}
+		count++;
+	}
+
+	ParallelRun(pool, (const char* const*)commands, count, max_processes, RUN_ORDERED, PrintCommandOutput,
+		NULL, &stats);
+	fprintf(stderr, "%llu commands (%llu failed, %llu could not be run) in %.2f s: "
+		"%.1f ms median, %.1f ms p99, %.1f ms max\n", stats.commands, stats.failed, stats.errors,
+		stats.seconds, stats.time_median, stats.time_p99, stats.time_max);
+	if ((stats.commands == count) && (stats.failed == 0))
+		r = 0;
+
+out:
+	while (count > 0)
+		free(commands[--count]);
+	free(commands);
+	return r;
+}
+
+// Run the tasks of the coordinator at HOST:PORT, or [HOST]:PORT for IPv6 addresses
+static int RunAgentFor(char* address)
+{
+	char* port = strrchr(address, ':');
+
+	if (port == NULL) {
+		fprintf(stderr, "Agent address must be HOST:PORT.\n");
+		return 1;
+	}
+	*port++ = 0;
+	if ((address[0] == '[') && (port - address > 2) && (port[-2] == ']')) {
+		address++;
+		port[-2] = 0;
+	}
+	return RunAgent(pool, address, port) ? 0 : 1;
+}
+
 // Important: If debugging this in Visual Studio, you will get an
 // exception when pressing Ctrl-C as the debugger is set to break
 // then. See https://stackoverflow.com/a/13207212/1069307.
@@ -242,6 +323,8 @@ static BOOL WINAPI ConsoleHandler(DWORD dwCtrlType)
 	case CTRL_C_EVENT:
 		printf("Ctrl-C received\n");
 		cancel_requested = TRUE;
+		if (pool != NULL)
+			CancelPool(pool);
 		return TRUE;
 	default:
 		return FALSE;
@@ -250,9 +333,54 @@ static BOOL WINAPI ConsoleHandler(DWORD dwCtrlType)
 
 int main_utf8(int argc, char** argv)
 {
-	int r = 1;
+	int i, r = 1;
+	uint32_t disabled_features = 0;
+	const char* bench = NULL;
+	const char* worker_name = NULL;
+	const char* daemon_name = NULL;
+	char* agent = NULL;
+	char** job_argv = NULL;
+	int job_argc = 0;
+	DWORD max_processes = 0, worker_index = 0;
+	BOOL run = FALSE, daemon = FALSE;
 	HANDLE control_thread;
 
+	for (i = 1; i < argc; i++) {
+		if ((strcmp(argv[i], "-a") == 0) && (i + 1 < argc)) {
+			agent = argv[++i];
+		} else if ((strcmp(argv[i], "-b") == 0) && (i + 1 < argc)) {
+			bench = argv[++i];
+		} else if ((strcmp(argv[i], "-c") == 0) && (i + 2 < argc)) {
+			// The rest of the command line is the job
+			daemon_name = argv[++i];
+			job_argv = &argv[i + 1];
+			job_argc = argc - i - 1;
+			break;
+		} else if ((strcmp(argv[i], "-d") == 0) && (i + 1 < argc)) {
+			daemon_name = argv[++i];
+			daemon = TRUE;
+		} else if ((strcmp(argv[i], "-r") == 0) && (i + 1 < argc)) {
+			max_processes = (DWORD)strtoul(argv[++i], NULL, 10);
+			run = TRUE;
+		} else if ((strcmp(argv[i], "-w") == 0) && (i + 2 < argc)) {
+			// How CreateProcPool() starts its workers, so it isn't part of the usage
+			worker_name = argv[++i];
+			worker_index = (DWORD)strtoul(argv[++i], NULL, 10);
+		} else if ((strcmp(argv[i], "-x") == 0) && (i + 1 < argc)) {
+			disabled_features = (uint32_t)strtoul(argv[++i], NULL, 16);
+		} else {
+			fprintf(stderr, "Usage: %s [-a HOST:PORT] [-b BENCHMARK] [-c NAME JOB [ARGS...]] [-d NAME] "
+				"[-r MAX_PROCESSES] [-x DISABLED_CPU_FEATURES_MASK]\n", appname(argv[0]));
+			goto out;
+		}
+	}
+
+	// Jobs sent to a daemon skip everything that the daemon did once for all of them
+	if (job_argv != NULL) {
+		r = RunDaemonJob(daemon_name, job_argc, job_argv);
+		goto out;
+	}
+
 	fprintf(stderr, "%s %s © 2020 Pete Batard <pete@akeo.ie>\n\n", appname(argv[0]), APP_VERSION_STR);
 	fprintf(stderr, "This program is free software; you can redistribute it and/or modify it under \n");
 	fprintf(stderr, "the terms of the GNU General Public License as published by the Free Software \n");
@@ -264,6 +392,41 @@ int main_utf8(int argc, char** argv)
 		goto out;
 	}
 
+	DetectCpuFeatures();
+	DisableCpuFeatures(disabled_features);
+	fprintf(stderr, "CPU features: %s\n", CpuFeaturesString());
+	crc_init();
+	popcount_init();
+	utf_init();
+	scan_init();
+	prefix_init();
+	search_init();
+	rng_init();
+	RegisterBenchHandlers();
+
+	if (worker_name != NULL) {
+		r = ProcWorkerMain(worker_name, worker_index);
+		goto out;
+	}
+
+	if ((bench != NULL) || (agent != NULL) || daemon || run) {
+		pool = CreatePool(num_threads, thread_affinity);
+		if (pool == NULL) {
+			fprintf(stderr, "Could not create pool.\n");
+			goto out;
+		}
+		SetConsoleCtrlHandler((PHANDLER_ROUTINE)ConsoleHandler, TRUE);
+		if (bench != NULL)
+			r = RunBenchmark(pool, bench) ? 0 : 1;
+		else if (agent != NULL)
+			r = RunAgentFor(agent);
+		else if (daemon)
+			r = RunDaemon(pool, daemon_name) ? 0 : 1;
+		else
+			r = RunCommands(max_processes);
+		goto out;
+	}
+
 	control_thread = CreateThread(NULL, 0, ControlThread, NULL, 0, NULL);
 	if (control_thread == NULL) {
 		fprintf(stderr, "Could not create control thread.\n");
@@ -278,6 +441,7 @@ int main_utf8(int argc, char** argv)
 	r = 0;
 
 out:
+	DestroyPool(pool);
 	free(thread_affinity);
 	return r;
 }
@@ -0,0 +1,2390 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Benchmarks
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msapi_utf8.h"
+#include "aggregate.h"
+#include "bench.h"
+#include "copy.h"
+#include "crc.h"
+#include "net.h"
+#include "pathcache.h"
+#include "pool.h"
+#include "popcnt.h"
+#include "prefix.h"
+#include "proc.h"
+#include "rng.h"
+#include "run.h"
+#include "scan.h"
+#include "search.h"
+#include "sort.h"
+#include "summary.h"
+#include "tree.h"
+#include "utf.h"
+#include "walk.h"
+
+// Number of times each measurement is repeated (we keep the best one)
+#define BENCH_RUNS			5
+// Size of the bitmaps for the population count benchmark
+#define BENCH_POPCNT_SIZE	(256 << 20)
+// Number of paths for the UTF-16 <-> UTF-8 conversion benchmark
+#define BENCH_UTF_PATHS		(1 << 16)
+// Number of paths and of calls for the file wrappers benchmark
+#define BENCH_WRAPPER_PATHS	1024
+#define BENCH_WRAPPER_CALLS	(1 << 22)
+// Size of the text for the UTF-8 scanning benchmark, and how much each worker grabs at once
+#define BENCH_SCAN_SIZE		(64 << 20)
+#define BENCH_SCAN_CHUNK	(1 << 20)
+// Size of the blocks that scan_index() is called on
+#define BENCH_SCAN_BLOCK	(1 << 16)
+// Number of leaf directories (as 16 subdirectories of 16 directories), and of files in each
+#define BENCH_TREE_DIRS		256
+#define BENCH_TREE_FILES	64
+// Files that ParallelCopyFiles() splits, and files that it copies whole
+#define BENCH_COPY_LARGE	4
+#define BENCH_COPY_LARGE_SIZE	(64 << 20)
+#define BENCH_COPY_SMALL	1024
+#define BENCH_COPY_SMALL_SIZE	(64 << 10)
+#define BENCH_RUN_COMMANDS	256
+#define BENCH_PROC_TASKS	4096
+#define BENCH_PROC_SIZE		(64 << 10)
+// Tasks that kill their worker, out of BENCH_PROC_TASKS
+#define BENCH_PROC_CRASHES	4
+#define BENCH_PROC_CRC		0
+// Agents for the distribution benchmark, the last of which we kill during the last run
+#define BENCH_NET_AGENTS	4
+#define BENCH_NET_TASKS		4096
+// Size of the arrays for the prefix sum and compaction benchmark
+#define BENCH_PREFIX_SIZE	(256 << 20)
+// Keys for the sort benchmark, and the cardinality of the ones of the records
+#define BENCH_SORT_KEYS		(16 << 20)
+#define BENCH_SORT_CARDINALITY	(1 << 16)
+// Keys for the aggregation benchmark, and the number of distinct ones in the low cardinality run
+#define BENCH_AGG_KEYS		(16 << 20)
+#define BENCH_AGG_LOW		(1 << 10)
+// Indexes of the top-K and quantiles benchmark, and how many of the best ones to keep
+#define BENCH_SUMMARY_ITEMS	(8 << 20)
+#define BENCH_SUMMARY_K		100
+// Search space of the find benchmark, chunks of it, and the bits of the hash a match must have cleared
+#define BENCH_FIND_SPACE	(1ULL << 36)
+#define BENCH_FIND_GRAIN	(1 << 16)
+#define BENCH_FIND_BITS		28
+// Candidates of the brute-force search benchmark, and where the one that matches is
+#define BENCH_SEARCH_SPACE	(1ULL << 28)
+#define BENCH_SEARCH_SECRET	(BENCH_SEARCH_SPACE - 12345)
+// Numbers of the random number benchmark, then tasks and samples per task of its Monte Carlo run
+#define BENCH_RNG_NUMBERS	(16 << 20)
+#define BENCH_RNG_TASKS		4096
+#define BENCH_RNG_SAMPLES	4096
+#define BENCH_RNG_SEED		0x0123456789abcdefULL
+// Side of the square matrix of floats the tiling benchmark transposes
+#define BENCH_TILE_SIDE		4096
+
+typedef struct {
+	const char* name;
+	const char* description;
+	BOOL (*run)(pool_t* pool);
+} benchmark_t;
+
+static double GetTime(void)
+{
+	static LARGE_INTEGER freq = { 0 };
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / (double)freq.QuadPart;
+}
+
+// xorshift64
+static uint64_t NextRandom(uint64_t* seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+	return *seed;
+}
+
+static void FillRandom(void* buf, size_t len, uint64_t seed)
+{
+	uint64_t* p = (uint64_t*)buf;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(uint64_t); i++)
+		p[i] = NextRandom(&seed);
+}
+
+static void PrintRate(const char* label, double bytes, double seconds)
+{
+	printf("  %-32s %8.2f GB/s\n", label, bytes / seconds / 1.0e9);
+}
+
+static void PrintCallRate(const char* label, double calls, double seconds)
+{
+	printf("  %-32s %8.2f M/s (%.0f ns/call)\n", label, calls / seconds / 1.0e6, seconds * 1.0e9 / calls);
+}
+
+static void PrintKeyRate(const char* label, double keys, double seconds)
+{
+	printf("  %-32s %8.2f M keys/s\n", label, keys / seconds / 1.0e6);
+}
+
+static void PrintFileRate(const char* label, double files, double seconds)
+{
+	printf("  %-32s %8.0f files/s\n", label, files / seconds);
+}
+
+static BOOL BenchPopcount(pool_t* pool)
+{
+	static const char* op_name[POPCNT_OP_MAX] = { "", " (AND)", " (OR)", " (XOR)" };
+	uint64_t *a, *b, count, ref[POPCNT_OP_MAX];
+	double t, best;
+	char label[64];
+	size_t i, len = BENCH_POPCNT_SIZE;
+	int run, op;
+	BOOL r = FALSE;
+
+	a = (uint64_t*)malloc(len);
+	b = (uint64_t*)malloc(len);
+	if ((a == NULL) || (b == NULL)) {
+		fprintf(stderr, "Could not allocate bitmaps.\n");
+		goto out;
+	}
+	FillRandom(a, len, 0x2545f4914f6cdd1dULL);
+	FillRandom(b, len, 0x9e3779b97f4a7c15ULL);
+	printf("Population count over %d MB (%s, %d workers):\n", (int)(len >> 20),
+		popcount_impl(), PoolSize(pool));
+
+	// Baseline: the popcnt64() loop, as used for the affinity mask
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		t = GetTime();
+		for (ref[POPCNT_OP_NONE] = 0, i = 0; i < len / sizeof(uint64_t); i++)
+			ref[POPCNT_OP_NONE] += popcnt64(a[i]);
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintRate("popcnt64() loop", (double)len, best);
+	ref[POPCNT_OP_AND] = popcount_and(a, b, len);
+	ref[POPCNT_OP_OR] = popcount_or(a, b, len);
+	ref[POPCNT_OP_XOR] = popcount_xor(a, b, len);
+
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		t = GetTime();
+		count = popcount(a, len);
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintRate("popcount(), 1 thread", (double)len, best);
+	if (count != ref[POPCNT_OP_NONE]) {
+		fprintf(stderr, "popcount() mismatch: %llu vs %llu\n", count, ref[POPCNT_OP_NONE]);
+		goto out;
+	}
+
+	for (op = POPCNT_OP_NONE; op < POPCNT_OP_MAX; op++) {
+		for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+			t = GetTime();
+			if (!ParallelPopcount(pool, (popcnt_op_t)op, a, b, len, &count))
+				goto out;
+			t = GetTime() - t;
+			best = min(best, t);
+		}
+		snprintf(label, sizeof(label), "ParallelPopcount()%s", op_name[op]);
+		// Operations on two bitmaps read twice as much data
+		PrintRate(label, (double)len * ((op == POPCNT_OP_NONE) ? 1 : 2), best);
+		if (count != ref[op]) {
+			fprintf(stderr, "ParallelPopcount()%s mismatch: %llu vs %llu\n", op_name[op], count, ref[op]);
+			goto out;
+		}
+	}
+	r = TRUE;
+
+out:
+	free(a);
+	free(b);
+	return r;
+}
+
+/*
+ * A path that is mostly ASCII, with some Latin-1, CJK and the odd
+ * character outside of the BMP, which is what we mostly deal with.
+ */
+static wchar_t* RandomPath(uint64_t* seed)
+{
+	wchar_t* path;
+	uint64_t r;
+	int i = 0, j, k, n = 3 + (int)(NextRandom(seed) % 6);
+
+	// Up to 16 characters per component, that may each be a surrogate pair
+	path = (wchar_t*)malloc((3 + n * (1 + 2 * 16)) * sizeof(wchar_t));
+	if (path == NULL)
+		return NULL;
+	path[i++] = L'C';
+	path[i++] = L':';
+	for (j = 0; j < n; j++) {
+		path[i++] = L'\\';
+		for (k = 3 + (int)(NextRandom(seed) % 14); k > 0; k--) {
+			r = NextRandom(seed) % 100;
+			if (r < 85) {
+				path[i++] = L'a' + (wchar_t)(NextRandom(seed) % 26);
+			} else if (r < 95) {
+				path[i++] = 0xe0 + (wchar_t)(NextRandom(seed) % 0x20);
+			} else if (r < 99) {
+				path[i++] = 0x4e00 + (wchar_t)(NextRandom(seed) % 0x5200);
+			} else {
+				path[i++] = 0xd83d;
+				path[i++] = 0xde00 + (wchar_t)(NextRandom(seed) % 0x50);
+			}
+		}
+	}
+	path[i] = 0;
+	return path;
+}
+
+// How the conversions used to be done, with one call to get the size and one to convert
+static char* WinWcharToUtf8(const wchar_t* wstr)
+{
+	int size = WideCharToMultiByte(CP_UTF8, 0, wstr, -1, NULL, 0, NULL, NULL);
+	char* str = (char*)malloc(size);
+
+	if (str != NULL)
+		WideCharToMultiByte(CP_UTF8, 0, wstr, -1, str, size, NULL, NULL);
+	return str;
+}
+
+static wchar_t* WinUtf8ToWchar(const char* str)
+{
+	int size = MultiByteToWideChar(CP_UTF8, 0, str, -1, NULL, 0);
+	wchar_t* wstr = (wchar_t*)malloc(size * sizeof(wchar_t));
+
+	if (wstr != NULL)
+		MultiByteToWideChar(CP_UTF8, 0, str, -1, wstr, size);
+	return wstr;
+}
+
+static BOOL BenchUtf(pool_t* pool)
+{
+	static const char* label[4] = { "WideCharToMultiByte() x2", "wchar_to_utf8()",
+		"MultiByteToWideChar() x2", "utf8_to_wchar()" };
+	uint64_t seed = 0x2545f4914f6cdd1dULL;
+	wchar_t** wpath;
+	char** path;
+	void* p;
+	double t, best;
+	int i, run, variant;
+	BOOL r = FALSE;
+
+	wpath = (wchar_t**)calloc(BENCH_UTF_PATHS, sizeof(wchar_t*));
+	path = (char**)calloc(BENCH_UTF_PATHS, sizeof(char*));
+	if ((wpath == NULL) || (path == NULL))
+		goto out;
+	for (i = 0; i < BENCH_UTF_PATHS; i++) {
+		wpath[i] = RandomPath(&seed);
+		path[i] = WinWcharToUtf8(wpath[i]);
+		if ((wpath[i] == NULL) || (path[i] == NULL)) {
+			fprintf(stderr, "Could not allocate paths.\n");
+			goto out;
+		}
+	}
+	printf("UTF-16 <-> UTF-8 conversion of %d paths (%s):\n", BENCH_UTF_PATHS, utf_impl());
+
+	// Check that we produce the same as Windows
+	for (i = 0; i < BENCH_UTF_PATHS; i++) {
+		char* str = wchar_to_utf8(wpath[i]);
+		wchar_t* wstr = utf8_to_wchar(path[i]);
+		BOOL match = (str != NULL) && (wstr != NULL) && (strcmp(str, path[i]) == 0) && (wcscmp(wstr, wpath[i]) == 0);
+		free(str);
+		free(wstr);
+		if (!match) {
+			fprintf(stderr, "Conversion mismatch for path %d\n", i);
+			goto out;
+		}
+	}
+	// And that the vector kernels produce the same as the scalar one, on malformed input too
+	if ((i = (int)utf_check(seed, BENCH_UTF_PATHS)) != 0) {
+		fprintf(stderr, "%s disagrees with the scalar conversion on %d strings\n", utf_impl(), i);
+		goto out;
+	}
+
+	for (variant = 0; variant < (int)ARRAYSIZE(label); variant++) {
+		for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+			t = GetTime();
+			for (i = 0; i < BENCH_UTF_PATHS; i++) {
+				switch (variant) {
+				case 0: p = WinWcharToUtf8(wpath[i]); break;
+				case 1: p = wchar_to_utf8(wpath[i]); break;
+				case 2: p = WinUtf8ToWchar(path[i]); break;
+				default: p = utf8_to_wchar(path[i]); break;
+				}
+				free(p);
+			}
+			t = GetTime() - t;
+			best = min(best, t);
+		}
+		PrintCallRate(label[variant], BENCH_UTF_PATHS, best);
+	}
+	r = TRUE;
+
+out:
+	for (i = 0; (wpath != NULL) && (i < BENCH_UTF_PATHS); i++)
+		free(wpath[i]);
+	for (i = 0; (path != NULL) && (i < BENCH_UTF_PATHS); i++)
+		free(path[i]);
+	free(wpath);
+	free(path);
+	return r;
+}
+
+typedef struct {
+	char** path;
+	int variant;
+	volatile LONG sink;
+} wrapper_bench_t;
+
+static void WrapperRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	wrapper_bench_t* wb = (wrapper_bench_t*)ctx;
+	struct __stat64 st;
+	LONG sink = 0;
+	uint64_t k;
+
+	for (k = begin; k < end; k++) {
+		char* path = wb->path[k % BENCH_WRAPPER_PATHS];
+		switch (wb->variant) {
+		case 0: {
+			// What wconvert()/wfree() used to do
+			wchar_t* wpath = utf8_to_wchar(path);
+			sink += wpath[0];
+			free(wpath);
+			break;
+		}
+		case 1: {
+			wconvert(path);
+			sink += wpath[0];
+			wfree(path);
+			break;
+		}
+		case 2:
+			sink += (LONG)GetFileAttributesU(path);
+			break;
+		case 3:
+			sink += _stat64U(path, &st);
+			break;
+		case 4:
+			sink += (LONG)GetFileAttributesCachedU(path);
+			break;
+		default:
+			sink += _stat64CachedU(path, &st);
+			break;
+		}
+	}
+	InterlockedExchangeAdd(&wb->sink, sink);
+}
+
+// Check that the path cache gives the same results as the wrappers, and that invalidation works
+static BOOL CheckPathCache(char** path)
+{
+	char tmp_dir[MAX_PATH], tmp_file[MAX_PATH], alt_file[MAX_PATH + 2];
+	struct __stat64 st1, st2;
+	int i;
+
+	for (i = 0; i < BENCH_WRAPPER_PATHS; i++) {
+		if ((GetFileAttributesCachedU(path[i]) != GetFileAttributesU(path[i])) ||
+			(_stat64CachedU(path[i], &st1) != _stat64U(path[i], &st2))) {
+			fprintf(stderr, "Path cache mismatch for path %d\n", i);
+			return FALSE;
+		}
+	}
+	if ((GetTempPathU(sizeof(tmp_dir), tmp_dir) == 0) || (GetTempFileNameU(tmp_dir, "bp", 0, tmp_file) == 0)) {
+		fprintf(stderr, "Could not create temporary file.\n");
+		return FALSE;
+	}
+	if (!PathFileExistsCachedU(tmp_file) || !DeleteFileU(tmp_file)) {
+		fprintf(stderr, "Path cache did not find '%s'\n", tmp_file);
+		return FALSE;
+	}
+	// Deleting the file doesn't update the cache until we invalidate it, and the
+	// quoted version of the path is the same entry
+	alt_file[0] = '"';
+	strcpy(&alt_file[1], tmp_file);
+	strcat(alt_file, "\"");
+	if (!PathFileExistsCachedU(tmp_file) || !PathFileExistsCachedU(alt_file)) {
+		fprintf(stderr, "Path cache entry for '%s' was not kept\n", tmp_file);
+		return FALSE;
+	}
+	// And invalidating it under another case reaches the same entry too
+	for (i = 0; alt_file[i] != 0; i++)
+		alt_file[i] = (char)toupper(alt_file[i]);
+	InvalidatePathCache(alt_file);
+	if (PathFileExistsCachedU(tmp_file)) {
+		fprintf(stderr, "Path cache entry for '%s' was not invalidated\n", tmp_file);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Per call overhead of the conversions that the file wrappers do, with all
+ * the workers calling them at once, which is where going through the heap
+ * hurts the most. The wrappers themselves are called on paths that don't
+ * exist, to keep what the file system does to a minimum, and then again
+ * through the path cache.
+ */
+static BOOL BenchWrappers(pool_t* pool)
+{
+	static const struct {
+		const char* label;
+		uint64_t calls;
+	} variant[] = {
+		{ "utf8_to_wchar() + free()", BENCH_WRAPPER_CALLS },
+		{ "wconvert() + wfree()", BENCH_WRAPPER_CALLS },
+		{ "GetFileAttributesU()", BENCH_WRAPPER_CALLS / 16 },
+		{ "_stat64U()", BENCH_WRAPPER_CALLS / 16 },
+		{ "GetFileAttributesCachedU()", BENCH_WRAPPER_CALLS },
+		{ "_stat64CachedU()", BENCH_WRAPPER_CALLS },
+	};
+	path_cache_stats_t stats;
+	uint64_t seed = 0x9e3779b97f4a7c15ULL;
+	wrapper_bench_t wb = { 0 };
+	wchar_t* wpath;
+	double t, best;
+	int i, run;
+	BOOL r = FALSE;
+
+	wb.path = (char**)calloc(BENCH_WRAPPER_PATHS, sizeof(char*));
+	if (wb.path == NULL)
+		goto out;
+	for (i = 0; i < BENCH_WRAPPER_PATHS; i++) {
+		wpath = RandomPath(&seed);
+		wb.path[i] = (wpath == NULL) ? NULL : wchar_to_utf8(wpath);
+		free(wpath);
+		if (wb.path[i] == NULL) {
+			fprintf(stderr, "Could not allocate paths.\n");
+			goto out;
+		}
+	}
+	printf("File wrappers overhead on %d paths (%d workers):\n", BENCH_WRAPPER_PATHS, PoolSize(pool));
+	if (!EnablePathCache()) {
+		fprintf(stderr, "Could not enable path cache.\n");
+		goto out;
+	}
+	if (!CheckPathCache(wb.path))
+		goto out;
+
+	for (wb.variant = 0; wb.variant < (int)ARRAYSIZE(variant); wb.variant++) {
+		for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+			t = GetTime();
+			if (!ParallelFor(pool, 0, variant[wb.variant].calls, 0, WrapperRange, &wb))
+				goto out;
+			t = GetTime() - t;
+			best = min(best, t);
+		}
+		PrintCallRate(variant[wb.variant].label, (double)variant[wb.variant].calls, best);
+	}
+	GetPathCacheStats(&stats);
+	printf("  Path cache: %llu hits, %llu misses, %llu entries\n", stats.hits, stats.misses, stats.entries);
+	r = TRUE;
+
+out:
+	DisablePathCache();
+	for (i = 0; (wb.path != NULL) && (i < BENCH_WRAPPER_PATHS); i++)
+		free(wb.path[i]);
+	free(wb.path);
+	return r;
+}
+
+/*
+ * Comma separated records of words, with the odd 'é' or '中', and of
+ * space padded numbers, as a stand-in for the text that workers parse.
+ */
+static void FillRecords(char* buf, size_t len, uint64_t seed)
+{
+	static const char* accent[2] = { "\xc3\xa9", "\xe4\xb8\xad" };
+	uint64_t r;
+	size_t i = 0, n;
+	int field = 0;
+
+	while (i + 32 < len) {
+		r = NextRandom(&seed);
+		if (r & 1) {
+			for (n = 3 + (r >> 8) % 10; n > 0; n--) {
+				r = NextRandom(&seed);
+				if (r % 10 == 0) {
+					memcpy(&buf[i], accent[(r >> 8) & 1], strlen(accent[(r >> 8) & 1]));
+					i += strlen(accent[(r >> 8) & 1]);
+				} else {
+					buf[i++] = 'a' + (char)((r >> 8) % 26);
+				}
+			}
+		} else {
+			for (n = (r >> 8) % 3; n > 0; n--)
+				buf[i++] = ' ';
+			for (n = 1 + (r >> 16) % 10; n > 0; n--)
+				buf[i++] = '0' + (char)(NextRandom(&seed) % 10);
+		}
+		buf[i++] = (++field % 6 == 0) ? '\n' : ',';
+	}
+	memset(&buf[i], '\n', len - i);
+}
+
+static scan_set_t scan_bench_delims;
+static uint32_t scan_bench_index[BENCH_SCAN_BLOCK];
+
+static uint64_t CountDigitsU(const char* buf, size_t len)
+{
+	uint64_t count = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		count += isdigitU(buf[i]) ? 1 : 0;
+	return count;
+}
+
+static uint64_t CountDigitsScan(const char* buf, size_t len)
+{
+	return scan_count(buf, len, &scan_digits);
+}
+
+static uint64_t CountSpacesU(const char* buf, size_t len)
+{
+	uint64_t count = 0;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		count += isspaceU(buf[i]) ? 1 : 0;
+	return count;
+}
+
+static uint64_t CountSpacesScan(const char* buf, size_t len)
+{
+	return scan_count(buf, len, &scan_spaces);
+}
+
+// The split and run functions return a hash of the lengths they found
+static uint64_t SplitFieldsU(const char* buf, size_t len)
+{
+	uint64_t hash = 0;
+	size_t i, start = 0;
+
+	for (i = 0; i < len; i++) {
+		if ((buf[i] == ',') || (buf[i] == '\n')) {
+			hash = hash * 31 + (i - start);
+			start = i + 1;
+		}
+	}
+	return hash * 31 + (len - start);
+}
+
+static uint64_t SplitFieldsScan(const char* buf, size_t len)
+{
+	uint64_t hash = 0;
+	size_t i, start = 0;
+
+	while (1) {
+		i = start + scan_find(&buf[start], len - start, &scan_bench_delims);
+		hash = hash * 31 + (i - start);
+		if (i == len)
+			return hash;
+		start = i + 1;
+	}
+}
+
+static uint64_t SplitFieldsIndex(const char* buf, size_t len)
+{
+	uint64_t hash = 0;
+	size_t i, k, n, pos, start = 0;
+
+	for (i = 0; i < len; i += BENCH_SCAN_BLOCK) {
+		n = scan_index(&buf[i], min(len - i, BENCH_SCAN_BLOCK), &scan_bench_delims, scan_bench_index);
+		for (k = 0; k < n; k++) {
+			pos = i + scan_bench_index[k];
+			hash = hash * 31 + (pos - start);
+			start = pos + 1;
+		}
+	}
+	return hash * 31 + (len - start);
+}
+
+static uint64_t DigitRunsU(const char* buf, size_t len)
+{
+	uint64_t hash = 0;
+	size_t i = 0, start;
+
+	while (i < len) {
+		if (!isdigitU(buf[i])) {
+			i++;
+			continue;
+		}
+		for (start = i; (i < len) && isdigitU(buf[i]); i++);
+		hash = hash * 31 + (i - start);
+	}
+	return hash;
+}
+
+static uint64_t DigitRunsScan(const char* buf, size_t len)
+{
+	uint64_t hash = 0;
+	size_t i = 0, n;
+
+	while (1) {
+		i += scan_find(&buf[i], len - i, &scan_digits);
+		if (i == len)
+			return hash;
+		n = scan_span(&buf[i], len - i, &scan_digits);
+		hash = hash * 31 + n;
+		i += n;
+	}
+}
+
+typedef struct {
+	const char* buf;
+	uint64_t* count;
+} scan_bench_t;
+
+// Spacing between the per-worker counts, to avoid false sharing
+#define SCAN_BENCH_STRIDE	(64 / sizeof(uint64_t))
+
+static void ScanCountRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	scan_bench_t* sb = (scan_bench_t*)ctx;
+
+	sb->count[worker * SCAN_BENCH_STRIDE] += scan_count(sb->buf + begin, (size_t)(end - begin), &scan_digits);
+}
+
+/*
+ * UTF-8 validation and classification of record text, with each of the
+ * scanning kernels checked against the per-byte macros of msapi_utf8.h.
+ */
+static BOOL BenchScan(pool_t* pool)
+{
+	static const struct {
+		const char* ref_label;
+		const char* label;
+		uint64_t (*ref)(const char* buf, size_t len);
+		uint64_t (*fn)(const char* buf, size_t len);
+	} variant[] = {
+		{ "isdigitU() count", "scan_count(scan_digits)", CountDigitsU, CountDigitsScan },
+		{ "isspaceU() count", "scan_count(scan_spaces)", CountSpacesU, CountSpacesScan },
+		{ "Per byte field split", "scan_find() field split", SplitFieldsU, SplitFieldsScan },
+		{ "Per byte field split", "scan_index() field split", SplitFieldsU, SplitFieldsIndex },
+		{ "isdigitU() runs", "scan_find()/scan_span() runs", DigitRunsU, DigitRunsScan },
+	};
+	scan_bench_t sb = { 0 };
+	char* buf;
+	uint64_t ref, res;
+	double t, best;
+	size_t len = BENCH_SCAN_SIZE, pos;
+	DWORD w;
+	int i, run;
+	BOOL r = FALSE;
+
+	buf = (char*)malloc(len);
+	sb.count = (uint64_t*)calloc((size_t)PoolSize(pool) * SCAN_BENCH_STRIDE, sizeof(uint64_t));
+	if ((buf == NULL) || (sb.count == NULL)) {
+		fprintf(stderr, "Could not allocate text.\n");
+		goto out;
+	}
+	FillRecords(buf, len, 0x2545f4914f6cdd1dULL);
+	scan_set(&scan_bench_delims, ",\n");
+	printf("UTF-8 scanning of %d MB of records (%s validation, %s scan, %d workers):\n",
+		(int)(len >> 20), utf_impl(), scan_impl(), PoolSize(pool));
+
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		t = GetTime();
+		pos = utf8_validate(buf, len);
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintRate("utf8_validate()", (double)len, best);
+	if (pos != len) {
+		fprintf(stderr, "utf8_validate() reported an error at offset %zu\n", pos);
+		goto out;
+	}
+	// An invalid byte right after a record separator must be reported at its own offset
+	for (pos = len / 3; buf[pos - 1] != '\n'; pos++);
+	buf[pos] = (char)0xff;
+	res = utf8_validate(buf, len);
+	buf[pos] = '\n';
+	if (res != pos) {
+		fprintf(stderr, "utf8_validate() reported offset %llu instead of %zu\n", res, pos);
+		goto out;
+	}
+
+	for (i = 0; i < (int)ARRAYSIZE(variant); i++) {
+		for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+			t = GetTime();
+			ref = variant[i].ref(buf, len);
+			t = GetTime() - t;
+			best = min(best, t);
+		}
+		PrintRate(variant[i].ref_label, (double)len, best);
+		for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+			t = GetTime();
+			res = variant[i].fn(buf, len);
+			t = GetTime() - t;
+			best = min(best, t);
+		}
+		PrintRate(variant[i].label, (double)len, best);
+		if (res != ref) {
+			fprintf(stderr, "%s mismatch: %llu vs %llu\n", variant[i].label, res, ref);
+			goto out;
+		}
+	}
+
+	sb.buf = buf;
+	ref = CountDigitsU(buf, len);
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		memset(sb.count, 0, (size_t)PoolSize(pool) * SCAN_BENCH_STRIDE * sizeof(uint64_t));
+		t = GetTime();
+		if (!ParallelFor(pool, 0, len, BENCH_SCAN_CHUNK, ScanCountRange, &sb))
+			goto out;
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintRate("scan_count(scan_digits), pool", (double)len, best);
+	for (res = 0, w = 0; w < PoolSize(pool); w++)
+		res += sb.count[w * SCAN_BENCH_STRIDE];
+	if (res != ref) {
+		fprintf(stderr, "Parallel scan_count() mismatch: %llu vs %llu\n", res, ref);
+		goto out;
+	}
+	r = TRUE;
+
+out:
+	free(buf);
+	free(sb.count);
+	return r;
+}
+
+typedef struct {
+	const char* root;
+	volatile LONG errors;
+	// Per-worker counts, for the walk callback
+	uint64_t* count;
+} tree_bench_t;
+
+// Spacing between the per-worker counts, to avoid false sharing
+#define TREE_BENCH_STRIDE	(64 / sizeof(uint64_t))
+
+// Path of leaf directory d of the benchmark tree
+static void TreeDirectory(char* path, size_t size, const char* root, uint64_t d)
+{
+	snprintf(path, size, "%s\\d%02d\\s%02d", root, (int)(d / 16), (int)(d % 16));
+}
+
+// Create the files of leaf directories [begin, end) of the benchmark tree, with file f holding f + 1 bytes
+static void CreateTreeRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	tree_bench_t* tb = (tree_bench_t*)ctx;
+	char path[MAX_PATH];
+	HANDLE h;
+	DWORD written;
+	uint64_t d;
+	size_t len;
+	int f;
+
+	for (d = begin; d < end; d++) {
+		TreeDirectory(path, sizeof(path), tb->root, d);
+		len = strlen(path);
+		for (f = 0; f < BENCH_TREE_FILES; f++) {
+			snprintf(&path[len], sizeof(path) - len, "\\f%03d_\xc3\xa9.dat", f);
+			h = CreateFileU(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+			if ((h == INVALID_HANDLE_VALUE) || !WriteFile(h, path, (DWORD)f + 1, &written, NULL))
+				InterlockedIncrement(&tb->errors);
+			if (h != INVALID_HANDLE_VALUE)
+				CloseHandle(h);
+		}
+	}
+}
+
+/*
+ * Create a scratch tree of BENCH_TREE_DIRS * BENCH_TREE_FILES files under the temp
+ * directory, from all the workers, or sequentially if pool is NULL.
+ */
+static BOOL CreateBenchTree(pool_t* pool, const char* name, char* root, size_t root_size)
+{
+	tree_bench_t tb = { 0 };
+	char tmp_dir[MAX_PATH];
+	char (*dir)[MAX_PATH] = NULL;
+	const char* dirs[BENCH_TREE_DIRS];
+	BOOL r = FALSE;
+	int d;
+
+	if (GetTempPathU(sizeof(tmp_dir), tmp_dir) == 0)
+		return FALSE;
+	snprintf(root, root_size, "%s%s", tmp_dir, name);
+	SHDeleteDirectoryExU(NULL, root, FOF_NO_UI);
+	dir = (char (*)[MAX_PATH])malloc(BENCH_TREE_DIRS * sizeof(*dir));
+	if (dir == NULL)
+		return FALSE;
+	for (d = 0; d < BENCH_TREE_DIRS; d++) {
+		TreeDirectory(dir[d], MAX_PATH, root, d);
+		dirs[d] = dir[d];
+	}
+	tb.root = root;
+	if (pool == NULL) {
+		for (d = 0; d < BENCH_TREE_DIRS; d++) {
+			if (_mkdirExU(dirs[d]) != 0)
+				tb.errors++;
+		}
+		CreateTreeRange(&tb, 0, 0, BENCH_TREE_DIRS);
+	} else if (!ParallelCreateDirectories(pool, dirs, BENCH_TREE_DIRS, NULL) ||
+		!ParallelFor(pool, 0, BENCH_TREE_DIRS, 1, CreateTreeRange, &tb)) {
+		tb.errors++;
+	}
+	if (tb.errors != 0)
+		fprintf(stderr, "Could not create the content of '%s'\n", root);
+	else
+		r = TRUE;
+	free(dir);
+	return r;
+}
+
+// Recursive listing, as a sequential baseline for ParallelWalk()
+static void WalkTree(wchar_t* path, size_t len, walk_stats_t* stats)
+{
+	WIN32_FIND_DATAW fd;
+	HANDLE h;
+	size_t name_len;
+
+	if (len + 2 >= MAX_PATH)
+		return;
+	wcscpy(&path[len], L"\\*");
+	h = FindFirstFileExW(path, FindExInfoBasic, &fd, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	if (h == INVALID_HANDLE_VALUE) {
+		stats->errors++;
+		return;
+	}
+	do {
+		if ((wcscmp(fd.cFileName, L".") == 0) || (wcscmp(fd.cFileName, L"..") == 0))
+			continue;
+		if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			stats->directories++;
+			name_len = wcslen(fd.cFileName);
+			if (len + 1 + name_len >= MAX_PATH)
+				continue;
+			path[len] = L'\\';
+			wcscpy(&path[len + 1], fd.cFileName);
+			WalkTree(path, len + 1 + name_len, stats);
+		} else {
+			stats->files++;
+			stats->bytes += ((uint64_t)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+		}
+	} while (FindNextFileW(h, &fd));
+	FindClose(h);
+	path[len] = 0;
+}
+
+static BOOL CountFile(void* ctx, uint32_t worker, const walk_entry_t* entry)
+{
+	tree_bench_t* tb = (tree_bench_t*)ctx;
+
+	// Check that we got the right path for the right size
+	tb->count[worker * TREE_BENCH_STRIDE] += (atoi(&entry->name[1]) + 1 == (int)entry->size) ? 1 : 0;
+	return TRUE;
+}
+
+/*
+ * Listing of a scratch tree, sequentially and with ParallelWalk(). Note
+ * that directory listings get cached by the OS, so this measures how fast
+ * we can go through the tree rather than how fast the disk is.
+ */
+static BOOL BenchWalk(pool_t* pool)
+{
+	tree_bench_t tb = { 0 };
+	walk_stats_t ref, stats;
+	char root[MAX_PATH];
+	wchar_t wroot[MAX_PATH];
+	uint64_t count;
+	double t, best;
+	DWORD w;
+	int run;
+	BOOL r = FALSE;
+
+	root[0] = 0;
+	tb.count = (uint64_t*)calloc((size_t)PoolSize(pool) * TREE_BENCH_STRIDE, sizeof(uint64_t));
+	if (tb.count == NULL)
+		goto out;
+	if (!CreateBenchTree(pool, "base-parallel-walk", root, sizeof(root)))
+		goto out;
+	utf8_to_wchar_no_alloc(root, wroot, MAX_PATH);
+	printf("Directory walk of %d files in %d directories (%d workers):\n",
+		BENCH_TREE_DIRS * BENCH_TREE_FILES, BENCH_TREE_DIRS + BENCH_TREE_DIRS / 16, PoolSize(pool));
+
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		memset(&ref, 0, sizeof(ref));
+		t = GetTime();
+		WalkTree(wroot, wcslen(wroot), &ref);
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintFileRate("Recursive FindFirstFileEx()", (double)ref.files, best);
+	if ((ref.files != BENCH_TREE_DIRS * BENCH_TREE_FILES) || (ref.errors != 0)) {
+		fprintf(stderr, "Recursive listing found %llu files instead of %d\n", ref.files,
+			BENCH_TREE_DIRS * BENCH_TREE_FILES);
+		goto out;
+	}
+
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		memset(tb.count, 0, (size_t)PoolSize(pool) * TREE_BENCH_STRIDE * sizeof(uint64_t));
+		t = GetTime();
+		if (!ParallelWalk(pool, root, 0, CountFile, &tb, &stats))
+			goto out;
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintFileRate("ParallelWalk()", (double)stats.files, best);
+	for (count = 0, w = 0; w < PoolSize(pool); w++)
+		count += tb.count[w * TREE_BENCH_STRIDE];
+	if ((stats.files != ref.files) || (stats.directories != ref.directories) ||
+		(stats.bytes != ref.bytes) || (stats.errors != 0) || (count != ref.files)) {
+		fprintf(stderr, "ParallelWalk() mismatch: %llu/%llu files, %llu/%llu directories, %llu/%llu bytes\n",
+			count, ref.files, stats.directories, ref.directories, stats.bytes, ref.bytes);
+		goto out;
+	}
+	r = TRUE;
+
+out:
+	if (root[0] != 0)
+		ParallelDeleteTree(pool, root, NULL);
+	free(tb.count);
+	return r;
+}
+
+typedef struct {
+	char src[BENCH_COPY_LARGE + BENCH_COPY_SMALL][MAX_PATH];
+	char dst[BENCH_COPY_LARGE + BENCH_COPY_SMALL][MAX_PATH];
+	uint32_t crc[BENCH_COPY_LARGE + BENCH_COPY_SMALL];
+} copy_bench_t;
+
+// Write size random bytes to path, returning their CRC-32C in crc
+static BOOL WriteRandomFile(const char* path, uint64_t size, uint64_t seed, uint8_t* buf, uint32_t* crc)
+{
+	HANDLE h;
+	DWORD len, written;
+	BOOL r = TRUE;
+
+	h = CreateFileU(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		return FALSE;
+	for (*crc = 0; r && (size != 0); size -= len) {
+		len = (DWORD)min(size, BENCH_SCAN_CHUNK);
+		FillRandom(buf, BENCH_SCAN_CHUNK, seed++);
+		*crc = crc32c(*crc, buf, len);
+		r = WriteFile(h, buf, len, &written, NULL) && (written == len);
+	}
+	CloseHandle(h);
+	return r;
+}
+
+static BOOL CheckCopy(const char* path, uint32_t expected, uint8_t* buf)
+{
+	HANDLE h;
+	DWORD len;
+	uint32_t crc = 0;
+	BOOL r;
+
+	h = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		return FALSE;
+	while ((r = ReadFile(h, buf, BENCH_SCAN_CHUNK, &len, NULL)) && (len != 0))
+		crc = crc32c(crc, buf, len);
+	CloseHandle(h);
+	return r && (crc == expected);
+}
+
+/*
+ * Copy of a few large files and many small ones, with CopyFileU() and with
+ * ParallelCopyFiles(). The source files were just written, so they are likely
+ * to be read from the cache, whereas unbuffered I/O always goes to the disk.
+ */
+static BOOL BenchCopy(pool_t* pool)
+{
+	copy_bench_t* cb;
+	copy_stats_t stats;
+	const char* src[BENCH_COPY_LARGE + BENCH_COPY_SMALL];
+	const char* dst[BENCH_COPY_LARGE + BENCH_COPY_SMALL];
+	char root[MAX_PATH], tmp_dir[MAX_PATH];
+	uint8_t* buf = NULL;
+	uint64_t seed = 1, size, total = 0;
+	double t;
+	int i, pass;
+	BOOL r = FALSE;
+
+	root[0] = 0;
+	cb = (copy_bench_t*)malloc(sizeof(copy_bench_t));
+	buf = (uint8_t*)malloc(BENCH_SCAN_CHUNK);
+	if ((cb == NULL) || (buf == NULL) || (GetTempPathU(sizeof(tmp_dir), tmp_dir) == 0))
+		goto out;
+	snprintf(root, sizeof(root), "%sbase-parallel-copy", tmp_dir);
+	SHDeleteDirectoryExU(NULL, root, FOF_NO_UI);
+	if (!CreateDirectoryU(root, NULL)) {
+		fprintf(stderr, "Could not create '%s'\n", root);
+		root[0] = 0;
+		goto out;
+	}
+	for (i = 0; i < BENCH_COPY_LARGE + BENCH_COPY_SMALL; i++) {
+		// Make the large files end in the middle of a sector, to exercise the tail
+		size = (i < BENCH_COPY_LARGE) ? BENCH_COPY_LARGE_SIZE + 1000 * (uint64_t)i + 1 :
+			NextRandom(&seed) % BENCH_COPY_SMALL_SIZE;
+		snprintf(cb->src[i], MAX_PATH, "%s\\src_%04d_\xc3\xa9.dat", root, i);
+		if (!WriteRandomFile(cb->src[i], size, seed + i * 1000, buf, &cb->crc[i])) {
+			fprintf(stderr, "Could not create '%s'\n", cb->src[i]);
+			goto out;
+		}
+		src[i] = cb->src[i];
+		dst[i] = cb->dst[i];
+		total += size;
+	}
+	printf("Copy of %d files of %d MB and %d files of up to %d KB (%d workers):\n",
+		BENCH_COPY_LARGE, BENCH_COPY_LARGE_SIZE >> 20, BENCH_COPY_SMALL,
+		BENCH_COPY_SMALL_SIZE >> 10, PoolSize(pool));
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < BENCH_COPY_LARGE + BENCH_COPY_SMALL; i++)
+			snprintf(cb->dst[i], MAX_PATH, "%s\\dst%d_%04d_\xc3\xa9.dat", root, pass, i);
+		t = GetTime();
+		if (pass == 0) {
+			for (i = 0; i < BENCH_COPY_LARGE + BENCH_COPY_SMALL; i++) {
+				if (!CopyFileU(cb->src[i], cb->dst[i], TRUE)) {
+					fprintf(stderr, "CopyFileU() failed for '%s': %u\n", cb->src[i], GetLastError());
+					goto out;
+				}
+			}
+			PrintRate("CopyFileU()", (double)total, GetTime() - t);
+		} else {
+			if (!ParallelCopyFiles(pool, src, dst, BENCH_COPY_LARGE + BENCH_COPY_SMALL,
+				COPY_FAIL_IF_EXISTS, &stats) || (stats.bytes != total)) {
+				fprintf(stderr, "ParallelCopyFiles() failed: %llu errors, %u\n", stats.errors, GetLastError());
+				goto out;
+			}
+			PrintRate("ParallelCopyFiles()", (double)stats.bytes, stats.seconds);
+			printf("  %-32s %8.2f ms median, %.2f ms p99, %.2f ms max\n", "Per file latency",
+				stats.latency_median, stats.latency_p99, stats.latency_max);
+		}
+		for (i = 0; i < BENCH_COPY_LARGE + BENCH_COPY_SMALL; i++) {
+			if (!CheckCopy(cb->dst[i], cb->crc[i], buf)) {
+				fprintf(stderr, "'%s' is not a copy of '%s'\n", cb->dst[i], cb->src[i]);
+				goto out;
+			}
+		}
+	}
+	r = TRUE;
+
+out:
+	if (root[0] != 0)
+		SHDeleteDirectoryExU(NULL, root, FOF_NO_UI);
+	free(buf);
+	free(cb);
+	return r;
+}
+
+/*
+ * Creation and deletion of a scratch tree, sequentially and from all the
+ * workers. Creation includes writing the files, which is where most of the
+ * time goes, and we count directories along with files for the deletion.
+ */
+static BOOL BenchTree(pool_t* pool)
+{
+	tree_stats_t stats;
+	char root[MAX_PATH];
+	uint64_t entries = BENCH_TREE_DIRS * BENCH_TREE_FILES + BENCH_TREE_DIRS + BENCH_TREE_DIRS / 16 + 1;
+	double t;
+
+	printf("Creation and deletion of %d files in %d directories (%d workers):\n",
+		BENCH_TREE_DIRS * BENCH_TREE_FILES, BENCH_TREE_DIRS + BENCH_TREE_DIRS / 16, PoolSize(pool));
+	t = GetTime();
+	if (!CreateBenchTree(NULL, "base-parallel-tree", root, sizeof(root)))
+		return FALSE;
+	PrintFileRate("_mkdirExU() + CreateFileU()", BENCH_TREE_DIRS * BENCH_TREE_FILES, GetTime() - t);
+	t = GetTime();
+	SHDeleteDirectoryExU(NULL, root, FOF_NO_UI);
+	PrintFileRate("SHDeleteDirectoryExU()", (double)entries, GetTime() - t);
+	if (GetFileAttributesU(root) != INVALID_FILE_ATTRIBUTES) {
+		fprintf(stderr, "SHDeleteDirectoryExU() did not delete '%s'\n", root);
+		return FALSE;
+	}
+
+	t = GetTime();
+	if (!CreateBenchTree(pool, "base-parallel-tree", root, sizeof(root)))
+		return FALSE;
+	PrintFileRate("ParallelCreateDirectories()", BENCH_TREE_DIRS * BENCH_TREE_FILES, GetTime() - t);
+	t = GetTime();
+	if (!ParallelDeleteTree(pool, root, &stats)) {
+		fprintf(stderr, "ParallelDeleteTree() failed with %llu errors\n", stats.errors);
+		return FALSE;
+	}
+	PrintFileRate("ParallelDeleteTree()", (double)entries, GetTime() - t);
+	if ((stats.files + stats.directories != entries) || (GetFileAttributesU(root) != INVALID_FILE_ATTRIBUTES)) {
+		fprintf(stderr, "ParallelDeleteTree() deleted %llu files and %llu directories out of %llu entries\n",
+			stats.files, stats.directories, entries);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+typedef struct {
+	size_t next;
+	uint64_t errors;
+} run_bench_t;
+
+// Each command echoes its index, which must come back in order
+static BOOL CheckCommandOutput(void* ctx, const run_result_t* result)
+{
+	run_bench_t* rb = (run_bench_t*)ctx;
+
+	if ((result->index != rb->next++) || (result->out_len == 0) || (result->exit_code != 0) ||
+		((size_t)atoi(result->out) != result->index))
+		rb->errors++;
+	return TRUE;
+}
+
+/*
+ * Run of short lived commands, one at a time and from all the workers. This
+ * mostly measures how long it takes Windows to create and tear down a process.
+ */
+static BOOL BenchRun(pool_t* pool)
+{
+	static char command[BENCH_RUN_COMMANDS][32];
+	const char* commands[BENCH_RUN_COMMANDS];
+	run_bench_t rb;
+	run_stats_t stats;
+	DWORD max_processes[2] = { 1, 0 };
+	int i, pass;
+
+	for (i = 0; i < BENCH_RUN_COMMANDS; i++) {
+		snprintf(command[i], sizeof(command[i]), "cmd.exe /d /c echo %d", i);
+		commands[i] = command[i];
+	}
+	printf("Run of %d commands (%d workers):\n", BENCH_RUN_COMMANDS, PoolSize(pool));
+	for (pass = 0; pass < 2; pass++) {
+		memset(&rb, 0, sizeof(rb));
+		if (!ParallelRun(pool, commands, BENCH_RUN_COMMANDS, max_processes[pass], RUN_ORDERED,
+			CheckCommandOutput, &rb, &stats) || (rb.errors != 0) || (rb.next != BENCH_RUN_COMMANDS)) {
+			fprintf(stderr, "ParallelRun() failed: %llu errors, %llu bad outputs\n", stats.errors, rb.errors);
+			return FALSE;
+		}
+		printf("  %-32s %8.1f commands/s\n", (pass == 0) ? "ParallelRun(1 process)" : "ParallelRun()",
+			BENCH_RUN_COMMANDS / stats.seconds);
+		printf("  %-32s %8.2f ms median, %.2f ms p99, %.2f ms max\n", "Per command time",
+			stats.time_median, stats.time_p99, stats.time_max);
+	}
+	return TRUE;
+}
+
+typedef struct {
+	uint64_t seed;
+	uint32_t size;
+	uint32_t crash;
+} proc_bench_task_t;
+
+typedef struct {
+	uint32_t* crc;
+	uint8_t* buf;
+	uint64_t first_id;
+	uint64_t errors;
+} proc_bench_t;
+
+static uint32_t ProcBenchCrc(const proc_bench_task_t* task, uint8_t* buf)
+{
+	FillRandom(buf, task->size, task->seed);
+	return crc32c(0, buf, task->size);
+}
+
+// What the worker processes and the agents run, concurrently for the latter
+static BOOL ProcBenchHandler(const void* task, uint32_t task_size, void* result, uint32_t* result_size)
+{
+	const proc_bench_task_t* t = (const proc_bench_task_t*)task;
+	uint8_t* buf;
+	uint32_t crc;
+
+	if ((task_size != sizeof(proc_bench_task_t)) || (t->size > BENCH_PROC_SIZE) || (*result_size < sizeof(crc)))
+		return FALSE;
+	// Die like a crash would, without bringing up Windows Error Reporting
+	if (t->crash)
+		TerminateProcess(GetCurrentProcess(), ERROR_PROCESS_ABORTED);
+	buf = (uint8_t*)malloc(t->size);
+	if (buf == NULL)
+		return FALSE;
+	crc = ProcBenchCrc(t, buf);
+	free(buf);
+	memcpy(result, &crc, sizeof(crc));
+	*result_size = sizeof(crc);
+	return TRUE;
+}
+
+void RegisterBenchHandlers(void)
+{
+	RegisterProcHandler(BENCH_PROC_CRC, ProcBenchHandler);
+}
+
+static void ProcBenchTask(uint64_t i, proc_bench_task_t* task)
+{
+	task->seed = i + 1;
+	task->size = BENCH_PROC_SIZE;
+	task->crash = (i % (BENCH_PROC_TASKS / BENCH_PROC_CRASHES)) == 1;
+}
+
+static void ProcBenchRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	proc_bench_t* pb = (proc_bench_t*)ctx;
+	proc_bench_task_t task;
+	uint64_t i;
+
+	for (i = begin; i < end; i++) {
+		ProcBenchTask(i, &task);
+		pb->crc[i] = task.crash ? 0 : ProcBenchCrc(&task, &pb->buf[worker * BENCH_PROC_SIZE]);
+	}
+}
+
+static void CheckProcResult(void* ctx, uint64_t id, BOOL success, const void* result, uint32_t result_size)
+{
+	proc_bench_t* pb = (proc_bench_t*)ctx;
+	uint64_t i = id - pb->first_id;
+	proc_bench_task_t task;
+	uint32_t crc;
+
+	ProcBenchTask(i, &task);
+	if (task.crash) {
+		pb->errors += success ? 1 : 0;
+	} else if (!success || (result_size != sizeof(crc))) {
+		pb->errors++;
+	} else {
+		memcpy(&crc, result, sizeof(crc));
+		pb->errors += (crc == pb->crc[i]) ? 0 : 1;
+	}
+}
+
+/*
+ * The same tasks, on the workers of the pool and on as many worker processes,
+ * some of which get killed by the tasks they run. As the tasks are small, this
+ * mostly measures the overhead of going through the rings.
+ */
+static BOOL BenchProc(pool_t* pool)
+{
+	proc_bench_t pb = { 0 };
+	proc_bench_task_t task;
+	proc_pool_t* pp = NULL;
+	proc_stats_t stats;
+	uint64_t i;
+	double t;
+	BOOL r = FALSE;
+
+	pb.crc = (uint32_t*)calloc(BENCH_PROC_TASKS, sizeof(uint32_t));
+	pb.buf = (uint8_t*)malloc((size_t)PoolSize(pool) * BENCH_PROC_SIZE);
+	if ((pb.crc == NULL) || (pb.buf == NULL))
+		goto out;
+	printf("Processing of %d tasks, %d of which kill their worker (%d workers):\n", BENCH_PROC_TASKS,
+		BENCH_PROC_CRASHES, PoolSize(pool));
+
+	t = GetTime();
+	if (!ParallelFor(pool, 0, BENCH_PROC_TASKS, 16, ProcBenchRange, &pb))
+		goto out;
+	printf("  %-32s %8.0f tasks/s\n", "ParallelFor()", BENCH_PROC_TASKS / (GetTime() - t));
+
+	pp = CreateProcPool(PoolSize(pool), NULL, CheckProcResult, &pb);
+	if (pp == NULL)
+		goto out;
+	t = GetTime();
+	for (i = 0; i < BENCH_PROC_TASKS; i++) {
+		ProcBenchTask(i, &task);
+		if (!SubmitProcTask(pp, BENCH_PROC_CRC, &task, sizeof(task), (i == 0) ? &pb.first_id : NULL))
+			goto out;
+	}
+	if (!WaitProcPool(pp))
+		goto out;
+	printf("  %-32s %8.0f tasks/s\n", "SubmitProcTask()", BENCH_PROC_TASKS / (GetTime() - t));
+	GetProcPoolStats(pp, &stats);
+	printf("  %-32s %8llu\n", "Worker restarts", stats.respawns);
+	if ((pb.errors != 0) || (stats.tasks != BENCH_PROC_TASKS) || (stats.failed != BENCH_PROC_CRASHES) ||
+		(stats.respawns != BENCH_PROC_CRASHES * PROC_MAX_ATTEMPTS)) {
+		fprintf(stderr, "Process pool mismatch: %llu bad results, %llu/%d tasks, %llu/%d failed\n",
+			pb.errors, stats.tasks, BENCH_PROC_TASKS, stats.failed, BENCH_PROC_CRASHES);
+		goto out;
+	}
+	r = TRUE;
+
+out:
+	DestroyProcPool(pp);
+	free(pb.buf);
+	free(pb.crc);
+	return r;
+}
+
+typedef struct {
+	uint32_t* crc;
+	uint8_t* buf;
+	uint8_t* seen;
+	uint64_t errors;
+	// For the run where the first agent gets killed, and the others started then
+	HANDLE* agent;
+	DWORD num_agents;
+	uint16_t port;
+	BOOL kill;
+} net_bench_t;
+
+static void NetBenchTask(uint64_t i, proc_bench_task_t* task)
+{
+	task->seed = i + 1;
+	task->size = BENCH_PROC_SIZE;
+	task->crash = 0;
+}
+
+static void NetBenchRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	net_bench_t* nb = (net_bench_t*)ctx;
+	proc_bench_task_t task;
+	uint64_t i;
+
+	for (i = begin; i < end; i++) {
+		NetBenchTask(i, &task);
+		nb->crc[i] = ProcBenchCrc(&task, &nb->buf[worker * BENCH_PROC_SIZE]);
+	}
+}
+
+static HANDLE StartAgent(uint16_t port)
+{
+	char exe[MAX_PATH], cmd[MAX_PATH + 64];
+	STARTUPINFOA si = { 0 };
+	PROCESS_INFORMATION pi;
+
+	if (GetModuleFileNameU(NULL, exe, sizeof(exe)) == 0)
+		return NULL;
+	snprintf(cmd, sizeof(cmd), "\"%s\" -a 127.0.0.1:%u", exe, port);
+	si.cb = sizeof(si);
+	if (!CreateProcessU(exe, cmd, NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL, &si, &pi)) {
+		fprintf(stderr, "Unable to start agent: %lu\n", GetLastError());
+		return NULL;
+	}
+	CloseHandle(pi.hThread);
+	return pi.hProcess;
+}
+
+static BOOL GetNetTask(void* ctx, uint64_t index, uint32_t* handler, void* task, uint32_t* size)
+{
+	net_bench_t* nb = (net_bench_t*)ctx;
+	DWORD i;
+
+	NetBenchTask(index, (proc_bench_task_t*)task);
+	*handler = BENCH_PROC_CRC;
+	*size = sizeof(proc_bench_task_t);
+	// The first agent is the only one up until now, so this is its batch, which
+	// has to go to the others once it's gone
+	if (nb->kill) {
+		nb->kill = FALSE;
+		TerminateProcess(nb->agent[0], ERROR_PROCESS_ABORTED);
+		for (i = 1; i < nb->num_agents; i++) {
+			nb->agent[i] = StartAgent(nb->port);
+			if (nb->agent[i] == NULL)
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static void CheckNetResult(void* ctx, uint64_t id, BOOL success, const void* result, uint32_t result_size)
+{
+	net_bench_t* nb = (net_bench_t*)ctx;
+	uint32_t crc;
+
+	if (!success || (result_size != sizeof(crc)) || (id >= BENCH_NET_TASKS) || nb->seen[id]) {
+		nb->errors++;
+		return;
+	}
+	nb->seen[id] = 1;
+	memcpy(&crc, result, sizeof(crc));
+	nb->errors += (crc == nb->crc[id]) ? 0 : 1;
+}
+
+/*
+ * The same tasks, on the workers of the pool and on 1 to BENCH_NET_AGENTS
+ * agents started on this machine, which connect over the loopback interface.
+ * As the agents all use the same processors, this shows the overhead of
+ * going through the network rather than any scaling. The times include the
+ * agents starting, and in the last run, the first one gets killed as soon as
+ * it was handed a batch, before the others are started, so that they must
+ * pick up its tasks.
+ */
+static BOOL BenchNet(pool_t* pool)
+{
+	net_bench_t nb = { 0 };
+	net_coordinator_t* nc = NULL;
+	net_stats_t stats;
+	HANDLE agent[BENCH_NET_AGENTS] = { 0 };
+	DWORD i, num_agents;
+	char label[64];
+	double t;
+	BOOL r = FALSE;
+
+	nb.crc = (uint32_t*)calloc(BENCH_NET_TASKS, sizeof(uint32_t));
+	nb.seen = (uint8_t*)calloc(BENCH_NET_TASKS, 1);
+	nb.buf = (uint8_t*)malloc((size_t)PoolSize(pool) * BENCH_PROC_SIZE);
+	if ((nb.crc == NULL) || (nb.seen == NULL) || (nb.buf == NULL))
+		goto out;
+	printf("Processing of %d tasks over loopback (%d workers per agent):\n", BENCH_NET_TASKS, PoolSize(pool));
+
+	t = GetTime();
+	if (!ParallelFor(pool, 0, BENCH_NET_TASKS, 16, NetBenchRange, &nb))
+		goto out;
+	printf("  %-32s %8.0f tasks/s\n", "ParallelFor()", BENCH_NET_TASKS / (GetTime() - t));
+
+	for (num_agents = 1; num_agents <= BENCH_NET_AGENTS; num_agents *= 2) {
+		nc = CreateCoordinator("127.0.0.1", "0");
+		if (nc == NULL)
+			goto out;
+		nb.kill = (num_agents == BENCH_NET_AGENTS);
+		nb.agent = agent;
+		nb.num_agents = num_agents;
+		nb.port = CoordinatorPort(nc);
+		for (i = 0; i < (nb.kill ? 1 : num_agents); i++) {
+			agent[i] = StartAgent(nb.port);
+			if (agent[i] == NULL)
+				goto out;
+		}
+		memset(nb.seen, 0, BENCH_NET_TASKS);
+		if (!RunCoordinator(nc, BENCH_NET_TASKS, GetNetTask, CheckNetResult, &nb, &stats))
+			goto out;
+		snprintf(label, sizeof(label), "%lu agent%s", num_agents, (num_agents == 1) ? "" : "s");
+		printf("  %-32s %8.0f tasks/s (%llu batches, %llu steals, %lu lost)\n", label,
+			BENCH_NET_TASKS / stats.seconds, stats.batches, stats.steals, stats.dropped);
+		if ((nb.errors != 0) || (stats.tasks != BENCH_NET_TASKS) || (stats.failed != 0)) {
+			fprintf(stderr, "Distribution mismatch: %llu bad results, %llu/%d tasks\n",
+				nb.errors, stats.tasks, BENCH_NET_TASKS);
+			goto out;
+		}
+		if ((num_agents == BENCH_NET_AGENTS) && (stats.dropped != 1)) {
+			fprintf(stderr, "%lu agents lost, instead of the one that was killed\n", stats.dropped);
+			goto out;
+		}
+		// Released by the coordinator, the agents exit on their own
+		WaitForMultipleObjects(num_agents, agent, TRUE, 10000);
+		for (i = 0; i < num_agents; i++) {
+			TerminateProcess(agent[i], ERROR_PROCESS_ABORTED);
+			CloseHandle(agent[i]);
+			agent[i] = NULL;
+		}
+		DestroyCoordinator(nc);
+		nc = NULL;
+	}
+	r = TRUE;
+
+out:
+	for (i = 0; i < BENCH_NET_AGENTS; i++) {
+		if (agent[i] != NULL) {
+			TerminateProcess(agent[i], ERROR_PROCESS_ABORTED);
+			CloseHandle(agent[i]);
+		}
+	}
+	DestroyCoordinator(nc);
+	free(nb.buf);
+	free(nb.seen);
+	free(nb.crc);
+	return r;
+}
+
+static BOOL KeepEven(void* ctx, const void* item, size_t index)
+{
+	return (*(const uint32_t*)item & 1) == 0;
+}
+
+/*
+ * Scans read and write each item once, so we report the bytes moved both
+ * ways, which should get close to what the memory can do once there are
+ * enough workers.
+ */
+static BOOL BenchPrefix(pool_t* pool)
+{
+	uint32_t *in, *out, *ref, total;
+	uint64_t *in64 = NULL, *out64 = NULL, sum64;
+	double t, best;
+	size_t i, count, n = BENCH_PREFIX_SIZE / sizeof(uint32_t);
+	int run;
+	BOOL r = FALSE;
+
+	in = (uint32_t*)malloc(n * sizeof(uint32_t));
+	out = (uint32_t*)malloc(n * sizeof(uint32_t));
+	ref = (uint32_t*)malloc(n * sizeof(uint32_t));
+	if ((in == NULL) || (out == NULL) || (ref == NULL)) {
+		fprintf(stderr, "Could not allocate arrays.\n");
+		goto out;
+	}
+	FillRandom(in, n * sizeof(uint32_t), 0x2545f4914f6cdd1dULL);
+	printf("Prefix sums over %d MB (%s, %d workers):\n", (int)(BENCH_PREFIX_SIZE >> 20),
+		prefix_impl(), PoolSize(pool));
+
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		t = GetTime();
+		for (total = 0, i = 0; i < n; i++) {
+			total += in[i];
+			ref[i] = total;
+		}
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintRate("Sequential loop", 2.0 * BENCH_PREFIX_SIZE, best);
+
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		t = GetTime();
+		prefix_sum32(in, out, n, 0, TRUE);
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintRate("prefix_sum32(), 1 thread", 2.0 * BENCH_PREFIX_SIZE, best);
+	if (memcmp(out, ref, n * sizeof(uint32_t)) != 0) {
+		fprintf(stderr, "prefix_sum32() mismatch\n");
+		goto out;
+	}
+
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		memset(out, 0, n * sizeof(uint32_t));
+		t = GetTime();
+		if (!ParallelPrefixSum32(pool, in, out, n, TRUE, &total))
+			goto out;
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintRate("ParallelPrefixSum32()", 2.0 * BENCH_PREFIX_SIZE, best);
+	if ((memcmp(out, ref, n * sizeof(uint32_t)) != 0) || (total != ref[n - 1])) {
+		fprintf(stderr, "ParallelPrefixSum32() mismatch\n");
+		goto out;
+	}
+
+	// Exclusive, in place
+	memcpy(out, in, n * sizeof(uint32_t));
+	if (!ParallelPrefixSum32(pool, out, out, n, FALSE, &total))
+		goto out;
+	for (i = 0; i < n; i++) {
+		if (out[i] != ref[i] - in[i]) {
+			fprintf(stderr, "ParallelPrefixSum32() (exclusive, in place) mismatch at %zu\n", i);
+			goto out;
+		}
+	}
+
+	in64 = (uint64_t*)in;
+	out64 = (uint64_t*)out;
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		t = GetTime();
+		if (!ParallelPrefixSum64(pool, in64, out64, n / 2, FALSE, &sum64))
+			goto out;
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintRate("ParallelPrefixSum64(), exclusive", 2.0 * BENCH_PREFIX_SIZE, best);
+	if (prefix_sum64(in64, (uint64_t*)ref, n / 2, 0, FALSE) != sum64 ||
+		memcmp(out64, ref, n / 2 * sizeof(uint64_t)) != 0) {
+		fprintf(stderr, "ParallelPrefixSum64() mismatch\n");
+		goto out;
+	}
+
+	// Keep the even items, which is about half of them
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		t = GetTime();
+		for (count = 0, i = 0; i < n; i++) {
+			if (KeepEven(NULL, &in[i], i))
+				ref[count++] = in[i];
+		}
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintRate("Sequential compaction", (double)BENCH_PREFIX_SIZE + (double)count * sizeof(uint32_t), best);
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		t = GetTime();
+		if (!ParallelCompact(pool, in, n, sizeof(uint32_t), KeepEven, NULL, out, &i))
+			goto out;
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintRate("ParallelCompact()", (double)BENCH_PREFIX_SIZE + (double)count * sizeof(uint32_t), best);
+	if ((i != count) || (memcmp(out, ref, count * sizeof(uint32_t)) != 0)) {
+		fprintf(stderr, "ParallelCompact() mismatch: %zu vs %zu items\n", i, count);
+		goto out;
+	}
+	r = TRUE;
+
+out:
+	free(in);
+	free(out);
+	free(ref);
+	return r;
+}
+
+typedef struct {
+	uint64_t key;
+	uint64_t index;
+} sort_item_t;
+
+static int CompareKeys(const void* a, const void* b)
+{
+	uint64_t ka = *(const uint64_t*)a, kb = *(const uint64_t*)b;
+
+	return (ka > kb) - (ka < kb);
+}
+
+/*
+ * Sorts of random 64-bit keys, of 16-byte records with a lot of equal keys,
+ * which must keep their order, and the merge of one sorted run per worker.
+ */
+static BOOL BenchSort(pool_t* pool)
+{
+	uint64_t *in, *out, *ref, **runs = NULL;
+	sort_item_t* items = NULL;
+	const sort_record_t item_record = { sizeof(sort_item_t), offsetof(sort_item_t, key), sizeof(uint64_t) };
+	const sort_record_t key_record = { sizeof(uint64_t), 0, sizeof(uint64_t) };
+	size_t *counts = NULL, *pos = NULL, i, j, m, k = PoolSize(pool), n = BENCH_SORT_KEYS;
+	double t, best;
+	int run;
+	BOOL r = FALSE;
+
+	in = (uint64_t*)malloc(n * sizeof(uint64_t));
+	out = (uint64_t*)malloc(n * sizeof(uint64_t));
+	ref = (uint64_t*)malloc(n * sizeof(uint64_t));
+	items = (sort_item_t*)malloc(n * sizeof(sort_item_t));
+	runs = (uint64_t**)malloc(k * sizeof(uint64_t*));
+	counts = (size_t*)malloc(k * sizeof(size_t));
+	pos = (size_t*)malloc(k * sizeof(size_t));
+	if ((in == NULL) || (out == NULL) || (ref == NULL) || (items == NULL) ||
+		(runs == NULL) || (counts == NULL) || (pos == NULL)) {
+		fprintf(stderr, "Could not allocate arrays.\n");
+		goto out;
+	}
+	FillRandom(in, n * sizeof(uint64_t), 0x2545f4914f6cdd1dULL);
+	printf("Sorting %d M keys (%d workers):\n", (int)(n >> 20), PoolSize(pool));
+
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		memcpy(ref, in, n * sizeof(uint64_t));
+		t = GetTime();
+		qsort(ref, n, sizeof(uint64_t), CompareKeys);
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintKeyRate("qsort()", (double)n, best);
+
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		memcpy(out, in, n * sizeof(uint64_t));
+		t = GetTime();
+		if (!ParallelRadixSort64(pool, out, n))
+			goto out;
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintKeyRate("ParallelRadixSort64()", (double)n, best);
+	if (memcmp(out, ref, n * sizeof(uint64_t)) != 0) {
+		fprintf(stderr, "ParallelRadixSort64() mismatch\n");
+		goto out;
+	}
+
+	// Only the low digits of these keys differ, so the other passes get skipped
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		for (i = 0; i < n; i++) {
+			items[i].key = in[i] % BENCH_SORT_CARDINALITY;
+			items[i].index = i;
+		}
+		t = GetTime();
+		if (!ParallelRadixSort(pool, items, n, &item_record, NULL))
+			goto out;
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintKeyRate("ParallelRadixSort(), 16-byte", (double)n, best);
+	for (i = 1; i < n; i++) {
+		if ((items[i].key < items[i - 1].key) ||
+			((items[i].key == items[i - 1].key) && (items[i].index < items[i - 1].index))) {
+			fprintf(stderr, "ParallelRadixSort() mismatch at %zu\n", i);
+			goto out;
+		}
+	}
+
+	// One sorted run per worker, merged on the control thread, then on the pool
+	for (j = 0; j < k; j++) {
+		runs[j] = &in[n * j / k];
+		counts[j] = n * (j + 1) / k - n * j / k;
+		qsort(runs[j], counts[j], sizeof(uint64_t), CompareKeys);
+	}
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		memset(pos, 0, k * sizeof(size_t));
+		t = GetTime();
+		for (i = 0; i < n; i++) {
+			for (m = k, j = 0; j < k; j++) {
+				if ((pos[j] < counts[j]) && ((m == k) || (runs[j][pos[j]] < runs[m][pos[m]])))
+					m = j;
+			}
+			out[i] = runs[m][pos[m]++];
+		}
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintKeyRate("Sequential merge", (double)n, best);
+	if (memcmp(out, ref, n * sizeof(uint64_t)) != 0) {
+		fprintf(stderr, "Sequential merge mismatch\n");
+		goto out;
+	}
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		memset(out, 0, n * sizeof(uint64_t));
+		t = GetTime();
+		if (!ParallelMergeRuns(pool, (const void* const*)runs, counts, k, &key_record, out))
+			goto out;
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintKeyRate("ParallelMergeRuns()", (double)n, best);
+	if (memcmp(out, ref, n * sizeof(uint64_t)) != 0) {
+		fprintf(stderr, "ParallelMergeRuns() mismatch\n");
+		goto out;
+	}
+	r = TRUE;
+
+out:
+	free(in);
+	free(out);
+	free(ref);
+	free(items);
+	free(runs);
+	free(counts);
+	free(pos);
+	return r;
+}
+
+// Group of key in the reference table, which gets added if missing
+static agg_group_t* FindGroup(agg_group_t* table, size_t mask, uint64_t key)
+{
+	size_t i;
+
+	for (i = (size_t)(key * 0x9e3779b97f4a7c15ULL >> 32) & mask; table[i].count != 0; i = (i + 1) & mask) {
+		if (table[i].key == key)
+			break;
+	}
+	table[i].key = key;
+	return &table[i];
+}
+
+/*
+ * Group by over few keys, which the workers mostly aggregate on their own,
+ * then over about as many keys as groups, which mostly goes to the merge.
+ */
+static BOOL BenchAggregate(pool_t* pool)
+{
+	const size_t cardinality[] = { BENCH_AGG_LOW, BENCH_AGG_KEYS / 2 };
+	uint64_t *keys, *values;
+	agg_group_t *ref = NULL, *groups = NULL, *g;
+	size_t c, i, n = BENCH_AGG_KEYS, num_groups, ref_groups, size;
+	char label[64];
+	double t, best;
+	int run;
+	BOOL r = FALSE;
+
+	keys = (uint64_t*)malloc(n * sizeof(uint64_t));
+	values = (uint64_t*)malloc(n * sizeof(uint64_t));
+	if ((keys == NULL) || (values == NULL)) {
+		fprintf(stderr, "Could not allocate arrays.\n");
+		goto out;
+	}
+	FillRandom(values, n * sizeof(uint64_t), 0x2545f4914f6cdd1dULL);
+	printf("Aggregating %d M keys (%d workers):\n", (int)(n >> 20), PoolSize(pool));
+
+	for (c = 0; c < ARRAYSIZE(cardinality); c++) {
+		// Spread the keys out, so that they don't hash any better than real ones
+		for (i = 0; i < n; i++)
+			keys[i] = (values[i] % cardinality[c]) * 0xbf58476d1ce4e5b9ULL;
+		for (size = 16; size < 2 * cardinality[c]; size <<= 1);
+		free(ref);
+		ref = (agg_group_t*)malloc(size * sizeof(agg_group_t));
+		if (ref == NULL) {
+			fprintf(stderr, "Could not allocate arrays.\n");
+			goto out;
+		}
+
+		for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+			memset(ref, 0, size * sizeof(agg_group_t));
+			t = GetTime();
+			for (ref_groups = 0, i = 0; i < n; i++) {
+				g = FindGroup(ref, size - 1, keys[i]);
+				if (g->count++ == 0)
+					ref_groups++;
+				g->sum += values[i];
+			}
+			t = GetTime() - t;
+			best = min(best, t);
+		}
+		snprintf(label, sizeof(label), "Sequential table, %zu groups", ref_groups);
+		PrintKeyRate(label, (double)n, best);
+
+		for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+			free(groups);
+			t = GetTime();
+			if (!ParallelAggregate(pool, keys, values, n, &groups, &num_groups))
+				goto out;
+			t = GetTime() - t;
+			best = min(best, t);
+		}
+		snprintf(label, sizeof(label), "Parallel, %zu groups", num_groups);
+		PrintKeyRate(label, (double)n, best);
+		if (num_groups != ref_groups) {
+			fprintf(stderr, "ParallelAggregate() mismatch: %zu vs %zu groups\n", num_groups, ref_groups);
+			goto out;
+		}
+		for (i = 0; i < num_groups; i++) {
+			g = FindGroup(ref, size - 1, groups[i].key);
+			if ((g->count != groups[i].count) || (g->sum != groups[i].sum)) {
+				fprintf(stderr, "ParallelAggregate() mismatch for key %016llx\n", groups[i].key);
+				goto out;
+			}
+		}
+	}
+	r = TRUE;
+
+out:
+	free(keys);
+	free(values);
+	free(ref);
+	free(groups);
+	return r;
+}
+
+// One index out of 8 has no result, and the others get a score from 0.0 to 1.0
+// Hash of an index, as the result of some work on it
+static uint64_t HashIndex(uint64_t index)
+{
+	uint64_t seed = (index + 1) * 0x9e3779b97f4a7c15ULL;
+
+	return seed ^ (NextRandom(&seed) >> 29);
+}
+
+static BOOL ScoreIndex(void* ctx, uint32_t worker, uint64_t index, double* score)
+{
+	uint64_t seed = HashIndex(index);
+
+	*score = (double)(seed >> 11) * (1.0 / 9007199254740992.0);
+	return (seed & 7) != 0;
+}
+
+// Best first, then lowest id
+static int CompareScores(const void* a, const void* b)
+{
+	const topk_item_t *ia = (const topk_item_t*)a, *ib = (const topk_item_t*)b;
+
+	if (ia->score != ib->score)
+		return (ia->score < ib->score) ? 1 : -1;
+	return (ia->id > ib->id) - (ia->id < ib->id);
+}
+
+/*
+ * Best scores and quantiles of a job, collected and sorted, against the
+ * per-worker top-K and sketches, which only take a few KB.
+ */
+static BOOL BenchSummary(pool_t* pool)
+{
+	const double q[] = { 0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.99 };
+	topk_item_t* all;
+	topk_t topk = { 0 };
+	quantile_t sketch = { 0 };
+	double value[ARRAYSIZE(q)], score, t, best;
+	size_t i, j, lo, hi, count = 0, n = BENCH_SUMMARY_ITEMS;
+	int run;
+	BOOL r = FALSE;
+
+	all = (topk_item_t*)malloc(n * sizeof(topk_item_t));
+	if (all == NULL) {
+		fprintf(stderr, "Could not allocate arrays.\n");
+		goto out;
+	}
+	printf("Top %d and quantiles of %d M scores (%d workers):\n", BENCH_SUMMARY_K, (int)(n >> 20), PoolSize(pool));
+
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		t = GetTime();
+		for (count = 0, i = 0; i < n; i++) {
+			if (ScoreIndex(NULL, 0, i, &score)) {
+				all[count].score = score;
+				all[count++].id = i;
+			}
+		}
+		qsort(all, count, sizeof(topk_item_t), CompareScores);
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintKeyRate("Collect and qsort()", (double)n, best);
+
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		topk_free(&topk);
+		quantile_free(&sketch);
+		if (!topk_init(&topk, BENCH_SUMMARY_K) || !quantile_init(&sketch, 0, 0))
+			goto out;
+		t = GetTime();
+		if (!ParallelSummarize(pool, 0, n, ScoreIndex, NULL, &topk, &sketch))
+			goto out;
+		topk_sort(&topk);
+		if (!quantile_query(&sketch, q, value, ARRAYSIZE(q)))
+			goto out;
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintKeyRate("ParallelSummarize()", (double)n, best);
+	printf("  %zu MB collected, against %llu values in the sketch\n",
+		(count * sizeof(topk_item_t)) >> 20, sketch.held);
+
+	if ((topk.count != BENCH_SUMMARY_K) || (sketch.n != count)) {
+		fprintf(stderr, "ParallelSummarize() mismatch: %zu best, %llu values\n", topk.count, sketch.n);
+		goto out;
+	}
+	for (i = 0; i < topk.count; i++) {
+		if ((topk.item[i].id != all[i].id) || (topk.item[i].score != all[i].score)) {
+			fprintf(stderr, "Top-K mismatch at %zu\n", i);
+			goto out;
+		}
+	}
+	// The scores are sorted from the highest, so the rank of a value is how many come after it
+	for (j = 0; j < ARRAYSIZE(q); j++) {
+		for (lo = 0, hi = count; lo < hi; ) {
+			i = lo + (hi - lo) / 2;
+			if (all[i].score > value[j])
+				lo = i + 1;
+			else
+				hi = i;
+		}
+		printf("  %2.0f%% quantile %.4f, %+.3f%% off\n", q[j] * 100.0, value[j],
+			((double)(count - lo) / count - q[j]) * 100.0);
+		if (fabs((double)(count - lo) / count - q[j]) > 0.02) {
+			fprintf(stderr, "Quantile %.2f is off by more than 2%%\n", q[j]);
+			goto out;
+		}
+	}
+	r = TRUE;
+
+out:
+	free(all);
+	topk_free(&topk);
+	quantile_free(&sketch);
+	return r;
+}
+
+static BOOL FindHash(void* ctx, uint32_t worker, uint64_t begin, uint64_t end, uint64_t* index)
+{
+	uint64_t i;
+
+	for (i = begin; i < end; i++) {
+		if ((HashIndex(i) >> (64 - BENCH_FIND_BITS)) == 0) {
+			*index = i;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Search for the first index with a hash that has its top bits cleared,
+ * which shows up about 2^BENCH_FIND_BITS indexes in, out of a space that
+ * would take minutes to go through, so that it only works if the workers
+ * stop once there is a match.
+ */
+static BOOL BenchFind(pool_t* pool)
+{
+	uint64_t first = 0, index;
+	double t, best;
+	int run, lowest;
+	BOOL r = FALSE;
+
+	printf("Search for a %d-bit hash (%d workers):\n", BENCH_FIND_BITS, PoolSize(pool));
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		t = GetTime();
+		FindHash(NULL, 0, 0, BENCH_FIND_SPACE, &first);
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintCallRate("Sequential loop", (double)first, best);
+	printf("  First match at %llu\n", first);
+
+	for (lowest = 1; lowest >= 0; lowest--) {
+		for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+			t = GetTime();
+			if (!ParallelFind(pool, 0, BENCH_FIND_SPACE, BENCH_FIND_GRAIN, FindHash, NULL, lowest, &index))
+				goto out;
+			t = GetTime() - t;
+			best = min(best, t);
+			// The lowest match is the one the loop found, and any other one must be a match too
+			if ((lowest && (index != first)) || (!lowest && ((index == BENCH_FIND_SPACE) ||
+				!FindHash(NULL, 0, index, index + 1, &index)))) {
+				fprintf(stderr, "ParallelFind() mismatch: %llu vs %llu\n", index, first);
+				goto out;
+			}
+		}
+		PrintCallRate(lowest ? "ParallelFind(), lowest" : "ParallelFind(), any", (double)first, best);
+	}
+	r = TRUE;
+
+out:
+	return r;
+}
+
+typedef struct {
+	const char* name;
+	search_kernel_fn kernel;
+	const void* ctx;
+	uint32_t target;
+} bench_search_t;
+
+// One candidate per iteration, which is what the kernels are up against
+static uint64_t SearchLoop(const bench_search_t* s, uint64_t* first)
+{
+	uint64_t i, matches = 0;
+	uint32_t x, v;
+
+	*first = BENCH_SEARCH_SPACE;
+	for (i = 0; i < BENCH_SEARCH_SPACE; i++) {
+		x = (uint32_t)i;
+		v = (s->kernel == search_crc32c) ? crc32c(0, &x, sizeof(x)) : search_hash32_value(x, ((const search_hash32_t*)s->ctx)->seed);
+		if (v == s->target) {
+			if (matches++ == 0)
+				*first = i;
+		}
+	}
+	return matches;
+}
+
+/*
+ * Look for the preimage of a CRC-32C and of a hash, both of which are
+ * bijections of 32-bit values, so that there is exactly one match, near
+ * the end of the space. Counting goes through all of it, and finding the
+ * first one too, but without adding up the masks.
+ */
+static BOOL BenchSearch(pool_t* pool)
+{
+	search_crc32c_t crc;
+	search_hash32_t hash;
+	search_result_t result;
+	bench_search_t search[2];
+	uint64_t first, matches;
+	uint32_t secret = (uint32_t)BENCH_SEARCH_SECRET;
+	double t, best;
+	char label[64];
+	int run, i, count_all;
+	BOOL r = FALSE;
+
+	crc.target = crc32c(0, &secret, sizeof(secret));
+	hash.seed = 0x9e3779b9;
+	hash.target = search_hash32_value(secret, hash.seed);
+	search[0].name = "CRC-32C";
+	search[0].kernel = search_crc32c;
+	search[0].ctx = &crc;
+	search[0].target = crc.target;
+	search[1].name = "hash";
+	search[1].kernel = search_hash32;
+	search[1].ctx = &hash;
+	search[1].target = hash.target;
+
+	printf("Brute-force search of %llu candidates (%s, %d workers):\n",
+		BENCH_SEARCH_SPACE, search_impl(), PoolSize(pool));
+	for (i = 0; i < (int)ARRAYSIZE(search); i++) {
+		for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+			t = GetTime();
+			matches = SearchLoop(&search[i], &first);
+			t = GetTime() - t;
+			best = min(best, t);
+		}
+		snprintf(label, sizeof(label), "Loop, %s", search[i].name);
+		PrintKeyRate(label, (double)BENCH_SEARCH_SPACE, best);
+		if ((matches != 1) || (first != BENCH_SEARCH_SECRET)) {
+			fprintf(stderr, "%s loop mismatch: %llu matches, first at %llu\n", search[i].name, matches, first);
+			goto out;
+		}
+
+		for (count_all = 1; count_all >= 0; count_all--) {
+			for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+				t = GetTime();
+				if (!ParallelSearch(pool, 0, BENCH_SEARCH_SPACE, search[i].kernel, search[i].ctx, count_all, &result))
+					goto out;
+				t = GetTime() - t;
+				best = min(best, t);
+				if ((result.matches != 1) || (result.first != BENCH_SEARCH_SECRET)) {
+					fprintf(stderr, "ParallelSearch() mismatch: %llu matches, first at %llu\n",
+						result.matches, result.first);
+					goto out;
+				}
+			}
+			snprintf(label, sizeof(label), "ParallelSearch(), %s, %s", search[i].name, count_all ? "count" : "find");
+			PrintKeyRate(label, (double)BENCH_SEARCH_SPACE, best);
+		}
+	}
+	r = TRUE;
+
+out:
+	return r;
+}
+
+#define RNG_BENCH_STRIDE	(64 / sizeof(uint64_t))
+#define RNG_BENCH_BATCH		512
+
+// Points of a task that fall inside the quarter circle, from the stream of the task
+static void RngBenchRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	uint64_t* hits = (uint64_t*)ctx;
+	double u[2 * RNG_BENCH_BATCH];
+	rng_t rng;
+	uint64_t task;
+	int i, j;
+
+	for (task = begin; task < end; task++) {
+		rng_seed(&rng, BENCH_RNG_SEED, task);
+		for (i = 0; i < BENCH_RNG_SAMPLES; i += RNG_BENCH_BATCH) {
+			rng_uniforms(&rng, u, 2 * RNG_BENCH_BATCH);
+			for (j = 0; j < 2 * RNG_BENCH_BATCH; j += 2)
+				hits[worker * RNG_BENCH_STRIDE] += (u[j] * u[j] + u[j + 1] * u[j + 1] < 1.0) ? 1 : 0;
+		}
+	}
+}
+
+/*
+ * Generate numbers one at a time, then in bulk, which must give the same
+ * ones, from a stream that doesn't start on a block. Then estimate pi from
+ * the points of BENCH_RNG_TASKS tasks, that each have a stream of their
+ * own, which must give the same count on the pool as on a single thread.
+ */
+static BOOL BenchRng(pool_t* pool)
+{
+	double *buf = NULL, sum, sq, t, best;
+	uint64_t *hits = NULL, ref, total;
+	size_t i, n = BENCH_RNG_NUMBERS;
+	DWORD w, workers = PoolSize(pool);
+	rng_t rng;
+	int run;
+	BOOL r = FALSE;
+
+	buf = (double*)malloc(n * sizeof(double));
+	hits = (uint64_t*)calloc((size_t)workers * RNG_BENCH_STRIDE, sizeof(uint64_t));
+	if ((buf == NULL) || (hits == NULL)) {
+		fprintf(stderr, "Could not allocate random number buffers\n");
+		goto out;
+	}
+
+	printf("Counter-based random numbers (%s, %d workers):\n", rng_impl(), workers);
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		rng_seed(&rng, BENCH_RNG_SEED, 0);
+		rng_next32(&rng);
+		t = GetTime();
+		for (i = 0; i < n; i++)
+			buf[i] = rng_uniform(&rng);
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintCallRate("rng_uniform() loop", (double)n, best);
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		rng_seed(&rng, BENCH_RNG_SEED, 0);
+		rng_next32(&rng);
+		t = GetTime();
+		rng_uniforms(&rng, buf, n);
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintCallRate("rng_uniforms()", (double)n, best);
+	rng_seed(&rng, BENCH_RNG_SEED, 0);
+	rng_next32(&rng);
+	for (i = 0; i < n; i++) {
+		if (buf[i] != rng_uniform(&rng)) {
+			fprintf(stderr, "rng_uniforms() mismatch at %zu\n", i);
+			goto out;
+		}
+	}
+
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		rng_seed(&rng, BENCH_RNG_SEED, 0);
+		t = GetTime();
+		rng_normals(&rng, buf, n);
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintCallRate("rng_normals()", (double)n, best);
+	for (sum = 0.0, sq = 0.0, i = 0; i < n; i++) {
+		sum += buf[i];
+		sq += buf[i] * buf[i];
+	}
+	printf("  Mean %.4f, variance %.4f\n", sum / n, sq / n - (sum / n) * (sum / n));
+
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		hits[0] = 0;
+		t = GetTime();
+		RngBenchRange(hits, 0, 0, BENCH_RNG_TASKS);
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	ref = hits[0];
+	PrintCallRate("Monte Carlo, 1 thread", (double)BENCH_RNG_TASKS * BENCH_RNG_SAMPLES, best);
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		memset(hits, 0, (size_t)workers * RNG_BENCH_STRIDE * sizeof(uint64_t));
+		t = GetTime();
+		if (!ParallelFor(pool, 0, BENCH_RNG_TASKS, 1, RngBenchRange, hits))
+			goto out;
+		t = GetTime() - t;
+		best = min(best, t);
+		for (total = 0, w = 0; w < workers; w++)
+			total += hits[w * RNG_BENCH_STRIDE];
+		if (total != ref) {
+			fprintf(stderr, "Monte Carlo mismatch: %llu vs %llu\n", total, ref);
+			goto out;
+		}
+	}
+	PrintCallRate("Monte Carlo, parallel", (double)BENCH_RNG_TASKS * BENCH_RNG_SAMPLES, best);
+	printf("  Pi is about %.6f\n", 4.0 * ref / ((double)BENCH_RNG_TASKS * BENCH_RNG_SAMPLES));
+	r = TRUE;
+
+out:
+	free(buf);
+	free(hits);
+	return r;
+}
+
+typedef struct {
+	const float* in;
+	float* out;
+	uint64_t side;
+} tile_bench_t;
+
+static void TransposeRows(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	tile_bench_t* tb = (tile_bench_t*)ctx;
+	uint64_t x, y;
+
+	for (y = begin; y < end; y++)
+		for (x = 0; x < tb->side; x++)
+			tb->out[x * tb->side + y] = tb->in[y * tb->side + x];
+}
+
+static void TransposeTile(void* ctx, uint32_t worker, const pool_box_t* tile)
+{
+	tile_bench_t* tb = (tile_bench_t*)ctx;
+	uint64_t x, y;
+
+	for (y = tile->begin[1]; y < tile->end[1]; y++)
+		for (x = tile->begin[0]; x < tile->end[0]; x++)
+			tb->out[x * tb->side + y] = tb->in[y * tb->side + x];
+}
+
+/*
+ * Transpose a matrix that is too large for the cache, by rows, which reads
+ * along the rows of the input but writes down the columns of the output,
+ * then by tiles, which read and write both of them a few lines at a time.
+ */
+static BOOL BenchTile(pool_t* pool)
+{
+	tile_bench_t tb;
+	pool_box_t box = { { 0, 0, 0 }, { BENCH_TILE_SIDE, BENCH_TILE_SIDE, 1 } };
+	uint64_t size[2] = { BENCH_TILE_SIDE, BENCH_TILE_SIDE }, tile[3];
+	float *ref = NULL, *in = NULL, *out = NULL;
+	size_t i, n = (size_t)BENCH_TILE_SIDE * BENCH_TILE_SIDE;
+	double t, best;
+	int run;
+	BOOL r = FALSE;
+
+	in = (float*)malloc(n * sizeof(float));
+	out = (float*)malloc(n * sizeof(float));
+	ref = (float*)malloc(n * sizeof(float));
+	if ((in == NULL) || (out == NULL) || (ref == NULL)) {
+		fprintf(stderr, "Could not allocate matrices\n");
+		goto out;
+	}
+	for (i = 0; i < n; i++)
+		in[i] = (float)i;
+	tb.in = in;
+	tb.side = BENCH_TILE_SIDE;
+
+	GetTileSize(2, size, sizeof(float), tile);
+	printf("Transposition of a %dx%d matrix (%llux%llu tiles, %d workers):\n",
+		BENCH_TILE_SIDE, BENCH_TILE_SIDE, tile[0], tile[1], PoolSize(pool));
+	tb.out = ref;
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		t = GetTime();
+		TransposeRows(&tb, 0, 0, BENCH_TILE_SIDE);
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintRate("Rows, 1 thread", (double)n * sizeof(float), best);
+
+	tb.out = out;
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		memset(out, 0, n * sizeof(float));
+		t = GetTime();
+		if (!ParallelFor(pool, 0, BENCH_TILE_SIDE, 0, TransposeRows, &tb))
+			goto out;
+		t = GetTime() - t;
+		best = min(best, t);
+	}
+	PrintRate("ParallelFor(), rows", (double)n * sizeof(float), best);
+
+	for (best = 1.0e9, run = 0; run < BENCH_RUNS; run++) {
+		memset(out, 0, n * sizeof(float));
+		t = GetTime();
+		if (!ParallelFor2D(pool, &box, sizeof(float), TransposeTile, &tb))
+			goto out;
+		t = GetTime() - t;
+		best = min(best, t);
+		if (memcmp(out, ref, n * sizeof(float)) != 0) {
+			fprintf(stderr, "ParallelFor2D() mismatch\n");
+			goto out;
+		}
+	}
+	PrintRate("ParallelFor2D(), tiles", (double)n * sizeof(float), best);
+	r = TRUE;
+
+out:
+	free(in);
+	free(out);
+	free(ref);
+	return r;
+}
+
+static const benchmark_t benchmark[] = {
+	{ "popcnt", "Bulk population count, against the popcnt64() loop", BenchPopcount },
+	{ "utf", "UTF-16 <-> UTF-8 path conversion, against the Windows API", BenchUtf },
+	{ "wrappers", "Per call overhead of the file wrappers, from all workers", BenchWrappers },
+	{ "scan", "UTF-8 validation and classification, against the per-byte macros", BenchScan },
+	{ "walk", "Directory traversal, against a recursive listing", BenchWalk },
+	{ "tree", "Directory tree creation and deletion, against the sequential calls", BenchTree },
+	{ "copy", "File copy, against sequential CopyFileU()", BenchCopy },
+	{ "run", "External commands, one at a time and from all workers", BenchRun },
+	{ "proc", "Tasks on worker processes, against the pool", BenchProc },
+	{ "net", "Tasks on agents over loopback, against the pool", BenchNet },
+	{ "prefix", "Prefix sums and compaction, against the sequential loops", BenchPrefix },
+	{ "sort", "Radix sort and k-way merge, against qsort() and a sequential merge", BenchSort },
+	{ "aggregate", "Hash aggregation, against a sequential hash table", BenchAggregate },
+	{ "summary", "Top-K and quantile sketches, against collecting and sorting", BenchSummary },
+	{ "find", "Search with early exit, against a sequential loop", BenchFind },
+	{ "search", "Brute-force search 64 candidates at a time, against a loop", BenchSearch },
+	{ "rng", "Counter-based random numbers, one at a time and in bulk", BenchRng },
+	{ "tile", "Matrix transposition by tiles, against row ranges", BenchTile },
+};
+
+BOOL RunBenchmark(pool_t* pool, const char* name)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAYSIZE(benchmark); i++) {
+		if (strcmp(name, benchmark[i].name) == 0)
+			return benchmark[i].run(pool);
+	}
+	fprintf(stderr, "Unknown benchmark '%s'. Available benchmarks:\n", name);
+	for (i = 0; i < ARRAYSIZE(benchmark); i++)
+		fprintf(stderr, "  %-12s %s\n", benchmark[i].name, benchmark[i].description);
+	return FALSE;
+}
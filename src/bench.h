@@ -0,0 +1,29 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Benchmarks
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <windows.h>
+
+#include "pool.h"
+
+extern BOOL RunBenchmark(pool_t* pool, const char* name);
+// The benchmarks that use worker processes need their handlers registered in these too
+extern void RegisterBenchHandlers(void);
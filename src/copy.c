@@ -0,0 +1,427 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Parallel file copy
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msapi_utf8.h"
+#include "copy.h"
+#include "pool.h"
+
+// Size of the ranges that large files are split into, each copied by a single task
+#define COPY_CHUNK_SIZE		(16 << 20)
+// Files of fewer chunks than this are left to CopyFile()
+#define COPY_SPLIT_CHUNKS	2
+// Size of each unbuffered read or write
+#define COPY_IO_SIZE		(1 << 20)
+// Unbuffered I/O must be a multiple of the sector size, which this is a multiple of
+#define COPY_ALIGN			4096
+#define COPY_ALIGN_UP(n)	(((n) + COPY_ALIGN - 1) & ~((uint64_t)COPY_ALIGN - 1))
+
+// What each worker needs for its I/O, allocated the first time it copies a chunk
+typedef struct {
+	uint8_t* buf[2];
+	OVERLAPPED ov[2];
+} copy_worker_t;
+
+typedef struct {
+	pool_t* pool;
+	pool_group_t group;
+	DWORD flags;
+	copy_worker_t* worker;
+	double* latency;
+	volatile LONG num_latencies;
+	volatile LONG64 files;
+	volatile LONG64 bytes;
+	volatile LONG64 errors;
+	volatile LONG error;
+} copy_job_t;
+
+typedef struct {
+	struct copy_file* file;
+	uint64_t offset;
+	uint64_t len;
+} copy_chunk_t;
+
+typedef struct copy_file {
+	copy_job_t* job;
+	wchar_t* src;
+	wchar_t* dst;
+	HANDLE hsrc;
+	HANDLE hdst;
+	DWORD attributes;
+	uint64_t size;
+	double start;
+	copy_chunk_t* chunk;
+	// Chunks that are still being copied, plus one for the task that queues them
+	volatile LONG pending;
+	volatile LONG error;
+} copy_file_t;
+
+static double GetTime(void)
+{
+	static LARGE_INTEGER freq = { 0 };
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / (double)freq.QuadPart;
+}
+
+static void CopyFailed(copy_job_t* job, DWORD error)
+{
+	InterlockedIncrement64(&job->errors);
+	// Only keep the first error
+	InterlockedCompareExchange(&job->error, (LONG)error, 0);
+}
+
+static void CopyDone(copy_file_t* file)
+{
+	copy_job_t* job = file->job;
+
+	job->latency[InterlockedIncrement(&job->num_latencies) - 1] = (GetTime() - file->start) * 1000.0;
+	InterlockedIncrement64(&job->files);
+	InterlockedExchangeAdd64(&job->bytes, (LONG64)file->size);
+}
+
+static void FreeCopyFile(copy_file_t* file)
+{
+	if (file == NULL)
+		return;
+	if (file->hsrc != INVALID_HANDLE_VALUE)
+		CloseHandle(file->hsrc);
+	if (file->hdst != INVALID_HANDLE_VALUE)
+		CloseHandle(file->hdst);
+	free(file->src);
+	free(file->dst);
+	free(file->chunk);
+	free(file);
+}
+
+static BOOL InitCopyWorker(copy_worker_t* w)
+{
+	int i;
+
+	if (w->buf[0] != NULL)
+		return TRUE;
+	// VirtualAlloc() gives us page alignment, as unbuffered I/O requires
+	w->buf[0] = (uint8_t*)VirtualAlloc(NULL, 2 * COPY_IO_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (w->buf[0] == NULL)
+		return FALSE;
+	w->buf[1] = w->buf[0] + COPY_IO_SIZE;
+	for (i = 0; i < 2; i++) {
+		w->ov[i].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (w->ov[i].hEvent == NULL)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void ExitCopyWorker(copy_worker_t* w)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (w->ov[i].hEvent != NULL)
+			CloseHandle(w->ov[i].hEvent);
+	}
+	if (w->buf[0] != NULL)
+		VirtualFree(w->buf[0], 0, MEM_RELEASE);
+}
+
+static BOOL StartIo(HANDLE h, BOOL write, void* buf, DWORD size, uint64_t offset, OVERLAPPED* ov)
+{
+	HANDLE event = ov->hEvent;
+	BOOL r;
+
+	memset(ov, 0, sizeof(*ov));
+	ov->hEvent = event;
+	ov->Offset = (DWORD)offset;
+	ov->OffsetHigh = (DWORD)(offset >> 32);
+	r = write ? WriteFile(h, buf, size, NULL, ov) : ReadFile(h, buf, size, NULL, ov);
+	// EOF gets reported by WaitIo()
+	return r || (GetLastError() == ERROR_IO_PENDING) || (GetLastError() == ERROR_HANDLE_EOF);
+}
+
+static BOOL WaitIo(HANDLE h, OVERLAPPED* ov, DWORD* size)
+{
+	if (GetOverlappedResult(h, ov, size, TRUE))
+		return TRUE;
+	*size = 0;
+	return (GetLastError() == ERROR_HANDLE_EOF);
+}
+
+/*
+ * Copy [offset, offset + len) with two buffers, so that we read the next
+ * block while we write the current one. offset is aligned, and so is len
+ * unless the range ends the file, in which case we write a whole sector,
+ * that FinishCopy() truncates.
+ */
+static DWORD CopyRange(copy_file_t* file, copy_worker_t* w, uint64_t offset, uint64_t len)
+{
+	uint64_t pos = offset, end = offset + len, next;
+	DWORD size, next_size, got, done, error = ERROR_SUCCESS;
+	BOOL reading;
+	int cur = 0;
+
+	size = (DWORD)min(COPY_IO_SIZE, end - pos);
+	if (!StartIo(file->hsrc, FALSE, w->buf[cur], (DWORD)COPY_ALIGN_UP(size), pos, &w->ov[cur]) ||
+		!WaitIo(file->hsrc, &w->ov[cur], &got))
+		return GetLastError();
+	while (1) {
+		// The file may have been truncated since we got its size
+		if (got < size)
+			return ERROR_HANDLE_EOF;
+		next = pos + size;
+		next_size = (DWORD)min(COPY_IO_SIZE, end - next);
+		if (!StartIo(file->hdst, TRUE, w->buf[cur], (DWORD)COPY_ALIGN_UP(size), pos, &w->ov[cur]))
+			return GetLastError();
+		reading = (next_size != 0) && StartIo(file->hsrc, FALSE, w->buf[cur ^ 1],
+			(DWORD)COPY_ALIGN_UP(next_size), next, &w->ov[cur ^ 1]);
+		if ((next_size != 0) && !reading)
+			error = GetLastError();
+		// Whatever fails, we can't leave with I/O still pending on our buffers
+		if (!WaitIo(file->hdst, &w->ov[cur], &done) && (error == ERROR_SUCCESS))
+			error = GetLastError();
+		if ((done != COPY_ALIGN_UP(size)) && (error == ERROR_SUCCESS))
+			error = ERROR_WRITE_FAULT;
+		if (reading && !WaitIo(file->hsrc, &w->ov[cur ^ 1], &got) && (error == ERROR_SUCCESS))
+			error = GetLastError();
+		if ((error != ERROR_SUCCESS) || (next_size == 0))
+			return error;
+		pos = next;
+		size = next_size;
+		cur ^= 1;
+	}
+}
+
+// Called once all the chunks of a file have been copied
+static void FinishCopy(copy_file_t* file)
+{
+	FILE_END_OF_FILE_INFO eof;
+	FILETIME creation, access, write;
+	DWORD error = (DWORD)file->error;
+
+	if (error == ERROR_SUCCESS) {
+		eof.EndOfFile.QuadPart = (LONGLONG)file->size;
+		if (!SetFileInformationByHandle(file->hdst, FileEndOfFileInfo, &eof, sizeof(eof)) ||
+			!GetFileTime(file->hsrc, &creation, &access, &write) ||
+			!SetFileTime(file->hdst, &creation, &access, &write))
+			error = GetLastError();
+	}
+	CloseHandle(file->hsrc);
+	CloseHandle(file->hdst);
+	file->hsrc = INVALID_HANDLE_VALUE;
+	file->hdst = INVALID_HANDLE_VALUE;
+	if ((error == ERROR_SUCCESS) && !SetFileAttributesW(file->dst, file->attributes))
+		error = GetLastError();
+	if (error == ERROR_SUCCESS) {
+		CopyDone(file);
+	} else {
+		// Like CopyFile(), don't leave a partial copy behind
+		DeleteFileW(file->dst);
+		CopyFailed(file->job, error);
+	}
+	FreeCopyFile(file);
+}
+
+static void ReleaseCopyFile(copy_file_t* file)
+{
+	if (InterlockedDecrement(&file->pending) == 0)
+		FinishCopy(file);
+}
+
+static void CopyChunkTask(void* ctx, uint32_t worker)
+{
+	copy_chunk_t* chunk = (copy_chunk_t*)ctx;
+	copy_file_t* file = chunk->file;
+	copy_job_t* job = file->job;
+	DWORD error = ERROR_SUCCESS;
+
+	if (TaskCancelled(job->pool, &job->group))
+		error = ERROR_CANCELLED;
+	else if (!InitCopyWorker(&job->worker[worker]))
+		error = ERROR_NOT_ENOUGH_MEMORY;
+	// Don't bother with the rest of a file that already failed
+	else if (file->error == ERROR_SUCCESS)
+		error = CopyRange(file, &job->worker[worker], chunk->offset, chunk->len);
+	if (error != ERROR_SUCCESS)
+		InterlockedCompareExchange(&file->error, (LONG)error, ERROR_SUCCESS);
+	ReleaseCopyFile(file);
+}
+
+static void CopyFileTask(void* ctx, uint32_t worker)
+{
+	copy_file_t* file = (copy_file_t*)ctx;
+	copy_job_t* job = file->job;
+	WIN32_FILE_ATTRIBUTE_DATA fa;
+	FILE_ALLOCATION_INFO alloc;
+	uint64_t i, num_chunks;
+	DWORD error = ERROR_SUCCESS;
+
+	file->start = GetTime();
+	if (TaskCancelled(job->pool, &job->group)) {
+		error = ERROR_CANCELLED;
+		goto out;
+	}
+	if (!GetFileAttributesExW(file->src, GetFileExInfoStandard, &fa)) {
+		error = GetLastError();
+		goto out;
+	}
+	file->attributes = fa.dwFileAttributes;
+	file->size = ((uint64_t)fa.nFileSizeHigh << 32) | fa.nFileSizeLow;
+	if (file->size < (uint64_t)COPY_SPLIT_CHUNKS * COPY_CHUNK_SIZE) {
+		if (!CopyFileW(file->src, file->dst, (job->flags & COPY_FAIL_IF_EXISTS) ? TRUE : FALSE))
+			error = GetLastError();
+		else
+			CopyDone(file);
+		goto out;
+	}
+
+	file->hsrc = CreateFileW(file->src, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL);
+	if (file->hsrc == INVALID_HANDLE_VALUE) {
+		error = GetLastError();
+		goto out;
+	}
+	file->hdst = CreateFileW(file->dst, GENERIC_WRITE, 0, NULL,
+		(job->flags & COPY_FAIL_IF_EXISTS) ? CREATE_NEW : CREATE_ALWAYS,
+		FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL);
+	if (file->hdst == INVALID_HANDLE_VALUE) {
+		error = GetLastError();
+		goto out;
+	}
+	// Reserve the space up front, so that the chunks don't fragment the file
+	alloc.AllocationSize.QuadPart = (LONGLONG)COPY_ALIGN_UP(file->size);
+	SetFileInformationByHandle(file->hdst, FileAllocationInfo, &alloc, sizeof(alloc));
+
+	num_chunks = (file->size + COPY_CHUNK_SIZE - 1) / COPY_CHUNK_SIZE;
+	file->chunk = (copy_chunk_t*)calloc((size_t)num_chunks, sizeof(copy_chunk_t));
+	if (file->chunk == NULL) {
+		error = ERROR_NOT_ENOUGH_MEMORY;
+		// The destination can only be deleted once we no longer hold it open
+		CloseHandle(file->hsrc);
+		CloseHandle(file->hdst);
+		file->hsrc = INVALID_HANDLE_VALUE;
+		file->hdst = INVALID_HANDLE_VALUE;
+		DeleteFileW(file->dst);
+		goto out;
+	}
+	file->pending = (LONG)num_chunks + 1;
+	for (i = 0; i < num_chunks; i++) {
+		file->chunk[i].file = file;
+		file->chunk[i].offset = i * COPY_CHUNK_SIZE;
+		file->chunk[i].len = min(COPY_CHUNK_SIZE, file->size - i * COPY_CHUNK_SIZE);
+		if (!SubmitTask(job->pool, &job->group, CopyChunkTask, &file->chunk[i])) {
+			InterlockedCompareExchange(&file->error, ERROR_NOT_ENOUGH_MEMORY, ERROR_SUCCESS);
+			ReleaseCopyFile(file);
+		}
+	}
+	// The last chunk to complete (possibly us) finishes the copy
+	ReleaseCopyFile(file);
+	return;
+
+out:
+	if (error != ERROR_SUCCESS)
+		CopyFailed(job, error);
+	FreeCopyFile(file);
+}
+
+static int CompareLatency(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+BOOL ParallelCopyFiles(pool_t* pool, const char* const* src, const char* const* dst,
+	size_t count, DWORD flags, copy_stats_t* stats)
+{
+	copy_job_t job = { 0 };
+	copy_file_t* file;
+	double start = GetTime();
+	size_t i, n;
+	DWORD w;
+	BOOL r;
+
+	if (!InitTaskGroup(&job.group))
+		return FALSE;
+	job.pool = pool;
+	job.flags = flags;
+	job.worker = (copy_worker_t*)calloc(PoolSize(pool), sizeof(copy_worker_t));
+	job.latency = (double*)calloc(max(count, 1), sizeof(double));
+	if ((job.worker == NULL) || (job.latency == NULL)) {
+		CopyFailed(&job, ERROR_NOT_ENOUGH_MEMORY);
+		count = 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		file = (copy_file_t*)calloc(1, sizeof(copy_file_t));
+		if (file != NULL) {
+			file->job = &job;
+			file->hsrc = INVALID_HANDLE_VALUE;
+			file->hdst = INVALID_HANDLE_VALUE;
+			file->src = utf8_to_wchar(src[i]);
+			file->dst = utf8_to_wchar(dst[i]);
+		}
+		if ((file == NULL) || (file->src == NULL) || (file->dst == NULL)) {
+			CopyFailed(&job, ERROR_NOT_ENOUGH_MEMORY);
+			FreeCopyFile(file);
+		} else if (!SubmitTask(pool, &job.group, CopyFileTask, file)) {
+			CopyFailed(&job, ERROR_NOT_ENOUGH_MEMORY);
+			FreeCopyFile(file);
+		}
+	}
+	r = WaitTaskGroup(pool, &job.group) && (job.errors == 0);
+	CloseTaskGroup(&job.group);
+
+	if (stats != NULL) {
+		memset(stats, 0, sizeof(*stats));
+		stats->files = job.files;
+		stats->bytes = job.bytes;
+		stats->errors = job.errors;
+		stats->seconds = GetTime() - start;
+		n = (size_t)job.num_latencies;
+		if (n != 0) {
+			qsort(job.latency, n, sizeof(double), CompareLatency);
+			stats->latency_median = job.latency[n / 2];
+			stats->latency_p99 = job.latency[(n * 99) / 100];
+			stats->latency_max = job.latency[n - 1];
+		}
+	}
+	for (w = 0; (job.worker != NULL) && (w < PoolSize(pool)); w++)
+		ExitCopyWorker(&job.worker[w]);
+	free(job.worker);
+	free(job.latency);
+	if (job.error != ERROR_SUCCESS)
+		SetLastError((DWORD)job.error);
+	return r;
+}
+
+BOOL ParallelCopyFileU(pool_t* pool, const char* lpExistingFileName, const char* lpNewFileName,
+	BOOL bFailIfExists)
+{
+	return ParallelCopyFiles(pool, &lpExistingFileName, &lpNewFileName, 1,
+		bFailIfExists ? COPY_FAIL_IF_EXISTS : 0, NULL);
+}
@@ -0,0 +1,56 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Parallel file copy
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+// Fail rather than overwrite existing destination files, like CopyFile()'s bFailIfExists
+#define COPY_FAIL_IF_EXISTS		0x00000001
+
+typedef struct {
+	uint64_t files;				// Successfully copied
+	uint64_t bytes;
+	uint64_t errors;
+	double seconds;
+	// Time it took to copy each file, in milliseconds
+	double latency_median;
+	double latency_p99;
+	double latency_max;
+} copy_stats_t;
+
+/*
+ * Copy src[i] to dst[i] for all count files, from all the workers of the
+ * pool. Files that are larger than a few chunks are split into chunks that
+ * get copied in parallel with unbuffered I/O, and then get the attributes
+ * and timestamps of their source, like CopyFile() does. Smaller files just
+ * go through CopyFile(). Returns FALSE if any file could not be copied, in
+ * which case the last error is the one of the first failure. stats can be
+ * NULL.
+ */
+extern BOOL ParallelCopyFiles(pool_t* pool, const char* const* src, const char* const* dst,
+	size_t count, DWORD flags, copy_stats_t* stats);
+
+// Same as CopyFileU(), with a large file being split across the workers
+extern BOOL ParallelCopyFileU(pool_t* pool, const char* lpExistingFileName, const char* lpNewFileName,
+	BOOL bFailIfExists);
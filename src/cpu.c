@@ -0,0 +1,192 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * CPU feature detection
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu.h"
+
+#if defined(CPU_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#elif defined(CPU_ARM64) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+uint32_t cpu_features = 0;
+
+static const struct {
+	uint32_t feature;
+	const char* name;
+} cpu_feature_name[] = {
+	{ CPU_FEATURE_SSE2, "SSE2" },
+	{ CPU_FEATURE_SSSE3, "SSSE3" },
+	{ CPU_FEATURE_SSE41, "SSE4.1" },
+	{ CPU_FEATURE_SSE42, "SSE4.2" },
+	{ CPU_FEATURE_PCLMUL, "PCLMULQDQ" },
+	{ CPU_FEATURE_POPCNT, "POPCNT" },
+	{ CPU_FEATURE_AVX, "AVX" },
+	{ CPU_FEATURE_AVX2, "AVX2" },
+	{ CPU_FEATURE_BMI2, "BMI2" },
+	{ CPU_FEATURE_AVX512F, "AVX512F" },
+	{ CPU_FEATURE_AVX512BW, "AVX512BW" },
+	{ CPU_FEATURE_AVX512VL, "AVX512VL" },
+	{ CPU_FEATURE_AVX512_VPOPCNTDQ, "AVX512_VPOPCNTDQ" },
+	{ CPU_FEATURE_NEON, "NEON" },
+	{ CPU_FEATURE_CRC32, "CRC32" },
+	{ CPU_FEATURE_PMULL, "PMULL" },
+};
+
+#if defined(CPU_X86)
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+#if defined(_MSC_VER)
+	__cpuidex((int*)regs, (int)leaf, (int)subleaf);
+#else
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Return the register state that the OS saves on context switch
+static uint64_t xgetbv(void)
+{
+#if defined(_MSC_VER)
+	return _xgetbv(0);
+#else
+	uint32_t eax, edx;
+	__asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((uint64_t)edx << 32) | eax;
+#endif
+}
+#endif
+
+/*
+ * Populate cpu_features with the instruction set extensions that the
+ * kernels we ship can make use of. Must be called before any of these
+ * kernels are initialized.
+ */
+void DetectCpuFeatures(void)
+{
+	cpu_features = 0;
+
+#if defined(CPU_X86)
+	uint32_t regs[4], max_leaf;
+	uint64_t xcr0 = 0;
+
+	cpuid(0, 0, regs);
+	max_leaf = regs[0];
+	if (max_leaf < 1)
+		return;
+	cpuid(1, 0, regs);
+	if (regs[3] & (1 << 26))
+		cpu_features |= CPU_FEATURE_SSE2;
+	if (regs[2] & (1 << 9))
+		cpu_features |= CPU_FEATURE_SSSE3;
+	if (regs[2] & (1 << 19))
+		cpu_features |= CPU_FEATURE_SSE41;
+	if (regs[2] & (1 << 20))
+		cpu_features |= CPU_FEATURE_SSE42;
+	if (regs[2] & (1 << 1))
+		cpu_features |= CPU_FEATURE_PCLMUL;
+	if (regs[2] & (1 << 23))
+		cpu_features |= CPU_FEATURE_POPCNT;
+	// AVX registers are only usable if the OS saves them (OSXSAVE + XCR0)
+	if (regs[2] & (1 << 27))
+		xcr0 = xgetbv();
+	if ((regs[2] & (1 << 28)) && ((xcr0 & 0x06) == 0x06))
+		cpu_features |= CPU_FEATURE_AVX;
+	if (max_leaf < 7)
+		return;
+	cpuid(7, 0, regs);
+	if ((regs[1] & (1 << 5)) && ((xcr0 & 0x06) == 0x06))
+		cpu_features |= CPU_FEATURE_AVX2;
+	if (regs[1] & (1 << 8))
+		cpu_features |= CPU_FEATURE_BMI2;
+	if ((regs[1] & (1 << 16)) && ((xcr0 & 0xe6) == 0xe6)) {
+		cpu_features |= CPU_FEATURE_AVX512F;
+		if (regs[1] & (1 << 30))
+			cpu_features |= CPU_FEATURE_AVX512BW;
+		if (regs[1] & (1U << 31))
+			cpu_features |= CPU_FEATURE_AVX512VL;
+		if (regs[2] & (1 << 14))
+			cpu_features |= CPU_FEATURE_AVX512_VPOPCNTDQ;
+	}
+#elif defined(CPU_ARM64) && defined(_WIN32)
+	// NEON is mandatory on ARM64
+	cpu_features |= CPU_FEATURE_NEON;
+	if (IsProcessorFeaturePresent(PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE))
+		cpu_features |= CPU_FEATURE_CRC32;
+	if (IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE))
+		cpu_features |= CPU_FEATURE_PMULL;
+#elif defined(CPU_ARM64) && defined(__linux__)
+	unsigned long hwcap = getauxval(AT_HWCAP);
+
+	if (hwcap & HWCAP_ASIMD)
+		cpu_features |= CPU_FEATURE_NEON;
+	if (hwcap & HWCAP_CRC32)
+		cpu_features |= CPU_FEATURE_CRC32;
+	if (hwcap & HWCAP_PMULL)
+		cpu_features |= CPU_FEATURE_PMULL;
+#endif
+}
+
+/*
+ * Pretend that the CPU doesn't have some features, so that the fallback
+ * kernels can be tested and benchmarked. Kernels must be initialized
+ * again for this to take effect.
+ */
+void DisableCpuFeatures(uint32_t features)
+{
+	cpu_features &= ~features;
+}
+
+const char* CpuFeaturesString(void)
+{
+	static char str[256];
+	size_t i;
+
+	str[0] = 0;
+	for (i = 0; i < sizeof(cpu_feature_name) / sizeof(cpu_feature_name[0]); i++) {
+		if (!cpu_has(cpu_feature_name[i].feature))
+			continue;
+		if (str[0] != 0)
+			strncat(str, " ", sizeof(str) - strlen(str) - 1);
+		strncat(str, cpu_feature_name[i].name, sizeof(str) - strlen(str) - 1);
+	}
+	if (str[0] == 0)
+		snprintf(str, sizeof(str), "None");
+	return str;
+}
+
+const cpu_variant_t* SelectCpuVariant(const cpu_variant_t* variant)
+{
+	while (!cpu_has(variant->features))
+		variant++;
+	return variant;
+}
@@ -0,0 +1,88 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * CPU feature detection
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define CPU_X86
+#define CPU_X64
+#elif defined(_M_IX86) || defined(__i386__)
+#define CPU_X86
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#define CPU_ARM64
+#endif
+
+// MSVC lets us use any intrinsic anywhere, but gcc/clang need to be told
+// which instruction set extensions a function is allowed to use.
+#if defined(__GNUC__)
+#define TARGET_ATTR(s)		__attribute__((target(s)))
+#else
+#define TARGET_ATTR(s)
+#endif
+
+// Used to specialize a generic kernel into variants with constant parameters
+#if defined(_MSC_VER)
+#define FORCE_INLINE		__forceinline
+#else
+#define FORCE_INLINE		inline __attribute__((always_inline))
+#endif
+
+#define CPU_FEATURE_SSE42	0x00000001
+#define CPU_FEATURE_PCLMUL	0x00000002
+#define CPU_FEATURE_CRC32	0x00000004	// ARMv8 CRC32 instructions
+#define CPU_FEATURE_PMULL	0x00000008	// ARMv8 64-bit polynomial multiply
+#define CPU_FEATURE_POPCNT	0x00000010
+#define CPU_FEATURE_AVX2	0x00000020	// Includes OS support for YMM state
+#define CPU_FEATURE_AVX512F	0x00000040	// Includes OS support for ZMM state
+#define CPU_FEATURE_AVX512_VPOPCNTDQ	0x00000080
+#define CPU_FEATURE_NEON	0x00000100
+#define CPU_FEATURE_SSE2	0x00000200
+#define CPU_FEATURE_SSSE3	0x00000400
+#define CPU_FEATURE_SSE41	0x00000800
+#define CPU_FEATURE_AVX		0x00001000	// Includes OS support for YMM state
+#define CPU_FEATURE_BMI2	0x00002000
+#define CPU_FEATURE_AVX512BW	0x00004000
+#define CPU_FEATURE_AVX512VL	0x00008000
+
+#define cpu_has(f)			((cpu_features & (f)) == (f))
+
+/*
+ * Multi-versioned kernels: a module lists the variants of a kernel, best
+ * first, each with the CPU features it requires, and ends the list with a
+ * baseline variant that requires none. SelectCpuVariant() then returns the
+ * first variant this CPU can run, which the module stores into a function
+ * pointer from its init call, so that there is no per-call branching.
+ */
+typedef struct {
+	uint32_t features;
+	const void* impl;
+	const char* name;
+} cpu_variant_t;
+
+#define CPU_VARIANT(features, impl, name)	{ features, (const void*)(impl), name }
+
+extern uint32_t cpu_features;
+
+extern void DetectCpuFeatures(void);
+extern void DisableCpuFeatures(uint32_t features);
+extern const char* CpuFeaturesString(void);
+extern const cpu_variant_t* SelectCpuVariant(const cpu_variant_t* variant);
@@ -0,0 +1,482 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * CRC-32C and CRC-64 computation
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "crc.h"
+
+#if defined(CPU_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <immintrin.h>
+#endif
+#elif defined(CPU_ARM64)
+#if defined(_MSC_VER)
+#include <arm64_neon.h>
+#else
+#include <arm_acle.h>
+#include <arm_neon.h>
+#endif
+#endif
+
+// Reflected polynomials
+#define CRC32C_POLY			0x82f63b78
+#define CRC64_POLY			0xc96c5795d7870f42ULL
+
+// Sizes of the blocks that the hardware CRC-32C code processes 3 at a time.
+// The CRC instruction has a latency of 3 cycles but a throughput of 1, so
+// we need 3 independent streams to keep it busy.
+#define CRC32C_LONG			8192
+#define CRC32C_SHORT		256
+
+// Minimum length for which the CRC-64 folding code is worth it
+#define CRC64_FOLD_MIN		128
+
+// Slicing-by-8 tables for the software fallback
+static uint32_t crc32c_table[8][256];
+static uint64_t crc64_table[8][256];
+// x^(2^n) modulo P, used to combine CRCs
+static uint32_t crc32c_x2n[32];
+static uint64_t crc64_x2n[64];
+// Tables to append CRC32C_LONG/CRC32C_SHORT zero bytes to a CRC-32C
+static uint32_t crc32c_long[4][256], crc32c_short[4][256];
+// CRC-64 folding constants, for a distance of 512 and 128 bits
+static uint64_t crc64_k512[2], crc64_k128[2];
+
+// These update a "raw" CRC, i.e. one that has no pre/post conditioning
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const uint8_t* buf, size_t len);
+typedef uint64_t (*crc64_fn)(uint64_t crc, const uint8_t* buf, size_t len);
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* buf, size_t len);
+static uint64_t crc64_sw(uint64_t crc, const uint8_t* buf, size_t len);
+static crc32c_fn crc32c_update = crc32c_sw;
+static crc64_fn crc64_update = crc64_sw;
+static const char* crc32c_name = "Software";
+static const char* crc64_name = "Software";
+
+static __inline uint32_t read32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static __inline uint64_t read64(const uint8_t* p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+ * Multiply a and b modulo P. Polynomials are in reflected form,
+ * meaning that the MSB holds the x^0 coefficient.
+ */
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m, p = 0;
+
+	for (m = 1U << 31; m != 0; m >>= 1) {
+		if (a & m)
+			p ^= b;
+		b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+static uint64_t crc64_multmodp(uint64_t a, uint64_t b)
+{
+	uint64_t m, p = 0;
+
+	for (m = 1ULL << 63; m != 0; m >>= 1) {
+		if (a & m)
+			p ^= b;
+		b = (b & 1) ? (b >> 1) ^ CRC64_POLY : b >> 1;
+	}
+	return p;
+}
+
+// Return x^(n * 2^k) modulo P
+static uint32_t crc32c_x2nmodp(uint64_t n, uint32_t k)
+{
+	uint32_t p = 1U << 31;
+
+	for (; n != 0; n >>= 1, k++) {
+		if (n & 1)
+			p = crc32c_multmodp(crc32c_x2n[k & 31], p);
+	}
+	return p;
+}
+
+static uint64_t crc64_x2nmodp(uint64_t n, uint32_t k)
+{
+	uint64_t p = 1ULL << 63;
+
+	for (; n != 0; n >>= 1, k++) {
+		if (n & 1)
+			p = crc64_multmodp(crc64_x2n[k & 63], p);
+	}
+	return p;
+}
+
+// Build the tables that append len zero bytes to a raw CRC-32C
+static void crc32c_zeros(uint32_t zeros[4][256], size_t len)
+{
+	uint32_t n, op = crc32c_x2nmodp(len, 3);
+
+	for (n = 0; n < 256; n++) {
+		zeros[0][n] = crc32c_multmodp(op, n);
+		zeros[1][n] = crc32c_multmodp(op, n << 8);
+		zeros[2][n] = crc32c_multmodp(op, n << 16);
+		zeros[3][n] = crc32c_multmodp(op, n << 24);
+	}
+}
+
+static __inline uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc)
+{
+	return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+		zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* buf, size_t len)
+{
+	uint64_t w;
+
+	while ((len > 0) && (((uintptr_t)buf & 7) != 0)) {
+		crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		w = read64(buf) ^ crc;
+		crc = crc32c_table[7][w & 0xff] ^ crc32c_table[6][(w >> 8) & 0xff] ^
+			crc32c_table[5][(w >> 16) & 0xff] ^ crc32c_table[4][(w >> 24) & 0xff] ^
+			crc32c_table[3][(w >> 32) & 0xff] ^ crc32c_table[2][(w >> 40) & 0xff] ^
+			crc32c_table[1][(w >> 48) & 0xff] ^ crc32c_table[0][w >> 56];
+		buf += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+static uint64_t crc64_sw(uint64_t crc, const uint8_t* buf, size_t len)
+{
+	uint64_t w;
+
+	while ((len > 0) && (((uintptr_t)buf & 7) != 0)) {
+		crc = crc64_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		w = read64(buf) ^ crc;
+		crc = crc64_table[7][w & 0xff] ^ crc64_table[6][(w >> 8) & 0xff] ^
+			crc64_table[5][(w >> 16) & 0xff] ^ crc64_table[4][(w >> 24) & 0xff] ^
+			crc64_table[3][(w >> 32) & 0xff] ^ crc64_table[2][(w >> 40) & 0xff] ^
+			crc64_table[1][(w >> 48) & 0xff] ^ crc64_table[0][w >> 56];
+		buf += 8;
+		len -= 8;
+	}
+	while (len-- > 0)
+		crc = crc64_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+/*
+ * Hardware CRC-32C, using the SSE4.2 or ARMv8 CRC32C instructions.
+ */
+#if defined(CPU_X64)
+#define CRC32C_HW_TARGET		TARGET_ATTR("sse4.2")
+#define CRC32C_WORD_SIZE		8
+#define crc32c_hw_word(crc, p)	((uint32_t)_mm_crc32_u64(crc, read64(p)))
+#define crc32c_hw_byte(crc, b)	_mm_crc32_u8(crc, b)
+#elif defined(CPU_X86)
+#define CRC32C_HW_TARGET		TARGET_ATTR("sse4.2")
+#define CRC32C_WORD_SIZE		4
+#define crc32c_hw_word(crc, p)	_mm_crc32_u32(crc, read32(p))
+#define crc32c_hw_byte(crc, b)	_mm_crc32_u8(crc, b)
+#elif defined(CPU_ARM64)
+#define CRC32C_HW_TARGET		TARGET_ATTR("arch=armv8-a+crc")
+#define CRC32C_WORD_SIZE		8
+#define crc32c_hw_word(crc, p)	__crc32cd(crc, read64(p))
+#define crc32c_hw_byte(crc, b)	__crc32cb(crc, b)
+#endif
+
+#if defined(CRC32C_WORD_SIZE)
+static CRC32C_HW_TARGET uint32_t crc32c_hw(uint32_t crc, const uint8_t* buf, size_t len)
+{
+	const uint8_t* end;
+	uint32_t crc1, crc2;
+
+	while ((len > 0) && (((uintptr_t)buf & (CRC32C_WORD_SIZE - 1)) != 0)) {
+		crc = crc32c_hw_byte(crc, *buf++);
+		len--;
+	}
+
+	// Compute the CRC of 3 consecutive blocks in parallel, then merge
+	// them by shifting the first two by the length of the ones after.
+	while (len >= 3 * CRC32C_LONG) {
+		crc1 = crc2 = 0;
+		end = buf + CRC32C_LONG;
+		do {
+			crc = crc32c_hw_word(crc, buf);
+			crc1 = crc32c_hw_word(crc1, buf + CRC32C_LONG);
+			crc2 = crc32c_hw_word(crc2, buf + 2 * CRC32C_LONG);
+			buf += CRC32C_WORD_SIZE;
+		} while (buf < end);
+		crc = crc32c_shift(crc32c_long, crc) ^ crc1;
+		crc = crc32c_shift(crc32c_long, crc) ^ crc2;
+		buf += 2 * CRC32C_LONG;
+		len -= 3 * CRC32C_LONG;
+	}
+	while (len >= 3 * CRC32C_SHORT) {
+		crc1 = crc2 = 0;
+		end = buf + CRC32C_SHORT;
+		do {
+			crc = crc32c_hw_word(crc, buf);
+			crc1 = crc32c_hw_word(crc1, buf + CRC32C_SHORT);
+			crc2 = crc32c_hw_word(crc2, buf + 2 * CRC32C_SHORT);
+			buf += CRC32C_WORD_SIZE;
+		} while (buf < end);
+		crc = crc32c_shift(crc32c_short, crc) ^ crc1;
+		crc = crc32c_shift(crc32c_short, crc) ^ crc2;
+		buf += 2 * CRC32C_SHORT;
+		len -= 3 * CRC32C_SHORT;
+	}
+
+	while (len >= CRC32C_WORD_SIZE) {
+		crc = crc32c_hw_word(crc, buf);
+		buf += CRC32C_WORD_SIZE;
+		len -= CRC32C_WORD_SIZE;
+	}
+	while (len-- > 0)
+		crc = crc32c_hw_byte(crc, *buf++);
+	return crc;
+}
+#endif
+
+/*
+ * Carry-less multiplication CRC-64, using PCLMULQDQ or ARMv8 PMULL.
+ *
+ * We keep 4 x 128-bit accumulators that we fold 512 bits forward at each
+ * step: if a 128-bit accumulator holds H.x^64 + L, then folding it by D
+ * bits is H.(x^(D+64) mod P) + L.(x^D mod P), which is congruent modulo P
+ * and still fits in 128 bits. Because the product of two reflected 64-bit
+ * values comes out shifted by one, the constants are x^(D+63) and x^(D-1).
+ * Once everything has been folded into a single accumulator, we just run
+ * its 16 bytes through the table code to get the CRC.
+ */
+#if defined(CPU_X86)
+static __inline TARGET_ATTR("sse2,pclmul") __m128i crc64_fold(__m128i x, __m128i k, __m128i next)
+{
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+		_mm_clmulepi64_si128(x, k, 0x11)), next);
+}
+
+static TARGET_ATTR("sse2,pclmul") uint64_t crc64_clmul(uint64_t crc, const uint8_t* buf, size_t len)
+{
+	uint64_t init[2] = { crc, 0 };
+	uint8_t last[16];
+	__m128i x0, x1, x2, x3, k;
+
+	if (len < CRC64_FOLD_MIN)
+		return crc64_sw(crc, buf, len);
+
+	x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)buf), _mm_loadu_si128((const __m128i*)init));
+	x1 = _mm_loadu_si128((const __m128i*)(buf + 16));
+	x2 = _mm_loadu_si128((const __m128i*)(buf + 32));
+	x3 = _mm_loadu_si128((const __m128i*)(buf + 48));
+	buf += 64;
+	len -= 64;
+
+	k = _mm_loadu_si128((const __m128i*)crc64_k512);
+	while (len >= 64) {
+		x0 = crc64_fold(x0, k, _mm_loadu_si128((const __m128i*)buf));
+		x1 = crc64_fold(x1, k, _mm_loadu_si128((const __m128i*)(buf + 16)));
+		x2 = crc64_fold(x2, k, _mm_loadu_si128((const __m128i*)(buf + 32)));
+		x3 = crc64_fold(x3, k, _mm_loadu_si128((const __m128i*)(buf + 48)));
+		buf += 64;
+		len -= 64;
+	}
+
+	k = _mm_loadu_si128((const __m128i*)crc64_k128);
+	x0 = crc64_fold(x0, k, x1);
+	x0 = crc64_fold(x0, k, x2);
+	x0 = crc64_fold(x0, k, x3);
+	while (len >= 16) {
+		x0 = crc64_fold(x0, k, _mm_loadu_si128((const __m128i*)buf));
+		buf += 16;
+		len -= 16;
+	}
+
+	_mm_storeu_si128((__m128i*)last, x0);
+	return crc64_sw(crc64_sw(0, last, sizeof(last)), buf, len);
+}
+#elif defined(CPU_ARM64)
+static __inline TARGET_ATTR("arch=armv8-a+crypto") uint64x2_t crc64_fold(uint64x2_t x, uint64x2_t k, uint64x2_t next)
+{
+	uint64x2_t lo = vreinterpretq_u64_p128(vmull_p64((poly64_t)vgetq_lane_u64(x, 0), (poly64_t)vgetq_lane_u64(k, 0)));
+	uint64x2_t hi = vreinterpretq_u64_p128(vmull_p64((poly64_t)vgetq_lane_u64(x, 1), (poly64_t)vgetq_lane_u64(k, 1)));
+	return veorq_u64(veorq_u64(lo, hi), next);
+}
+
+static TARGET_ATTR("arch=armv8-a+crypto") uint64_t crc64_clmul(uint64_t crc, const uint8_t* buf, size_t len)
+{
+	uint64_t init[2] = { crc, 0 };
+	uint8_t last[16];
+	uint64x2_t x0, x1, x2, x3, k;
+
+	if (len < CRC64_FOLD_MIN)
+		return crc64_sw(crc, buf, len);
+
+	x0 = veorq_u64(vld1q_u64((const uint64_t*)buf), vld1q_u64(init));
+	x1 = vld1q_u64((const uint64_t*)(buf + 16));
+	x2 = vld1q_u64((const uint64_t*)(buf + 32));
+	x3 = vld1q_u64((const uint64_t*)(buf + 48));
+	buf += 64;
+	len -= 64;
+
+	k = vld1q_u64(crc64_k512);
+	while (len >= 64) {
+		x0 = crc64_fold(x0, k, vld1q_u64((const uint64_t*)buf));
+		x1 = crc64_fold(x1, k, vld1q_u64((const uint64_t*)(buf + 16)));
+		x2 = crc64_fold(x2, k, vld1q_u64((const uint64_t*)(buf + 32)));
+		x3 = crc64_fold(x3, k, vld1q_u64((const uint64_t*)(buf + 48)));
+		buf += 64;
+		len -= 64;
+	}
+
+	k = vld1q_u64(crc64_k128);
+	x0 = crc64_fold(x0, k, x1);
+	x0 = crc64_fold(x0, k, x2);
+	x0 = crc64_fold(x0, k, x3);
+	while (len >= 16) {
+		x0 = crc64_fold(x0, k, vld1q_u64((const uint64_t*)buf));
+		buf += 16;
+		len -= 16;
+	}
+
+	vst1q_u64((uint64_t*)last, x0);
+	return crc64_sw(crc64_sw(0, last, sizeof(last)), buf, len);
+}
+#endif
+
+static const cpu_variant_t crc32c_variant[] = {
+#if defined(CPU_X86)
+	CPU_VARIANT(CPU_FEATURE_SSE42, crc32c_hw, "SSE4.2"),
+#elif defined(CPU_ARM64)
+	CPU_VARIANT(CPU_FEATURE_CRC32, crc32c_hw, "ARMv8 CRC32"),
+#endif
+	CPU_VARIANT(0, crc32c_sw, "Software"),
+};
+
+static const cpu_variant_t crc64_variant[] = {
+#if defined(CPU_X86)
+	CPU_VARIANT(CPU_FEATURE_PCLMUL, crc64_clmul, "PCLMULQDQ"),
+#elif defined(CPU_ARM64)
+	CPU_VARIANT(CPU_FEATURE_PMULL, crc64_clmul, "ARMv8 PMULL"),
+#endif
+	CPU_VARIANT(0, crc64_sw, "Software"),
+};
+
+/*
+ * Build the tables and select the fastest implementation for this CPU.
+ * DetectCpuFeatures() must have been called first.
+ */
+void crc_init(void)
+{
+	const cpu_variant_t* v;
+	uint32_t n, k, c32;
+	uint64_t c64;
+
+	for (n = 0; n < 256; n++) {
+		c32 = n;
+		c64 = n;
+		for (k = 0; k < 8; k++) {
+			c32 = (c32 & 1) ? (c32 >> 1) ^ CRC32C_POLY : c32 >> 1;
+			c64 = (c64 & 1) ? (c64 >> 1) ^ CRC64_POLY : c64 >> 1;
+		}
+		crc32c_table[0][n] = c32;
+		crc64_table[0][n] = c64;
+	}
+	for (n = 0; n < 256; n++) {
+		c32 = crc32c_table[0][n];
+		c64 = crc64_table[0][n];
+		for (k = 1; k < 8; k++) {
+			c32 = crc32c_table[0][c32 & 0xff] ^ (c32 >> 8);
+			c64 = crc64_table[0][c64 & 0xff] ^ (c64 >> 8);
+			crc32c_table[k][n] = c32;
+			crc64_table[k][n] = c64;
+		}
+	}
+
+	crc32c_x2n[0] = 1U << 30;
+	for (n = 1; n < 32; n++)
+		crc32c_x2n[n] = crc32c_multmodp(crc32c_x2n[n - 1], crc32c_x2n[n - 1]);
+	crc64_x2n[0] = 1ULL << 62;
+	for (n = 1; n < 64; n++)
+		crc64_x2n[n] = crc64_multmodp(crc64_x2n[n - 1], crc64_x2n[n - 1]);
+
+	crc32c_zeros(crc32c_long, CRC32C_LONG);
+	crc32c_zeros(crc32c_short, CRC32C_SHORT);
+	crc64_k512[0] = crc64_x2nmodp(512 + 63, 0);
+	crc64_k512[1] = crc64_x2nmodp(512 - 1, 0);
+	crc64_k128[0] = crc64_x2nmodp(128 + 63, 0);
+	crc64_k128[1] = crc64_x2nmodp(128 - 1, 0);
+
+	v = SelectCpuVariant(crc32c_variant);
+	crc32c_update = (crc32c_fn)v->impl;
+	crc32c_name = v->name;
+	v = SelectCpuVariant(crc64_variant);
+	crc64_update = (crc64_fn)v->impl;
+	crc64_name = v->name;
+}
+
+const char* crc_impl(void)
+{
+	static char name[64];
+
+	snprintf(name, sizeof(name), "CRC-32C: %s, CRC-64: %s", crc32c_name, crc64_name);
+	return name;
+}
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len)
+{
+	return ~crc32c_update(~crc, (const uint8_t*)buf, len);
+}
+
+uint64_t crc64(uint64_t crc, const void* buf, size_t len)
+{
+	return ~crc64_update(~crc, (const uint8_t*)buf, len);
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	return crc32c_multmodp(crc32c_x2nmodp(len2, 3), crc1) ^ crc2;
+}
+
+uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, uint64_t len2)
+{
+	return crc64_multmodp(crc64_x2nmodp(len2, 3), crc1) ^ crc2;
+}
@@ -0,0 +1,42 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * CRC-32C and CRC-64 computation
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32C is the Castagnoli CRC (iSCSI, ext4, ...) and CRC-64 is the
+ * ECMA-182 reflected CRC used by xz. Both are computed zlib style, i.e.
+ * start with crc = 0 and feed the previous result back for each update.
+ */
+extern void crc_init(void);
+extern const char* crc_impl(void);
+extern uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+extern uint64_t crc64(uint64_t crc, const void* buf, size_t len);
+
+/*
+ * Return the CRC of the concatenation of two chunks, from the CRC of
+ * each chunk and the length of the second one. This is what lets each
+ * worker checksum its own part of a file independently.
+ */
+extern uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+extern uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, uint64_t len2);
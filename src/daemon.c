@@ -0,0 +1,631 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Daemon mode, serving jobs over a named pipe
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msapi_utf8.h"
+#include "copy.h"
+#include "daemon.h"
+#include "pool.h"
+#include "run.h"
+#include "tree.h"
+#include "walk.h"
+
+// How often we check for the pool being cancelled, while waiting for clients or for jobs to end (ms)
+#define DAEMON_POLL_TIME	100
+// How long a client waits for the daemon to have a free pipe instance (ms)
+#define DAEMON_CONNECT_TIMEOUT	5000
+// How long the daemon waits for its jobs to end once cancelled (ms)
+#define DAEMON_EXIT_WAIT	15000
+
+/*
+ * The client sends a single message, with the NUL terminated arguments of the
+ * job, and gets messages starting with one of these back, the last of which
+ * is the status, with the exit code of the job followed by its stats.
+ */
+#define DAEMON_OUT			'o'
+#define DAEMON_ERR			'e'
+#define DAEMON_STATUS		's'
+
+typedef struct daemon daemon_t;
+
+typedef struct {
+	daemon_t* daemon;
+	HANDLE pipe;
+	uint64_t id;
+	const char* name;
+	double start;
+	pool_group_t scope;
+	// Jobs can write from several workers at once
+	CRITICAL_SECTION write_lock;
+	char* message;
+	char stats[256];
+} daemon_job_t;
+
+typedef struct {
+	const char* name;
+	const char* usage;
+	int min_args;
+	int max_args;				// -1 for no limit
+	int (*run)(daemon_job_t* job, pool_t* pool, int argc, char** argv);
+} daemon_command_t;
+
+struct daemon {
+	pool_t* pool;
+	CRITICAL_SECTION lock;
+	daemon_job_t* job[DAEMON_MAX_JOBS];
+	uint64_t last_id;
+	volatile LONG num_threads;
+};
+
+static double GetTime(void)
+{
+	static LARGE_INTEGER freq = { 0 };
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / (double)freq.QuadPart;
+}
+
+// Overlapped I/O that we wait on, as the daemon's end of the pipes is opened for overlapped I/O
+static BOOL PipeIo(HANDLE pipe, BOOL write, void* buf, DWORD size, DWORD* done)
+{
+	OVERLAPPED ov = { 0 };
+	BOOL r;
+
+	ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (ov.hEvent == NULL)
+		return FALSE;
+	r = write ? WriteFile(pipe, buf, size, NULL, &ov) : ReadFile(pipe, buf, size, NULL, &ov);
+	if (!r && (GetLastError() == ERROR_IO_PENDING))
+		r = TRUE;
+	r = r && GetOverlappedResult(pipe, &ov, done, TRUE);
+	CloseHandle(ov.hEvent);
+	return r;
+}
+
+// Send data to the client, split across as many messages of type as needed
+static BOOL Send(daemon_job_t* job, char type, const void* data, size_t len)
+{
+	const char* p = (const char*)data;
+	DWORD size, written;
+	BOOL r = TRUE;
+
+	EnterCriticalSection(&job->write_lock);
+	do {
+		size = (DWORD)min(len, DAEMON_MESSAGE_SIZE - 1);
+		job->message[0] = type;
+		memcpy(&job->message[1], p, size);
+		r = PipeIo(job->pipe, TRUE, job->message, size + 1, &written);
+		p += size;
+		len -= size;
+	} while (r && (len > 0));
+	LeaveCriticalSection(&job->write_lock);
+	return r;
+}
+
+static BOOL Print(daemon_job_t* job, char type, const char* format, ...)
+{
+	char line[4096];
+	va_list args;
+	int len;
+
+	va_start(args, format);
+	len = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if (len < 0)
+		return FALSE;
+	return Send(job, type, line, min((size_t)len, sizeof(line) - 1));
+}
+
+/*
+ * Jobs
+ */
+
+static int JobList(daemon_job_t* job, pool_t* pool, int argc, char** argv)
+{
+	daemon_t* d = job->daemon;
+	// Printing can block on the client, so we only take a copy of the jobs under the
+	// lock, and the names too, as they go away with their job
+	struct {
+		uint64_t id;
+		char name[32];
+		double start;
+		BOOL cancelled;
+	} list[DAEMON_MAX_JOBS];
+	double now = GetTime();
+	DWORD i, n = 0;
+
+	EnterCriticalSection(&d->lock);
+	for (i = 0; i < DAEMON_MAX_JOBS; i++) {
+		if ((d->job[i] != NULL) && (d->job[i] != job)) {
+			list[n].id = d->job[i]->id;
+			strncpy(list[n].name, d->job[i]->name, sizeof(list[n].name) - 1);
+			list[n].name[sizeof(list[n].name) - 1] = 0;
+			list[n].start = d->job[i]->start;
+			list[n].cancelled = d->job[i]->scope.cancelled;
+			n++;
+		}
+	}
+	LeaveCriticalSection(&d->lock);
+	for (i = 0; i < n; i++)
+		Print(job, DAEMON_OUT, "#%-6llu %-8s %8.2f s%s\n", list[i].id, list[i].name,
+			now - list[i].start, list[i].cancelled ? " (cancelled)" : "");
+	return 0;
+}
+
+static int JobCancel(daemon_job_t* job, pool_t* pool, int argc, char** argv)
+{
+	daemon_t* d = job->daemon;
+	uint64_t id = strtoull((argv[0][0] == '#') ? &argv[0][1] : argv[0], NULL, 10);
+	DWORD i;
+	int r = 1;
+
+	EnterCriticalSection(&d->lock);
+	for (i = 0; i < DAEMON_MAX_JOBS; i++) {
+		if ((d->job[i] != NULL) && (d->job[i]->id == id)) {
+			CancelTaskGroup(&d->job[i]->scope);
+			r = 0;
+		}
+	}
+	LeaveCriticalSection(&d->lock);
+	if (r != 0)
+		Print(job, DAEMON_ERR, "No job #%llu\n", id);
+	return r;
+}
+
+static BOOL SendCommandOutput(void* ctx, const run_result_t* result)
+{
+	daemon_job_t* job = (daemon_job_t*)ctx;
+
+	if (result->error != ERROR_SUCCESS)
+		return Print(job, DAEMON_ERR, "Could not run '%s': error %lu\n", result->command, result->error);
+	return ((result->out_len == 0) || Send(job, DAEMON_OUT, result->out, result->out_len)) &&
+		((result->err_len == 0) || Send(job, DAEMON_ERR, result->err, result->err_len));
+}
+
+static int JobRun(daemon_job_t* job, pool_t* pool, int argc, char** argv)
+{
+	run_stats_t stats;
+
+	ParallelRun(pool, (const char* const*)&argv[1], argc - 1, (DWORD)strtoul(argv[0], NULL, 10), RUN_ORDERED,
+		SendCommandOutput, job, &stats);
+	snprintf(job->stats, sizeof(job->stats), "%llu commands (%llu failed, %llu could not be run), "
+		"%.1f ms median, %.1f ms p99, %.1f ms max", stats.commands, stats.failed, stats.errors,
+		stats.time_median, stats.time_p99, stats.time_max);
+	return ((stats.commands == (uint64_t)(argc - 1)) && (stats.failed == 0)) ? 0 : 1;
+}
+
+static int JobCopy(daemon_job_t* job, pool_t* pool, int argc, char** argv)
+{
+	const char** src = (const char**)malloc((argc / 2) * sizeof(char*));
+	const char** dst = (const char**)malloc((argc / 2) * sizeof(char*));
+	copy_stats_t stats = { 0 };
+	int i, r = 1;
+
+	if ((argc % 2) != 0) {
+		Print(job, DAEMON_ERR, "Sources and destinations must go in pairs\n");
+		goto out;
+	}
+	if ((src == NULL) || (dst == NULL))
+		goto out;
+	for (i = 0; i < argc / 2; i++) {
+		src[i] = argv[2 * i];
+		dst[i] = argv[2 * i + 1];
+	}
+	if (ParallelCopyFiles(pool, (const char* const*)src, (const char* const*)dst, argc / 2, 0, &stats))
+		r = 0;
+	else
+		Print(job, DAEMON_ERR, "Could not copy all the files: error %lu\n", GetLastError());
+	snprintf(job->stats, sizeof(job->stats), "%llu files, %llu bytes copied (%llu errors), "
+		"%.1f ms median, %.1f ms p99, %.1f ms max", stats.files, stats.bytes, stats.errors,
+		stats.latency_median, stats.latency_p99, stats.latency_max);
+
+out:
+	free((void*)src);
+	free((void*)dst);
+	return r;
+}
+
+static int JobMkdir(daemon_job_t* job, pool_t* pool, int argc, char** argv)
+{
+	tree_stats_t stats = { 0 };
+	BOOL r;
+
+	r = ParallelCreateDirectories(pool, (const char* const*)argv, argc, &stats);
+	snprintf(job->stats, sizeof(job->stats), "%llu directories created (%llu errors)",
+		stats.directories, stats.errors);
+	return r ? 0 : 1;
+}
+
+static int JobDelete(daemon_job_t* job, pool_t* pool, int argc, char** argv)
+{
+	tree_stats_t stats = { 0 };
+	BOOL r;
+
+	r = ParallelDeleteTree(pool, argv[0], &stats);
+	snprintf(job->stats, sizeof(job->stats), "%llu files and %llu directories deleted (%llu errors)",
+		stats.files, stats.directories, stats.errors);
+	return r ? 0 : 1;
+}
+
+static BOOL SendWalkEntry(void* ctx, uint32_t worker, const walk_entry_t* entry)
+{
+	return Print((daemon_job_t*)ctx, DAEMON_OUT, "%12llu %s\n", entry->size, entry->path);
+}
+
+static int JobWalk(daemon_job_t* job, pool_t* pool, int argc, char** argv)
+{
+	walk_stats_t stats = { 0 };
+	BOOL r;
+
+	r = ParallelWalk(pool, argv[0], 0, SendWalkEntry, job, &stats);
+	snprintf(job->stats, sizeof(job->stats), "%llu files, %llu directories, %llu bytes (%llu errors)",
+		stats.files, stats.directories, stats.bytes, stats.errors);
+	return r ? 0 : 1;
+}
+
+static const daemon_command_t daemon_command[] = {
+	{ "jobs", "List the jobs that are running", 0, 0, JobList },
+	{ "cancel", "ID: Cancel a job that is running", 1, 1, JobCancel },
+	{ "run", "MAX_PROCESSES COMMAND...: Run command lines, like -r", 2, -1, JobRun },
+	{ "copy", "SRC DST [SRC DST...]: Copy files", 2, -1, JobCopy },
+	{ "mkdir", "DIR...: Create directories, along with their parents", 1, -1, JobMkdir },
+	{ "delete", "DIR: Delete a directory tree", 1, 1, JobDelete },
+	{ "walk", "DIR: List the files under a directory, with their size", 1, 1, JobWalk },
+};
+
+/*
+ * Daemon
+ */
+
+static BOOL AddJob(daemon_t* d, daemon_job_t* job)
+{
+	DWORD i;
+
+	EnterCriticalSection(&d->lock);
+	for (i = 0; i < DAEMON_MAX_JOBS; i++) {
+		if (d->job[i] == NULL)
+			break;
+	}
+	if (i < DAEMON_MAX_JOBS) {
+		job->id = ++d->last_id;
+		d->job[i] = job;
+	}
+	LeaveCriticalSection(&d->lock);
+	return (i < DAEMON_MAX_JOBS);
+}
+
+static void RemoveJob(daemon_t* d, daemon_job_t* job)
+{
+	DWORD i;
+
+	EnterCriticalSection(&d->lock);
+	for (i = 0; i < DAEMON_MAX_JOBS; i++) {
+		if (d->job[i] == job)
+			d->job[i] = NULL;
+	}
+	LeaveCriticalSection(&d->lock);
+}
+
+static void FreeJob(daemon_job_t* job)
+{
+	if (job->pipe != INVALID_HANDLE_VALUE) {
+		DisconnectNamedPipe(job->pipe);
+		CloseHandle(job->pipe);
+	}
+	CloseTaskGroup(&job->scope);
+	DeleteCriticalSection(&job->write_lock);
+	free(job->message);
+	free(job);
+}
+
+static void CALLBACK ClientGone(void* ctx, BOOLEAN timed_out)
+{
+	CancelTaskGroup(&((daemon_job_t*)ctx)->scope);
+}
+
+static void SendStatus(daemon_job_t* job, int32_t code, const char* format, ...)
+{
+	char status[1 + sizeof(int32_t) + 512];
+	size_t len = 1 + sizeof(code);
+	DWORD written;
+	va_list args;
+	int n;
+
+	status[0] = DAEMON_STATUS;
+	memcpy(&status[1], &code, sizeof(code));
+	va_start(args, format);
+	n = vsnprintf(&status[len], sizeof(status) - len, format, args);
+	va_end(args);
+	if (n > 0)
+		len += min((size_t)n, sizeof(status) - len - 1);
+	fprintf(stderr, "%.*s\n", (int)(len - 1 - sizeof(code)), &status[1 + sizeof(code)]);
+	EnterCriticalSection(&job->write_lock);
+	PipeIo(job->pipe, TRUE, status, (DWORD)len, &written);
+	LeaveCriticalSection(&job->write_lock);
+}
+
+static DWORD WINAPI JobThread(void* param)
+{
+	daemon_job_t* job = (daemon_job_t*)param;
+	daemon_t* d = job->daemon;
+	const daemon_command_t* cmd = NULL;
+	char* request = NULL;
+	char* argv[DAEMON_MAX_ARGS];
+	OVERLAPPED watch = { 0 };
+	HANDLE wait = NULL;
+	pool_group_t* scope;
+	uint8_t byte;
+	DWORD size, pos;
+	size_t i;
+	int argc = 0, code = 1;
+
+	request = (char*)malloc(DAEMON_MESSAGE_SIZE + 1);
+	if ((request == NULL) || !PipeIo(job->pipe, FALSE, request, DAEMON_MESSAGE_SIZE, &size))
+		goto out;
+	request[size] = 0;
+	for (pos = 0; (pos < size) && (argc < DAEMON_MAX_ARGS); pos += (DWORD)strlen(&request[pos]) + 1)
+		argv[argc++] = &request[pos];
+	if (argc == 0)
+		goto out;
+	job->name = argv[0];
+	for (i = 0; (i < ARRAYSIZE(daemon_command)) && (cmd == NULL); i++) {
+		if (strcmp(argv[0], daemon_command[i].name) == 0)
+			cmd = &daemon_command[i];
+	}
+	if (cmd == NULL) {
+		for (i = 0; i < ARRAYSIZE(daemon_command); i++)
+			Print(job, DAEMON_OUT, "  %-8s %s\n", daemon_command[i].name, daemon_command[i].usage);
+		if (strcmp(argv[0], "help") == 0)
+			SendStatus(job, 0, "%d jobs available", (int)ARRAYSIZE(daemon_command));
+		else
+			SendStatus(job, 1, "Unknown job '%s'", argv[0]);
+		goto out;
+	}
+	if ((argc - 1 < cmd->min_args) || ((cmd->max_args >= 0) && (argc - 1 > cmd->max_args))) {
+		SendStatus(job, 1, "Usage: %s %s", cmd->name, cmd->usage);
+		goto out;
+	}
+	job->start = GetTime();
+	if (!AddJob(d, job)) {
+		SendStatus(job, 1, "Too many jobs running already.");
+		goto out;
+	}
+
+	// Anything from the client, including it going away, cancels the job
+	watch.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if ((watch.hEvent == NULL) || ReadFile(job->pipe, &byte, 1, NULL, &watch) ||
+		(GetLastError() != ERROR_IO_PENDING) ||
+		!RegisterWaitForSingleObject(&wait, watch.hEvent, ClientGone, job, INFINITE, WT_EXECUTEONLYONCE))
+		CancelTaskGroup(&job->scope);
+
+	scope = SetTaskScope(&job->scope);
+	code = cmd->run(job, d->pool, argc - 1, &argv[1]);
+	SetTaskScope(scope);
+
+	if (wait != NULL)
+		UnregisterWaitEx(wait, INVALID_HANDLE_VALUE);
+	if (watch.hEvent != NULL) {
+		CancelIoEx(job->pipe, &watch);
+		GetOverlappedResult(job->pipe, &watch, &size, TRUE);
+		CloseHandle(watch.hEvent);
+	}
+	RemoveJob(d, job);
+	if (TaskCancelled(d->pool, &job->scope))
+		code = 1;
+	SendStatus(job, code, "Job #%llu (%s) %s in %.3f s%s%s", job->id, job->name,
+		TaskCancelled(d->pool, &job->scope) ? "was cancelled" : ((code == 0) ? "succeeded" : "failed"),
+		GetTime() - job->start, (job->stats[0] != 0) ? ": " : "", job->stats);
+	FlushFileBuffers(job->pipe);
+
+out:
+	free(request);
+	FreeJob(job);
+	InterlockedDecrement(&d->num_threads);
+	return code;
+}
+
+// Hand a connected pipe to a thread of its own
+static BOOL StartJob(daemon_t* d, HANDLE pipe)
+{
+	daemon_job_t* job;
+	HANDLE thread;
+
+	job = (daemon_job_t*)calloc(1, sizeof(daemon_job_t));
+	if (job == NULL)
+		return FALSE;
+	job->daemon = d;
+	job->pipe = pipe;
+	job->name = "";
+	InitializeCriticalSection(&job->write_lock);
+	job->message = (char*)malloc(DAEMON_MESSAGE_SIZE);
+	if ((job->message == NULL) || !InitTaskGroup(&job->scope)) {
+		FreeJob(job);
+		return FALSE;
+	}
+	InterlockedIncrement(&d->num_threads);
+	thread = CreateThread(NULL, 0, JobThread, job, 0, NULL);
+	if (thread == NULL) {
+		InterlockedDecrement(&d->num_threads);
+		FreeJob(job);
+		return FALSE;
+	}
+	CloseHandle(thread);
+	return TRUE;
+}
+
+BOOL RunDaemon(pool_t* pool, const char* name)
+{
+	daemon_t d = { 0 };
+	char path[MAX_PATH];
+	wchar_t* wpath = NULL;
+	OVERLAPPED ov = { 0 };
+	HANDLE pipe = INVALID_HANDLE_VALUE;
+	DWORD size, flags = FILE_FLAG_FIRST_PIPE_INSTANCE;
+	BOOL r = FALSE;
+	int i;
+
+	d.pool = pool;
+	InitializeCriticalSection(&d.lock);
+	snprintf(path, sizeof(path), "\\\\.\\pipe\\%s", name);
+	wpath = utf8_to_wchar(path);
+	ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if ((wpath == NULL) || (ov.hEvent == NULL))
+		goto out;
+	fprintf(stderr, "Serving jobs on %s with %lu workers\n", path, PoolSize(pool));
+
+	while (!TaskCancelled(pool, NULL)) {
+		// The first instance fails if another daemon already uses that name
+		pipe = CreateNamedPipeW(wpath, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | flags,
+			PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+			PIPE_UNLIMITED_INSTANCES, DAEMON_MESSAGE_SIZE, DAEMON_MESSAGE_SIZE, 0, NULL);
+		if (pipe == INVALID_HANDLE_VALUE) {
+			fprintf(stderr, "Could not create %s: %lu\n", path, GetLastError());
+			goto out;
+		}
+		flags = 0;
+		ResetEvent(ov.hEvent);
+		if (!ConnectNamedPipe(pipe, &ov)) {
+			switch (GetLastError()) {
+			case ERROR_PIPE_CONNECTED:
+				break;
+			case ERROR_IO_PENDING:
+				while ((WaitForSingleObject(ov.hEvent, DAEMON_POLL_TIME) == WAIT_TIMEOUT) && !TaskCancelled(pool, NULL));
+				if (!HasOverlappedIoCompleted(&ov))
+					CancelIoEx(pipe, &ov);
+				if (GetOverlappedResult(pipe, &ov, &size, TRUE))
+					break;
+				// Fall through
+			default:
+				// Cancelled, or a client that came and went
+				CloseHandle(pipe);
+				pipe = INVALID_HANDLE_VALUE;
+				continue;
+			}
+		}
+		if (!StartJob(&d, pipe)) {
+			DisconnectNamedPipe(pipe);
+			CloseHandle(pipe);
+		}
+		pipe = INVALID_HANDLE_VALUE;
+	}
+	r = TRUE;
+
+out:
+	// The jobs were cancelled along with the pool
+	for (i = 0; (d.num_threads > 0) && (i < DAEMON_EXIT_WAIT / DAEMON_POLL_TIME); i++)
+		Sleep(DAEMON_POLL_TIME);
+	if (d.num_threads > 0) {
+		fprintf(stderr, "Jobs did not finalize\n");
+		r = FALSE;
+	}
+	if (ov.hEvent != NULL)
+		CloseHandle(ov.hEvent);
+	free(wpath);
+	// Jobs that did not finalize may still use it
+	if (d.num_threads == 0)
+		DeleteCriticalSection(&d.lock);
+	return r;
+}
+
+/*
+ * Client
+ */
+
+int RunDaemonJob(const char* name, int argc, char** argv)
+{
+	char path[MAX_PATH];
+	wchar_t* wpath = NULL;
+	HANDLE pipe = INVALID_HANDLE_VALUE;
+	DWORD mode = PIPE_READMODE_MESSAGE, size;
+	char* message = NULL;
+	size_t len = 0, arg_len;
+	int32_t status;
+	int i, code = 1;
+
+	snprintf(path, sizeof(path), "\\\\.\\pipe\\%s", name);
+	wpath = utf8_to_wchar(path);
+	message = (char*)malloc(DAEMON_MESSAGE_SIZE);
+	if ((wpath == NULL) || (message == NULL))
+		goto out;
+	if ((argc == 0) || (argc > DAEMON_MAX_ARGS)) {
+		fprintf(stderr, "A job takes between 1 and %d arguments.\n", DAEMON_MAX_ARGS);
+		goto out;
+	}
+	for (i = 0; i < argc; i++) {
+		arg_len = strlen(argv[i]) + 1;
+		if (arg_len > DAEMON_MESSAGE_SIZE - len) {
+			fprintf(stderr, "Job arguments are too long.\n");
+			goto out;
+		}
+		memcpy(&message[len], argv[i], arg_len);
+		len += arg_len;
+	}
+
+	do {
+		pipe = CreateFileW(wpath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+	} while ((pipe == INVALID_HANDLE_VALUE) && (GetLastError() == ERROR_PIPE_BUSY) &&
+		WaitNamedPipeW(wpath, DAEMON_CONNECT_TIMEOUT));
+	if (pipe == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "Could not connect to the daemon on %s: %lu\n", path, GetLastError());
+		goto out;
+	}
+	if (!SetNamedPipeHandleState(pipe, &mode, NULL, NULL) || !WriteFile(pipe, message, (DWORD)len, &size, NULL))
+		goto lost;
+
+	// If we get killed, the daemon cancels the job when the pipe breaks
+	while (ReadFile(pipe, message, DAEMON_MESSAGE_SIZE, &size, NULL) && (size != 0)) {
+		switch (message[0]) {
+		case DAEMON_OUT:
+			fwrite(&message[1], 1, size - 1, stdout);
+			break;
+		case DAEMON_ERR:
+			fwrite(&message[1], 1, size - 1, stderr);
+			break;
+		case DAEMON_STATUS:
+			if (size < 1 + sizeof(status))
+				goto lost;
+			memcpy(&status, &message[1], sizeof(status));
+			fflush(stdout);
+			fprintf(stderr, "%.*s\n", (int)(size - 1 - sizeof(status)), &message[1 + sizeof(status)]);
+			code = status;
+			goto out;
+		}
+	}
+
+lost:
+	fprintf(stderr, "Lost the daemon on %s: %lu\n", path, GetLastError());
+
+out:
+	if (pipe != INVALID_HANDLE_VALUE)
+		CloseHandle(pipe);
+	free(message);
+	free(wpath);
+	return code;
+}
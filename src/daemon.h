@@ -0,0 +1,49 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Daemon mode, serving jobs over a named pipe
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+// Maximum size of a message between the daemon and a client, which also bounds a job's arguments
+#define DAEMON_MESSAGE_SIZE	(64 * 1024)
+#define DAEMON_MAX_ARGS		1024
+// Maximum number of jobs running at once
+#define DAEMON_MAX_JOBS		64
+
+/*
+ * Serve jobs on the named pipe \\.\pipe\NAME, on the workers of pool, until
+ * the pool gets cancelled. Each client connection runs a job, on a thread of
+ * its own, with the job's output and stats streamed back to the client. Each
+ * job runs in a task scope of its own, which gets cancelled if its client
+ * goes away or sends anything, or if another client asks to cancel it, so
+ * that cancelling a job leaves the others running.
+ */
+extern BOOL RunDaemon(pool_t* pool, const char* name);
+
+/*
+ * Send a job to the daemon on NAME, writing its output to our stdout and
+ * stderr. Returns the exit code of the job, or 1 if the daemon could not be
+ * reached. The "help" job lists the jobs.
+ */
+extern int RunDaemonJob(const char* name, int argc, char** argv);
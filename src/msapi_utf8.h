@@ -36,6 +36,7 @@
 #include <sys/stat.h>
 #include <psapi.h>
 #include <imagehlp.h>
+#include "utf.h"
 
 #pragma once
 #if defined(_MSC_VER)
@@ -50,10 +51,6 @@ extern "C" {
 #define _LTEXT(txt) L##txt
 #define LTEXT(txt) _LTEXT(txt)
 
-#define wchar_to_utf8_no_alloc(wsrc, dest, dest_size) \
-	WideCharToMultiByte(CP_UTF8, 0, wsrc, -1, dest, dest_size, NULL, NULL)
-#define utf8_to_wchar_no_alloc(src, wdest, wdest_size) \
-	MultiByteToWideChar(CP_UTF8, 0, src, -1, wdest, wdest_size)
 #define Edit_ReplaceSelU(hCtrl, str) ((void)SendMessageLU(hCtrl, EM_REPLACESEL, (WPARAM)FALSE, str))
 #define ComboBox_AddStringU(hCtrl, str) ((int)(DWORD)SendMessageLU(hCtrl, CB_ADDSTRING, (WPARAM)FALSE, str))
 #define ComboBox_InsertStringU(hCtrl, index, str) ((int)(DWORD)SendMessageLU(hCtrl, CB_INSERTSTRING, (WPARAM)index, str))
@@ -74,9 +71,72 @@ extern "C" {
 // NB: other issomething() calls are not implemented as they may require multibyte UTF-8 sequences to be converted
 
 #define sfree(p) do {if (p != NULL) {free((void*)(p)); p = NULL;}} while(0)
-#define wconvert(p)     wchar_t* w ## p = utf8_to_wchar(p)
-#define walloc(p, size) wchar_t* w ## p = (p == NULL)?NULL:(wchar_t*)calloc(size, sizeof(wchar_t))
-#define wfree(p) sfree(w ## p)
+// The UTF-16 strings we pass to the W calls live on the stack, unless they are too
+// long for it, so that the common case doesn't need to go through the allocator.
+#define WCONVERT_BUF_SIZE MAX_PATH
+#define wconvert(p)     wchar_t w ## p ## _buf[WCONVERT_BUF_SIZE]; \
+	wchar_t* w ## p = utf8_to_wchar_buf(p, w ## p ## _buf, WCONVERT_BUF_SIZE)
+#define walloc(p, size) wchar_t w ## p ## _buf[WCONVERT_BUF_SIZE]; \
+	wchar_t* w ## p = (p == NULL)?NULL:((size_t)(size) <= WCONVERT_BUF_SIZE)? \
+	(wchar_t*)memset(w ## p ## _buf, 0, (size_t)(size) * sizeof(wchar_t)):(wchar_t*)calloc(size, sizeof(wchar_t))
+#define wfree(p) do {if (w ## p != w ## p ## _buf) free(w ## p); w ## p = NULL;} while(0)
+
+/*
+ * The conversions below use our own transcoder rather than WideCharToMultiByte()
+ * and MultiByteToWideChar(), as it can predict the exact size of the output with
+ * a quick vectorized scan, so that we only allocate and convert once. Like the
+ * Windows calls, invalid sequences are replaced with U+FFFD.
+ */
+
+/*
+ * Converts an UTF-16 string to UTF8 in a buffer of dest_size bytes.
+ * Returns the number of bytes written, including the NUL terminator,
+ * or 0 on error. If dest_size is 0, returns the size required.
+ */
+static __inline int wchar_to_utf8_no_alloc(const wchar_t* wsrc, char* dest, int dest_size)
+{
+	size_t wlen, size;
+
+	if (wsrc == NULL || dest_size < 0) {
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return 0;
+	}
+	wlen = wcslen(wsrc);
+	size = utf16_to_utf8_length((const uint16_t*)wsrc, wlen);
+	if (dest_size == 0)
+		return (int)size + 1;
+	if (size >= (size_t)dest_size) {
+		SetLastError(ERROR_INSUFFICIENT_BUFFER);
+		return 0;
+	}
+	dest[utf16_to_utf8((const uint16_t*)wsrc, wlen, dest)] = 0;
+	return (int)size + 1;
+}
+
+/*
+ * Converts an UTF8 string to UTF-16 in a buffer of wdest_size characters.
+ * Returns the number of characters written, including the NUL terminator,
+ * or 0 on error. If wdest_size is 0, returns the size required.
+ */
+static __inline int utf8_to_wchar_no_alloc(const char* src, wchar_t* wdest, int wdest_size)
+{
+	size_t len, size;
+
+	if (src == NULL || wdest_size < 0) {
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return 0;
+	}
+	len = strlen(src);
+	size = utf8_to_utf16_length(src, len);
+	if (wdest_size == 0)
+		return (int)size + 1;
+	if (size >= (size_t)wdest_size) {
+		SetLastError(ERROR_INSUFFICIENT_BUFFER);
+		return 0;
+	}
+	wdest[utf8_to_utf16(src, len, (uint16_t*)wdest)] = 0;
+	return (int)size + 1;
+}
 
 /*
  * Converts an UTF-16 string to UTF8 (allocate returned string)
@@ -84,25 +144,17 @@ extern "C" {
  */
 static __inline char* wchar_to_utf8(const wchar_t* wstr)
 {
-	int size = 0;
+	size_t wlen, size;
 	char* str = NULL;
 
-	// Convert the empty string too
-	if (wstr[0] == 0)
-		return (char*)calloc(1, 1);
-
-	// Find out the size we need to allocate for our converted string
-	size = WideCharToMultiByte(CP_UTF8, 0, wstr, -1, NULL, 0, NULL, NULL);
-	if (size <= 1)	// An empty string would be size 1
-		return NULL;
-
-	if ((str = (char*)calloc(size, 1)) == NULL)
+	if (wstr == NULL)
 		return NULL;
 
-	if (wchar_to_utf8_no_alloc(wstr, str, size) != size) {
-		sfree(str);
+	wlen = wcslen(wstr);
+	size = utf16_to_utf8_length((const uint16_t*)wstr, wlen);
+	if ((str = (char*)malloc(size + 1)) == NULL)
 		return NULL;
-	}
+	str[utf16_to_utf8((const uint16_t*)wstr, wlen, str)] = 0;
 
 	return str;
 }
@@ -113,52 +165,61 @@ static __inline char* wchar_to_utf8(const wchar_t* wstr)
  */
 static __inline wchar_t* utf8_to_wchar(const char* str)
 {
-	int size = 0;
+	size_t len, size;
 	wchar_t* wstr = NULL;
 
 	if (str == NULL)
 		return NULL;
 
-	// Convert the empty string too
-	if (str[0] == 0)
-		return (wchar_t*)calloc(1, sizeof(wchar_t));
-
-	// Find out the size we need to allocate for our converted string
-	size = MultiByteToWideChar(CP_UTF8, 0, str, -1, NULL, 0);
-	if (size <= 1)	// An empty string would be size 1
+	len = strlen(str);
+	size = utf8_to_utf16_length(str, len);
+	if ((wstr = (wchar_t*)malloc((size + 1) * sizeof(wchar_t))) == NULL)
 		return NULL;
+	wstr[utf8_to_utf16(str, len, (uint16_t*)wstr)] = 0;
 
-	if ((wstr = (wchar_t*)calloc(size, sizeof(wchar_t))) == NULL)
-		return NULL;
+	return wstr;
+}
 
-	if (utf8_to_wchar_no_alloc(str, wstr, size) != size) {
-		sfree(wstr);
+/*
+ * Converts an UTF8 string to UTF-16 into buf, of buf_size characters, if it fits,
+ * or into an allocated string otherwise. Use wfree() or compare with buf to free.
+ * Returns NULL on error
+ */
+static __inline wchar_t* utf8_to_wchar_buf(const char* str, wchar_t* buf, size_t buf_size)
+{
+	size_t len;
+
+	if (str == NULL)
 		return NULL;
-	}
-	return wstr;
+
+	// An UTF-16 string never has more characters than its UTF-8 version has bytes,
+	// so we don't need to find out the converted size if the UTF-8 string fits.
+	len = strlen(str);
+	if (len >= buf_size)
+		return utf8_to_wchar(str);
+	buf[utf8_to_utf16(str, len, (uint16_t*)buf)] = 0;
+
+	return buf;
 }
 
 /*
 * Converts an non NUL-terminated UTF-16 string of length len to UTF8 (allocate returned string)
+* A len of -1 means that the string is NUL-terminated after all, as with WideCharToMultiByte()
 * Returns NULL on error
 */
 static __inline char* wchar_len_to_utf8(const wchar_t* wstr, int wlen)
 {
-	int size = 0;
+	size_t len, size;
 	char* str = NULL;
 
-	// Find out the size we need to allocate for our converted string
-	size = WideCharToMultiByte(CP_UTF8, 0, wstr, wlen, NULL, 0, NULL, NULL);
-	if (size <= 1)	// An empty string would be size 1
+	if (wstr == NULL)
 		return NULL;
 
-	if ((str = (char*)calloc(size, 1)) == NULL)
+	len = (wlen < 0) ? wcslen(wstr) : (size_t)wlen;
+	size = utf16_to_utf8_length((const uint16_t*)wstr, len);
+	if ((str = (char*)malloc(size + 1)) == NULL)
 		return NULL;
-
-	if (WideCharToMultiByte(CP_UTF8, 0, wstr, wlen, str, size, NULL, NULL) != size) {
-		sfree(str);
-		return NULL;
-	}
+	str[utf16_to_utf8((const uint16_t*)wstr, len, str)] = 0;
 
 	return str;
 }
@@ -446,7 +507,7 @@ static __inline int ComboBox_GetLBTextU(HWND hCtrl, int index, char* lpString)
 	err = GetLastError();
 	if (size > 0)
 		wchar_to_utf8_no_alloc(wlpString, lpString, size+1);
-	wfree(lpString);
+	sfree(wlpString);
 	SetLastError(err);
 	return size;
 }
@@ -0,0 +1,775 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Work distribution over TCP
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "net.h"
+
+#define NET_MAGIC			0x3054454e	// "NET0"
+// How long we wait on the sockets before we check on the run again (ms)
+#define NET_POLL_TIME		100
+// How long an agent keeps trying to reach the coordinator (ms)
+#define NET_CONNECT_TIMEOUT	10000
+// How much we try to read from a socket at once
+#define NET_READ_SIZE		(64 << 10)
+
+/*
+ * Every message is a header followed by size bytes of payload, which is a
+ * multiple of 8. Everything is in the byte order of the hosts, which is little
+ * endian for all of Windows.
+ */
+enum {
+	NET_HELLO = 1,				// Agent: net_hello_t
+	NET_BATCH,					// Coordinator: net_batch_t, then count net_item_t with their task
+	NET_RESULTS,				// Agent: net_batch_t, then count net_item_t with their result
+	NET_DONE,					// Coordinator: nothing
+};
+
+typedef struct {
+	uint32_t type;
+	uint32_t size;
+} net_header_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t workers;
+} net_hello_t;
+
+// For tasks first to first + count - 1
+typedef struct {
+	uint64_t first;
+	uint32_t count;
+	uint32_t reserved;
+} net_batch_t;
+
+// Followed by size bytes of data, padded to 8 bytes so that the next item is aligned
+typedef struct {
+	uint32_t code;				// Handler for a task, success for a result
+	uint32_t size;
+} net_item_t;
+
+#define NET_PAD(size)		(((size) + 7) & ~(size_t)7)
+
+#define NET_MAX_MESSAGE		(sizeof(net_batch_t) + NET_MAX_BATCH * (sizeof(net_item_t) + PROC_DATA_SIZE))
+
+typedef struct {
+	uint8_t* data;
+	size_t pos;					// What was consumed
+	size_t len;
+	size_t size;
+} net_buffer_t;
+
+typedef struct {
+	uint64_t begin;
+	uint64_t end;
+} net_range_t;
+
+typedef struct {
+	SOCKET s;
+	DWORD workers;				// 0 until it says hello
+	net_range_t share;
+	// The batches it was sent, in the order it runs them
+	net_range_t batch[NET_PIPELINE];
+	DWORD num_batches;
+	net_buffer_t in;
+	net_buffer_t out;
+} net_agent_t;
+
+struct net_coordinator {
+	SOCKET listener;
+	uint16_t port;
+	net_agent_t agent[NET_MAX_AGENTS];
+	DWORD num_agents;
+	// The share of nobody, and the batches and shares of the agents that went away
+	net_range_t unassigned;
+	net_range_t* retry;
+	size_t num_retry;
+	size_t retry_size;
+	uint64_t completed;
+	BOOL aborted;
+	net_task_fn task_fn;
+	proc_result_fn result_fn;
+	void* ctx;
+	uint8_t* task;
+	net_stats_t stats;
+};
+
+typedef struct {
+	net_item_t task[NET_MAX_BATCH];
+	const uint8_t* task_data[NET_MAX_BATCH];
+	net_item_t result[NET_MAX_BATCH];
+	uint8_t* data;
+} net_job_t;
+
+static double GetTime(void)
+{
+	static LARGE_INTEGER freq = { 0 };
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / (double)freq.QuadPart;
+}
+
+static __inline uint64_t RangeSize(const net_range_t* range)
+{
+	return range->end - range->begin;
+}
+
+// Make room for len more bytes
+static BOOL BufferReserve(net_buffer_t* buf, size_t len)
+{
+	uint8_t* data;
+	size_t size;
+
+	if (buf->size - buf->len >= len)
+		return TRUE;
+	size = max(2 * buf->size, buf->len + len);
+	data = (uint8_t*)realloc(buf->data, size);
+	if (data == NULL)
+		return FALSE;
+	buf->data = data;
+	buf->size = size;
+	return TRUE;
+}
+
+static BOOL BufferAppend(net_buffer_t* buf, const void* data, size_t len)
+{
+	if (!BufferReserve(buf, len))
+		return FALSE;
+	memcpy(&buf->data[buf->len], data, len);
+	buf->len += len;
+	return TRUE;
+}
+
+// Drop what was consumed
+static void BufferCompact(net_buffer_t* buf)
+{
+	memmove(buf->data, &buf->data[buf->pos], buf->len - buf->pos);
+	buf->len -= buf->pos;
+	buf->pos = 0;
+}
+
+static void SetNonBlocking(SOCKET s, BOOL enable)
+{
+	u_long mode = enable ? 1 : 0;
+	BOOL nodelay = TRUE;
+
+	ioctlsocket(s, FIONBIO, &mode);
+	// Our messages are whole batches, which we don't want held back
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+}
+
+static BOOL SendAll(SOCKET s, const void* data, size_t len)
+{
+	const char* p = (const char*)data;
+	int n;
+
+	while (len > 0) {
+		n = send(s, p, (int)min(len, INT_MAX), 0);
+		if (n == SOCKET_ERROR)
+			return FALSE;
+		p += n;
+		len -= n;
+	}
+	return TRUE;
+}
+
+static BOOL RecvAll(SOCKET s, void* data, size_t len)
+{
+	char* p = (char*)data;
+	int n;
+
+	while (len > 0) {
+		n = recv(s, p, (int)min(len, INT_MAX), 0);
+		if ((n == 0) || (n == SOCKET_ERROR))
+			return FALSE;
+		p += n;
+		len -= n;
+	}
+	return TRUE;
+}
+
+/*
+ * Coordinator
+ */
+
+net_coordinator_t* CreateCoordinator(const char* host, const char* port)
+{
+	WSADATA wsa;
+	struct addrinfo hints = { 0 }, *res = NULL, *ai;
+	struct sockaddr_storage addr;
+	int addr_len = sizeof(addr);
+	net_coordinator_t* nc;
+
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+		return NULL;
+	nc = (net_coordinator_t*)calloc(1, sizeof(net_coordinator_t));
+	if (nc == NULL) {
+		WSACleanup();
+		return NULL;
+	}
+	nc->listener = INVALID_SOCKET;
+
+	hints.ai_family = (host == NULL) ? AF_INET : AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		fprintf(stderr, "Could not resolve %s:%s: %d\n", (host == NULL) ? "*" : host, port, WSAGetLastError());
+		goto error;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		nc->listener = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (nc->listener == INVALID_SOCKET)
+			continue;
+		if ((bind(nc->listener, ai->ai_addr, (int)ai->ai_addrlen) == 0) && (listen(nc->listener, SOMAXCONN) == 0))
+			break;
+		closesocket(nc->listener);
+		nc->listener = INVALID_SOCKET;
+	}
+	if (nc->listener == INVALID_SOCKET) {
+		fprintf(stderr, "Could not listen on %s:%s: %d\n", (host == NULL) ? "*" : host, port, WSAGetLastError());
+		goto error;
+	}
+	if (getsockname(nc->listener, (struct sockaddr*)&addr, &addr_len) != 0)
+		goto error;
+	nc->port = ntohs((addr.ss_family == AF_INET6) ? ((struct sockaddr_in6*)&addr)->sin6_port :
+		((struct sockaddr_in*)&addr)->sin_port);
+	SetNonBlocking(nc->listener, TRUE);
+	freeaddrinfo(res);
+	return nc;
+
+error:
+	if (res != NULL)
+		freeaddrinfo(res);
+	DestroyCoordinator(nc);
+	return NULL;
+}
+
+static void CloseAgent(net_agent_t* a)
+{
+	closesocket(a->s);
+	free(a->in.data);
+	free(a->out.data);
+	memset(a, 0, sizeof(net_agent_t));
+}
+
+void DestroyCoordinator(net_coordinator_t* nc)
+{
+	if (nc == NULL)
+		return;
+	while (nc->num_agents > 0)
+		CloseAgent(&nc->agent[--nc->num_agents]);
+	if (nc->listener != INVALID_SOCKET)
+		closesocket(nc->listener);
+	free(nc->retry);
+	free(nc);
+	WSACleanup();
+}
+
+uint16_t CoordinatorPort(net_coordinator_t* nc)
+{
+	return nc->port;
+}
+
+static BOOL AddRetry(net_coordinator_t* nc, const net_range_t* range)
+{
+	net_range_t* retry;
+	size_t size;
+
+	if (RangeSize(range) == 0)
+		return TRUE;
+	if (nc->num_retry == nc->retry_size) {
+		size = max(2 * nc->retry_size, 16);
+		retry = (net_range_t*)realloc(nc->retry, size * sizeof(net_range_t));
+		if (retry == NULL)
+			return FALSE;
+		nc->retry = retry;
+		nc->retry_size = size;
+	}
+	nc->retry[nc->num_retry++] = *range;
+	return TRUE;
+}
+
+static void AcceptAgent(net_coordinator_t* nc)
+{
+	net_agent_t* a;
+	SOCKET s;
+
+	s = accept(nc->listener, NULL, NULL);
+	if (s == INVALID_SOCKET)
+		return;
+	if (nc->num_agents >= NET_MAX_AGENTS) {
+		closesocket(s);
+		return;
+	}
+	SetNonBlocking(s, TRUE);
+	a = &nc->agent[nc->num_agents++];
+	memset(a, 0, sizeof(net_agent_t));
+	a->s = s;
+	nc->stats.agents++;
+}
+
+// Hand what the agent had to the others, and replace it with the last one
+static void DropAgent(net_coordinator_t* nc, DWORD index)
+{
+	net_agent_t* a = &nc->agent[index];
+	DWORD i;
+
+	for (i = 0; i < a->num_batches; i++) {
+		if (!AddRetry(nc, &a->batch[i]))
+			nc->aborted = TRUE;
+	}
+	if (!AddRetry(nc, &a->share))
+		nc->aborted = TRUE;
+	CloseAgent(a);
+	nc->stats.dropped++;
+	if (index != --nc->num_agents) {
+		*a = nc->agent[nc->num_agents];
+		memset(&nc->agent[nc->num_agents], 0, sizeof(net_agent_t));
+	}
+}
+
+// Take up to n tasks from the front of src
+static void TakeRange(net_range_t* src, uint64_t n, net_range_t* range)
+{
+	range->begin = src->begin;
+	range->end = src->begin + min(n, RangeSize(src));
+	src->begin = range->end;
+}
+
+/*
+ * Pick the next batch of an agent: tasks that another agent didn't complete
+ * first, then its own share, then half of what is left of the largest share.
+ */
+static BOOL NextBatch(net_coordinator_t* nc, net_agent_t* a, net_range_t* range)
+{
+	uint64_t n = min((uint64_t)a->workers * NET_BATCH_PER_WORKER, NET_MAX_BATCH);
+	net_range_t* victim;
+	DWORD i;
+
+	if (nc->num_retry > 0) {
+		victim = &nc->retry[nc->num_retry - 1];
+		TakeRange(victim, n, range);
+		if (RangeSize(victim) == 0)
+			nc->num_retry--;
+		return TRUE;
+	}
+	if (RangeSize(&a->share) == 0) {
+		victim = &nc->unassigned;
+		for (i = 0; i < nc->num_agents; i++) {
+			if (RangeSize(&nc->agent[i].share) > RangeSize(victim))
+				victim = &nc->agent[i].share;
+		}
+		if (RangeSize(victim) == 0)
+			return FALSE;
+		a->share.end = victim->end;
+		a->share.begin = victim->end - (RangeSize(victim) + 1) / 2;
+		victim->end = a->share.begin;
+		if (victim != &nc->unassigned)
+			nc->stats.steals++;
+	}
+	TakeRange(&a->share, n, range);
+	return TRUE;
+}
+
+static BOOL QueueBatch(net_coordinator_t* nc, net_agent_t* a, const net_range_t* range)
+{
+	net_header_t header = { NET_BATCH, 0 };
+	net_batch_t batch = { range->begin, (uint32_t)RangeSize(range), 0 };
+	net_item_t item;
+	static const uint8_t pad[8] = { 0 };
+	size_t start = a->out.len;
+	uint64_t i;
+
+	if (!BufferAppend(&a->out, &header, sizeof(header)) || !BufferAppend(&a->out, &batch, sizeof(batch)))
+		return FALSE;
+	for (i = range->begin; i < range->end; i++) {
+		item.size = PROC_DATA_SIZE;
+		if (!nc->task_fn(nc->ctx, i, &item.code, nc->task, &item.size) || (item.size > PROC_DATA_SIZE))
+			return FALSE;
+		if (!BufferAppend(&a->out, &item, sizeof(item)) || !BufferAppend(&a->out, nc->task, item.size) ||
+			!BufferAppend(&a->out, pad, NET_PAD(item.size) - item.size))
+			return FALSE;
+	}
+	header.size = (uint32_t)(a->out.len - start - sizeof(header));
+	memcpy(&a->out.data[start], &header, sizeof(header));
+	a->batch[a->num_batches++] = *range;
+	nc->stats.batches++;
+	return TRUE;
+}
+
+// Keep NET_PIPELINE batches queued for an agent, for as long as there are tasks
+static BOOL FillPipeline(net_coordinator_t* nc, net_agent_t* a)
+{
+	net_range_t range;
+
+	while ((a->workers != 0) && (a->num_batches < NET_PIPELINE) && NextBatch(nc, a, &range)) {
+		if (!QueueBatch(nc, a, &range))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static BOOL HandleResults(net_coordinator_t* nc, net_agent_t* a, const uint8_t* data, size_t size)
+{
+	net_batch_t batch;
+	net_item_t item;
+	size_t pos;
+	uint32_t i;
+
+	if (size < sizeof(batch))
+		return FALSE;
+	memcpy(&batch, data, sizeof(batch));
+	if ((a->num_batches == 0) || (batch.first != a->batch[0].begin) || (batch.count != RangeSize(&a->batch[0])))
+		return FALSE;
+	// Check all of it before we report anything, as we send the whole batch again otherwise
+	for (i = 0, pos = sizeof(batch); i < batch.count; i++) {
+		if (size - pos < sizeof(item))
+			return FALSE;
+		memcpy(&item, &data[pos], sizeof(item));
+		pos += sizeof(item);
+		if ((item.size > PROC_DATA_SIZE) || (size - pos < NET_PAD(item.size)))
+			return FALSE;
+		pos += NET_PAD(item.size);
+	}
+	for (i = 0, pos = sizeof(batch); i < batch.count; i++) {
+		memcpy(&item, &data[pos], sizeof(item));
+		pos += sizeof(item);
+		nc->stats.tasks++;
+		if (!item.code)
+			nc->stats.failed++;
+		if (nc->result_fn != NULL)
+			nc->result_fn(nc->ctx, batch.first + i, (BOOL)item.code, &data[pos], item.size);
+		pos += NET_PAD(item.size);
+	}
+	nc->completed += batch.count;
+	memmove(&a->batch[0], &a->batch[1], --a->num_batches * sizeof(net_range_t));
+	return TRUE;
+}
+
+// Read what the agent sent and process the messages it completed. Returns FALSE to drop the agent.
+static BOOL ReadAgent(net_coordinator_t* nc, net_agent_t* a)
+{
+	net_header_t header;
+	net_hello_t hello;
+	const uint8_t* payload;
+	int n;
+
+	if (!BufferReserve(&a->in, NET_READ_SIZE))
+		return FALSE;
+	n = recv(a->s, (char*)&a->in.data[a->in.len], (int)min(a->in.size - a->in.len, INT_MAX), 0);
+	if (n == 0)
+		return FALSE;
+	if (n == SOCKET_ERROR)
+		return (WSAGetLastError() == WSAEWOULDBLOCK);
+	a->in.len += n;
+
+	while (a->in.len - a->in.pos >= sizeof(header)) {
+		memcpy(&header, &a->in.data[a->in.pos], sizeof(header));
+		if (header.size > NET_MAX_MESSAGE)
+			return FALSE;
+		if (a->in.len - a->in.pos - sizeof(header) < header.size)
+			break;
+		payload = &a->in.data[a->in.pos + sizeof(header)];
+		switch (header.type) {
+		case NET_HELLO:
+			if ((a->workers != 0) || (header.size != sizeof(hello)))
+				return FALSE;
+			memcpy(&hello, payload, sizeof(hello));
+			if ((hello.magic != NET_MAGIC) || (hello.workers == 0))
+				return FALSE;
+			a->workers = hello.workers;
+			break;
+		case NET_RESULTS:
+			if (!HandleResults(nc, a, payload, header.size))
+				return FALSE;
+			break;
+		default:
+			return FALSE;
+		}
+		a->in.pos += sizeof(header) + header.size;
+	}
+	BufferCompact(&a->in);
+	return TRUE;
+}
+
+// Send as much of what we queued for the agent as its socket takes. Returns FALSE to drop the agent.
+static BOOL WriteAgent(net_agent_t* a)
+{
+	int n;
+
+	n = send(a->s, (const char*)&a->out.data[a->out.pos], (int)min(a->out.len - a->out.pos, INT_MAX), 0);
+	if (n == SOCKET_ERROR)
+		return (WSAGetLastError() == WSAEWOULDBLOCK);
+	a->out.pos += n;
+	BufferCompact(&a->out);
+	return TRUE;
+}
+
+// Tell the agents we are done, and disconnect them
+static void ReleaseAgents(net_coordinator_t* nc)
+{
+	net_header_t header = { NET_DONE, 0 };
+	net_agent_t* a;
+
+	while (nc->num_agents > 0) {
+		a = &nc->agent[--nc->num_agents];
+		SetNonBlocking(a->s, FALSE);
+		// Unless we are aborting, the agents have completed all they were sent
+		if (a->num_batches == 0)
+			SendAll(a->s, &a->out.data[a->out.pos], a->out.len - a->out.pos);
+		SendAll(a->s, &header, sizeof(header));
+		shutdown(a->s, SD_SEND);
+		CloseAgent(a);
+	}
+}
+
+BOOL RunCoordinator(net_coordinator_t* nc, uint64_t count, net_task_fn task_fn,
+	proc_result_fn result_fn, void* ctx, net_stats_t* stats)
+{
+	struct timeval tv = { 0, NET_POLL_TIME * 1000 };
+	fd_set rfds, wfds;
+	net_agent_t* a;
+	double start = GetTime(), seen = start;
+	DWORD i;
+	BOOL r = FALSE;
+
+	memset(&nc->stats, 0, sizeof(nc->stats));
+	nc->unassigned.begin = 0;
+	nc->unassigned.end = count;
+	nc->num_retry = 0;
+	nc->completed = 0;
+	nc->aborted = FALSE;
+	nc->task_fn = task_fn;
+	nc->result_fn = result_fn;
+	nc->ctx = ctx;
+	nc->task = (uint8_t*)malloc(PROC_DATA_SIZE);
+	if (nc->task == NULL)
+		goto out;
+
+	while (nc->completed < count) {
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+		if (nc->num_agents < NET_MAX_AGENTS)
+			FD_SET(nc->listener, &rfds);
+		for (i = 0; i < nc->num_agents; i++) {
+			FD_SET(nc->agent[i].s, &rfds);
+			if (nc->agent[i].out.len != 0)
+				FD_SET(nc->agent[i].s, &wfds);
+		}
+		if (select(0, &rfds, &wfds, NULL, &tv) == SOCKET_ERROR) {
+			fprintf(stderr, "Could not wait on agents: %d\n", WSAGetLastError());
+			goto out;
+		}
+		if (FD_ISSET(nc->listener, &rfds))
+			AcceptAgent(nc);
+		// Backwards, as dropping an agent moves the last one in its place
+		for (i = nc->num_agents; i-- > 0; ) {
+			a = &nc->agent[i];
+			if ((FD_ISSET(a->s, &wfds) && !WriteAgent(a)) || (FD_ISSET(a->s, &rfds) && !ReadAgent(nc, a)))
+				DropAgent(nc, i);
+		}
+		// Done after the agents were read, as one that went away may have left tasks for the others
+		for (i = 0; (i < nc->num_agents) && !nc->aborted; i++)
+			nc->aborted = !FillPipeline(nc, &nc->agent[i]);
+		if (nc->aborted) {
+			fprintf(stderr, "Distributed run aborted\n");
+			goto out;
+		}
+		if (nc->num_agents != 0) {
+			seen = GetTime();
+		} else if (GetTime() - seen > NET_AGENT_TIMEOUT / 1000.0) {
+			fprintf(stderr, "No agent to run the tasks on\n");
+			goto out;
+		}
+	}
+	r = TRUE;
+
+out:
+	ReleaseAgents(nc);
+	free(nc->task);
+	nc->task = NULL;
+	nc->stats.seconds = GetTime() - start;
+	if (stats != NULL)
+		*stats = nc->stats;
+	return r;
+}
+
+/*
+ * Agent
+ */
+
+static SOCKET ConnectCoordinator(const char* host, const char* port)
+{
+	struct addrinfo hints = { 0 }, *res = NULL, *ai;
+	SOCKET s = INVALID_SOCKET;
+	DWORD t;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		fprintf(stderr, "Could not resolve %s:%s: %d\n", host, port, WSAGetLastError());
+		return INVALID_SOCKET;
+	}
+	for (t = 0; t < NET_CONNECT_TIMEOUT; t += NET_POLL_TIME) {
+		for (ai = res; ai != NULL; ai = ai->ai_next) {
+			s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+			if (s == INVALID_SOCKET)
+				continue;
+			if (connect(s, ai->ai_addr, (int)ai->ai_addrlen) == 0)
+				goto out;
+			closesocket(s);
+			s = INVALID_SOCKET;
+		}
+		Sleep(NET_POLL_TIME);
+	}
+	fprintf(stderr, "Could not connect to %s:%s\n", host, port);
+
+out:
+	freeaddrinfo(res);
+	return s;
+}
+
+static void RunTasks(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	net_job_t* job = (net_job_t*)ctx;
+	proc_handler_fn fn;
+	uint64_t i;
+
+	for (i = begin; i < end; i++) {
+		fn = GetProcHandler(job->task[i].code);
+		job->result[i].size = PROC_DATA_SIZE;
+		job->result[i].code = (fn != NULL) && fn(job->task_data[i], job->task[i].size,
+			&job->data[i * PROC_DATA_SIZE], &job->result[i].size);
+		if (!job->result[i].code || (job->result[i].size > PROC_DATA_SIZE))
+			job->result[i].size = 0;
+	}
+}
+
+// Run a batch on the pool, and write the message with its results into out
+static BOOL RunBatch(pool_t* pool, net_job_t* job, const uint8_t* data, size_t size, net_buffer_t* out,
+	uint64_t* tasks)
+{
+	static const uint8_t pad[8] = { 0 };
+	net_header_t header = { NET_RESULTS, 0 };
+	net_batch_t batch;
+	size_t pos;
+	uint32_t i;
+
+	if (size < sizeof(batch))
+		return FALSE;
+	memcpy(&batch, data, sizeof(batch));
+	if (batch.count > NET_MAX_BATCH)
+		return FALSE;
+	for (i = 0, pos = sizeof(batch); i < batch.count; i++) {
+		if (size - pos < sizeof(net_item_t))
+			return FALSE;
+		memcpy(&job->task[i], &data[pos], sizeof(net_item_t));
+		pos += sizeof(net_item_t);
+		if ((job->task[i].size > PROC_DATA_SIZE) || (size - pos < NET_PAD(job->task[i].size)))
+			return FALSE;
+		job->task_data[i] = &data[pos];
+		pos += NET_PAD(job->task[i].size);
+	}
+	if (!ParallelFor(pool, 0, batch.count, 1, RunTasks, job))
+		return FALSE;
+
+	out->pos = 0;
+	out->len = 0;
+	if (!BufferAppend(out, &header, sizeof(header)) || !BufferAppend(out, &batch, sizeof(batch)))
+		return FALSE;
+	for (i = 0; i < batch.count; i++) {
+		if (!BufferAppend(out, &job->result[i], sizeof(net_item_t)) ||
+			!BufferAppend(out, &job->data[(size_t)i * PROC_DATA_SIZE], job->result[i].size) ||
+			!BufferAppend(out, pad, NET_PAD(job->result[i].size) - job->result[i].size))
+			return FALSE;
+	}
+	header.size = (uint32_t)(out->len - sizeof(header));
+	memcpy(out->data, &header, sizeof(header));
+	*tasks += batch.count;
+	return TRUE;
+}
+
+BOOL RunAgent(pool_t* pool, const char* host, const char* port)
+{
+	WSADATA wsa;
+	SOCKET s = INVALID_SOCKET;
+	net_header_t header = { NET_HELLO, sizeof(net_hello_t) };
+	net_hello_t hello = { NET_MAGIC, PoolSize(pool) };
+	net_buffer_t in = { 0 }, out = { 0 };
+	net_job_t* job = NULL;
+	uint64_t tasks = 0;
+	BOOL r = FALSE;
+
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+		return FALSE;
+	job = (net_job_t*)calloc(1, sizeof(net_job_t));
+	if (job != NULL)
+		job->data = (uint8_t*)malloc((size_t)NET_MAX_BATCH * PROC_DATA_SIZE);
+	if ((job == NULL) || (job->data == NULL) || !BufferReserve(&in, NET_MAX_MESSAGE)) {
+		fprintf(stderr, "Could not alloc agent buffers.\n");
+		goto out;
+	}
+	s = ConnectCoordinator(host, port);
+	if (s == INVALID_SOCKET)
+		goto out;
+	SetNonBlocking(s, FALSE);
+	if (!SendAll(s, &header, sizeof(header)) || !SendAll(s, &hello, sizeof(hello)))
+		goto out;
+
+	// The coordinator keeps the next batches coming while we run this one
+	while (RecvAll(s, &header, sizeof(header)) && (header.size <= NET_MAX_MESSAGE) &&
+		RecvAll(s, in.data, header.size)) {
+		if (header.type == NET_DONE) {
+			fprintf(stderr, "Ran %llu tasks for %s:%s\n", tasks, host, port);
+			r = TRUE;
+			break;
+		}
+		if ((header.type != NET_BATCH) || !RunBatch(pool, job, in.data, header.size, &out, &tasks) ||
+			!SendAll(s, out.data, out.len))
+			break;
+	}
+	if (!r)
+		fprintf(stderr, "Lost the coordinator at %s:%s\n", host, port);
+
+out:
+	if (s != INVALID_SOCKET)
+		closesocket(s);
+	if (job != NULL)
+		free(job->data);
+	free(job);
+	free(in.data);
+	free(out.data);
+	WSACleanup();
+	return r;
+}
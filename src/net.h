@@ -0,0 +1,85 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Work distribution over TCP
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <stdint.h>
+
+#include "pool.h"
+#include "proc.h"
+
+// Maximum number of agents a coordinator serves at once, so that they fit a select() set with its listener
+#define NET_MAX_AGENTS		63
+// Tasks per batch, for each worker of the agent it goes to, and at most
+#define NET_BATCH_PER_WORKER	4
+#define NET_MAX_BATCH		256
+// Batches an agent gets ahead of the one it is running, so that it never waits on the network
+#define NET_PIPELINE		2
+// How long a run waits without any agent connected before it gives up (ms)
+#define NET_AGENT_TIMEOUT	30000
+
+typedef struct net_coordinator net_coordinator_t;
+
+/*
+ * Write task index of the work source into task, which has room for
+ * PROC_DATA_SIZE bytes, along with its size and the handler to run it with.
+ * Return FALSE to abort the run.
+ */
+typedef BOOL (*net_task_fn)(void* ctx, uint64_t index, uint32_t* handler, void* task, uint32_t* size);
+
+typedef struct {
+	uint64_t tasks;				// Completed, successfully or not
+	uint64_t failed;
+	uint64_t batches;
+	uint64_t steals;			// Times an agent took half of what was left to another
+	DWORD agents;				// That connected during the run
+	DWORD dropped;				// That went away before the end, with their batches going to the others
+	double seconds;
+} net_stats_t;
+
+/*
+ * Listen for agents on host:port, where host can be NULL for all the
+ * IPv4 interfaces and port can be "0" to get one from the system.
+ */
+extern net_coordinator_t* CreateCoordinator(const char* host, const char* port);
+extern void DestroyCoordinator(net_coordinator_t* nc);
+extern uint16_t CoordinatorPort(net_coordinator_t* nc);
+
+/*
+ * Run tasks [0, count) of the work source task_fn on the agents that connect to
+ * the coordinator, which can come and go during the run. Each agent gets a
+ * share of the tasks that have not been handed out, which it is sent in
+ * batches, NET_PIPELINE ahead, and once it runs out it steals half of what is
+ * left of the largest share. The batches of an agent that goes away go to the
+ * others. Results are reported through result_fn, with the index of the task
+ * as id, from the calling thread. Returns FALSE if the run was aborted or if
+ * there was no agent for NET_AGENT_TIMEOUT. stats can be NULL.
+ */
+extern BOOL RunCoordinator(net_coordinator_t* nc, uint64_t count, net_task_fn task_fn,
+	proc_result_fn result_fn, void* ctx, net_stats_t* stats);
+
+/*
+ * Connect to the coordinator at host:port, retrying for a while if it isn't
+ * up yet, and run the tasks it sends on the workers of pool, with the handlers
+ * registered through RegisterProcHandler(), until it has no more. As the tasks
+ * of a batch run concurrently, these handlers must be reentrant.
+ */
+extern BOOL RunAgent(pool_t* pool, const char* host, const char* port);
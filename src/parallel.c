@@ -0,0 +1,181 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Embeddable C API for the thread pool
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "parallel.h"
+
+// Size of parallel_stats_t in the first version of the API, which is the least we fill
+#define PARALLEL_STATS_MIN_SIZE	(sizeof(uint32_t) * 2 + sizeof(uint64_t) * 5)
+
+// Only ever handed out by pointer, so that pool_group_t can change
+struct parallel_group {
+	pool_group_t group;		// Must come first, for parallel_scope()
+};
+
+uint32_t parallel_version(void)
+{
+	return PARALLEL_API_VERSION;
+}
+
+parallel_pool_t* parallel_create(uint32_t num_workers, uint32_t flags)
+{
+	pool_t* pool;
+	DWORD_PTR* affinity = NULL;
+	DWORD_PTR process_affinity, system_affinity, mask;
+	uint32_t i, num_cpus = 0;
+
+	if (!GetProcessAffinityMask(GetCurrentProcess(), &process_affinity, &system_affinity))
+		process_affinity = 0;
+	for (mask = process_affinity; mask != 0; mask &= mask - 1)
+		num_cpus++;
+	if (num_workers == 0)
+		num_workers = (num_cpus == 0) ? 1 : num_cpus;
+	if (num_workers > MAXIMUM_WAIT_OBJECTS)
+		num_workers = MAXIMUM_WAIT_OBJECTS;
+
+	// Spread the affinity evenly, going round if there are more workers than processors
+	if ((flags & PARALLEL_PIN_WORKERS) && (num_cpus != 0)) {
+		affinity = (DWORD_PTR*)calloc(num_workers, sizeof(DWORD_PTR));
+		if (affinity == NULL)
+			return NULL;
+		for (i = 0, mask = process_affinity; i < num_workers; i++) {
+			if (mask == 0)
+				mask = process_affinity;
+			affinity[i] = mask & (~mask + 1);
+			mask ^= affinity[i];
+		}
+	}
+
+	pool = CreatePool(num_workers, affinity);
+	free(affinity);
+	return pool;
+}
+
+void parallel_destroy(parallel_pool_t* pool)
+{
+	DestroyPool(pool);
+}
+
+uint32_t parallel_size(parallel_pool_t* pool)
+{
+	return PoolSize(pool);
+}
+
+void parallel_cancel(parallel_pool_t* pool)
+{
+	CancelPool(pool);
+}
+
+parallel_group_t* parallel_group_create(void)
+{
+	parallel_group_t* group = (parallel_group_t*)calloc(1, sizeof(parallel_group_t));
+
+	if ((group != NULL) && !InitTaskGroup(&group->group)) {
+		free(group);
+		group = NULL;
+	}
+	return group;
+}
+
+void parallel_group_destroy(parallel_group_t* group)
+{
+	if (group == NULL)
+		return;
+	CloseTaskGroup(&group->group);
+	free(group);
+}
+
+void parallel_group_cancel(parallel_group_t* group)
+{
+	CancelTaskGroup(&group->group);
+}
+
+int parallel_cancelled(parallel_pool_t* pool, parallel_group_t* group)
+{
+	return TaskCancelled(pool, (group == NULL) ? NULL : &group->group);
+}
+
+parallel_group_t* parallel_scope(parallel_group_t* group)
+{
+	// Only we set scopes, so the previous one is either NULL or one of our groups
+	return (parallel_group_t*)SetTaskScope((group == NULL) ? NULL : &group->group);
+}
+
+int parallel_submit(parallel_pool_t* pool, parallel_group_t* group, parallel_task_fn fn, void* ctx)
+{
+	return SubmitTask(pool, (group == NULL) ? NULL : &group->group, fn, ctx);
+}
+
+int parallel_wait(parallel_pool_t* pool, parallel_group_t* group)
+{
+	return WaitTaskGroup(pool, &group->group);
+}
+
+int parallel_for(parallel_pool_t* pool, uint64_t begin, uint64_t end, uint64_t grain,
+	parallel_range_fn fn, void* ctx)
+{
+	return ParallelFor(pool, begin, end, grain, fn, ctx);
+}
+
+int parallel_find(parallel_pool_t* pool, uint64_t begin, uint64_t end, uint64_t grain,
+	parallel_find_fn fn, void* ctx, int lowest, uint64_t* index)
+{
+	return ParallelFind(pool, begin, end, grain, fn, ctx, lowest, index);
+}
+
+// parallel_box_t is laid out the same as pool_box_t, so that the tile functions can be passed through
+int parallel_for_2d(parallel_pool_t* pool, const parallel_box_t* box, uint32_t item_size,
+	parallel_tile_fn fn, void* ctx)
+{
+	return ParallelFor2D(pool, (const pool_box_t*)box, item_size, (pool_tile_fn)fn, ctx);
+}
+
+int parallel_for_3d(parallel_pool_t* pool, const parallel_box_t* box, uint32_t item_size,
+	parallel_tile_fn fn, void* ctx)
+{
+	return ParallelFor3D(pool, (const pool_box_t*)box, item_size, (pool_tile_fn)fn, ctx);
+}
+
+int parallel_stats(parallel_pool_t* pool, parallel_stats_t* stats)
+{
+	parallel_stats_t s;
+	pool_stats_t ps;
+
+	if (stats->size < PARALLEL_STATS_MIN_SIZE)
+		return 0;
+	GetPoolStats(pool, &ps);
+	s.size = stats->size;
+	s.workers = ps.workers;
+	s.submitted = ps.submitted;
+	s.completed = ps.completed;
+	s.helped = ps.helped;
+	s.queued = ps.queued;
+	s.queue_peak = ps.queue_peak;
+	// Older applications get the fields they know about, newer ones get their size back
+	memcpy(stats, &s, min(stats->size, sizeof(s)));
+	stats->size = (uint32_t)min(stats->size, sizeof(s));
+	return 1;
+}
@@ -0,0 +1,157 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Embeddable C API for the thread pool
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is the only header applications that link with base-parallel-lib.lib,
+ * or with base-parallel-dll.dll (with PARALLEL_DLL defined), need. Unlike
+ * pool.h, its types are opaque and it does not pull windows.h, so that the
+ * pool can change without breaking applications built against an earlier
+ * version: functions only ever get added, and parallel_stats_t only grows
+ * at the end, with its size telling the library how much it can fill.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define PARALLEL_API_VERSION	3
+
+#if defined(PARALLEL_DLL)
+#if defined(PARALLEL_EXPORTS)
+#define PARALLEL_API		__declspec(dllexport)
+#else
+#define PARALLEL_API		__declspec(dllimport)
+#endif
+#else
+#define PARALLEL_API
+#endif
+
+// Flags for parallel_create()
+#define PARALLEL_PIN_WORKERS	0x00000001	// One worker per logical processor of the process
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct pool parallel_pool_t;
+typedef struct parallel_group parallel_group_t;
+
+// A task gets called with its context and the index of the worker running it
+typedef void (*parallel_task_fn)(void* ctx, uint32_t worker);
+// A range function processes items [begin, end)
+typedef void (*parallel_range_fn)(void* ctx, uint32_t worker, uint64_t begin, uint64_t end);
+// Search items [begin, end), and return nonzero after setting index to the first match, if any
+typedef int (*parallel_find_fn)(void* ctx, uint32_t worker, uint64_t begin, uint64_t end, uint64_t* index);
+
+// Items [begin[i], end[i]) along each dimension, x first, with [0, 1) for the ones that aren't used
+typedef struct {
+	uint64_t begin[3];
+	uint64_t end[3];
+} parallel_box_t;
+// A tile function processes the items of a box
+typedef void (*parallel_tile_fn)(void* ctx, uint32_t worker, const parallel_box_t* tile);
+
+typedef struct {
+	uint32_t size;				// Set to sizeof(parallel_stats_t) by the caller
+	uint32_t workers;
+	uint64_t submitted;
+	uint64_t completed;
+	uint64_t helped;			// Run by workers waiting on a group
+	uint64_t queued;			// Submitted, but not picked up yet
+	uint64_t queue_peak;
+} parallel_stats_t;
+
+// PARALLEL_API_VERSION of the library, which can be newer than the one the application was built with
+PARALLEL_API uint32_t parallel_version(void);
+
+/*
+ * Create a pool of num_workers, or of one worker per logical processor of
+ * the process if 0. Returns NULL on error.
+ */
+PARALLEL_API parallel_pool_t* parallel_create(uint32_t num_workers, uint32_t flags);
+PARALLEL_API void parallel_destroy(parallel_pool_t* pool);
+PARALLEL_API uint32_t parallel_size(parallel_pool_t* pool);
+// Cancel everything that runs on the pool, for good
+PARALLEL_API void parallel_cancel(parallel_pool_t* pool);
+
+/*
+ * Groups of tasks that can be waited on or cancelled together. A group gets
+ * cancelled along with the scope it was created in, if any.
+ */
+PARALLEL_API parallel_group_t* parallel_group_create(void);
+PARALLEL_API void parallel_group_destroy(parallel_group_t* group);
+PARALLEL_API void parallel_group_cancel(parallel_group_t* group);
+// Returns non-zero if the pool, group or one of the groups it was created in got cancelled
+PARALLEL_API int parallel_cancelled(parallel_pool_t* pool, parallel_group_t* group);
+
+/*
+ * Make group the cancellation scope of the calling thread, returning the
+ * previous one (NULL to leave it). Groups created from this thread, and from
+ * the tasks it submits, down to their own tasks, get cancelled when the scope
+ * does, so that independent jobs can share a pool and be cancelled on their
+ * own. The scope must outlive the work that gets started in it.
+ */
+PARALLEL_API parallel_group_t* parallel_scope(parallel_group_t* group);
+
+/*
+ * Queue a task, with group NULL for fire and forget. Tasks can only be added
+ * to a group by its owner, before it calls parallel_wait(), or by tasks of
+ * the same group. Tasks can submit and wait for other tasks. Both return 0
+ * on error, with parallel_wait() also returning 0 if the group got cancelled.
+ */
+PARALLEL_API int parallel_submit(parallel_pool_t* pool, parallel_group_t* group, parallel_task_fn fn, void* ctx);
+PARALLEL_API int parallel_wait(parallel_pool_t* pool, parallel_group_t* group);
+
+/*
+ * Split [begin, end) into chunks of grain items (0 to pick a default) that
+ * the workers grab as they go, and wait for all of them to be processed.
+ * Returns 0 on error, or if the pool or the scope of the caller got cancelled.
+ */
+PARALLEL_API int parallel_for(parallel_pool_t* pool, uint64_t begin, uint64_t end, uint64_t grain,
+	parallel_range_fn fn, void* ctx);
+
+/*
+ * Same as the above, for a search that stops within a chunk of a match
+ * being found. If lowest is nonzero, index gets the lowest match, as only
+ * the chunks after it get skipped, otherwise it gets whichever is found
+ * first. index is set to end if there is no match. Since version 2.
+ */
+PARALLEL_API int parallel_find(parallel_pool_t* pool, uint64_t begin, uint64_t end, uint64_t grain,
+	parallel_find_fn fn, void* ctx, int lowest, uint64_t* index);
+
+/*
+ * Split a 2D or 3D box of items of item_size bytes into tiles, sized after
+ * the L1 and L2 data caches, and wait for all of them to be processed. The
+ * tiles go along a Morton curve, in one stretch per worker, so that each
+ * worker gets tiles that are next to each other, and the same ones from
+ * one call to the next. Returns 0 on error, or if the pool or the scope of
+ * the caller got cancelled. Since version 3.
+ */
+PARALLEL_API int parallel_for_2d(parallel_pool_t* pool, const parallel_box_t* box, uint32_t item_size,
+	parallel_tile_fn fn, void* ctx);
+PARALLEL_API int parallel_for_3d(parallel_pool_t* pool, const parallel_box_t* box, uint32_t item_size,
+	parallel_tile_fn fn, void* ctx);
+
+// Fill stats, up to stats->size. Returns 0 if stats->size is too small.
+PARALLEL_API int parallel_stats(parallel_pool_t* pool, parallel_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,507 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * C++17 parallel algorithms on the thread pool
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Header only, on top of the C API of parallel.h, so that C++ applications
+ * that link with the library can run the usual algorithms on its workers:
+ *
+ *   parallel::pool_policy par(pool);
+ *   parallel::sort(par, v.begin(), v.end());
+ *   auto sum = parallel::transform_reduce(par, v.begin(), v.end(), 0.0, std::plus<>(), f);
+ *
+ * The standard library only takes its own execution policies, so these have
+ * the same signatures as the std:: overloads, in their own namespace. As with
+ * std::execution::par, an exception that escapes an element function calls
+ * std::terminate(), since it can't unwind through the workers. The pool or
+ * scope of the caller getting cancelled throws parallel::cancelled.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "parallel.h"
+
+namespace parallel {
+
+// Below this many items, algorithms don't bother with the workers
+constexpr uint64_t sequential_threshold = 2048;
+// How many blocks per worker the algorithms that need fixed blocks aim for
+constexpr uint64_t blocks_per_worker = 4;
+
+class cancelled : public std::runtime_error {
+public:
+	cancelled() : std::runtime_error("parallel algorithm cancelled") {}
+};
+
+// Run algorithms on pool, with chunks of grain items (0 to let the pool pick)
+class pool_policy {
+public:
+	explicit pool_policy(parallel_pool_t* pool, uint64_t grain = 0) : pool_(pool), grain_(grain) {}
+	pool_policy with_grain(uint64_t grain) const { return pool_policy(pool_, grain); }
+	parallel_pool_t* pool() const { return pool_; }
+	uint64_t grain() const { return grain_; }
+	uint32_t size() const { return parallel_size(pool_); }
+
+private:
+	parallel_pool_t* pool_;
+	uint64_t grain_;
+};
+
+namespace detail {
+
+template<class It>
+using difference_t = typename std::iterator_traits<It>::difference_type;
+template<class It>
+using value_t = typename std::iterator_traits<It>::value_type;
+
+template<class It>
+constexpr void check_iterator()
+{
+	static_assert(std::is_base_of_v<std::random_access_iterator_tag,
+		typename std::iterator_traits<It>::iterator_category>,
+		"parallel algorithms need random access iterators");
+}
+
+// Call fn(worker, begin, end) over chunks of [0, n), on the workers
+template<class F>
+void for_range(const pool_policy& policy, uint64_t n, uint64_t grain, F fn)
+{
+	auto range = [](void* ctx, uint32_t worker, uint64_t begin, uint64_t end) noexcept {
+		(*static_cast<F*>(ctx))(worker, begin, end);
+	};
+
+	if (!parallel_for(policy.pool(), 0, n, grain, range, &fn))
+		throw cancelled();
+}
+
+template<class F>
+void for_range(const pool_policy& policy, uint64_t n, F fn)
+{
+	for_range(policy, n, policy.grain(), std::move(fn));
+}
+
+// Lowest i of [0, n) for which fn(i) is true, or n, with the workers skipping the chunks past it
+template<class F>
+uint64_t find_range(const pool_policy& policy, uint64_t n, F fn)
+{
+	auto find = [](void* ctx, uint32_t, uint64_t begin, uint64_t end, uint64_t* index) noexcept -> int {
+		for (uint64_t i = begin; i < end; i++) {
+			if ((*static_cast<F*>(ctx))(i)) {
+				*index = i;
+				return 1;
+			}
+		}
+		return 0;
+	};
+	uint64_t index;
+
+	if (!parallel_find(policy.pool(), 0, n, policy.grain(), find, &fn, 1, &index))
+		throw cancelled();
+	return index;
+}
+
+// Whether n items are worth sending to the workers
+inline bool sequential(const pool_policy& policy, uint64_t n)
+{
+	return (n < sequential_threshold) || (policy.size() <= 1);
+}
+
+// Fixed blocks of [0, n), for the algorithms that combine results in order
+inline uint64_t num_blocks(const pool_policy& policy, uint64_t n)
+{
+	return std::min<uint64_t>(n, (uint64_t)policy.size() * blocks_per_worker);
+}
+
+inline uint64_t block_start(uint64_t n, uint64_t blocks, uint64_t b)
+{
+	return (n / blocks) * b + std::min(b, n % blocks);
+}
+
+// One partial result per worker, each on a cache line of its own
+template<class T>
+struct alignas(64) partial {
+	std::optional<T> value;
+};
+
+// Reduce map(i) for i in [0, n) into init, with per worker partials
+template<class T, class BinaryOp, class Map>
+T reduce_indexes(const pool_policy& policy, uint64_t n, T init, BinaryOp& op, Map map)
+{
+	if (sequential(policy, n)) {
+		for (uint64_t i = 0; i < n; i++)
+			init = op(std::move(init), map(i));
+		return init;
+	}
+
+	std::vector<partial<T>> partials(policy.size());
+	for_range(policy, n, [&partials, &op, &map](uint32_t worker, uint64_t begin, uint64_t end) {
+		// Only merge once the chunk is done, in case an element function nests
+		// parallel algorithms, as the worker can run our other chunks meanwhile.
+		T sum = map(begin);
+		for (uint64_t i = begin + 1; i < end; i++)
+			sum = op(std::move(sum), map(i));
+		std::optional<T>& p = partials[worker].value;
+		if (p.has_value())
+			*p = op(std::move(*p), std::move(sum));
+		else
+			p.emplace(std::move(sum));
+	});
+	for (auto& p : partials) {
+		if (p.value.has_value())
+			init = op(std::move(init), std::move(*p.value));
+	}
+	return init;
+}
+
+// Position in a, for the merge of a and b, stable, of output position d
+template<class It, class Compare>
+difference_t<It> co_rank(difference_t<It> d, It a, difference_t<It> na, It b, difference_t<It> nb, Compare comp)
+{
+	difference_t<It> lo = std::max<difference_t<It>>(0, d - nb), hi = std::min(d, na), mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (comp(b[d - mid - 1], a[mid]))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+// std::merge, moving the items, with comp seeing them as lvalues
+template<class It, class OutIt, class Compare>
+OutIt move_merge(It a, It a_end, It b, It b_end, OutIt out, Compare& comp)
+{
+	for (; (a != a_end) && (b != b_end); ++out) {
+		if (comp(*b, *a))
+			*out = std::move(*b++);
+		else
+			*out = std::move(*a++);
+	}
+	out = std::move(a, a_end, out);
+	return std::move(b, b_end, out);
+}
+
+}	// namespace detail
+
+template<class It, class F>
+void for_each(const pool_policy& policy, It first, It last, F f)
+{
+	detail::check_iterator<It>();
+	uint64_t n = (uint64_t)(last - first);
+
+	if (detail::sequential(policy, n)) {
+		std::for_each(first, last, f);
+		return;
+	}
+	detail::for_range(policy, n, [first, &f](uint32_t, uint64_t begin, uint64_t end) {
+		for (uint64_t i = begin; i < end; i++)
+			f(first[(detail::difference_t<It>)i]);
+	});
+}
+
+template<class It, class Size, class F>
+It for_each_n(const pool_policy& policy, It first, Size n, F f)
+{
+	if (n <= 0)
+		return first;
+	parallel::for_each(policy, first, first + n, std::move(f));
+	return first + n;
+}
+
+template<class It, class Pred>
+It find_if(const pool_policy& policy, It first, It last, Pred pred)
+{
+	detail::check_iterator<It>();
+	uint64_t n = (uint64_t)(last - first);
+
+	if (detail::sequential(policy, n))
+		return std::find_if(first, last, pred);
+	return first + (detail::difference_t<It>)detail::find_range(policy, n, [first, &pred](uint64_t i) {
+		return (bool)pred(first[(detail::difference_t<It>)i]);
+	});
+}
+
+template<class It, class Pred>
+It find_if_not(const pool_policy& policy, It first, It last, Pred pred)
+{
+	return parallel::find_if(policy, first, last, [&pred](const auto& v) { return !pred(v); });
+}
+
+template<class It, class T>
+It find(const pool_policy& policy, It first, It last, const T& value)
+{
+	return parallel::find_if(policy, first, last, [&value](const auto& v) { return v == value; });
+}
+
+template<class It, class OutIt, class UnaryOp>
+OutIt transform(const pool_policy& policy, It first, It last, OutIt d_first, UnaryOp op)
+{
+	detail::check_iterator<It>();
+	detail::check_iterator<OutIt>();
+	uint64_t n = (uint64_t)(last - first);
+
+	if (detail::sequential(policy, n))
+		return std::transform(first, last, d_first, op);
+	detail::for_range(policy, n, [first, d_first, &op](uint32_t, uint64_t begin, uint64_t end) {
+		for (uint64_t i = begin; i < end; i++)
+			d_first[(detail::difference_t<OutIt>)i] = op(first[(detail::difference_t<It>)i]);
+	});
+	return d_first + (detail::difference_t<OutIt>)n;
+}
+
+template<class It1, class It2, class OutIt, class BinaryOp>
+OutIt transform(const pool_policy& policy, It1 first1, It1 last1, It2 first2, OutIt d_first, BinaryOp op)
+{
+	detail::check_iterator<It1>();
+	detail::check_iterator<It2>();
+	detail::check_iterator<OutIt>();
+	uint64_t n = (uint64_t)(last1 - first1);
+
+	if (detail::sequential(policy, n))
+		return std::transform(first1, last1, first2, d_first, op);
+	detail::for_range(policy, n, [first1, first2, d_first, &op](uint32_t, uint64_t begin, uint64_t end) {
+		for (uint64_t i = begin; i < end; i++)
+			d_first[(detail::difference_t<OutIt>)i] = op(first1[(detail::difference_t<It1>)i],
+				first2[(detail::difference_t<It2>)i]);
+	});
+	return d_first + (detail::difference_t<OutIt>)n;
+}
+
+/*
+ * As with std::transform_reduce, reduce_op must be associative and
+ * commutative, since chunks get combined in whatever order the workers
+ * get to them.
+ */
+template<class It, class T, class BinaryReduceOp, class UnaryTransformOp>
+T transform_reduce(const pool_policy& policy, It first, It last, T init,
+	BinaryReduceOp reduce_op, UnaryTransformOp transform_op)
+{
+	detail::check_iterator<It>();
+	return detail::reduce_indexes(policy, (uint64_t)(last - first), std::move(init), reduce_op,
+		[first, &transform_op](uint64_t i) { return transform_op(first[(detail::difference_t<It>)i]); });
+}
+
+template<class It1, class It2, class T, class BinaryReduceOp, class BinaryTransformOp>
+T transform_reduce(const pool_policy& policy, It1 first1, It1 last1, It2 first2, T init,
+	BinaryReduceOp reduce_op, BinaryTransformOp transform_op)
+{
+	detail::check_iterator<It1>();
+	detail::check_iterator<It2>();
+	return detail::reduce_indexes(policy, (uint64_t)(last1 - first1), std::move(init), reduce_op,
+		[first1, first2, &transform_op](uint64_t i) {
+			return transform_op(first1[(detail::difference_t<It1>)i], first2[(detail::difference_t<It2>)i]);
+		});
+}
+
+template<class It1, class It2, class T>
+T transform_reduce(const pool_policy& policy, It1 first1, It1 last1, It2 first2, T init)
+{
+	return parallel::transform_reduce(policy, first1, last1, first2, std::move(init),
+		std::plus<>(), std::multiplies<>());
+}
+
+template<class It, class T, class BinaryOp>
+T reduce(const pool_policy& policy, It first, It last, T init, BinaryOp op)
+{
+	detail::check_iterator<It>();
+	return detail::reduce_indexes(policy, (uint64_t)(last - first), std::move(init), op,
+		[first](uint64_t i) -> decltype(auto) { return first[(detail::difference_t<It>)i]; });
+}
+
+template<class It, class T>
+T reduce(const pool_policy& policy, It first, It last, T init)
+{
+	return parallel::reduce(policy, first, last, std::move(init), std::plus<>());
+}
+
+template<class It>
+detail::value_t<It> reduce(const pool_policy& policy, It first, It last)
+{
+	return parallel::reduce(policy, first, last, detail::value_t<It>(), std::plus<>());
+}
+
+/*
+ * Two passes over fixed blocks: the sum of each block, which the caller
+ * scans, then the scan of each block from the sum of the ones before it.
+ * op only needs to be associative, and d_first can be first.
+ */
+template<class It, class OutIt, class BinaryOp, class T>
+OutIt inclusive_scan(const pool_policy& policy, It first, It last, OutIt d_first, BinaryOp op, T init)
+{
+	detail::check_iterator<It>();
+	detail::check_iterator<OutIt>();
+	uint64_t n = (uint64_t)(last - first);
+
+	if (detail::sequential(policy, n)) {
+		for (; first != last; ++first, ++d_first) {
+			init = op(std::move(init), *first);
+			*d_first = init;
+		}
+		return d_first;
+	}
+
+	uint64_t blocks = detail::num_blocks(policy, n);
+	std::vector<std::optional<T>> sums(blocks);
+	detail::for_range(policy, blocks, 1, [first, n, blocks, &sums, &op](uint32_t, uint64_t begin, uint64_t end) {
+		for (uint64_t b = begin; b < end; b++) {
+			uint64_t i = detail::block_start(n, blocks, b), j = detail::block_start(n, blocks, b + 1);
+			T sum = first[(detail::difference_t<It>)i];
+			for (i++; i < j; i++)
+				sum = op(std::move(sum), first[(detail::difference_t<It>)i]);
+			sums[b].emplace(std::move(sum));
+		}
+	});
+	// Turn the block sums into the carry each block starts from
+	for (auto& s : sums) {
+		T carry = op(init, *s);
+		*s = std::move(init);
+		init = std::move(carry);
+	}
+	detail::for_range(policy, blocks, 1, [first, d_first, n, blocks, &sums, &op](uint32_t, uint64_t begin, uint64_t end) {
+		for (uint64_t b = begin; b < end; b++) {
+			uint64_t i = detail::block_start(n, blocks, b), j = detail::block_start(n, blocks, b + 1);
+			T sum = std::move(*sums[b]);
+			for (; i < j; i++) {
+				sum = op(std::move(sum), first[(detail::difference_t<It>)i]);
+				d_first[(detail::difference_t<OutIt>)i] = sum;
+			}
+		}
+	});
+	return d_first + (detail::difference_t<OutIt>)n;
+}
+
+template<class It, class OutIt, class BinaryOp>
+OutIt inclusive_scan(const pool_policy& policy, It first, It last, OutIt d_first, BinaryOp op)
+{
+	detail::check_iterator<It>();
+	if (first == last)
+		return d_first;
+	// The first element is the init of the rest
+	detail::value_t<It> init = *first;
+	*d_first = init;
+	return parallel::inclusive_scan(policy, first + 1, last, d_first + 1, std::move(op), std::move(init));
+}
+
+template<class It, class OutIt>
+OutIt inclusive_scan(const pool_policy& policy, It first, It last, OutIt d_first)
+{
+	return parallel::inclusive_scan(policy, first, last, d_first, std::plus<>());
+}
+
+/*
+ * Sort fixed blocks on the workers, then merge them in pairs, between the
+ * range and a buffer, until one is left. Every merge gets split at even
+ * output positions, so that the last rounds, with few pairs left, still
+ * keep all the workers busy. Stable, as a bonus.
+ */
+template<class It, class Compare>
+void sort(const pool_policy& policy, It first, It last, Compare comp)
+{
+	detail::check_iterator<It>();
+	using diff_t = detail::difference_t<It>;
+	using value_t = detail::value_t<It>;
+	uint64_t n = (uint64_t)(last - first);
+
+	// Stable on every path, so that it doesn't depend on the size or the pool
+	if (detail::sequential(policy, n)) {
+		std::stable_sort(first, last, comp);
+		return;
+	}
+
+	uint64_t blocks = detail::num_blocks(policy, n);
+	std::vector<uint64_t> bounds(blocks + 1);
+	for (uint64_t b = 0; b <= blocks; b++)
+		bounds[b] = detail::block_start(n, blocks, b);
+	detail::for_range(policy, blocks, 1, [first, &bounds, &comp](uint32_t, uint64_t begin, uint64_t end) {
+		for (uint64_t b = begin; b < end; b++)
+			std::stable_sort(first + (diff_t)bounds[b], first + (diff_t)bounds[b + 1], comp);
+	});
+	if (blocks == 1)
+		return;
+
+	std::vector<value_t> buffer(std::make_move_iterator(first), std::make_move_iterator(last));
+	bool in_buffer = true;
+	// Output pieces of a round, as many as the blocks we started with
+	uint64_t piece = (n + blocks - 1) / blocks;
+	struct merge_piece {
+		uint64_t lo, mid, hi;	// The runs being merged, [lo, mid) and [mid, hi)
+		uint64_t begin, end;	// The part of the output this piece writes
+	};
+	std::vector<merge_piece> pieces;
+
+	while (bounds.size() > 2) {
+		std::vector<uint64_t> next;
+		pieces.clear();
+		for (size_t r = 0; r + 1 < bounds.size(); r += 2) {
+			uint64_t lo = bounds[r], mid = bounds[r + 1];
+			uint64_t hi = (r + 2 < bounds.size()) ? bounds[r + 2] : mid;
+			next.push_back(lo);
+			for (uint64_t d = lo; d < hi; d += piece)
+				pieces.push_back({ lo, mid, hi, d, std::min(d + piece, hi) });
+		}
+		next.push_back(n);
+
+		auto merge = [&](auto src, auto dst) {
+			detail::for_range(policy, pieces.size(), 1, [&pieces, src, dst, &comp](uint32_t, uint64_t begin, uint64_t end) {
+				for (uint64_t p = begin; p < end; p++) {
+					const merge_piece& m = pieces[p];
+					auto a = src + (diff_t)m.lo, b = src + (diff_t)m.mid;
+					diff_t na = (diff_t)(m.mid - m.lo), nb = (diff_t)(m.hi - m.mid);
+					diff_t i = detail::co_rank((diff_t)(m.begin - m.lo), a, na, b, nb, comp);
+					diff_t j = detail::co_rank((diff_t)(m.end - m.lo), a, na, b, nb, comp);
+					detail::move_merge(a + i, a + j, b + ((diff_t)(m.begin - m.lo) - i),
+						b + ((diff_t)(m.end - m.lo) - j), dst + (diff_t)m.begin, comp);
+				}
+			});
+		};
+		if (in_buffer)
+			merge(buffer.begin(), first);
+		else
+			merge(first, buffer.begin());
+		in_buffer = !in_buffer;
+		bounds.swap(next);
+	}
+
+	if (in_buffer) {
+		auto src = buffer.begin();
+		detail::for_range(policy, n, [src, first](uint32_t, uint64_t begin, uint64_t end) {
+			std::move(src + (diff_t)begin, src + (diff_t)end, first + (diff_t)begin);
+		});
+	}
+}
+
+template<class It>
+void sort(const pool_policy& policy, It first, It last)
+{
+	parallel::sort(policy, first, last, std::less<>());
+}
+
+}	// namespace parallel
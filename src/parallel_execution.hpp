@@ -0,0 +1,557 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Sender/receiver scheduler on the thread pool
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Header only, on top of the C API of parallel.h, following the model of
+ * P2300 (std::execution) closely enough for code written against it to be
+ * ported by changing the namespace:
+ *
+ *   parallel::execution::scheduler sch(pool);
+ *   auto work = sch.schedule()
+ *             | parallel::execution::bulk(n, [&](uint64_t i) { out[i] = f(in[i]); })
+ *             | parallel::execution::then([&] { return reduce(out); });
+ *   auto [sum] = parallel::execution::sync_wait(std::move(work)).value();
+ *
+ * As C++17 has neither concepts nor tag_invoke, the customization points
+ * are members: a sender has connect(receiver) and a value_types alias, its
+ * operation state has start(), and a receiver has set_value(), set_error()
+ * (with a std::exception_ptr) and set_stopped(). Each sender completes with
+ * a single set of values, and with set_stopped() if the pool got cancelled.
+ *
+ * bulk() runs its function over ranges of indexes, through parallel_for(),
+ * rather than as one task per index, on the thread that completed the
+ * sender before it, which is a worker for anything that started from
+ * schedule(). A bulk function that throws cancels the ranges not started.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "parallel.h"
+
+namespace parallel {
+namespace execution {
+
+class scheduler;
+
+namespace detail {
+
+// Operation states get pointed to by the receivers of their children
+struct immovable {
+	immovable() = default;
+	immovable(immovable&&) = delete;
+	immovable& operator=(immovable&&) = delete;
+};
+
+template<class S, template<class...> class Tuple>
+using value_types_of_t = typename std::decay_t<S>::template value_types<Tuple>;
+
+template<class S, class R>
+using connect_result_t = decltype(std::declval<S>().connect(std::declval<R>()));
+
+template<class... Ts>
+using decayed_tuple = std::tuple<std::decay_t<Ts>...>;
+
+template<template<class...> class Tuple, class T>
+struct rebind;
+template<template<class...> class Tuple, class... Ts>
+struct rebind<Tuple, std::tuple<Ts...>> {
+	using type = Tuple<Ts...>;
+};
+
+// What then() completes with, for a function returning T
+template<class T>
+struct then_values {
+	template<template<class...> class Tuple>
+	using type = Tuple<std::decay_t<T>>;
+};
+template<>
+struct then_values<void> {
+	template<template<class...> class Tuple>
+	using type = Tuple<>;
+};
+
+template<class F>
+struct invoke_result_of {
+	template<class... Ts>
+	using type = std::invoke_result_t<F&, Ts...>;
+};
+
+inline std::exception_ptr submit_error()
+{
+	return std::make_exception_ptr(std::runtime_error("could not submit to the pool"));
+}
+
+template<class T>
+struct sync_wait_state {
+	std::mutex lock;
+	std::condition_variable cv;
+	bool done = false;
+	std::optional<T> values;
+	std::exception_ptr error;
+};
+
+template<class State>
+struct sync_wait_receiver {
+	State* st;
+
+	void complete() noexcept
+	{
+		std::lock_guard<std::mutex> guard(st->lock);
+		st->done = true;
+		st->cv.notify_one();
+	}
+	template<class... Ts>
+	void set_value(Ts&&... vs) noexcept
+	{
+		st->values.emplace(std::forward<Ts>(vs)...);
+		complete();
+	}
+	void set_error(std::exception_ptr e) noexcept
+	{
+		st->error = std::move(e);
+		complete();
+	}
+	void set_stopped() noexcept { complete(); }
+};
+
+}	// namespace detail
+
+/*
+ * schedule()
+ */
+
+class schedule_sender {
+public:
+	template<template<class...> class Tuple>
+	using value_types = Tuple<>;
+
+	explicit schedule_sender(parallel_pool_t* pool, uint64_t grain) : pool_(pool), grain_(grain) {}
+	inline scheduler get_scheduler() const;
+
+	template<class R>
+	struct operation : detail::immovable {
+		parallel_pool_t* pool;
+		R r;
+
+		operation(parallel_pool_t* pool, R r) : pool(pool), r(std::move(r)) {}
+		void start() noexcept
+		{
+			if (!parallel_submit(pool, nullptr, run, this))
+				r.set_error(detail::submit_error());
+		}
+		static void run(void* ctx, uint32_t) noexcept
+		{
+			operation* op = static_cast<operation*>(ctx);
+
+			if (parallel_cancelled(op->pool, nullptr))
+				op->r.set_stopped();
+			else
+				op->r.set_value();
+		}
+	};
+
+	template<class R>
+	operation<R> connect(R r) const
+	{
+		return operation<R>(pool_, std::move(r));
+	}
+
+private:
+	parallel_pool_t* pool_;
+	uint64_t grain_;
+};
+
+// Schedules on pool, with bulk() using chunks of grain indexes (0 to let the pool pick)
+class scheduler {
+public:
+	explicit scheduler(parallel_pool_t* pool, uint64_t grain = 0) : pool_(pool), grain_(grain) {}
+	schedule_sender schedule() const { return schedule_sender(pool_, grain_); }
+	parallel_pool_t* pool() const { return pool_; }
+	uint64_t grain() const { return grain_; }
+	bool operator==(const scheduler& other) const { return pool_ == other.pool_; }
+	bool operator!=(const scheduler& other) const { return pool_ != other.pool_; }
+
+private:
+	parallel_pool_t* pool_;
+	uint64_t grain_;
+};
+
+inline scheduler schedule_sender::get_scheduler() const
+{
+	return scheduler(pool_, grain_);
+}
+
+inline schedule_sender schedule(const scheduler& sch)
+{
+	return sch.schedule();
+}
+
+/*
+ * then()
+ */
+
+template<class S, class F>
+class then_sender {
+	using result_t = detail::value_types_of_t<S, detail::invoke_result_of<F>::template type>;
+
+public:
+	template<template<class...> class Tuple>
+	using value_types = typename detail::then_values<result_t>::template type<Tuple>;
+
+	then_sender(S s, F f) : s_(std::move(s)), f_(std::move(f)) {}
+	scheduler get_scheduler() const { return s_.get_scheduler(); }
+
+	template<class R>
+	struct receiver {
+		R* r;
+		F* f;
+
+		template<class... Ts>
+		void set_value(Ts&&... vs) noexcept
+		{
+			if constexpr (std::is_void_v<result_t>) {
+				try {
+					(*f)(std::forward<Ts>(vs)...);
+				} catch (...) {
+					r->set_error(std::current_exception());
+					return;
+				}
+				r->set_value();
+			} else {
+				std::optional<std::decay_t<result_t>> v;
+				try {
+					v.emplace((*f)(std::forward<Ts>(vs)...));
+				} catch (...) {
+					r->set_error(std::current_exception());
+					return;
+				}
+				r->set_value(std::move(*v));
+			}
+		}
+		void set_error(std::exception_ptr e) noexcept { r->set_error(std::move(e)); }
+		void set_stopped() noexcept { r->set_stopped(); }
+	};
+
+	template<class R>
+	struct operation : detail::immovable {
+		R r;
+		F f;
+		detail::connect_result_t<S, receiver<R>> op;
+
+		operation(S&& s, F f, R r) : r(std::move(r)), f(std::move(f)),
+			op(std::move(s).connect(receiver<R>{ &this->r, &this->f })) {}
+		void start() noexcept { op.start(); }
+	};
+
+	template<class R>
+	operation<R> connect(R r) &&
+	{
+		return operation<R>(std::move(s_), std::move(f_), std::move(r));
+	}
+
+private:
+	S s_;
+	F f_;
+};
+
+template<class F>
+struct then_closure {
+	F f;
+
+	template<class S>
+	friend then_sender<std::decay_t<S>, F> operator|(S&& s, then_closure c)
+	{
+		return then_sender<std::decay_t<S>, F>(std::forward<S>(s), std::move(c.f));
+	}
+};
+
+template<class S, class F>
+then_sender<std::decay_t<S>, std::decay_t<F>> then(S&& s, F&& f)
+{
+	return then_sender<std::decay_t<S>, std::decay_t<F>>(std::forward<S>(s), std::forward<F>(f));
+}
+
+template<class F>
+then_closure<std::decay_t<F>> then(F&& f)
+{
+	return then_closure<std::decay_t<F>>{ std::forward<F>(f) };
+}
+
+/*
+ * bulk()
+ */
+
+template<class S, class Shape, class F>
+class bulk_sender {
+public:
+	template<template<class...> class Tuple>
+	using value_types = detail::value_types_of_t<S, Tuple>;
+
+	bulk_sender(S s, Shape shape, F f) : s_(std::move(s)), shape_(shape), f_(std::move(f)) {}
+	scheduler get_scheduler() const { return s_.get_scheduler(); }
+
+	template<class R>
+	struct receiver {
+		R* r;
+		F* f;
+		Shape shape;
+		scheduler sch;
+
+		template<class... Ts>
+		void set_value(Ts&&... vs) noexcept
+		{
+			struct context {
+				F* f;
+				std::tuple<Ts&...> values;
+				parallel_group_t* group;
+				std::atomic_flag failed = ATOMIC_FLAG_INIT;
+				std::exception_ptr error;
+
+				context(F* f, Ts&... vs) : f(f), values(vs...), group(parallel_group_create()) {}
+			} ctx(f, vs...);
+			auto range = [](void* p, uint32_t, uint64_t begin, uint64_t end) noexcept {
+				context* c = static_cast<context*>(p);
+				try {
+					for (uint64_t i = begin; i < end; i++)
+						std::apply([&](auto&... v) { (*c->f)((Shape)i, v...); }, c->values);
+				} catch (...) {
+					if (!c->failed.test_and_set()) {
+						c->error = std::current_exception();
+						parallel_group_cancel(c->group);
+					}
+				}
+			};
+			parallel_group_t* scope;
+			int r_for;
+
+			if (ctx.group == nullptr) {
+				r->set_error(detail::submit_error());
+				return;
+			}
+			// The ranges get cancelled along with the scope we run them in
+			scope = parallel_scope(ctx.group);
+			r_for = parallel_for(sch.pool(), 0, (uint64_t)shape, sch.grain(), range, &ctx);
+			parallel_scope(scope);
+			parallel_group_destroy(ctx.group);
+			if (ctx.error)
+				r->set_error(std::move(ctx.error));
+			else if (!r_for)
+				r->set_stopped();
+			else
+				r->set_value(std::forward<Ts>(vs)...);
+		}
+		void set_error(std::exception_ptr e) noexcept { r->set_error(std::move(e)); }
+		void set_stopped() noexcept { r->set_stopped(); }
+	};
+
+	template<class R>
+	struct operation : detail::immovable {
+		R r;
+		F f;
+		detail::connect_result_t<S, receiver<R>> op;
+
+		operation(S&& s, Shape shape, F f, R r) : r(std::move(r)), f(std::move(f)),
+			op(std::move(s).connect(receiver<R>{ &this->r, &this->f, shape, s.get_scheduler() })) {}
+		void start() noexcept { op.start(); }
+	};
+
+	template<class R>
+	operation<R> connect(R r) &&
+	{
+		return operation<R>(std::move(s_), shape_, std::move(f_), std::move(r));
+	}
+
+private:
+	S s_;
+	Shape shape_;
+	F f_;
+};
+
+template<class Shape, class F>
+struct bulk_closure {
+	Shape shape;
+	F f;
+
+	template<class S>
+	friend bulk_sender<std::decay_t<S>, Shape, F> operator|(S&& s, bulk_closure c)
+	{
+		return bulk_sender<std::decay_t<S>, Shape, F>(std::forward<S>(s), c.shape, std::move(c.f));
+	}
+};
+
+// Call f(i, values...) for i in [0, shape), on the workers of the scheduler of s
+template<class S, class Shape, class F>
+bulk_sender<std::decay_t<S>, Shape, std::decay_t<F>> bulk(S&& s, Shape shape, F&& f)
+{
+	static_assert(std::is_integral_v<Shape>, "bulk() needs an integral shape");
+	return bulk_sender<std::decay_t<S>, Shape, std::decay_t<F>>(std::forward<S>(s), shape, std::forward<F>(f));
+}
+
+template<class Shape, class F>
+bulk_closure<Shape, std::decay_t<F>> bulk(Shape shape, F&& f)
+{
+	static_assert(std::is_integral_v<Shape>, "bulk() needs an integral shape");
+	return bulk_closure<Shape, std::decay_t<F>>{ shape, std::forward<F>(f) };
+}
+
+/*
+ * when_all()
+ */
+
+template<class... Ss>
+class when_all_sender {
+	static_assert(sizeof...(Ss) != 0, "when_all() needs at least one sender");
+	using values_t = decltype(std::tuple_cat(std::declval<detail::value_types_of_t<Ss, detail::decayed_tuple>>()...));
+
+public:
+	// The values of all the senders, in order
+	template<template<class...> class Tuple>
+	using value_types = typename detail::rebind<Tuple, values_t>::type;
+
+	explicit when_all_sender(Ss... ss) : ss_(std::move(ss)...) {}
+	scheduler get_scheduler() const { return std::get<0>(ss_).get_scheduler(); }
+
+	template<class R>
+	struct operation;
+
+	template<class R, size_t I>
+	struct receiver {
+		operation<R>* op;
+
+		template<class... Ts>
+		void set_value(Ts&&... vs) noexcept
+		{
+			std::get<I>(op->values).emplace(std::forward<Ts>(vs)...);
+			op->arrive();
+		}
+		void set_error(std::exception_ptr e) noexcept
+		{
+			int ok = 0;
+			if (op->state.compare_exchange_strong(ok, 1))
+				op->error = std::move(e);
+			op->arrive();
+		}
+		void set_stopped() noexcept
+		{
+			int ok = 0;
+			op->state.compare_exchange_strong(ok, 2);
+			op->arrive();
+		}
+	};
+
+	// The operations of the senders from I on, which can't be moved into a tuple
+	template<class R, size_t I, class... Ts>
+	struct children {
+		children(operation<R>*) {}
+		void start() noexcept {}
+	};
+	template<class R, size_t I, class T, class... Ts>
+	struct children<R, I, T, Ts...> : children<R, I + 1, Ts...> {
+		detail::connect_result_t<T, receiver<R, I>> op;
+
+		children(operation<R>* parent, T&& s, Ts&&... ss) : children<R, I + 1, Ts...>(parent, std::move(ss)...),
+			op(std::move(s).connect(receiver<R, I>{ parent })) {}
+		void start() noexcept
+		{
+			op.start();
+			children<R, I + 1, Ts...>::start();
+		}
+	};
+
+	template<class R>
+	struct operation : detail::immovable {
+		R r;
+		std::tuple<std::optional<detail::value_types_of_t<Ss, detail::decayed_tuple>>...> values;
+		std::atomic<int> state{ 0 };		// 0 for values, 1 for error and 2 for stopped
+		std::atomic<size_t> remaining{ sizeof...(Ss) };
+		std::exception_ptr error;
+		children<R, 0, Ss...> ops;
+
+		operation(std::tuple<Ss...>&& ss, R r) : r(std::move(r)),
+			ops(std::apply([this](Ss&... s) { return children<R, 0, Ss...>(this, std::move(s)...); }, ss)) {}
+		void start() noexcept { ops.start(); }
+		void arrive() noexcept
+		{
+			if (remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+				return;
+			switch (state.load()) {
+			case 1:
+				r.set_error(std::move(error));
+				break;
+			case 2:
+				r.set_stopped();
+				break;
+			default:
+				std::apply([this](auto&&... v) { r.set_value(std::move(v)...); },
+					std::apply([](auto&... t) { return std::tuple_cat(std::move(*t)...); }, values));
+				break;
+			}
+		}
+	};
+
+	template<class R>
+	operation<R> connect(R r) &&
+	{
+		return operation<R>(std::move(ss_), std::move(r));
+	}
+
+private:
+	std::tuple<Ss...> ss_;
+};
+
+template<class... Ss>
+when_all_sender<std::decay_t<Ss>...> when_all(Ss&&... ss)
+{
+	return when_all_sender<std::decay_t<Ss>...>(std::forward<Ss>(ss)...);
+}
+
+/*
+ * sync_wait(), which blocks the calling thread, so it should not be called
+ * from a worker. Returns the values of s, or nothing if it got stopped, and
+ * rethrows its error.
+ */
+
+template<class S>
+std::optional<detail::value_types_of_t<S, detail::decayed_tuple>> sync_wait(S&& s)
+{
+	detail::sync_wait_state<detail::value_types_of_t<S, detail::decayed_tuple>> st;
+	auto op = std::decay_t<S>(std::forward<S>(s)).connect(detail::sync_wait_receiver<decltype(st)>{ &st });
+
+	op.start();
+	std::unique_lock<std::mutex> guard(st.lock);
+	st.cv.wait(guard, [&st] { return st.done; });
+	if (st.error)
+		std::rethrow_exception(st.error);
+	return std::move(st.values);
+}
+
+}	// namespace execution
+}	// namespace parallel
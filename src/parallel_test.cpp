@@ -0,0 +1,307 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Checks and timings of the C++ headers, against the standard library
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Nothing in the library is C++, so this is what gets the templates of
+ * parallel.hpp and parallel_execution.hpp compiled. It only uses parallel.h,
+ * like any application that links with base-parallel-lib, which means that
+ * it also builds with g++ and libstdc++, where std::execution::par runs on
+ * TBB:
+ *
+ *   g++ -std=c++17 -O2 parallel_test.cpp <library objects> -ltbb -lpthread
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <execution>
+#include <functional>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "parallel.hpp"
+#include "parallel_execution.hpp"
+
+namespace ex = parallel::execution;
+
+// Sizes to check, around the sequential threshold and the block boundaries
+static const size_t check_size[] = { 0, 1, 5, 2047, 2049, 3000, 100001, 1 << 22 };
+// Size of the timed runs, and how many of them to keep the best of
+#define TEST_TIME_SIZE		(1 << 24)
+#define TEST_RUNS			3
+
+typedef std::pair<uint32_t, uint32_t> keyed_t;
+
+static bool Check(bool ok, const char* what, size_t n)
+{
+	if (!ok)
+		fprintf(stderr, "%s mismatch for %zu items\n", what, n);
+	return ok;
+}
+
+static bool CheckAlgorithms(const parallel::pool_policy& par, size_t n, std::mt19937_64& rng)
+{
+	std::vector<uint64_t> v(n), out(n), ref(n);
+	std::vector<keyed_t> pairs(n), pairs_out(n), keyed(n), keyed_ref;
+	std::vector<std::string> str(std::min(n, (size_t)100000)), str_ref;
+	std::atomic<uint64_t> sum(0);
+	bool r = true;
+
+	for (auto& x : v)
+		x = rng() % 1000003;
+
+	parallel::for_each(par, v.begin(), v.end(), [&sum](uint64_t x) { sum += x; });
+	r = Check(sum == std::accumulate(v.begin(), v.end(), (uint64_t)0), "for_each()", n) && r;
+
+	parallel::transform(par, v.begin(), v.end(), out.begin(), [](uint64_t x) { return 3 * x + 1; });
+	std::transform(v.begin(), v.end(), ref.begin(), [](uint64_t x) { return 3 * x + 1; });
+	r = Check(out == ref, "transform()", n) && r;
+
+	r = Check(parallel::reduce(par, v.begin(), v.end()) == std::accumulate(v.begin(), v.end(), (uint64_t)0),
+		"reduce()", n) && r;
+	r = Check(parallel::transform_reduce(par, v.begin(), v.end(), ref.begin(), (uint64_t)0) ==
+		std::inner_product(v.begin(), v.end(), ref.begin(), (uint64_t)0), "transform_reduce()", n) && r;
+
+	std::inclusive_scan(v.begin(), v.end(), ref.begin());
+	parallel::inclusive_scan(par, v.begin(), v.end(), out.begin());
+	r = Check(out == ref, "inclusive_scan()", n) && r;
+	out = v;
+	parallel::inclusive_scan(par, out.begin(), out.end(), out.begin());
+	r = Check(out == ref, "In place inclusive_scan()", n) && r;
+	// An operation that isn't commutative, which only works if the blocks get combined in order
+	for (size_t i = 0; i < n; i++)
+		pairs[i] = keyed_t((uint32_t)i, (uint32_t)i);
+	parallel::inclusive_scan(par, pairs.begin(), pairs.end(), pairs_out.begin(),
+		[](const keyed_t& a, const keyed_t& b) { return keyed_t(a.first, (a.second + 1 == b.first) ? b.second : 0); });
+	for (size_t i = 0; r && (i < n); i++)
+		r = Check((pairs_out[i].first == 0) && (pairs_out[i].second == i), "Ordered inclusive_scan()", n);
+
+	// Few keys, so that there are plenty of equal ones for stability to matter
+	for (size_t i = 0; i < n; i++)
+		keyed[i] = keyed_t((uint32_t)(rng() % 1000), (uint32_t)i);
+	keyed_ref = keyed;
+	parallel::sort(par, keyed.begin(), keyed.end(), [](const keyed_t& a, const keyed_t& b) { return a.first < b.first; });
+	std::stable_sort(keyed_ref.begin(), keyed_ref.end(), [](const keyed_t& a, const keyed_t& b) { return a.first < b.first; });
+	r = Check(keyed == keyed_ref, "Stable sort()", n) && r;
+	for (auto& s : str)
+		s = std::to_string(rng() % 100000);
+	str_ref = str;
+	parallel::sort(par, str.begin(), str.end());
+	std::sort(str_ref.begin(), str_ref.end());
+	r = Check(str == str_ref, "String sort()", str.size()) && r;
+
+	return r;
+}
+
+template<class F>
+static double Time(F f)
+{
+	double best = 1.0e9;
+
+	for (int run = 0; run < TEST_RUNS; run++) {
+		auto start = std::chrono::steady_clock::now();
+		f();
+		best = std::min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	}
+	return best;
+}
+
+static void PrintTime(const char* label, double pool_ms, double std_ms)
+{
+	printf("  %-20s %9.2f ms %9.2f ms\n", label, pool_ms, std_ms);
+}
+
+// Same work as std::execution::par, which uses all the processors, so the pool should too
+static bool TimeAlgorithms(const parallel::pool_policy& par, std::mt19937_64& rng)
+{
+	std::vector<uint64_t> v(TEST_TIME_SIZE), out(TEST_TIME_SIZE), sorted;
+	uint64_t a = 0, b = 0;
+	double t;
+
+	for (auto& x : v)
+		x = rng();
+	printf("Parallel algorithms over %d items (%u workers): parallel:: against std::execution::par\n",
+		TEST_TIME_SIZE, par.size());
+
+	t = Time([&] { parallel::for_each(par, out.begin(), out.end(), [](uint64_t& x) { x = x * 7 + 1; }); });
+	PrintTime("for_each()", t, Time([&] { std::for_each(std::execution::par, out.begin(), out.end(),
+		[](uint64_t& x) { x = x * 7 + 1; }); }));
+	t = Time([&] { parallel::transform(par, v.begin(), v.end(), out.begin(), [](uint64_t x) { return x >> 3; }); });
+	PrintTime("transform()", t, Time([&] { std::transform(std::execution::par, v.begin(), v.end(), out.begin(),
+		[](uint64_t x) { return x >> 3; }); }));
+	t = Time([&] { a = parallel::reduce(par, v.begin(), v.end()); });
+	PrintTime("reduce()", t, Time([&] { b = std::reduce(std::execution::par, v.begin(), v.end()); }));
+	if (!Check(a == b, "Timed reduce()", v.size()))
+		return false;
+	t = Time([&] { a = parallel::transform_reduce(par, v.begin(), v.end(), (uint64_t)0, std::plus<>(),
+		[](uint64_t x) { return x & 0xffff; }); });
+	PrintTime("transform_reduce()", t, Time([&] { b = std::transform_reduce(std::execution::par, v.begin(), v.end(),
+		(uint64_t)0, std::plus<>(), [](uint64_t x) { return x & 0xffff; }); }));
+	if (!Check(a == b, "Timed transform_reduce()", v.size()))
+		return false;
+	t = Time([&] { parallel::inclusive_scan(par, v.begin(), v.end(), out.begin()); });
+	PrintTime("inclusive_scan()", t, Time([&] { std::inclusive_scan(std::execution::par, v.begin(), v.end(),
+		out.begin()); }));
+	// Sorting sorted data is a different benchmark, so each run starts from the same copy
+	t = Time([&] { sorted = v; parallel::sort(par, sorted.begin(), sorted.end()); });
+	PrintTime("sort()", t, Time([&] { out = v; std::sort(std::execution::par, out.begin(), out.end()); }));
+	return Check(sorted == out, "Timed sort()", v.size());
+}
+
+// Which of its receiver's functions a sender completed with
+enum completion_t { COMPLETED_NONE, COMPLETED_VALUE, COMPLETED_ERROR, COMPLETED_STOPPED };
+
+struct completion {
+	std::mutex lock;
+	std::condition_variable cv;
+	completion_t how = COMPLETED_NONE;
+	std::exception_ptr error;
+};
+
+struct completion_receiver {
+	completion* c;
+
+	void complete(completion_t how) noexcept
+	{
+		std::lock_guard<std::mutex> guard(c->lock);
+		c->how = how;
+		c->cv.notify_one();
+	}
+	template<class... Ts>
+	void set_value(Ts&&...) noexcept { complete(COMPLETED_VALUE); }
+	void set_error(std::exception_ptr e) noexcept
+	{
+		c->error = std::move(e);
+		complete(COMPLETED_ERROR);
+	}
+	void set_stopped() noexcept { complete(COMPLETED_STOPPED); }
+};
+
+// Same as sync_wait(), but telling apart the ways the sender can complete
+template<class S>
+static completion_t Complete(S&& s, std::exception_ptr* error = nullptr)
+{
+	completion c;
+	auto op = std::forward<S>(s).connect(completion_receiver{ &c });
+	std::unique_lock<std::mutex> guard(c.lock);
+
+	op.start();
+	c.cv.wait(guard, [&c] { return c.how != COMPLETED_NONE; });
+	if (error != nullptr)
+		*error = c.error;
+	return c.how;
+}
+
+static bool CheckExecution(parallel_pool_t* pool)
+{
+	ex::scheduler sch(pool);
+	const size_t n = 1000000;
+	std::vector<uint64_t> in(n), out(n);
+	std::exception_ptr error;
+	parallel_pool_t* cancelled;
+	bool r = true;
+
+	for (size_t i = 0; i < n; i++)
+		in[i] = i;
+	auto work = sch.schedule()
+		| ex::bulk(n, [&](size_t i) { out[i] = 2 * in[i]; })
+		| ex::then([&] { return std::accumulate(out.begin(), out.end(), (uint64_t)0); });
+	auto sum = ex::sync_wait(std::move(work));
+	r = Check(sum.has_value() && (std::get<0>(*sum) == (uint64_t)n * (n - 1)), "schedule() | bulk() | then()", n) && r;
+
+	// Values of different types, none for a plain schedule(), and bulk() passing them through
+	auto all = ex::sync_wait(ex::when_all(
+		sch.schedule() | ex::then([] { return 1; }),
+		sch.schedule() | ex::then([] { return std::string("two"); }),
+		sch.schedule(),
+		sch.schedule() | ex::then([] { return 3.5; }) | ex::bulk(16, [](size_t, double& d) { d += 0.0; })));
+	r = Check(all.has_value() && (std::get<0>(*all) == 1) && (std::get<1>(*all) == "two") &&
+		(std::get<2>(*all) == 3.5), "when_all()", 4) && r;
+
+	// A bulk function that throws must complete with set_error(), and sync_wait() rethrow it
+	r = Check((Complete(sch.schedule() | ex::bulk(n, [](size_t i) {
+		if (i == n / 2)
+			throw std::runtime_error("bulk");
+	}), &error) == COMPLETED_ERROR) && (error != nullptr), "Throwing bulk() completion", n) && r;
+	try {
+		if (error != nullptr)
+			std::rethrow_exception(error);
+	} catch (const std::runtime_error& e) {
+		r = Check(std::string(e.what()) == "bulk", "Throwing bulk() error", n) && r;
+	}
+	try {
+		ex::sync_wait(sch.schedule() | ex::bulk(n, [](size_t i) {
+			if (i == n / 2)
+				throw std::runtime_error("bulk");
+		}));
+		r = Check(false, "sync_wait() of a throwing bulk()", n) && r;
+	} catch (const std::runtime_error&) {
+	}
+
+	// And a cancelled pool with set_stopped(), which sync_wait() turns into an empty optional
+	cancelled = parallel_create(1, 0);
+	if (cancelled == NULL) {
+		fprintf(stderr, "Could not create pool\n");
+		return false;
+	}
+	parallel_cancel(cancelled);
+	ex::scheduler stopped(cancelled);
+	r = Check(Complete(stopped.schedule() | ex::then([] { return 1; })) == COMPLETED_STOPPED,
+		"Cancelled pool completion", 1) && r;
+	r = Check(!ex::sync_wait(stopped.schedule() | ex::then([] { return 1; })).has_value(),
+		"sync_wait() on a cancelled pool", 1) && r;
+	parallel_destroy(cancelled);
+
+	if (r)
+		printf("parallel_execution.hpp senders complete as expected\n");
+	return r;
+}
+
+int main(int argc, char** argv)
+{
+	parallel_pool_t* pool;
+	std::mt19937_64 rng(0x2545f4914f6cdd1dULL);
+	bool r = true;
+
+	// 0, for one worker per logical processor, is also what std::execution::par gets
+	pool = parallel_create((argc > 1) ? (uint32_t)atoi(argv[1]) : 0, 0);
+	if (pool == NULL) {
+		fprintf(stderr, "Could not create pool\n");
+		return 1;
+	}
+	parallel::pool_policy par(pool);
+
+	for (size_t i = 0; i < sizeof(check_size) / sizeof(check_size[0]); i++)
+		r = CheckAlgorithms(par, check_size[i], rng) && r;
+	if (r)
+		printf("parallel.hpp algorithms match the std:: ones\n");
+	r = CheckExecution(pool) && r;
+	r = r && TimeAlgorithms(par, rng);
+
+	parallel_destroy(pool);
+	return r ? 0 : 1;
+}
@@ -0,0 +1,418 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Concurrent cache of converted paths and file metadata
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msapi_utf8.h"
+#include "crc.h"
+#include "pathcache.h"
+#include "utf.h"
+
+// Number of shards (must be a power of 2), and of buckets in each shard
+#define PATH_CACHE_SHARDS		64
+#define PATH_CACHE_BUCKETS		4096
+// Past this many entries, new paths are no longer added
+#define PATH_CACHE_MAX_ENTRIES	(1 << 20)
+
+/*
+ * Entries are never removed from their bucket until the cache is disabled,
+ * so that readers can walk the chains without a lock, and invalidating an
+ * entry only invalidates its metadata. Updates to the metadata are done
+ * under the shard lock, and readers use the seq counter to retry if they
+ * raced with an update (seqlock).
+ */
+typedef struct path_cache_entry {
+	struct path_cache_entry* volatile next;
+	uint32_t hash;
+	uint32_t len;
+	volatile LONG seq;				// Odd while the metadata is being updated
+	volatile LONG invalidations;
+	// Generation of the cache that the metadata is valid for, 0 for none
+	LONG attr_generation;
+	DWORD attr;
+	DWORD attr_error;
+	LONG stat_generation;
+	int stat_ret;
+	int stat_errno;
+	struct __stat64 st;
+	wchar_t* wpath;
+	char path[1];
+} path_cache_entry_t;
+
+typedef struct {
+	CRITICAL_SECTION lock;
+	path_cache_entry_t* volatile* bucket;
+	LONG entries;
+	volatile LONG64 hits;
+	volatile LONG64 misses;
+	volatile LONG64 invalidations;
+	// Keep the counters of different shards on different cache lines
+	uint8_t pad[64];
+} path_cache_shard_t;
+
+static path_cache_shard_t* path_cache = NULL;
+// Bumped to invalidate everything at once
+static volatile LONG path_cache_generation = 1;
+
+/*
+ * Windows paths don't care about case, so neither do the lookups, or a
+ * path could still hit an entry that got invalidated under a different
+ * case. This only folds ASCII, the same as the _strnicmp() of the C locale.
+ */
+static uint32_t PathHash(const char* path, size_t len)
+{
+	char buf[256];
+	uint32_t crc = 0;
+	size_t i, n;
+
+	for (; len > 0; path += n, len -= n) {
+		n = min(len, sizeof(buf));
+		for (i = 0; i < n; i++)
+			buf[i] = ((path[i] >= 'A') && (path[i] <= 'Z')) ? (path[i] | 0x20) : path[i];
+		crc = crc32c(crc, buf, n);
+	}
+	return crc;
+}
+
+// Like GetFileAttributesU(), accept quoted paths, as the same entry as the unquoted ones
+static __inline const char* UnquotePath(const char* path, size_t* len)
+{
+	*len = strlen(path);
+	if ((*len >= 2) && (path[0] == '"') && (path[*len - 1] == '"')) {
+		*len -= 2;
+		return &path[1];
+	}
+	return path;
+}
+
+static __inline path_cache_shard_t* PathShard(uint32_t hash)
+{
+	return &path_cache[hash & (PATH_CACHE_SHARDS - 1)];
+}
+
+static __inline path_cache_entry_t* volatile* PathBucket(uint32_t hash)
+{
+	return &PathShard(hash)->bucket[(hash / PATH_CACHE_SHARDS) % PATH_CACHE_BUCKETS];
+}
+
+BOOL EnablePathCache(void)
+{
+	int i;
+
+	if (path_cache != NULL)
+		return TRUE;
+	path_cache = (path_cache_shard_t*)calloc(PATH_CACHE_SHARDS, sizeof(path_cache_shard_t));
+	if (path_cache == NULL)
+		return FALSE;
+	for (i = 0; i < PATH_CACHE_SHARDS; i++) {
+		InitializeCriticalSection(&path_cache[i].lock);
+		path_cache[i].bucket = (path_cache_entry_t* volatile*)calloc(PATH_CACHE_BUCKETS, sizeof(path_cache_entry_t*));
+		if (path_cache[i].bucket == NULL) {
+			for (i++; i < PATH_CACHE_SHARDS; i++)
+				InitializeCriticalSection(&path_cache[i].lock);
+			DisablePathCache();
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+void DisablePathCache(void)
+{
+	path_cache_entry_t *entry, *next;
+	int i, j;
+
+	if (path_cache == NULL)
+		return;
+	for (i = 0; i < PATH_CACHE_SHARDS; i++) {
+		for (j = 0; (path_cache[i].bucket != NULL) && (j < PATH_CACHE_BUCKETS); j++) {
+			for (entry = path_cache[i].bucket[j]; entry != NULL; entry = next) {
+				next = entry->next;
+				free(entry);
+			}
+		}
+		free((void*)path_cache[i].bucket);
+		DeleteCriticalSection(&path_cache[i].lock);
+	}
+	free(path_cache);
+	path_cache = NULL;
+}
+
+BOOL PathCacheEnabled(void)
+{
+	return (path_cache != NULL);
+}
+
+void GetPathCacheStats(path_cache_stats_t* stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; (path_cache != NULL) && (i < PATH_CACHE_SHARDS); i++) {
+		stats->hits += path_cache[i].hits;
+		stats->misses += path_cache[i].misses;
+		stats->entries += path_cache[i].entries;
+		stats->invalidations += path_cache[i].invalidations;
+	}
+}
+
+static path_cache_entry_t* FindEntry(path_cache_entry_t* entry, uint32_t hash, const char* path, size_t len)
+{
+	for (; entry != NULL; entry = entry->next) {
+		if ((entry->hash == hash) && (entry->len == len) && (_strnicmp(entry->path, path, len) == 0))
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+ * Return the entry for path, adding it if needed, or NULL if the cache is
+ * disabled or full, in which case the caller should go to the file system.
+ */
+static path_cache_entry_t* GetEntry(const char* path)
+{
+	path_cache_shard_t* shard;
+	path_cache_entry_t *entry, * volatile* bucket;
+	size_t len, wlen;
+	uint32_t hash;
+
+	if ((path_cache == NULL) || (path == NULL))
+		return NULL;
+	path = UnquotePath(path, &len);
+	hash = PathHash(path, len);
+	bucket = PathBucket(hash);
+	entry = FindEntry(*bucket, hash, path, len);
+	if (entry != NULL)
+		return entry;
+
+	shard = PathShard(hash);
+	EnterCriticalSection(&shard->lock);
+	// Someone may have added it while we were waiting for the lock
+	entry = FindEntry(*bucket, hash, path, len);
+	if ((entry != NULL) || (shard->entries >= PATH_CACHE_MAX_ENTRIES / PATH_CACHE_SHARDS))
+		goto out;
+	wlen = utf8_to_utf16_length(path, len);
+	// The UTF-16 path follows the UTF-8 one, aligned for wchar_t
+	entry = (path_cache_entry_t*)calloc(1, sizeof(path_cache_entry_t) + len +
+		sizeof(wchar_t) + (wlen + 1) * sizeof(wchar_t));
+	if (entry == NULL)
+		goto out;
+	entry->hash = hash;
+	entry->len = (uint32_t)len;
+	memcpy(entry->path, path, len);
+	entry->wpath = (wchar_t*)(((uintptr_t)&entry->path[len + 1] + sizeof(wchar_t) - 1) & ~(sizeof(wchar_t) - 1));
+	entry->wpath[utf8_to_utf16(path, len, (uint16_t*)entry->wpath)] = 0;
+	entry->next = *bucket;
+	// Readers must not see the entry before it is fully initialized
+	InterlockedExchangePointer((PVOID volatile*)bucket, entry);
+	shard->entries++;
+
+out:
+	LeaveCriticalSection(&shard->lock);
+	return entry;
+}
+
+static __inline void BeginUpdate(path_cache_entry_t* entry)
+{
+	InterlockedIncrement(&entry->seq);
+}
+
+static __inline void EndUpdate(path_cache_entry_t* entry)
+{
+	InterlockedIncrement(&entry->seq);
+}
+
+static __inline LONG BeginRead(path_cache_entry_t* entry)
+{
+	LONG seq;
+
+	while ((seq = entry->seq) & 1)
+		YieldProcessor();
+	MemoryBarrier();
+	return seq;
+}
+
+static __inline BOOL EndRead(path_cache_entry_t* entry, LONG seq)
+{
+	MemoryBarrier();
+	return (entry->seq == seq);
+}
+
+static void InvalidateEntry(path_cache_shard_t* shard, path_cache_entry_t* entry)
+{
+	BeginUpdate(entry);
+	InterlockedIncrement(&entry->invalidations);
+	entry->attr_generation = 0;
+	entry->stat_generation = 0;
+	EndUpdate(entry);
+	InterlockedIncrement64(&shard->invalidations);
+}
+
+void InvalidatePathCache(const char* path)
+{
+	path_cache_shard_t* shard;
+	path_cache_entry_t* entry;
+	size_t len;
+	uint32_t hash;
+
+	if (path_cache == NULL)
+		return;
+	if (path == NULL) {
+		InterlockedIncrement(&path_cache_generation);
+		return;
+	}
+	path = UnquotePath(path, &len);
+	hash = PathHash(path, len);
+	shard = PathShard(hash);
+	EnterCriticalSection(&shard->lock);
+	entry = FindEntry(*PathBucket(hash), hash, path, len);
+	if (entry != NULL)
+		InvalidateEntry(shard, entry);
+	LeaveCriticalSection(&shard->lock);
+}
+
+void InvalidatePathCacheTree(const char* dir)
+{
+	path_cache_entry_t* entry;
+	size_t len;
+	int i, j;
+
+	if ((path_cache == NULL) || (dir == NULL))
+		return;
+	dir = UnquotePath(dir, &len);
+	while ((len > 0) && ((dir[len - 1] == '\\') || (dir[len - 1] == '/')))
+		len--;
+	for (i = 0; i < PATH_CACHE_SHARDS; i++) {
+		EnterCriticalSection(&path_cache[i].lock);
+		for (j = 0; j < PATH_CACHE_BUCKETS; j++) {
+			for (entry = path_cache[i].bucket[j]; entry != NULL; entry = entry->next) {
+				if ((entry->len >= len) && (_strnicmp(entry->path, dir, len) == 0) &&
+					((entry->path[len] == 0) || (entry->path[len] == '\\') || (entry->path[len] == '/')))
+					InvalidateEntry(&path_cache[i], entry);
+			}
+		}
+		LeaveCriticalSection(&path_cache[i].lock);
+	}
+}
+
+const wchar_t* GetCachedWidePath(const char* path)
+{
+	path_cache_entry_t* entry = GetEntry(path);
+
+	return (entry == NULL) ? NULL : entry->wpath;
+}
+
+DWORD GetFileAttributesCachedU(const char* lpFileName)
+{
+	path_cache_shard_t* shard;
+	path_cache_entry_t* entry;
+	DWORD attr, err;
+	LONG seq, generation, invalidations;
+	BOOL valid;
+
+	entry = GetEntry(lpFileName);
+	if (entry == NULL)
+		return GetFileAttributesU(lpFileName);
+	shard = PathShard(entry->hash);
+	generation = path_cache_generation;
+	do {
+		seq = BeginRead(entry);
+		valid = (entry->attr_generation == generation);
+		attr = entry->attr;
+		err = entry->attr_error;
+		invalidations = entry->invalidations;
+	} while (!EndRead(entry, seq));
+	if (valid) {
+		InterlockedIncrement64(&shard->hits);
+		SetLastError(err);
+		return attr;
+	}
+
+	InterlockedIncrement64(&shard->misses);
+	attr = GetFileAttributesW(entry->wpath);
+	err = GetLastError();
+	EnterCriticalSection(&shard->lock);
+	// Don't store a result that got invalidated while we were querying it
+	if (entry->invalidations == invalidations) {
+		BeginUpdate(entry);
+		entry->attr = attr;
+		entry->attr_error = err;
+		entry->attr_generation = generation;
+		EndUpdate(entry);
+	}
+	LeaveCriticalSection(&shard->lock);
+	SetLastError(err);
+	return attr;
+}
+
+BOOL PathFileExistsCachedU(const char* szPath)
+{
+	return (GetFileAttributesCachedU(szPath) != INVALID_FILE_ATTRIBUTES);
+}
+
+int _stat64CachedU(const char* path, struct __stat64* buffer)
+{
+	path_cache_shard_t* shard;
+	path_cache_entry_t* entry;
+	LONG seq, generation, invalidations;
+	int ret, err;
+	BOOL valid;
+
+	entry = GetEntry(path);
+	if (entry == NULL)
+		return _stat64U(path, buffer);
+	shard = PathShard(entry->hash);
+	generation = path_cache_generation;
+	do {
+		seq = BeginRead(entry);
+		valid = (entry->stat_generation == generation);
+		ret = entry->stat_ret;
+		err = entry->stat_errno;
+		memcpy(buffer, &entry->st, sizeof(*buffer));
+		invalidations = entry->invalidations;
+	} while (!EndRead(entry, seq));
+	if (valid) {
+		InterlockedIncrement64(&shard->hits);
+		if (ret != 0)
+			errno = err;
+		return ret;
+	}
+
+	InterlockedIncrement64(&shard->misses);
+	ret = _wstat64(entry->wpath, buffer);
+	err = errno;
+	EnterCriticalSection(&shard->lock);
+	if (entry->invalidations == invalidations) {
+		BeginUpdate(entry);
+		entry->stat_ret = ret;
+		entry->stat_errno = err;
+		memcpy(&entry->st, buffer, sizeof(entry->st));
+		entry->stat_generation = generation;
+		EndUpdate(entry);
+	}
+	LeaveCriticalSection(&shard->lock);
+	errno = err;
+	return ret;
+}
@@ -0,0 +1,63 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Concurrent cache of converted paths and file metadata
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t entries;
+	uint64_t invalidations;
+} path_cache_stats_t;
+
+/*
+ * The cache is off until EnablePathCache() is called, in which case the
+ * cached wrappers below just call their msapi_utf8.h counterparts. Paths
+ * are looked up without regard to ASCII case or surrounding quotes, but
+ * otherwise as given, so a file should be referred to with the same
+ * spelling throughout. Lookups don't take any lock, so that all
+ * the workers can hit the cache at once. DisablePathCache() frees it, and
+ * must not be called while other threads may still be using it.
+ */
+extern BOOL EnablePathCache(void);
+extern void DisablePathCache(void);
+extern BOOL PathCacheEnabled(void);
+extern void GetPathCacheStats(path_cache_stats_t* stats);
+
+/*
+ * Nothing ever expires by itself, so anything that modifies the file
+ * system must invalidate the paths it touched: a single path, everything
+ * under a directory (and the directory itself), or everything (NULL).
+ */
+extern void InvalidatePathCache(const char* path);
+extern void InvalidatePathCacheTree(const char* dir);
+
+// Return the UTF-16 version of path, which remains valid until the cache is disabled, or NULL
+extern const wchar_t* GetCachedWidePath(const char* path);
+
+// Same as the msapi_utf8.h wrappers, including the last error or errno
+extern DWORD GetFileAttributesCachedU(const char* lpFileName);
+extern BOOL PathFileExistsCachedU(const char* szPath);
+extern int _stat64CachedU(const char* path, struct __stat64* buffer);
@@ -0,0 +1,656 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Thread pool
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+#pragma warning(disable: 6258)		// I know what I'm using TerminateThread for
+
+// Maximum amount of time we allow for workers to exit (ms)
+#define POOL_EXIT_WAIT		15000
+// Initial size of the task queue (grows as needed)
+#define POOL_QUEUE_SIZE		256
+// How many chunks per worker ParallelFor() aims for, when no grain is given
+#define POOL_CHUNKS_PER_WORKER	8
+// How many tiles per worker ParallelFor2D() and ParallelFor3D() go down to, for the load to even out
+#define POOL_TILES_PER_WORKER	4
+// Data cache sizes to go with if the system doesn't tell us
+#define POOL_DEFAULT_L1_SIZE	(32 << 10)
+#define POOL_DEFAULT_L2_SIZE	(256 << 10)
+
+typedef struct {
+	pool_task_fn fn;
+	void* ctx;
+	pool_group_t* group;
+	pool_group_t* scope;
+} pool_task_t;
+
+typedef struct {
+	pool_t* pool;
+	uint32_t index;
+	HANDLE thread;
+} pool_worker_t;
+
+struct pool {
+	DWORD num_workers;
+	pool_worker_t* worker;
+	DWORD tls;
+	volatile LONG cancelled;
+	volatile LONG exiting;
+	// Task queue (circular buffer)
+	CRITICAL_SECTION lock;
+	HANDLE tasks_ready;
+	pool_task_t* queue;
+	size_t queue_size, head, count;
+	// Stats (the first two are protected by the lock)
+	uint64_t submitted, queue_peak;
+	volatile LONG64 completed, helped;
+};
+
+// Tiles of a worker's stretch of the curve, which the others take from once they are done with theirs
+typedef struct {
+	volatile LONG64 next;
+	uint64_t end;
+	uint8_t pad[64 - sizeof(LONG64) - sizeof(uint64_t)];
+} pool_span_t;
+
+typedef struct {
+	pool_t* pool;
+	pool_group_t* group;
+	pool_tile_fn fn;
+	void* ctx;
+	DWORD dims;
+	pool_box_t box;
+	uint64_t tile[3];
+	uint64_t* order;			// Morton codes of the tiles, in order
+	pool_span_t* span;			// One per worker
+} pool_tiles_t;
+
+// Cancellation scope of the current thread, which the tasks it submits inherit
+static __declspec(thread) pool_group_t* task_scope = NULL;
+
+typedef struct {
+	pool_t* pool;
+	pool_group_t* group;
+	pool_range_fn fn;
+	pool_find_fn find;
+	void* ctx;
+	volatile LONG64 next;
+	uint64_t end, grain;
+	// Lowest match so far (end for none), past which ParallelFind() stops
+	volatile LONG64 found;
+	BOOL lowest;
+} pool_range_t;
+
+static BOOL PushTask(pool_t* pool, pool_task_t* task)
+{
+	pool_task_t* queue;
+	size_t i;
+
+	EnterCriticalSection(&pool->lock);
+	if (pool->count == pool->queue_size) {
+		queue = (pool_task_t*)malloc(2 * pool->queue_size * sizeof(pool_task_t));
+		if (queue == NULL) {
+			LeaveCriticalSection(&pool->lock);
+			return FALSE;
+		}
+		for (i = 0; i < pool->count; i++)
+			queue[i] = pool->queue[(pool->head + i) % pool->queue_size];
+		free(pool->queue);
+		pool->queue = queue;
+		pool->queue_size *= 2;
+		pool->head = 0;
+	}
+	pool->queue[(pool->head + pool->count) % pool->queue_size] = *task;
+	pool->count++;
+	pool->submitted++;
+	if (pool->count > pool->queue_peak)
+		pool->queue_peak = pool->count;
+	LeaveCriticalSection(&pool->lock);
+	ReleaseSemaphore(pool->tasks_ready, 1, NULL);
+	return TRUE;
+}
+
+static BOOL PopTask(pool_t* pool, pool_task_t* task)
+{
+	BOOL r = FALSE;
+
+	EnterCriticalSection(&pool->lock);
+	if (pool->count != 0) {
+		*task = pool->queue[pool->head];
+		pool->head = (pool->head + 1) % pool->queue_size;
+		pool->count--;
+		r = TRUE;
+	}
+	LeaveCriticalSection(&pool->lock);
+	return r;
+}
+
+static void RunTask(pool_t* pool, pool_task_t* task, uint32_t worker)
+{
+	pool_group_t* group = task->group;
+	// We may be running this from WaitTaskGroup(), inside another task
+	pool_group_t* scope = SetTaskScope(task->scope);
+
+	task->fn(task->ctx, worker);
+	SetTaskScope(scope);
+	InterlockedIncrement64(&pool->completed);
+	if ((group != NULL) && (InterlockedDecrement(&group->pending) == 0))
+		SetEvent(group->done);
+}
+
+static DWORD WINAPI PoolWorkerThread(void* param)
+{
+	pool_worker_t* worker = (pool_worker_t*)param;
+	pool_t* pool = worker->pool;
+	pool_task_t task;
+
+	TlsSetValue(pool->tls, worker);
+	do {
+		if (WaitForSingleObject(pool->tasks_ready, INFINITE) != WAIT_OBJECT_0) {
+			printf("Failed to wait for tasks in worker #%02d\n", worker->index);
+			return 1;
+		}
+		if (pool->exiting)
+			return 0;
+		// The semaphore count can be ahead of the queue, since
+		// WaitTaskGroup() can steal tasks without consuming it.
+		if (PopTask(pool, &task))
+			RunTask(pool, &task, worker->index);
+	} while (1);
+}
+
+pool_t* CreatePool(DWORD num_workers, const DWORD_PTR* affinity)
+{
+	pool_t* pool;
+	DWORD i;
+
+	if ((num_workers == 0) || (num_workers > MAXIMUM_WAIT_OBJECTS))
+		return NULL;
+
+	pool = (pool_t*)calloc(1, sizeof(pool_t));
+	if (pool == NULL)
+		return NULL;
+	pool->tls = TLS_OUT_OF_INDEXES;
+	InitializeCriticalSection(&pool->lock);
+	pool->queue_size = POOL_QUEUE_SIZE;
+	pool->queue = (pool_task_t*)calloc(pool->queue_size, sizeof(pool_task_t));
+	pool->worker = (pool_worker_t*)calloc(num_workers, sizeof(pool_worker_t));
+	pool->tasks_ready = CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+	pool->tls = TlsAlloc();
+	if ((pool->queue == NULL) || (pool->worker == NULL) || (pool->tasks_ready == NULL) ||
+		(pool->tls == TLS_OUT_OF_INDEXES)) {
+		fprintf(stderr, "Could not allocate pool resources.\n");
+		goto error;
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		pool->worker[i].pool = pool;
+		pool->worker[i].index = i;
+		pool->worker[i].thread = CreateThread(NULL, 0, PoolWorkerThread, &pool->worker[i], 0, NULL);
+		if (pool->worker[i].thread == NULL) {
+			printf("Unable to start worker #%02d\n", i);
+			goto error;
+		}
+		pool->num_workers++;
+		SetThreadPriority(pool->worker[i].thread, THREAD_PRIORITY_ABOVE_NORMAL);
+		if ((affinity != NULL) && (affinity[i] != 0))
+			SetThreadAffinityMask(pool->worker[i].thread, affinity[i]);
+	}
+	return pool;
+
+error:
+	DestroyPool(pool);
+	return NULL;
+}
+
+void DestroyPool(pool_t* pool)
+{
+	HANDLE thread[MAXIMUM_WAIT_OBJECTS];
+	DWORD i;
+
+	if (pool == NULL)
+		return;
+
+	if (pool->num_workers != 0) {
+		pool->exiting = TRUE;
+		ReleaseSemaphore(pool->tasks_ready, pool->num_workers, NULL);
+		for (i = 0; i < pool->num_workers; i++)
+			thread[i] = pool->worker[i].thread;
+		if (WaitForMultipleObjects(pool->num_workers, thread, TRUE, POOL_EXIT_WAIT) != WAIT_OBJECT_0) {
+			printf("Workers did not finalize\n");
+			for (i = 0; i < pool->num_workers; i++)
+				TerminateThread(thread[i], 1);
+		}
+		for (i = 0; i < pool->num_workers; i++)
+			CloseHandle(thread[i]);
+	}
+	if (pool->tasks_ready != NULL)
+		CloseHandle(pool->tasks_ready);
+	if (pool->tls != TLS_OUT_OF_INDEXES)
+		TlsFree(pool->tls);
+	DeleteCriticalSection(&pool->lock);
+	free(pool->queue);
+	free(pool->worker);
+	free(pool);
+}
+
+DWORD PoolSize(pool_t* pool)
+{
+	return pool->num_workers;
+}
+
+void CancelPool(pool_t* pool)
+{
+	pool->cancelled = TRUE;
+}
+
+void GetPoolStats(pool_t* pool, pool_stats_t* stats)
+{
+	stats->workers = pool->num_workers;
+	EnterCriticalSection(&pool->lock);
+	stats->submitted = pool->submitted;
+	stats->queued = pool->count;
+	stats->queue_peak = pool->queue_peak;
+	LeaveCriticalSection(&pool->lock);
+	stats->completed = (uint64_t)pool->completed;
+	stats->helped = (uint64_t)pool->helped;
+}
+
+BOOL InitTaskGroup(pool_group_t* group)
+{
+	// The owner holds a reference until it calls WaitTaskGroup(), so that
+	// pending only drops to zero once, when the last task is done.
+	group->pending = 1;
+	group->cancelled = FALSE;
+	group->parent = task_scope;
+	group->done = CreateEvent(NULL, FALSE, FALSE, NULL);
+	return (group->done != NULL);
+}
+
+void CloseTaskGroup(pool_group_t* group)
+{
+	if (group->done != NULL)
+		CloseHandle(group->done);
+	group->done = NULL;
+}
+
+void CancelTaskGroup(pool_group_t* group)
+{
+	group->cancelled = TRUE;
+}
+
+BOOL TaskCancelled(pool_t* pool, pool_group_t* group)
+{
+	if (pool->cancelled)
+		return TRUE;
+	for (; group != NULL; group = group->parent) {
+		if (group->cancelled)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+pool_group_t* SetTaskScope(pool_group_t* group)
+{
+	pool_group_t* scope = task_scope;
+
+	task_scope = group;
+	return scope;
+}
+
+BOOL SubmitTask(pool_t* pool, pool_group_t* group, pool_task_fn fn, void* ctx)
+{
+	pool_task_t task = { fn, ctx, group, task_scope };
+
+	if (group != NULL)
+		InterlockedIncrement(&group->pending);
+	if (!PushTask(pool, &task)) {
+		if ((group != NULL) && (InterlockedDecrement(&group->pending) == 0))
+			SetEvent(group->done);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL WaitTaskGroup(pool_t* pool, pool_group_t* group)
+{
+	pool_worker_t* worker = (pool_worker_t*)TlsGetValue(pool->tls);
+	pool_task_t task;
+	DWORD r;
+
+	// Once we drop our reference, the thread completing the last task is the
+	// only one that touches the group, and it signals us when it's done.
+	if (InterlockedDecrement(&group->pending) != 0) {
+		do {
+			// Workers help with the queue rather than block a thread of the pool
+			if ((worker != NULL) && PopTask(pool, &task)) {
+				InterlockedIncrement64(&pool->helped);
+				RunTask(pool, &task, worker->index);
+				r = WaitForSingleObject(group->done, 0);
+			} else {
+				r = WaitForSingleObject(group->done, (worker != NULL) ? 1 : INFINITE);
+			}
+			if (r == WAIT_FAILED)
+				return FALSE;
+		} while (r != WAIT_OBJECT_0);
+	}
+	// Take our reference back, so that the group can be reused
+	group->pending = 1;
+	return !TaskCancelled(pool, group);
+}
+
+static void RangeTask(void* ctx, uint32_t worker)
+{
+	pool_range_t* range = (pool_range_t*)ctx;
+	uint64_t begin;
+
+	while (!TaskCancelled(range->pool, range->group)) {
+		begin = (uint64_t)InterlockedExchangeAdd64(&range->next, (LONG64)range->grain);
+		if (begin >= range->end)
+			break;
+		range->fn(range->ctx, worker, begin,
+			(range->end - begin > range->grain) ? begin + range->grain : range->end);
+	}
+}
+
+// Submit task to every worker that has a chunk of range to process, and wait for them
+static BOOL RunRange(pool_t* pool, pool_range_t* range, uint64_t begin, pool_task_fn task)
+{
+	pool_group_t group;
+	uint64_t i, num_chunks;
+	BOOL r = TRUE;
+
+	if (range->grain == 0)
+		range->grain = (range->end - begin) / ((uint64_t)pool->num_workers * POOL_CHUNKS_PER_WORKER);
+	if (range->grain == 0)
+		range->grain = 1;
+	num_chunks = (range->end - begin + range->grain - 1) / range->grain;
+
+	if (!InitTaskGroup(&group))
+		return FALSE;
+	range->pool = pool;
+	range->group = &group;
+	range->next = (LONG64)begin;
+	for (i = 0; (i < pool->num_workers) && (i < num_chunks) && r; i++)
+		r = SubmitTask(pool, &group, task, range);
+	if (!r)
+		CancelTaskGroup(&group);
+	r = WaitTaskGroup(pool, &group) && r;
+	CloseTaskGroup(&group);
+	return r;
+}
+
+BOOL ParallelFor(pool_t* pool, uint64_t begin, uint64_t end, uint64_t grain,
+	pool_range_fn fn, void* ctx)
+{
+	pool_range_t range = { 0 };
+
+	if (begin >= end)
+		return TRUE;
+	range.fn = fn;
+	range.ctx = ctx;
+	range.end = end;
+	range.grain = grain;
+	return RunRange(pool, &range, begin, RangeTask);
+}
+
+static void FindTask(void* ctx, uint32_t worker)
+{
+	pool_range_t* range = (pool_range_t*)ctx;
+	uint64_t begin, index;
+	LONG64 found;
+
+	while (!TaskCancelled(range->pool, range->group)) {
+		begin = (uint64_t)InterlockedExchangeAdd64(&range->next, (LONG64)range->grain);
+		// Chunks are handed out in order, so in lowest mode, the ones before a match still get searched
+		found = range->found;
+		if ((begin >= range->end) || (range->lowest ? (begin >= (uint64_t)found) : ((uint64_t)found != range->end)))
+			break;
+		if (!range->find(range->ctx, worker, begin,
+			(range->end - begin > range->grain) ? begin + range->grain : range->end, &index))
+			continue;
+		// Keep the lowest of the matches that made it in
+		while ((index < (uint64_t)found) &&
+			(InterlockedCompareExchange64(&range->found, (LONG64)index, found) != found))
+			found = range->found;
+		if (!range->lowest)
+			break;
+	}
+}
+
+BOOL ParallelFind(pool_t* pool, uint64_t begin, uint64_t end, uint64_t grain,
+	pool_find_fn fn, void* ctx, BOOL lowest, uint64_t* index)
+{
+	pool_range_t range = { 0 };
+	BOOL r;
+
+	*index = end;
+	if (begin >= end)
+		return TRUE;
+	range.find = fn;
+	range.ctx = ctx;
+	range.end = end;
+	range.grain = grain;
+	range.found = (LONG64)end;
+	range.lowest = lowest;
+	r = RunRange(pool, &range, begin, FindTask);
+	*index = (uint64_t)range.found;
+	return r;
+}
+
+// Share of the L1 and L2 data caches of a logical processor, which only gets looked up once
+static void GetCacheSizes(DWORD* l1, DWORD* l2)
+{
+	static volatile DWORD cache_size[2] = { 0, 0 };
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION* info = NULL;
+	DWORD i, len = 0, sharing, size[2] = { POOL_DEFAULT_L1_SIZE, POOL_DEFAULT_L2_SIZE };
+	DWORD_PTR mask;
+
+	if (cache_size[1] == 0) {
+		if (!GetLogicalProcessorInformation(NULL, &len) && (GetLastError() == ERROR_INSUFFICIENT_BUFFER))
+			info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION*)malloc(len);
+		if ((info != NULL) && GetLogicalProcessorInformation(info, &len)) {
+			for (i = 0; i < len / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION); i++) {
+				if ((info[i].Relationship != RelationCache) || (info[i].Cache.Type == CacheInstruction) ||
+					(info[i].Cache.Level < 1) || (info[i].Cache.Level > 2))
+					continue;
+				for (sharing = 0, mask = info[i].ProcessorMask; mask != 0; mask &= mask - 1)
+					sharing++;
+				size[info[i].Cache.Level - 1] = info[i].Cache.Size / max(sharing, 1);
+			}
+		}
+		free(info);
+		// Threads that get here at the same time all come up with the same sizes
+		cache_size[0] = size[0];
+		cache_size[1] = size[1];
+	}
+	*l1 = cache_size[0];
+	*l2 = cache_size[1];
+}
+
+void GetTileSize(DWORD dims, const uint64_t* size, size_t item_size, uint64_t* tile)
+{
+	uint64_t line = max(64 / item_size, 1), side, area;
+	DWORD d, l1, l2;
+
+	GetCacheSizes(&l1, &l2);
+	side = (uint64_t)sqrt((double)(l1 / 2 / item_size));
+	tile[0] = max(side / line * line, line);
+	tile[1] = tile[2] = 1;
+	if (dims >= 3)
+		tile[1] = max(side, 1);
+	for (area = 1, d = 0; d < dims - 1; d++)
+		area *= tile[d];
+	tile[dims - 1] = max(l2 / 2 / (area * item_size), 1);
+	for (d = 0; d < dims; d++)
+		tile[d] = min(tile[d], max(size[d], 1));
+}
+
+// Interleave the bits of the tile coordinates, x first
+static uint64_t MortonCode(DWORD dims, const uint64_t* t)
+{
+	uint64_t code = 0;
+	DWORD b;
+
+	for (b = 0; b < 64; b++)
+		code |= ((t[b % dims] >> (b / dims)) & 1) << b;
+	return code;
+}
+
+static void MortonDecode(DWORD dims, uint64_t code, uint64_t* t)
+{
+	DWORD b;
+
+	t[0] = t[1] = t[2] = 0;
+	for (b = 0; b < 64; b++)
+		t[b % dims] |= ((code >> b) & 1) << (b / dims);
+}
+
+static int CompareCodes(const void* a, const void* b)
+{
+	uint64_t ca = *(const uint64_t*)a, cb = *(const uint64_t*)b;
+
+	return (ca > cb) - (ca < cb);
+}
+
+static void TileTask(void* ctx, uint32_t worker)
+{
+	pool_tiles_t* tiles = (pool_tiles_t*)ctx;
+	pool_span_t* span;
+	pool_box_t box;
+	uint64_t i, t[3];
+	DWORD d, w, n = tiles->pool->num_workers;
+
+	for (w = 0; w < n; w++) {
+		span = &tiles->span[(worker + w) % n];
+		while (!TaskCancelled(tiles->pool, tiles->group)) {
+			i = (uint64_t)InterlockedIncrement64(&span->next) - 1;
+			if (i >= span->end)
+				break;
+			MortonDecode(tiles->dims, tiles->order[i], t);
+			for (d = 0; d < 3; d++) {
+				box.begin[d] = tiles->box.begin[d] + t[d] * tiles->tile[d];
+				box.end[d] = min(box.begin[d] + tiles->tile[d], tiles->box.end[d]);
+			}
+			tiles->fn(tiles->ctx, worker, &box);
+		}
+	}
+}
+
+BOOL ParallelForTiles(pool_t* pool, DWORD dims, const pool_box_t* box, const uint64_t* tile,
+	pool_tile_fn fn, void* ctx)
+{
+	pool_tiles_t tiles = { 0 };
+	pool_group_t group;
+	uint64_t i, count[3] = { 1, 1, 1 }, t[3], num_tiles = 1;
+	DWORD d, w;
+	BOOL r = FALSE;
+
+	if ((dims == 0) || (dims > 3))
+		return FALSE;
+	for (d = 0; d < 3; d++) {
+		tiles.box.begin[d] = (d < dims) ? box->begin[d] : 0;
+		tiles.box.end[d] = (d < dims) ? box->end[d] : 1;
+		tiles.tile[d] = (d < dims) ? max(tile[d], 1) : 1;
+		if (tiles.box.begin[d] >= tiles.box.end[d])
+			return TRUE;
+		count[d] = (tiles.box.end[d] - tiles.box.begin[d] + tiles.tile[d] - 1) / tiles.tile[d];
+		// The coordinates of a tile must fit in their share of the bits of its code
+		if ((d < dims) && (dims > 1) && (count[d] > (1ULL << (64 / dims)))) {
+			fprintf(stderr, "Too many tiles for ParallelForTiles()\n");
+			return FALSE;
+		}
+		num_tiles *= count[d];
+	}
+
+	tiles.pool = pool;
+	tiles.group = &group;
+	tiles.fn = fn;
+	tiles.ctx = ctx;
+	tiles.dims = dims;
+	tiles.order = (uint64_t*)malloc((size_t)num_tiles * sizeof(uint64_t));
+	tiles.span = (pool_span_t*)calloc(pool->num_workers, sizeof(pool_span_t));
+	if ((tiles.order == NULL) || (tiles.span == NULL)) {
+		fprintf(stderr, "Could not allocate tiles\n");
+		goto out;
+	}
+	for (i = 0, t[2] = 0; t[2] < count[2]; t[2]++)
+		for (t[1] = 0; t[1] < count[1]; t[1]++)
+			for (t[0] = 0; t[0] < count[0]; t[0]++)
+				tiles.order[i++] = MortonCode(dims, t);
+	qsort(tiles.order, (size_t)num_tiles, sizeof(uint64_t), CompareCodes);
+	for (w = 0; w < pool->num_workers; w++) {
+		tiles.span[w].next = (LONG64)(num_tiles * w / pool->num_workers);
+		tiles.span[w].end = num_tiles * (w + 1) / pool->num_workers;
+	}
+
+	if (!InitTaskGroup(&group))
+		goto out;
+	r = TRUE;
+	for (w = 0; (w < pool->num_workers) && (w < num_tiles) && r; w++)
+		r = SubmitTask(pool, &group, TileTask, &tiles);
+	if (!r)
+		CancelTaskGroup(&group);
+	r = WaitTaskGroup(pool, &group) && r;
+	CloseTaskGroup(&group);
+
+out:
+	free(tiles.order);
+	free(tiles.span);
+	return r;
+}
+
+static BOOL ParallelForGrid(pool_t* pool, DWORD dims, const pool_box_t* box, size_t item_size,
+	pool_tile_fn fn, void* ctx)
+{
+	uint64_t size[3], tile[3], num_tiles;
+	DWORD d;
+
+	for (d = 0; d < dims; d++)
+		size[d] = (box->end[d] > box->begin[d]) ? box->end[d] - box->begin[d] : 0;
+	GetTileSize(dims, size, max(item_size, 1), tile);
+	// Cut the outer dimension until there are enough tiles for every worker to get a few
+	do {
+		for (num_tiles = 1, d = 0; d < dims; d++)
+			num_tiles *= (size[d] + tile[d] - 1) / tile[d];
+		if ((num_tiles >= (uint64_t)pool->num_workers * POOL_TILES_PER_WORKER) || (tile[dims - 1] == 1))
+			break;
+		tile[dims - 1] = (tile[dims - 1] + 1) / 2;
+	} while (1);
+	return ParallelForTiles(pool, dims, box, tile, fn, ctx);
+}
+
+BOOL ParallelFor2D(pool_t* pool, const pool_box_t* box, size_t item_size, pool_tile_fn fn, void* ctx)
+{
+	return ParallelForGrid(pool, 2, box, item_size, fn, ctx);
+}
+
+BOOL ParallelFor3D(pool_t* pool, const pool_box_t* box, size_t item_size, pool_tile_fn fn, void* ctx)
+{
+	return ParallelForGrid(pool, 3, box, item_size, fn, ctx);
+}
@@ -0,0 +1,141 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Thread pool
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <stdint.h>
+
+typedef struct pool pool_t;
+
+// A task gets called with its context and the index of the worker running it
+typedef void (*pool_task_fn)(void* ctx, uint32_t worker);
+// A range function processes items [begin, end)
+typedef void (*pool_range_fn)(void* ctx, uint32_t worker, uint64_t begin, uint64_t end);
+// A find function searches items [begin, end), and sets index to the first match, if any
+typedef BOOL (*pool_find_fn)(void* ctx, uint32_t worker, uint64_t begin, uint64_t end, uint64_t* index);
+
+// Items [begin[i], end[i]) along each dimension, x first, with [0, 1) for the ones that aren't used
+typedef struct {
+	uint64_t begin[3];
+	uint64_t end[3];
+} pool_box_t;
+// A tile function processes the items of a box
+typedef void (*pool_tile_fn)(void* ctx, uint32_t worker, const pool_box_t* tile);
+
+// A group of tasks that can be waited on or cancelled together
+typedef struct pool_group {
+	volatile LONG pending;
+	volatile LONG cancelled;
+	HANDLE done;
+	// The scope it was initialized in, which cancels it along with itself
+	struct pool_group* parent;
+} pool_group_t;
+
+typedef struct {
+	DWORD workers;
+	uint64_t submitted;
+	uint64_t completed;
+	uint64_t helped;			// Run by workers waiting on a group, rather than from the main loop
+	uint64_t queued;			// Submitted, but not picked up yet
+	uint64_t queue_peak;
+} pool_stats_t;
+
+/*
+ * Create a pool of workers, each one pinned according to the matching
+ * affinity mask (0 for no pinning), as set up by SetThreadAffinity().
+ */
+extern pool_t* CreatePool(DWORD num_workers, const DWORD_PTR* affinity);
+extern void DestroyPool(pool_t* pool);
+extern DWORD PoolSize(pool_t* pool);
+extern void CancelPool(pool_t* pool);
+// Counters of the pool since its creation, which keep moving while tasks run
+extern void GetPoolStats(pool_t* pool, pool_stats_t* stats);
+
+extern BOOL InitTaskGroup(pool_group_t* group);
+extern void CloseTaskGroup(pool_group_t* group);
+extern void CancelTaskGroup(pool_group_t* group);
+extern BOOL TaskCancelled(pool_t* pool, pool_group_t* group);
+
+/*
+ * Make group the cancellation scope of the calling thread, returning the
+ * previous one. Groups initialized from this thread, and from the tasks it
+ * submits, down to their own tasks, get cancelled when the scope does, which
+ * lets independent jobs share a pool without CancelPool() stopping them all.
+ * The scope must outlive the work that gets started in it. NULL to leave it.
+ */
+extern pool_group_t* SetTaskScope(pool_group_t* group);
+
+/*
+ * Queue a task. group can be NULL for fire and forget. Tasks can only be
+ * added to a group by its owner, before it calls WaitTaskGroup(), or by
+ * tasks of the same group. When called from a worker, WaitTaskGroup() runs
+ * queued tasks while it waits, so tasks can submit and wait for other tasks
+ * without deadlocking the pool.
+ */
+extern BOOL SubmitTask(pool_t* pool, pool_group_t* group, pool_task_fn fn, void* ctx);
+extern BOOL WaitTaskGroup(pool_t* pool, pool_group_t* group);
+
+/*
+ * Split [begin, end) into chunks of grain items (0 to pick a default)
+ * that the workers grab as they go, and wait for all of them to be
+ * processed. Returns FALSE on error or if the pool got cancelled.
+ */
+extern BOOL ParallelFor(pool_t* pool, uint64_t begin, uint64_t end, uint64_t grain,
+	pool_range_fn fn, void* ctx);
+
+/*
+ * Same as the above, for a search that stops once a match is found: the
+ * workers check for one before each chunk, so they stop within a chunk of
+ * it. If lowest is set, only the chunks after the lowest match so far get
+ * skipped, so that index always gets the lowest one, otherwise it gets the
+ * first one found, or a lower one found at the same time. index is set to
+ * end if there is no match.
+ */
+extern BOOL ParallelFind(pool_t* pool, uint64_t begin, uint64_t end, uint64_t grain,
+	pool_find_fn fn, void* ctx, BOOL lowest, uint64_t* index);
+
+/*
+ * Tile sizes for a grid of dims dimensions, of size items of item_size
+ * bytes each, from the share of the L1 and L2 data caches each logical
+ * processor has: across every dimension but the last one, a tile is the
+ * square root of half of L1 in items, in whole cache lines along x, so that
+ * the lines it goes through stay in L1 from one step down the last one to
+ * the next, and it is as long along that one as it takes to fill half of
+ * L2. dims goes from 1 to 3.
+ */
+extern void GetTileSize(DWORD dims, const uint64_t* size, size_t item_size, uint64_t* tile);
+
+/*
+ * Split box into tiles of tile items, and wait for all of them to be
+ * processed. The tiles are laid out along a Morton curve, that gets split
+ * into one stretch per worker, so that a worker gets tiles that are next
+ * to each other, and the same ones from one call to the next, which keeps
+ * them in the cache of its core when the pool was set up with one worker
+ * per logical processor. Workers that are done with their own stretch take
+ * tiles from the ones after it, that the layout of SetThreadAffinity() puts
+ * on the processors next to theirs.
+ */
+extern BOOL ParallelForTiles(pool_t* pool, DWORD dims, const pool_box_t* box, const uint64_t* tile,
+	pool_tile_fn fn, void* ctx);
+
+// Same as the above, with the tile size from GetTileSize(), down to a few tiles per worker
+extern BOOL ParallelFor2D(pool_t* pool, const pool_box_t* box, size_t item_size, pool_tile_fn fn, void* ctx);
+extern BOOL ParallelFor3D(pool_t* pool, const pool_box_t* box, size_t item_size, pool_tile_fn fn, void* ctx);
@@ -0,0 +1,371 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Bulk population count
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "pool.h"
+#include "popcnt.h"
+
+#if defined(CPU_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <immintrin.h>
+#endif
+#elif defined(CPU_ARM64)
+#if defined(_MSC_VER)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
+// Amount of data each worker grabs at once in ParallelPopcount()
+#define POPCNT_CHUNK_SIZE	(1 << 20)
+// Spacing between the per-worker counts, to avoid false sharing
+#define POPCNT_COUNT_STRIDE	(64 / sizeof(uint64_t))
+
+typedef uint64_t (*popcount_fn)(const uint8_t* a, const uint8_t* b, size_t len);
+
+typedef struct {
+	popcount_fn fn;
+	const uint8_t* a;
+	const uint8_t* b;
+	uint64_t* count;
+} popcount_range_t;
+
+/*
+ * Each kernel below is written once, for a generic operation, and then
+ * specialized into one function per operation, so that the choice of
+ * operation doesn't cost anything in the inner loop.
+ */
+#define POPCOUNT_VARIANTS(name, target)													\
+static target uint64_t name##_none(const uint8_t* a, const uint8_t* b, size_t len)	\
+	{ return name(a, b, len, POPCNT_OP_NONE); }											\
+static target uint64_t name##_and(const uint8_t* a, const uint8_t* b, size_t len)	\
+	{ return name(a, b, len, POPCNT_OP_AND); }											\
+static target uint64_t name##_or(const uint8_t* a, const uint8_t* b, size_t len)	\
+	{ return name(a, b, len, POPCNT_OP_OR); }											\
+static target uint64_t name##_xor(const uint8_t* a, const uint8_t* b, size_t len)	\
+	{ return name(a, b, len, POPCNT_OP_XOR); }											\
+static const popcount_fn name##_fn[POPCNT_OP_MAX] =										\
+	{ name##_none, name##_and, name##_or, name##_xor }
+
+static popcount_fn popcount_kernel[POPCNT_OP_MAX];
+static const char* popcount_name;
+
+static __inline uint64_t read64(const uint8_t* p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static FORCE_INLINE uint64_t op64(uint64_t a, uint64_t b, int op)
+{
+	switch (op) {
+	case POPCNT_OP_AND: return a & b;
+	case POPCNT_OP_OR: return a | b;
+	case POPCNT_OP_XOR: return a ^ b;
+	default: return a;
+	}
+}
+
+static __inline uint64_t popcount64(uint64_t u)
+{
+	u -= (u >> 1) & 0x5555555555555555;
+	u = (u & 0x3333333333333333) + ((u >> 2) & 0x3333333333333333);
+	u = (u + (u >> 4)) & 0x0f0f0f0f0f0f0f0f;
+	return (u * 0x0101010101010101) >> 56;
+}
+
+static FORCE_INLINE uint64_t popcount_tail(const uint8_t* a, const uint8_t* b, size_t len, int op)
+{
+	uint64_t cnt = 0;
+
+	while (len-- > 0)
+		cnt += popcount64(op64(*a++, *b++, op));
+	return cnt;
+}
+
+static FORCE_INLINE uint64_t popcount_scalar(const uint8_t* a, const uint8_t* b, size_t len, int op)
+{
+	uint64_t cnt = 0;
+
+	for (; len >= 8; a += 8, b += 8, len -= 8)
+		cnt += popcount64(op64(read64(a), read64(b), op));
+	return cnt + popcount_tail(a, b, len, op);
+}
+POPCOUNT_VARIANTS(popcount_scalar, );
+
+#if defined(CPU_X86)
+#if defined(CPU_X64)
+#define hw_popcnt64(u)		((uint64_t)_mm_popcnt_u64(u))
+#else
+#define hw_popcnt64(u)		((uint64_t)_mm_popcnt_u32((uint32_t)(u)) + _mm_popcnt_u32((uint32_t)((u) >> 32)))
+#endif
+
+/*
+ * Hardware POPCNT, with 4 accumulators so that we're not limited by
+ * the latency of the instruction.
+ */
+static FORCE_INLINE TARGET_ATTR("popcnt") uint64_t popcount_popcnt(const uint8_t* a, const uint8_t* b, size_t len, int op)
+{
+	uint64_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+
+	for (; len >= 32; a += 32, b += 32, len -= 32) {
+		c0 += hw_popcnt64(op64(read64(a), read64(b), op));
+		c1 += hw_popcnt64(op64(read64(a + 8), read64(b + 8), op));
+		c2 += hw_popcnt64(op64(read64(a + 16), read64(b + 16), op));
+		c3 += hw_popcnt64(op64(read64(a + 24), read64(b + 24), op));
+	}
+	for (; len >= 8; a += 8, b += 8, len -= 8)
+		c0 += hw_popcnt64(op64(read64(a), read64(b), op));
+	return c0 + c1 + c2 + c3 + popcount_tail(a, b, len, op);
+}
+POPCOUNT_VARIANTS(popcount_popcnt, TARGET_ATTR("popcnt"));
+
+/*
+ * AVX2 Harley-Seal: a tree of carry-save adders reduces 16 vectors into
+ * ones/twos/fours/eights/sixteens counters, so that we only need to do a
+ * full (nibble lookup) population count on one vector out of 16.
+ * See Muła, Kurz & Lemire, "Faster Population Counts Using AVX2 Instructions".
+ */
+static FORCE_INLINE TARGET_ATTR("avx2") __m256i avx2_load(const uint8_t* a, const uint8_t* b, size_t i, int op)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i*)(a + 32 * i));
+
+	switch (op) {
+	case POPCNT_OP_AND: return _mm256_and_si256(v, _mm256_loadu_si256((const __m256i*)(b + 32 * i)));
+	case POPCNT_OP_OR: return _mm256_or_si256(v, _mm256_loadu_si256((const __m256i*)(b + 32 * i)));
+	case POPCNT_OP_XOR: return _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i*)(b + 32 * i)));
+	default: return v;
+	}
+}
+
+static FORCE_INLINE TARGET_ATTR("avx2") __m256i avx2_popcount(__m256i v)
+{
+	const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	__m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(v, mask));
+	__m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+	return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+static FORCE_INLINE TARGET_ATTR("avx2") void avx2_csa(__m256i* h, __m256i* l, __m256i a, __m256i b, __m256i c)
+{
+	__m256i u = _mm256_xor_si256(a, b);
+	*h = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+	*l = _mm256_xor_si256(u, c);
+}
+
+static FORCE_INLINE TARGET_ATTR("avx2") uint64_t popcount_avx2(const uint8_t* a, const uint8_t* b, size_t len, int op)
+{
+	__m256i total = _mm256_setzero_si256(), ones = _mm256_setzero_si256(), twos = _mm256_setzero_si256();
+	__m256i fours = _mm256_setzero_si256(), eights = _mm256_setzero_si256(), sixteens;
+	__m256i twos_a, twos_b, fours_a, fours_b, eights_a, eights_b;
+	uint64_t lanes[4];
+	size_t i, n = len / 32;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		avx2_csa(&twos_a, &ones, ones, avx2_load(a, b, i, op), avx2_load(a, b, i + 1, op));
+		avx2_csa(&twos_b, &ones, ones, avx2_load(a, b, i + 2, op), avx2_load(a, b, i + 3, op));
+		avx2_csa(&fours_a, &twos, twos, twos_a, twos_b);
+		avx2_csa(&twos_a, &ones, ones, avx2_load(a, b, i + 4, op), avx2_load(a, b, i + 5, op));
+		avx2_csa(&twos_b, &ones, ones, avx2_load(a, b, i + 6, op), avx2_load(a, b, i + 7, op));
+		avx2_csa(&fours_b, &twos, twos, twos_a, twos_b);
+		avx2_csa(&eights_a, &fours, fours, fours_a, fours_b);
+		avx2_csa(&twos_a, &ones, ones, avx2_load(a, b, i + 8, op), avx2_load(a, b, i + 9, op));
+		avx2_csa(&twos_b, &ones, ones, avx2_load(a, b, i + 10, op), avx2_load(a, b, i + 11, op));
+		avx2_csa(&fours_a, &twos, twos, twos_a, twos_b);
+		avx2_csa(&twos_a, &ones, ones, avx2_load(a, b, i + 12, op), avx2_load(a, b, i + 13, op));
+		avx2_csa(&twos_b, &ones, ones, avx2_load(a, b, i + 14, op), avx2_load(a, b, i + 15, op));
+		avx2_csa(&fours_b, &twos, twos, twos_a, twos_b);
+		avx2_csa(&eights_b, &fours, fours, fours_a, fours_b);
+		avx2_csa(&sixteens, &eights, eights, eights_a, eights_b);
+		total = _mm256_add_epi64(total, avx2_popcount(sixteens));
+	}
+	total = _mm256_slli_epi64(total, 4);
+	total = _mm256_add_epi64(total, _mm256_slli_epi64(avx2_popcount(eights), 3));
+	total = _mm256_add_epi64(total, _mm256_slli_epi64(avx2_popcount(fours), 2));
+	total = _mm256_add_epi64(total, _mm256_slli_epi64(avx2_popcount(twos), 1));
+	total = _mm256_add_epi64(total, avx2_popcount(ones));
+	for (; i < n; i++)
+		total = _mm256_add_epi64(total, avx2_popcount(avx2_load(a, b, i, op)));
+
+	_mm256_storeu_si256((__m256i*)lanes, total);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + popcount_tail(a + 32 * n, b + 32 * n, len % 32, op);
+}
+POPCOUNT_VARIANTS(popcount_avx2, TARGET_ATTR("avx2"));
+
+/*
+ * AVX-512 VPOPCNTDQ, which does a full 64-bit population count per lane.
+ */
+static FORCE_INLINE TARGET_ATTR("avx512f,avx512vpopcntdq") __m512i avx512_load(const uint8_t* a, const uint8_t* b, int op)
+{
+	__m512i v = _mm512_loadu_si512((const void*)a);
+
+	switch (op) {
+	case POPCNT_OP_AND: return _mm512_and_si512(v, _mm512_loadu_si512((const void*)b));
+	case POPCNT_OP_OR: return _mm512_or_si512(v, _mm512_loadu_si512((const void*)b));
+	case POPCNT_OP_XOR: return _mm512_xor_si512(v, _mm512_loadu_si512((const void*)b));
+	default: return v;
+	}
+}
+
+static FORCE_INLINE TARGET_ATTR("avx512f,avx512vpopcntdq") uint64_t popcount_avx512(const uint8_t* a, const uint8_t* b, size_t len, int op)
+{
+	__m512i c0 = _mm512_setzero_si512(), c1 = _mm512_setzero_si512();
+
+	for (; len >= 128; a += 128, b += 128, len -= 128) {
+		c0 = _mm512_add_epi64(c0, _mm512_popcnt_epi64(avx512_load(a, b, op)));
+		c1 = _mm512_add_epi64(c1, _mm512_popcnt_epi64(avx512_load(a + 64, b + 64, op)));
+	}
+	if (len >= 64) {
+		c0 = _mm512_add_epi64(c0, _mm512_popcnt_epi64(avx512_load(a, b, op)));
+		a += 64;
+		b += 64;
+		len -= 64;
+	}
+	return (uint64_t)_mm512_reduce_add_epi64(_mm512_add_epi64(c0, c1)) + popcount_tail(a, b, len, op);
+}
+POPCOUNT_VARIANTS(popcount_avx512, TARGET_ATTR("avx512f,avx512vpopcntdq"));
+#endif
+
+#if defined(CPU_ARM64)
+/*
+ * NEON CNT gives us per-byte counts, that we add up over 4 vectors
+ * before widening them into the 64-bit accumulator.
+ */
+static FORCE_INLINE uint8x16_t neon_load(const uint8_t* a, const uint8_t* b, int op)
+{
+	uint8x16_t v = vld1q_u8(a);
+
+	switch (op) {
+	case POPCNT_OP_AND: return vandq_u8(v, vld1q_u8(b));
+	case POPCNT_OP_OR: return vorrq_u8(v, vld1q_u8(b));
+	case POPCNT_OP_XOR: return veorq_u8(v, vld1q_u8(b));
+	default: return v;
+	}
+}
+
+static FORCE_INLINE uint64_t popcount_neon(const uint8_t* a, const uint8_t* b, size_t len, int op)
+{
+	uint64x2_t acc = vdupq_n_u64(0);
+	uint8x16_t t;
+
+	for (; len >= 64; a += 64, b += 64, len -= 64) {
+		t = vaddq_u8(vaddq_u8(vcntq_u8(neon_load(a, b, op)), vcntq_u8(neon_load(a + 16, b + 16, op))),
+			vaddq_u8(vcntq_u8(neon_load(a + 32, b + 32, op)), vcntq_u8(neon_load(a + 48, b + 48, op))));
+		acc = vpadalq_u32(acc, vpaddlq_u16(vpaddlq_u8(t)));
+	}
+	for (; len >= 16; a += 16, b += 16, len -= 16)
+		acc = vpadalq_u32(acc, vpaddlq_u16(vpaddlq_u8(vcntq_u8(neon_load(a, b, op)))));
+	return vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1) + popcount_tail(a, b, len, op);
+}
+POPCOUNT_VARIANTS(popcount_neon, );
+#endif
+
+static const cpu_variant_t popcount_variant[] = {
+#if defined(CPU_X86)
+	CPU_VARIANT(CPU_FEATURE_AVX512F | CPU_FEATURE_AVX512_VPOPCNTDQ, popcount_avx512_fn, "AVX-512 VPOPCNTDQ"),
+	CPU_VARIANT(CPU_FEATURE_AVX2, popcount_avx2_fn, "AVX2 Harley-Seal"),
+	CPU_VARIANT(CPU_FEATURE_POPCNT, popcount_popcnt_fn, "POPCNT"),
+#elif defined(CPU_ARM64)
+	CPU_VARIANT(CPU_FEATURE_NEON, popcount_neon_fn, "NEON CNT"),
+#endif
+	CPU_VARIANT(0, popcount_scalar_fn, "Scalar"),
+};
+
+/*
+ * Select the fastest implementation for this CPU.
+ * DetectCpuFeatures() must have been called first.
+ */
+void popcount_init(void)
+{
+	const cpu_variant_t* v = SelectCpuVariant(popcount_variant);
+
+	memcpy(popcount_kernel, v->impl, sizeof(popcount_kernel));
+	popcount_name = v->name;
+}
+
+const char* popcount_impl(void)
+{
+	return popcount_name;
+}
+
+uint64_t popcount(const void* buf, size_t len)
+{
+	return popcount_kernel[POPCNT_OP_NONE]((const uint8_t*)buf, (const uint8_t*)buf, len);
+}
+
+uint64_t popcount_and(const void* a, const void* b, size_t len)
+{
+	return popcount_kernel[POPCNT_OP_AND]((const uint8_t*)a, (const uint8_t*)b, len);
+}
+
+uint64_t popcount_or(const void* a, const void* b, size_t len)
+{
+	return popcount_kernel[POPCNT_OP_OR]((const uint8_t*)a, (const uint8_t*)b, len);
+}
+
+uint64_t popcount_xor(const void* a, const void* b, size_t len)
+{
+	return popcount_kernel[POPCNT_OP_XOR]((const uint8_t*)a, (const uint8_t*)b, len);
+}
+
+static void PopcountRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	popcount_range_t* range = (popcount_range_t*)ctx;
+
+	range->count[worker * POPCNT_COUNT_STRIDE] +=
+		range->fn(range->a + begin, range->b + begin, (size_t)(end - begin));
+}
+
+BOOL ParallelPopcount(pool_t* pool, popcnt_op_t op, const void* a, const void* b,
+	size_t len, uint64_t* count)
+{
+	popcount_range_t range;
+	DWORD i;
+	BOOL r;
+
+	if ((op >= POPCNT_OP_MAX) || (count == NULL))
+		return FALSE;
+	range.fn = popcount_kernel[op];
+	range.a = (const uint8_t*)a;
+	range.b = (const uint8_t*)((op == POPCNT_OP_NONE) ? a : b);
+	range.count = (uint64_t*)calloc((size_t)PoolSize(pool) * POPCNT_COUNT_STRIDE, sizeof(uint64_t));
+	if (range.count == NULL)
+		return FALSE;
+
+	r = ParallelFor(pool, 0, len, POPCNT_CHUNK_SIZE, PopcountRange, &range);
+	*count = 0;
+	for (i = 0; i < PoolSize(pool); i++)
+		*count += range.count[i * POPCNT_COUNT_STRIDE];
+	free(range.count);
+	return r;
+}
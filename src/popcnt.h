@@ -0,0 +1,59 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Bulk population count
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+// Logical operation applied to two bitmaps before their bits are counted
+typedef enum {
+	POPCNT_OP_NONE = 0,
+	POPCNT_OP_AND,
+	POPCNT_OP_OR,
+	POPCNT_OP_XOR,
+	POPCNT_OP_MAX
+} popcnt_op_t;
+
+static __inline uint8_t popcnt64(register uint64_t u)
+{
+	u = (u & 0x5555555555555555) + ((u >> 1) & 0x5555555555555555);
+	u = (u & 0x3333333333333333) + ((u >> 2) & 0x3333333333333333);
+	u = (u & 0x0f0f0f0f0f0f0f0f) + ((u >> 4) & 0x0f0f0f0f0f0f0f0f);
+	u = (u & 0x00ff00ff00ff00ff) + ((u >> 8) & 0x00ff00ff00ff00ff);
+	u = (u & 0x0000ffff0000ffff) + ((u >> 16) & 0x0000ffff0000ffff);
+	u = (u & 0x00000000ffffffff) + ((u >> 32) & 0x00000000ffffffff);
+	return (uint8_t)u;
+}
+
+extern void popcount_init(void);
+extern const char* popcount_impl(void);
+
+// Return the number of bits set in len bytes, optionally after combining a and b
+extern uint64_t popcount(const void* buf, size_t len);
+extern uint64_t popcount_and(const void* a, const void* b, size_t len);
+extern uint64_t popcount_or(const void* a, const void* b, size_t len);
+extern uint64_t popcount_xor(const void* a, const void* b, size_t len);
+
+// Same as the above, with the bitmap(s) split across the workers of the pool
+extern BOOL ParallelPopcount(pool_t* pool, popcnt_op_t op, const void* a, const void* b,
+	size_t len, uint64_t* count);
@@ -0,0 +1,545 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Prefix sums and stream compaction
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "pool.h"
+#include "popcnt.h"
+#include "prefix.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(CPU_X86)
+#if !defined(_MSC_VER)
+#include <immintrin.h>
+#endif
+#elif defined(CPU_ARM64)
+#if defined(_MSC_VER)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
+// Spacing between the per-tile sums, to avoid false sharing
+#define PREFIX_SUM_STRIDE	(64 / sizeof(uint64_t))
+// How many blocks per worker ParallelCompact() aims for
+#define PREFIX_BLOCKS_PER_WORKER	8
+
+typedef struct {
+	uint32_t (*sum32)(const uint32_t* in, size_t n);
+	uint64_t (*sum64)(const uint64_t* in, size_t n);
+	// Exclusive, then inclusive
+	uint32_t (*scan32[2])(const uint32_t* in, uint32_t* out, size_t n, uint32_t carry);
+	uint64_t (*scan64[2])(const uint64_t* in, uint64_t* out, size_t n, uint64_t carry);
+} prefix_kernel_t;
+
+typedef struct {
+	const uint8_t* in;
+	uint8_t* out;
+	size_t width;			// Of an item, 4 or 8
+	size_t n, tile;			// Items in the round, and in a tile
+	BOOL inclusive;
+	uint64_t* sums;
+} prefix_range_t;
+
+typedef struct {
+	const uint8_t* in;
+	uint8_t* out;
+	size_t n, size, block;		// block is a multiple of 64, so that blocks have their own flags
+	prefix_keep_fn keep;
+	void* ctx;
+	uint64_t* flags;
+	uint64_t* offset;		// Count of the items each block keeps, then where they go
+} compact_range_t;
+
+/*
+ * Each kernel below is written once, for both kinds of sums, and then
+ * specialized, so that the choice doesn't cost anything in the inner loop.
+ */
+#define PREFIX_VARIANTS(isa, target)													\
+static target uint32_t scan32_##isa##_exc(const uint32_t* in, uint32_t* out, size_t n, uint32_t carry)	\
+	{ return scan32_##isa(in, out, n, carry, 0); }									\
+static target uint32_t scan32_##isa##_inc(const uint32_t* in, uint32_t* out, size_t n, uint32_t carry)	\
+	{ return scan32_##isa(in, out, n, carry, 1); }									\
+static target uint64_t scan64_##isa##_exc(const uint64_t* in, uint64_t* out, size_t n, uint64_t carry)	\
+	{ return scan64_##isa(in, out, n, carry, 0); }									\
+static target uint64_t scan64_##isa##_inc(const uint64_t* in, uint64_t* out, size_t n, uint64_t carry)	\
+	{ return scan64_##isa(in, out, n, carry, 1); }									\
+static const prefix_kernel_t prefix_##isa##_kernel = { sum32_##isa, sum64_##isa,		\
+	{ scan32_##isa##_exc, scan32_##isa##_inc }, { scan64_##isa##_exc, scan64_##isa##_inc } }
+
+static FORCE_INLINE uint32_t prefix_ctz64(uint64_t mask)
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+	unsigned long i;
+	_BitScanForward64(&i, mask);
+	return (uint32_t)i;
+#elif defined(_MSC_VER)
+	unsigned long i;
+	if ((uint32_t)mask != 0) {
+		_BitScanForward(&i, (uint32_t)mask);
+		return (uint32_t)i;
+	}
+	_BitScanForward(&i, (uint32_t)(mask >> 32));
+	return (uint32_t)i + 32;
+#else
+	return (uint32_t)__builtin_ctzll(mask);
+#endif
+}
+
+static uint32_t sum32_scalar(const uint32_t* in, size_t n)
+{
+	uint32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		s0 += in[i];
+		s1 += in[i + 1];
+		s2 += in[i + 2];
+		s3 += in[i + 3];
+	}
+	for (; i < n; i++)
+		s0 += in[i];
+	return s0 + s1 + s2 + s3;
+}
+
+static uint64_t sum64_scalar(const uint64_t* in, size_t n)
+{
+	uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		s0 += in[i];
+		s1 += in[i + 1];
+		s2 += in[i + 2];
+		s3 += in[i + 3];
+	}
+	for (; i < n; i++)
+		s0 += in[i];
+	return s0 + s1 + s2 + s3;
+}
+
+static FORCE_INLINE uint32_t scan32_scalar(const uint32_t* in, uint32_t* out, size_t n, uint32_t carry, int inclusive)
+{
+	uint32_t v;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		v = in[i];
+		out[i] = inclusive ? carry + v : carry;
+		carry += v;
+	}
+	return carry;
+}
+
+static FORCE_INLINE uint64_t scan64_scalar(const uint64_t* in, uint64_t* out, size_t n, uint64_t carry, int inclusive)
+{
+	uint64_t v;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		v = in[i];
+		out[i] = inclusive ? carry + v : carry;
+		carry += v;
+	}
+	return carry;
+}
+PREFIX_VARIANTS(scalar, );
+
+#if defined(CPU_X86)
+static TARGET_ATTR("avx2") uint32_t sum32_avx2(const uint32_t* in, size_t n)
+{
+	__m256i s0 = _mm256_setzero_si256(), s1 = _mm256_setzero_si256();
+	__m128i s;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		s0 = _mm256_add_epi32(s0, _mm256_loadu_si256((const __m256i*)(in + i)));
+		s1 = _mm256_add_epi32(s1, _mm256_loadu_si256((const __m256i*)(in + i + 8)));
+	}
+	s0 = _mm256_add_epi32(s0, s1);
+	s = _mm_add_epi32(_mm256_castsi256_si128(s0), _mm256_extracti128_si256(s0, 1));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (uint32_t)_mm_cvtsi128_si32(s) + sum32_scalar(in + i, n - i);
+}
+
+static TARGET_ATTR("avx2") uint64_t sum64_avx2(const uint64_t* in, size_t n)
+{
+	__m256i s0 = _mm256_setzero_si256(), s1 = _mm256_setzero_si256();
+	uint64_t lanes[4];
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		s0 = _mm256_add_epi64(s0, _mm256_loadu_si256((const __m256i*)(in + i)));
+		s1 = _mm256_add_epi64(s1, _mm256_loadu_si256((const __m256i*)(in + i + 4)));
+	}
+	_mm256_storeu_si256((__m256i*)lanes, _mm256_add_epi64(s0, s1));
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sum64_scalar(in + i, n - i);
+}
+
+/*
+ * In register scans: log2(lanes) shifted adds within each 128-bit lane, then
+ * the top of the low lane added to the high one, then the carry, which we
+ * keep broadcast in a register so that it's only one add on the critical path.
+ */
+static FORCE_INLINE TARGET_ATTR("avx2") uint32_t scan32_avx2(const uint32_t* in, uint32_t* out, size_t n, uint32_t carry, int inclusive)
+{
+	const __m256i last = _mm256_set1_epi32(7);
+	__m256i c = _mm256_set1_epi32((int)carry), v, x, t;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm256_loadu_si256((const __m256i*)(in + i));
+		x = _mm256_add_epi32(v, _mm256_slli_si256(v, 4));
+		x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+		t = _mm256_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+		x = _mm256_add_epi32(x, _mm256_permute2x128_si256(t, t, 0x08));
+		x = _mm256_add_epi32(x, c);
+		_mm256_storeu_si256((__m256i*)(out + i), inclusive ? x : _mm256_sub_epi32(x, v));
+		c = _mm256_permutevar8x32_epi32(x, last);
+	}
+	carry = (uint32_t)_mm_cvtsi128_si32(_mm256_castsi256_si128(c));
+	return scan32_scalar(in + i, out + i, n - i, carry, inclusive);
+}
+
+static FORCE_INLINE TARGET_ATTR("avx2") uint64_t scan64_avx2(const uint64_t* in, uint64_t* out, size_t n, uint64_t carry, int inclusive)
+{
+	__m256i c = _mm256_set1_epi64x((long long)carry), v, x, t;
+	uint64_t lanes[4];
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		v = _mm256_loadu_si256((const __m256i*)(in + i));
+		x = _mm256_add_epi64(v, _mm256_slli_si256(v, 8));
+		t = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(1, 1, 1, 1));
+		x = _mm256_add_epi64(x, _mm256_blend_epi32(_mm256_setzero_si256(), t, 0xf0));
+		x = _mm256_add_epi64(x, c);
+		_mm256_storeu_si256((__m256i*)(out + i), inclusive ? x : _mm256_sub_epi64(x, v));
+		c = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	_mm256_storeu_si256((__m256i*)lanes, c);
+	return scan64_scalar(in + i, out + i, n - i, lanes[0], inclusive);
+}
+PREFIX_VARIANTS(avx2, TARGET_ATTR("avx2"));
+#endif
+
+#if defined(CPU_ARM64)
+static uint32_t sum32_neon(const uint32_t* in, size_t n)
+{
+	uint32x4_t s0 = vdupq_n_u32(0), s1 = vdupq_n_u32(0);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		s0 = vaddq_u32(s0, vld1q_u32(in + i));
+		s1 = vaddq_u32(s1, vld1q_u32(in + i + 4));
+	}
+	return vaddvq_u32(vaddq_u32(s0, s1)) + sum32_scalar(in + i, n - i);
+}
+
+static uint64_t sum64_neon(const uint64_t* in, size_t n)
+{
+	uint64x2_t s0 = vdupq_n_u64(0), s1 = vdupq_n_u64(0);
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		s0 = vaddq_u64(s0, vld1q_u64(in + i));
+		s1 = vaddq_u64(s1, vld1q_u64(in + i + 2));
+	}
+	return vaddvq_u64(vaddq_u64(s0, s1)) + sum64_scalar(in + i, n - i);
+}
+
+static FORCE_INLINE uint32_t scan32_neon(const uint32_t* in, uint32_t* out, size_t n, uint32_t carry, int inclusive)
+{
+	const uint32x4_t zero = vdupq_n_u32(0);
+	uint32x4_t c = vdupq_n_u32(carry), v, x;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		v = vld1q_u32(in + i);
+		x = vaddq_u32(v, vextq_u32(zero, v, 3));
+		x = vaddq_u32(x, vextq_u32(zero, x, 2));
+		x = vaddq_u32(x, c);
+		vst1q_u32(out + i, inclusive ? x : vsubq_u32(x, v));
+		c = vdupq_laneq_u32(x, 3);
+	}
+	return scan32_scalar(in + i, out + i, n - i, vgetq_lane_u32(c, 0), inclusive);
+}
+
+static FORCE_INLINE uint64_t scan64_neon(const uint64_t* in, uint64_t* out, size_t n, uint64_t carry, int inclusive)
+{
+	const uint64x2_t zero = vdupq_n_u64(0);
+	uint64x2_t c = vdupq_n_u64(carry), v, x;
+	size_t i;
+
+	for (i = 0; i + 2 <= n; i += 2) {
+		v = vld1q_u64(in + i);
+		x = vaddq_u64(vaddq_u64(v, vextq_u64(zero, v, 1)), c);
+		vst1q_u64(out + i, inclusive ? x : vsubq_u64(x, v));
+		c = vdupq_laneq_u64(x, 1);
+	}
+	return scan64_scalar(in + i, out + i, n - i, vgetq_lane_u64(c, 0), inclusive);
+}
+PREFIX_VARIANTS(neon, );
+#endif
+
+static const prefix_kernel_t* prefix_kernel = &prefix_scalar_kernel;
+static const char* prefix_name = "Scalar";
+
+static const cpu_variant_t prefix_variant[] = {
+#if defined(CPU_X86)
+	CPU_VARIANT(CPU_FEATURE_AVX2, &prefix_avx2_kernel, "AVX2"),
+#elif defined(CPU_ARM64)
+	CPU_VARIANT(CPU_FEATURE_NEON, &prefix_neon_kernel, "NEON"),
+#endif
+	CPU_VARIANT(0, &prefix_scalar_kernel, "Scalar"),
+};
+
+// DetectCpuFeatures() must have been called first
+void prefix_init(void)
+{
+	const cpu_variant_t* v = SelectCpuVariant(prefix_variant);
+
+	prefix_kernel = (const prefix_kernel_t*)v->impl;
+	prefix_name = v->name;
+}
+
+const char* prefix_impl(void)
+{
+	return prefix_name;
+}
+
+uint32_t prefix_sum32(const uint32_t* in, uint32_t* out, size_t n, uint32_t carry, BOOL inclusive)
+{
+	return prefix_kernel->scan32[inclusive ? 1 : 0](in, out, n, carry);
+}
+
+uint64_t prefix_sum64(const uint64_t* in, uint64_t* out, size_t n, uint64_t carry, BOOL inclusive)
+{
+	return prefix_kernel->scan64[inclusive ? 1 : 0](in, out, n, carry);
+}
+
+static void PrefixSumTile(void* ctx, uint32_t worker, const pool_box_t* tile)
+{
+	prefix_range_t* range = (prefix_range_t*)ctx;
+	size_t i, len;
+	uint64_t b;
+
+	for (b = tile->begin[0]; b < tile->end[0]; b++) {
+		i = (size_t)b * range->tile;
+		len = min(range->tile, range->n - i);
+		if (range->width == sizeof(uint32_t))
+			range->sums[b * PREFIX_SUM_STRIDE] = prefix_kernel->sum32((const uint32_t*)range->in + i, len);
+		else
+			range->sums[b * PREFIX_SUM_STRIDE] = prefix_kernel->sum64((const uint64_t*)range->in + i, len);
+	}
+}
+
+static void PrefixScanTile(void* ctx, uint32_t worker, const pool_box_t* tile)
+{
+	prefix_range_t* range = (prefix_range_t*)ctx;
+	size_t i, len;
+	uint64_t b;
+
+	for (b = tile->begin[0]; b < tile->end[0]; b++) {
+		i = (size_t)b * range->tile;
+		len = min(range->tile, range->n - i);
+		if (range->width == sizeof(uint32_t))
+			prefix_kernel->scan32[range->inclusive ? 1 : 0]((const uint32_t*)range->in + i,
+				(uint32_t*)range->out + i, len, (uint32_t)range->sums[b * PREFIX_SUM_STRIDE]);
+		else
+			prefix_kernel->scan64[range->inclusive ? 1 : 0]((const uint64_t*)range->in + i,
+				(uint64_t*)range->out + i, len, range->sums[b * PREFIX_SUM_STRIDE]);
+	}
+}
+
+static BOOL ParallelPrefixSum(pool_t* pool, const void* in, void* out, size_t n, size_t width,
+	BOOL inclusive, uint64_t* total)
+{
+	prefix_range_t range;
+	pool_box_t box = { { 0, 0, 0 }, { 0, 1, 1 } };
+	uint64_t carry = 0, sum, one = 1;
+	size_t base, b, blocks, workers = PoolSize(pool);
+	BOOL r = TRUE;
+
+	range.width = width;
+	range.tile = PREFIX_TILE_SIZE / width;
+	range.inclusive = inclusive;
+	// Not worth waking up the workers for a single tile
+	if ((n <= range.tile) || (workers == 1)) {
+		if (width == sizeof(uint32_t))
+			carry = prefix_sum32((const uint32_t*)in, (uint32_t*)out, n, 0, inclusive);
+		else
+			carry = prefix_sum64((const uint64_t*)in, (uint64_t*)out, n, 0, inclusive);
+		goto out;
+	}
+
+	range.sums = (uint64_t*)calloc(workers * PREFIX_SUM_STRIDE, sizeof(uint64_t));
+	if (range.sums == NULL)
+		return FALSE;
+	for (base = 0; r && (base < n); base += range.n) {
+		range.in = (const uint8_t*)in + base * width;
+		range.out = (uint8_t*)out + base * width;
+		range.n = min(n - base, workers * range.tile);
+		blocks = (range.n + range.tile - 1) / range.tile;
+		// ParallelForTiles() gives a worker the same span of blocks from one call to the
+		// next, so that it scans the block it added up, unless it had to be taken over
+		box.end[0] = blocks;
+		r = ParallelForTiles(pool, 1, &box, &one, PrefixSumTile, &range);
+		for (b = 0; b < blocks; b++) {
+			sum = range.sums[b * PREFIX_SUM_STRIDE];
+			range.sums[b * PREFIX_SUM_STRIDE] = carry;
+			carry += sum;
+		}
+		r = r && ParallelForTiles(pool, 1, &box, &one, PrefixScanTile, &range);
+	}
+	free(range.sums);
+
+out:
+	if (total != NULL)
+		*total = carry;
+	return r;
+}
+
+BOOL ParallelPrefixSum32(pool_t* pool, const uint32_t* in, uint32_t* out, size_t n,
+	BOOL inclusive, uint32_t* total)
+{
+	uint64_t sum;
+	BOOL r = ParallelPrefixSum(pool, in, out, n, sizeof(uint32_t), inclusive, &sum);
+
+	if (total != NULL)
+		*total = (uint32_t)sum;
+	return r;
+}
+
+BOOL ParallelPrefixSum64(pool_t* pool, const uint64_t* in, uint64_t* out, size_t n,
+	BOOL inclusive, uint64_t* total)
+{
+	return ParallelPrefixSum(pool, in, out, n, sizeof(uint64_t), inclusive, total);
+}
+
+static void CompactCountRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	compact_range_t* range = (compact_range_t*)ctx;
+	const uint8_t* item;
+	uint64_t b, flags, count;
+	size_t i, j, last;
+
+	for (b = begin; b < end; b++) {
+		count = 0;
+		last = min((size_t)(b + 1) * range->block, range->n);
+		for (i = (size_t)b * range->block; i < last; i += 64) {
+			item = range->in + i * range->size;
+			flags = 0;
+			for (j = 0; (j < 64) && (i + j < last); j++, item += range->size) {
+				if (range->keep(range->ctx, item, i + j))
+					flags |= 1ULL << j;
+			}
+			range->flags[i / 64] = flags;
+			count += popcnt64(flags);
+		}
+		range->offset[b] = count;
+	}
+}
+
+static FORCE_INLINE void compact_copy(const uint8_t* in, uint8_t* out, const uint64_t* flags,
+	size_t first, size_t last, size_t size)
+{
+	uint64_t mask;
+	size_t i;
+
+	for (i = first; i < last; i += 64) {
+		for (mask = flags[i / 64]; mask != 0; mask &= mask - 1) {
+			memcpy(out, in + (i + prefix_ctz64(mask)) * size, size);
+			out += size;
+		}
+	}
+}
+
+static void CompactCopyRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	compact_range_t* range = (compact_range_t*)ctx;
+	uint8_t* out;
+	size_t first, last;
+	uint64_t b;
+
+	for (b = begin; b < end; b++) {
+		first = (size_t)b * range->block;
+		last = min(first + range->block, range->n);
+		out = range->out + range->offset[b] * range->size;
+		// Let the compiler turn memcpy() into a move for the usual sizes
+		switch (range->size) {
+		case 4:
+			compact_copy(range->in, out, range->flags, first, last, 4);
+			break;
+		case 8:
+			compact_copy(range->in, out, range->flags, first, last, 8);
+			break;
+		default:
+			compact_copy(range->in, out, range->flags, first, last, range->size);
+			break;
+		}
+	}
+}
+
+BOOL ParallelCompact(pool_t* pool, const void* in, size_t n, size_t size,
+	prefix_keep_fn keep, void* ctx, void* out, size_t* count)
+{
+	compact_range_t range;
+	size_t blocks;
+	BOOL r = FALSE;
+
+	*count = 0;
+	if ((n == 0) || (size == 0))
+		return TRUE;
+
+	range.in = (const uint8_t*)in;
+	range.out = (uint8_t*)out;
+	range.n = n;
+	range.size = size;
+	range.keep = keep;
+	range.ctx = ctx;
+	range.block = n / ((size_t)PoolSize(pool) * PREFIX_BLOCKS_PER_WORKER);
+	range.block = max((range.block + 63) & ~(size_t)63, 64);
+	blocks = (n + range.block - 1) / range.block;
+	range.flags = (uint64_t*)malloc(((n + 63) / 64) * sizeof(uint64_t));
+	range.offset = (uint64_t*)malloc(blocks * sizeof(uint64_t));
+	if ((range.flags == NULL) || (range.offset == NULL))
+		goto out;
+
+	// Count what each block keeps, turn that into where it goes, then copy
+	if (!ParallelFor(pool, 0, blocks, 1, CompactCountRange, &range))
+		goto out;
+	*count = (size_t)prefix_sum64(range.offset, range.offset, blocks, 0, FALSE);
+	r = ParallelFor(pool, 0, blocks, 1, CompactCopyRange, &range);
+
+out:
+	free(range.flags);
+	free(range.offset);
+	return r;
+}
@@ -0,0 +1,66 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Prefix sums and stream compaction
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+// Input each worker scans at once, which should fit its share of the cache
+#define PREFIX_TILE_SIZE	(256 << 10)
+
+// Whether ParallelCompact() keeps item index, that is at item
+typedef BOOL (*prefix_keep_fn)(void* ctx, const void* item, size_t index);
+
+extern void prefix_init(void);
+extern const char* prefix_impl(void);
+
+/*
+ * Write the running sums of in, starting from carry, to out, which can be
+ * in. The inclusive sums include in[i] in out[i], the exclusive ones don't.
+ * Return carry plus the sum of in. Sums wrap around on overflow.
+ */
+extern uint32_t prefix_sum32(const uint32_t* in, uint32_t* out, size_t n, uint32_t carry, BOOL inclusive);
+extern uint64_t prefix_sum64(const uint64_t* in, uint64_t* out, size_t n, uint64_t carry, BOOL inclusive);
+
+/*
+ * Same as the above, from 0, on the workers of the pool. The input gets
+ * split into rounds of one tile per worker: the workers add up their tile,
+ * the caller turns these into the carry of each tile, then the workers scan
+ * their tile from its carry. Both passes go through ParallelForTiles(), so
+ * that a worker gets the same tile in each, and scans it while it is still
+ * in its cache, unless the worker was held up and another one took the
+ * tile over. total can be NULL.
+ */
+extern BOOL ParallelPrefixSum32(pool_t* pool, const uint32_t* in, uint32_t* out, size_t n,
+	BOOL inclusive, uint32_t* total);
+extern BOOL ParallelPrefixSum64(pool_t* pool, const uint64_t* in, uint64_t* out, size_t n,
+	BOOL inclusive, uint64_t* total);
+
+/*
+ * Copy the n items of size bytes from in, for which keep returns TRUE, to
+ * out, in order, and set count to the number of them. keep gets called once
+ * per item, from the workers. out must not overlap in.
+ */
+extern BOOL ParallelCompact(pool_t* pool, const void* in, size_t n, size_t size,
+	prefix_keep_fn keep, void* ctx, void* out, size_t* count);
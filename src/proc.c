@@ -0,0 +1,477 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Multi-process workers over shared memory
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msapi_utf8.h"
+#include "proc.h"
+
+// Number of slots of each ring, which must be a power of 2
+#define PROC_RING_SLOTS		64
+// How long we wait for results before we check on the workers again (ms)
+#define PROC_POLL_TIME		100
+// How long we give the workers to exit (ms)
+#define PROC_EXIT_WAIT		5000
+#define PROC_MAGIC			0x434f5250	// "PROC"
+
+typedef struct {
+	uint64_t seq;
+	uint32_t code;				// Handler for a task, success for a result
+	uint32_t size;
+	uint8_t data[PROC_DATA_SIZE];
+} proc_slot_t;
+
+// A single producer, single consumer ring, with its indexes on separate cache lines
+typedef struct {
+	volatile LONG head;
+	uint8_t pad0[64 - sizeof(LONG)];
+	volatile LONG tail;
+	uint8_t pad1[64 - sizeof(LONG)];
+} proc_ring_t;
+
+// What the parent and a worker share
+typedef struct {
+	proc_ring_t tasks;
+	proc_ring_t results;
+	proc_slot_t task[PROC_RING_SLOTS];
+	proc_slot_t result[PROC_RING_SLOTS];
+} proc_channel_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t num_workers;
+	DWORD parent_pid;
+	volatile LONG exiting;
+	proc_channel_t channel[1];
+} proc_shared_t;
+
+typedef struct {
+	HANDLE process;
+	HANDLE task_event;
+	DWORD_PTR affinity;
+	// Last result we reported, as a worker that dies at the wrong time may report one twice
+	uint64_t last_seq;
+	// Task at which the worker died last, and how many times it did
+	LONG crash_tail;
+	DWORD attempts;
+} proc_worker_t;
+
+struct proc_pool {
+	char name[64];
+	HANDLE mapping;
+	proc_shared_t* shared;
+	HANDLE result_event;
+	proc_worker_t* worker;
+	DWORD num_workers;
+	proc_result_fn fn;
+	void* ctx;
+	uint64_t last_id;
+	uint64_t submitted;
+	proc_stats_t stats;
+};
+
+static proc_handler_fn proc_handler[PROC_MAX_HANDLERS] = { 0 };
+
+/*
+ * Interlocked calls are full barriers, so a slot is complete by the time its
+ * index gets published, and seen complete by the time its index gets read.
+ */
+static __inline LONG RingLoad(volatile LONG* index)
+{
+	return InterlockedCompareExchange(index, 0, 0);
+}
+
+static __inline void RingStore(volatile LONG* index, LONG value)
+{
+	InterlockedExchange(index, value);
+}
+
+static __inline DWORD RingUsed(proc_ring_t* ring)
+{
+	return (DWORD)RingLoad(&ring->head) - (DWORD)RingLoad(&ring->tail);
+}
+
+static __inline LONG RingNext(LONG index)
+{
+	return (LONG)((DWORD)index + 1);
+}
+
+static __inline DWORD RingSlot(LONG index)
+{
+	return (DWORD)index & (PROC_RING_SLOTS - 1);
+}
+
+BOOL RegisterProcHandler(uint32_t handler, proc_handler_fn fn)
+{
+	if (handler >= PROC_MAX_HANDLERS)
+		return FALSE;
+	proc_handler[handler] = fn;
+	return TRUE;
+}
+
+proc_handler_fn GetProcHandler(uint32_t handler)
+{
+	return (handler < PROC_MAX_HANDLERS) ? proc_handler[handler] : NULL;
+}
+
+int ProcWorkerMain(const char* name, DWORD index)
+{
+	char obj[128];
+	HANDLE mapping = NULL, task_event = NULL, result_event = NULL, parent = NULL, wait[2];
+	proc_shared_t* shared = NULL;
+	proc_channel_t* ch;
+	proc_slot_t *task, *result;
+	proc_handler_fn fn;
+	LONG tail, head;
+	int r = 1;
+
+	snprintf(obj, sizeof(obj), "Local\\%s", name);
+	mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, obj);
+	if (mapping == NULL)
+		goto out;
+	shared = (proc_shared_t*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if ((shared == NULL) || (shared->magic != PROC_MAGIC) || (index >= shared->num_workers))
+		goto out;
+	ch = &shared->channel[index];
+	snprintf(obj, sizeof(obj), "Local\\%s-task-%lu", name, index);
+	task_event = OpenEventA(SYNCHRONIZE | EVENT_MODIFY_STATE, FALSE, obj);
+	snprintf(obj, sizeof(obj), "Local\\%s-result", name);
+	result_event = OpenEventA(SYNCHRONIZE | EVENT_MODIFY_STATE, FALSE, obj);
+	// So that we don't linger if the parent goes away without telling us
+	parent = OpenProcess(SYNCHRONIZE, FALSE, shared->parent_pid);
+	if ((task_event == NULL) || (result_event == NULL) || (parent == NULL))
+		goto out;
+	wait[0] = task_event;
+	wait[1] = parent;
+
+	while (!RingLoad(&shared->exiting)) {
+		tail = ch->tasks.tail;
+		head = ch->results.head;
+		if ((RingLoad(&ch->tasks.head) == tail) || (RingUsed(&ch->results) == PROC_RING_SLOTS)) {
+			if (WaitForMultipleObjects(2, wait, FALSE, INFINITE) != WAIT_OBJECT_0)
+				break;
+			continue;
+		}
+		task = &ch->task[RingSlot(tail)];
+		result = &ch->result[RingSlot(head)];
+		fn = GetProcHandler(task->code);
+		result->seq = task->seq;
+		result->size = PROC_DATA_SIZE;
+		result->code = (fn != NULL) && fn(task->data, task->size, result->data, &result->size);
+		if (!result->code || (result->size > PROC_DATA_SIZE))
+			result->size = 0;
+		RingStore(&ch->results.head, RingNext(head));
+		SetEvent(result_event);
+		// Only retire the task once its result is out, so that it gets retried if we die
+		RingStore(&ch->tasks.tail, RingNext(tail));
+	}
+	r = 0;
+
+out:
+	if (parent != NULL)
+		CloseHandle(parent);
+	if (result_event != NULL)
+		CloseHandle(result_event);
+	if (task_event != NULL)
+		CloseHandle(task_event);
+	if (shared != NULL)
+		UnmapViewOfFile(shared);
+	if (mapping != NULL)
+		CloseHandle(mapping);
+	return r;
+}
+
+static BOOL SpawnWorker(proc_pool_t* pp, DWORD index)
+{
+	char exe[MAX_PATH], cmd[MAX_PATH + 128];
+	STARTUPINFOA si = { 0 };
+	PROCESS_INFORMATION pi;
+
+	if (GetModuleFileNameU(NULL, exe, sizeof(exe)) == 0)
+		return FALSE;
+	snprintf(cmd, sizeof(cmd), "\"%s\" -w %s %lu", exe, pp->name, index);
+	si.cb = sizeof(si);
+	// Suspended, so that it only ever runs on the processor it's meant for
+	if (!CreateProcessU(exe, cmd, NULL, NULL, FALSE, CREATE_SUSPENDED | CREATE_NO_WINDOW, NULL, NULL,
+		&si, &pi)) {
+		fprintf(stderr, "Unable to start worker process #%02d: %lu\n", index, GetLastError());
+		return FALSE;
+	}
+	if (pp->worker[index].affinity != 0)
+		SetProcessAffinityMask(pi.hProcess, pp->worker[index].affinity);
+	ResumeThread(pi.hThread);
+	CloseHandle(pi.hThread);
+	pp->worker[index].process = pi.hProcess;
+	return TRUE;
+}
+
+static void ReportResult(proc_pool_t* pp, uint64_t id, BOOL success, const void* result, uint32_t size)
+{
+	pp->stats.tasks++;
+	if (!success)
+		pp->stats.failed++;
+	if (pp->fn != NULL)
+		pp->fn(pp->ctx, id, success, result, size);
+}
+
+// Report the results that the workers published, returning how many there were
+static DWORD DrainResults(proc_pool_t* pp)
+{
+	proc_channel_t* ch;
+	proc_worker_t* w;
+	proc_slot_t* result;
+	LONG head, tail;
+	DWORD i, n = 0;
+
+	for (i = 0; i < pp->num_workers; i++) {
+		ch = &pp->shared->channel[i];
+		w = &pp->worker[i];
+		head = RingLoad(&ch->results.head);
+		tail = ch->results.tail;
+		if (tail == head)
+			continue;
+		for (; tail != head; tail = RingNext(tail)) {
+			result = &ch->result[RingSlot(tail)];
+			if (result->seq <= w->last_seq)
+				continue;
+			w->last_seq = result->seq;
+			ReportResult(pp, result->seq, (BOOL)result->code, result->data, result->size);
+			n++;
+		}
+		RingStore(&ch->results.tail, tail);
+		// It may have been waiting for room to put its results in
+		SetEvent(w->task_event);
+	}
+	return n;
+}
+
+/*
+ * Restart a worker that died. If it was running a task, that task stays at
+ * the tail of its ring so that the new worker runs it again, unless it has
+ * now killed PROC_MAX_ATTEMPTS workers, in which case we fail it.
+ */
+static BOOL RestartWorker(proc_pool_t* pp, DWORD index)
+{
+	proc_worker_t* w = &pp->worker[index];
+	proc_channel_t* ch = &pp->shared->channel[index];
+	proc_slot_t* task;
+	LONG tail;
+
+	CloseHandle(w->process);
+	w->process = NULL;
+	pp->stats.respawns++;
+	DrainResults(pp);
+	// With the worker gone, we are the only one accessing its rings
+	tail = ch->tasks.tail;
+	if (ch->tasks.head != tail) {
+		task = &ch->task[RingSlot(tail)];
+		if (task->seq <= w->last_seq) {
+			// It died after sending the result
+			ch->tasks.tail = RingNext(tail);
+		} else {
+			if (tail != w->crash_tail) {
+				w->crash_tail = tail;
+				w->attempts = 0;
+			}
+			if (++w->attempts >= PROC_MAX_ATTEMPTS) {
+				w->last_seq = task->seq;
+				ReportResult(pp, task->seq, FALSE, NULL, 0);
+				ch->tasks.tail = RingNext(tail);
+				w->attempts = 0;
+			}
+		}
+	}
+	return SpawnWorker(pp, index);
+}
+
+// Wait up to ms for results, restarting any worker that died. Returns FALSE on error.
+static BOOL WaitResults(proc_pool_t* pp, DWORD ms)
+{
+	HANDLE wait[MAXIMUM_WAIT_OBJECTS];
+	DWORD i, r;
+
+	wait[0] = pp->result_event;
+	for (i = 0; i < pp->num_workers; i++)
+		wait[i + 1] = pp->worker[i].process;
+	r = WaitForMultipleObjects(pp->num_workers + 1, wait, FALSE, ms);
+	if ((r > WAIT_OBJECT_0) && (r <= WAIT_OBJECT_0 + pp->num_workers))
+		return RestartWorker(pp, r - WAIT_OBJECT_0 - 1);
+	return (r != WAIT_FAILED);
+}
+
+proc_pool_t* CreateProcPool(DWORD num_workers, const DWORD_PTR* affinity, proc_result_fn fn, void* ctx)
+{
+	static volatile LONG num_pools = 0;
+	char obj[128];
+	proc_pool_t* pp;
+	size_t size;
+	DWORD i;
+
+	// We wait on all the workers along with the result event
+	if ((num_workers == 0) || (num_workers > MAXIMUM_WAIT_OBJECTS - 1))
+		return NULL;
+
+	pp = (proc_pool_t*)calloc(1, sizeof(proc_pool_t));
+	if (pp == NULL)
+		return NULL;
+	pp->fn = fn;
+	pp->ctx = ctx;
+	pp->worker = (proc_worker_t*)calloc(num_workers, sizeof(proc_worker_t));
+	if (pp->worker == NULL)
+		goto error;
+	snprintf(pp->name, sizeof(pp->name), "base-parallel-%lu-%ld", GetCurrentProcessId(),
+		InterlockedIncrement(&num_pools));
+
+	size = offsetof(proc_shared_t, channel) + num_workers * sizeof(proc_channel_t);
+	snprintf(obj, sizeof(obj), "Local\\%s", pp->name);
+	pp->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32),
+		(DWORD)size, obj);
+	if (pp->mapping == NULL)
+		goto error;
+	// A new mapping is zeroed, which is what the rings start as
+	pp->shared = (proc_shared_t*)MapViewOfFile(pp->mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (pp->shared == NULL)
+		goto error;
+	pp->shared->magic = PROC_MAGIC;
+	pp->shared->num_workers = num_workers;
+	pp->shared->parent_pid = GetCurrentProcessId();
+	snprintf(obj, sizeof(obj), "Local\\%s-result", pp->name);
+	pp->result_event = CreateEventA(NULL, FALSE, FALSE, obj);
+	if (pp->result_event == NULL)
+		goto error;
+
+	for (i = 0; i < num_workers; i++) {
+		snprintf(obj, sizeof(obj), "Local\\%s-task-%lu", pp->name, i);
+		pp->worker[i].task_event = CreateEventA(NULL, FALSE, FALSE, obj);
+		if (pp->worker[i].task_event == NULL)
+			goto error;
+		pp->worker[i].affinity = (affinity != NULL) ? affinity[i] : 0;
+		pp->num_workers++;
+		if (!SpawnWorker(pp, i))
+			goto error;
+	}
+	return pp;
+
+error:
+	fprintf(stderr, "Could not create process pool.\n");
+	DestroyProcPool(pp);
+	return NULL;
+}
+
+void DestroyProcPool(proc_pool_t* pp)
+{
+	HANDLE process[MAXIMUM_WAIT_OBJECTS];
+	DWORD i, n = 0;
+
+	if (pp == NULL)
+		return;
+
+	if (pp->shared != NULL) {
+		RingStore(&pp->shared->exiting, TRUE);
+		for (i = 0; i < pp->num_workers; i++) {
+			SetEvent(pp->worker[i].task_event);
+			if (pp->worker[i].process != NULL)
+				process[n++] = pp->worker[i].process;
+		}
+		if ((n != 0) && (WaitForMultipleObjects(n, process, TRUE, PROC_EXIT_WAIT) != WAIT_OBJECT_0)) {
+			printf("Worker processes did not finalize\n");
+			for (i = 0; i < n; i++)
+				TerminateProcess(process[i], 1);
+		}
+	}
+	for (i = 0; (pp->worker != NULL) && (i < pp->num_workers); i++) {
+		if (pp->worker[i].process != NULL)
+			CloseHandle(pp->worker[i].process);
+		if (pp->worker[i].task_event != NULL)
+			CloseHandle(pp->worker[i].task_event);
+	}
+	if (pp->result_event != NULL)
+		CloseHandle(pp->result_event);
+	if (pp->shared != NULL)
+		UnmapViewOfFile(pp->shared);
+	if (pp->mapping != NULL)
+		CloseHandle(pp->mapping);
+	free(pp->worker);
+	free(pp);
+}
+
+BOOL SubmitProcTask(proc_pool_t* pp, uint32_t handler, const void* task, uint32_t size, uint64_t* id)
+{
+	proc_channel_t* ch;
+	proc_slot_t* slot;
+	DWORD i, best, used, best_used;
+	LONG head;
+
+	if ((handler >= PROC_MAX_HANDLERS) || (size > PROC_DATA_SIZE)) {
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+
+	// Go for the worker with the least tasks queued, waiting for one to have room if needed
+	while (1) {
+		best = pp->num_workers;
+		best_used = PROC_RING_SLOTS;
+		for (i = 0; i < pp->num_workers; i++) {
+			used = RingUsed(&pp->shared->channel[i].tasks);
+			if (used < best_used) {
+				best = i;
+				best_used = used;
+			}
+		}
+		if (best < pp->num_workers)
+			break;
+		if ((DrainResults(pp) == 0) && !WaitResults(pp, PROC_POLL_TIME))
+			return FALSE;
+	}
+
+	ch = &pp->shared->channel[best];
+	head = ch->tasks.head;
+	slot = &ch->task[RingSlot(head)];
+	slot->seq = ++pp->last_id;
+	slot->code = handler;
+	slot->size = size;
+	memcpy(slot->data, task, size);
+	RingStore(&ch->tasks.head, RingNext(head));
+	SetEvent(pp->worker[best].task_event);
+	pp->submitted++;
+	if (id != NULL)
+		*id = pp->last_id;
+	return TRUE;
+}
+
+BOOL WaitProcPool(proc_pool_t* pp)
+{
+	while (pp->stats.tasks < pp->submitted) {
+		if ((DrainResults(pp) == 0) && !WaitResults(pp, PROC_POLL_TIME))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+void GetProcPoolStats(proc_pool_t* pp, proc_stats_t* stats)
+{
+	*stats = pp->stats;
+}
@@ -0,0 +1,84 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Multi-process workers over shared memory
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <stdint.h>
+
+// Maximum number of handlers, and maximum size of a task or result
+#define PROC_MAX_HANDLERS	32
+#define PROC_DATA_SIZE		(4096 - 16)
+// Number of times a task that crashes its worker gets retried before it fails
+#define PROC_MAX_ATTEMPTS	3
+
+typedef struct proc_pool proc_pool_t;
+
+/*
+ * Process a task in a worker process, writing up to *result_size bytes of
+ * result and updating *result_size with what was written. Returns FALSE if
+ * the task failed. Handlers are referred to by the index they were registered
+ * with, as the same code lives at different addresses in different processes.
+ */
+typedef BOOL (*proc_handler_fn)(const void* task, uint32_t task_size, void* result, uint32_t* result_size);
+
+// Get the result of task id, or a failure if it kept crashing its worker
+typedef void (*proc_result_fn)(void* ctx, uint64_t id, BOOL success, const void* result, uint32_t result_size);
+
+typedef struct {
+	uint64_t tasks;				// Completed, successfully or not
+	uint64_t failed;
+	uint64_t respawns;			// Workers that had to be restarted
+} proc_stats_t;
+
+/*
+ * Handlers must be registered the same way in the parent and in the workers,
+ * which run the same executable, before CreateProcPool() or ProcWorkerMain().
+ */
+extern BOOL RegisterProcHandler(uint32_t handler, proc_handler_fn fn);
+extern proc_handler_fn GetProcHandler(uint32_t handler);
+
+/*
+ * Start num_workers copies of this executable, each pinned according to the
+ * matching affinity mask (0 for no pinning), and fed with tasks through a
+ * lock-free ring buffer in shared memory, with the results coming back the
+ * same way. A worker that dies gets restarted, with the task it was running
+ * being retried. Results are reported through fn, from the thread that
+ * calls SubmitProcTask() or WaitProcPool(), as only that thread may use the
+ * pool.
+ */
+extern proc_pool_t* CreateProcPool(DWORD num_workers, const DWORD_PTR* affinity, proc_result_fn fn, void* ctx);
+extern void DestroyProcPool(proc_pool_t* pp);
+
+/*
+ * Queue a task of size bytes for handler, returning its id in *id (can be
+ * NULL). This processes results if the rings of all the workers are full.
+ */
+extern BOOL SubmitProcTask(proc_pool_t* pp, uint32_t handler, const void* task, uint32_t size, uint64_t* id);
+
+// Wait for the results of all the tasks. Returns FALSE if a worker could not be restarted.
+extern BOOL WaitProcPool(proc_pool_t* pp);
+extern void GetProcPoolStats(proc_pool_t* pp, proc_stats_t* stats);
+
+/*
+ * What a worker process runs, when started by CreateProcPool() with
+ * "-w NAME INDEX" on its command line. Returns once the pool is destroyed.
+ */
+extern int ProcWorkerMain(const char* name, DWORD index);
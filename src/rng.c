@@ -0,0 +1,370 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Counter-based random number streams
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "rng.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(CPU_X86)
+#if !defined(_MSC_VER)
+#include <immintrin.h>
+#endif
+#elif defined(CPU_ARM64)
+#if defined(_MSC_VER)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
+#define PHILOX_ROUNDS		10
+#define PHILOX_M0		0xd2511f53
+#define PHILOX_M1		0xcd9e8d57
+#define PHILOX_W0		0x9e3779b9
+#define PHILOX_W1		0xbb67ae85
+
+// Uniforms rng_normals() gets at once
+#define RNG_NORMAL_BATCH	256
+// Exponent of 1.0, that the 52 bits of a uniform get put under, to get a double in [1, 2)
+#define RNG_ONE_BITS		0x3ff0000000000000ULL
+
+#ifndef M_PI
+#define M_PI			3.14159265358979323846
+#endif
+
+typedef struct {
+	// Blocks [block, block + count) of stream, to out
+	void (*blocks)(const uint32_t* key, uint64_t stream, uint64_t block, uint32_t* out, size_t count);
+	// Turn the n 64-bit words of buf into uniforms, in place
+	void (*uniforms)(void* buf, size_t n);
+} rng_kernel_t;
+
+static FORCE_INLINE void philox_block(const uint32_t* key, uint64_t stream, uint64_t block, uint32_t* out)
+{
+	uint32_t c0 = (uint32_t)block, c1 = (uint32_t)(block >> 32);
+	uint32_t c2 = (uint32_t)stream, c3 = (uint32_t)(stream >> 32);
+	uint32_t k0 = key[0], k1 = key[1];
+	uint64_t p0, p1;
+	int r;
+
+	for (r = 0; r < PHILOX_ROUNDS; r++) {
+		p0 = (uint64_t)PHILOX_M0 * c0;
+		p1 = (uint64_t)PHILOX_M1 * c2;
+		c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+		c1 = (uint32_t)p1;
+		c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+		c3 = (uint32_t)p0;
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+	out[0] = c0;
+	out[1] = c1;
+	out[2] = c2;
+	out[3] = c3;
+}
+
+static FORCE_INLINE double uniform_from_bits(uint64_t x)
+{
+	double d;
+
+	x = RNG_ONE_BITS | (x >> 12);
+	memcpy(&d, &x, sizeof(d));
+	return d - 1.0;
+}
+
+static void blocks_scalar(const uint32_t* key, uint64_t stream, uint64_t block, uint32_t* out, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		philox_block(key, stream, block + i, &out[4 * i]);
+}
+
+static void uniforms_scalar(void* buf, size_t n)
+{
+	uint8_t* p = (uint8_t*)buf;
+	uint64_t x;
+	double d;
+	size_t i;
+
+	for (i = 0; i < n; i++, p += sizeof(x)) {
+		memcpy(&x, p, sizeof(x));
+		d = uniform_from_bits(x);
+		memcpy(p, &d, sizeof(d));
+	}
+}
+static const rng_kernel_t rng_scalar_kernel = { blocks_scalar, uniforms_scalar };
+
+#if defined(CPU_X86)
+// The high and low halves of the products of the 8 lanes of x by m
+static FORCE_INLINE TARGET_ATTR("avx2") void mul_avx2(__m256i x, __m256i m, __m256i* hi, __m256i* lo)
+{
+	__m256i even = _mm256_mul_epu32(x, m), odd = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), m);
+
+	*lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xaa);
+	*hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xaa);
+}
+
+// 8 blocks at once, with word i of every block in c[i], which get transposed back at the end
+static TARGET_ATTR("avx2") void blocks_avx2(const uint32_t* key, uint64_t stream, uint64_t block, uint32_t* out, size_t count)
+{
+	const __m256i m0 = _mm256_set1_epi32((int)PHILOX_M0), m1 = _mm256_set1_epi32((int)PHILOX_M1);
+	const __m256i w0 = _mm256_set1_epi32((int)PHILOX_W0), w1 = _mm256_set1_epi32((int)PHILOX_W1);
+	__m256i c0, c1, c2, c3, k0, k1, hi0, lo0, hi1, lo1, t0, t1, t2, t3;
+	uint32_t lo[8], hi[8];
+	size_t i;
+	int j, r;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		for (j = 0; j < 8; j++) {
+			lo[j] = (uint32_t)(block + i + j);
+			hi[j] = (uint32_t)((block + i + j) >> 32);
+		}
+		c0 = _mm256_loadu_si256((const __m256i*)lo);
+		c1 = _mm256_loadu_si256((const __m256i*)hi);
+		c2 = _mm256_set1_epi32((int)(uint32_t)stream);
+		c3 = _mm256_set1_epi32((int)(uint32_t)(stream >> 32));
+		k0 = _mm256_set1_epi32((int)key[0]);
+		k1 = _mm256_set1_epi32((int)key[1]);
+		for (r = 0; r < PHILOX_ROUNDS; r++) {
+			mul_avx2(c0, m0, &hi0, &lo0);
+			mul_avx2(c2, m1, &hi1, &lo1);
+			c0 = _mm256_xor_si256(_mm256_xor_si256(hi1, c1), k0);
+			c1 = lo1;
+			c2 = _mm256_xor_si256(_mm256_xor_si256(hi0, c3), k1);
+			c3 = lo0;
+			k0 = _mm256_add_epi32(k0, w0);
+			k1 = _mm256_add_epi32(k1, w1);
+		}
+		// Blocks 0 and 4, 1 and 5, 2 and 6, 3 and 7, in the halves of t0 to t3
+		hi0 = _mm256_unpacklo_epi32(c0, c1);
+		lo0 = _mm256_unpacklo_epi32(c2, c3);
+		hi1 = _mm256_unpackhi_epi32(c0, c1);
+		lo1 = _mm256_unpackhi_epi32(c2, c3);
+		t0 = _mm256_unpacklo_epi64(hi0, lo0);
+		t1 = _mm256_unpackhi_epi64(hi0, lo0);
+		t2 = _mm256_unpacklo_epi64(hi1, lo1);
+		t3 = _mm256_unpackhi_epi64(hi1, lo1);
+		_mm256_storeu_si256((__m256i*)&out[4 * i], _mm256_permute2x128_si256(t0, t1, 0x20));
+		_mm256_storeu_si256((__m256i*)&out[4 * i + 8], _mm256_permute2x128_si256(t2, t3, 0x20));
+		_mm256_storeu_si256((__m256i*)&out[4 * i + 16], _mm256_permute2x128_si256(t0, t1, 0x31));
+		_mm256_storeu_si256((__m256i*)&out[4 * i + 24], _mm256_permute2x128_si256(t2, t3, 0x31));
+	}
+	blocks_scalar(key, stream, block + i, &out[4 * i], count - i);
+}
+
+static TARGET_ATTR("avx2") void uniforms_avx2(void* buf, size_t n)
+{
+	const __m256i one_bits = _mm256_set1_epi64x((long long)RNG_ONE_BITS);
+	const __m256d one = _mm256_set1_pd(1.0);
+	uint8_t* p = (uint8_t*)buf;
+	__m256i x;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4, p += 32) {
+		x = _mm256_or_si256(_mm256_srli_epi64(_mm256_loadu_si256((const __m256i*)p), 12), one_bits);
+		_mm256_storeu_pd((double*)p, _mm256_sub_pd(_mm256_castsi256_pd(x), one));
+	}
+	uniforms_scalar(p, n - i);
+}
+static const rng_kernel_t rng_avx2_kernel = { blocks_avx2, uniforms_avx2 };
+#elif defined(CPU_ARM64)
+static FORCE_INLINE void mul_neon(uint32x4_t x, uint32_t m, uint32x4_t* hi, uint32x4_t* lo)
+{
+	const uint32x2_t mm = vdup_n_u32(m);
+	uint64x2_t p0 = vmull_u32(vget_low_u32(x), mm), p1 = vmull_u32(vget_high_u32(x), mm);
+
+	*hi = vcombine_u32(vshrn_n_u64(p0, 32), vshrn_n_u64(p1, 32));
+	*lo = vcombine_u32(vmovn_u64(p0), vmovn_u64(p1));
+}
+
+// 4 blocks at once, that vst4q_u32() transposes back
+static void blocks_neon(const uint32_t* key, uint64_t stream, uint64_t block, uint32_t* out, size_t count)
+{
+	uint32x4x4_t c;
+	uint32x4_t k0, k1, hi0, lo0, hi1, lo1;
+	uint32_t lo[4], hi[4];
+	size_t i;
+	int j, r;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		for (j = 0; j < 4; j++) {
+			lo[j] = (uint32_t)(block + i + j);
+			hi[j] = (uint32_t)((block + i + j) >> 32);
+		}
+		c.val[0] = vld1q_u32(lo);
+		c.val[1] = vld1q_u32(hi);
+		c.val[2] = vdupq_n_u32((uint32_t)stream);
+		c.val[3] = vdupq_n_u32((uint32_t)(stream >> 32));
+		k0 = vdupq_n_u32(key[0]);
+		k1 = vdupq_n_u32(key[1]);
+		for (r = 0; r < PHILOX_ROUNDS; r++) {
+			mul_neon(c.val[0], PHILOX_M0, &hi0, &lo0);
+			mul_neon(c.val[2], PHILOX_M1, &hi1, &lo1);
+			c.val[0] = veorq_u32(veorq_u32(hi1, c.val[1]), k0);
+			c.val[1] = lo1;
+			c.val[2] = veorq_u32(veorq_u32(hi0, c.val[3]), k1);
+			c.val[3] = lo0;
+			k0 = vaddq_u32(k0, vdupq_n_u32(PHILOX_W0));
+			k1 = vaddq_u32(k1, vdupq_n_u32(PHILOX_W1));
+		}
+		vst4q_u32(&out[4 * i], c);
+	}
+	blocks_scalar(key, stream, block + i, &out[4 * i], count - i);
+}
+
+static void uniforms_neon(void* buf, size_t n)
+{
+	const uint64x2_t one_bits = vdupq_n_u64(RNG_ONE_BITS);
+	const float64x2_t one = vdupq_n_f64(1.0);
+	uint8_t* p = (uint8_t*)buf;
+	uint64x2_t x;
+	size_t i;
+
+	for (i = 0; i + 2 <= n; i += 2, p += 16) {
+		x = vorrq_u64(vshrq_n_u64(vld1q_u64((const uint64_t*)p), 12), one_bits);
+		vst1q_f64((double*)p, vsubq_f64(vreinterpretq_f64_u64(x), one));
+	}
+	uniforms_scalar(p, n - i);
+}
+static const rng_kernel_t rng_neon_kernel = { blocks_neon, uniforms_neon };
+#endif
+
+static const rng_kernel_t* rng_kernel = &rng_scalar_kernel;
+static const char* rng_name = "Scalar";
+
+static const cpu_variant_t rng_variant[] = {
+#if defined(CPU_X86)
+	CPU_VARIANT(CPU_FEATURE_AVX2, &rng_avx2_kernel, "AVX2"),
+#elif defined(CPU_ARM64)
+	CPU_VARIANT(CPU_FEATURE_NEON, &rng_neon_kernel, "NEON"),
+#endif
+	CPU_VARIANT(0, &rng_scalar_kernel, "Scalar"),
+};
+
+void rng_init(void)
+{
+	const cpu_variant_t* v = SelectCpuVariant(rng_variant);
+
+	rng_kernel = (const rng_kernel_t*)v->impl;
+	rng_name = v->name;
+}
+
+const char* rng_impl(void)
+{
+	return rng_name;
+}
+
+static __inline void rng_refill(rng_t* rng)
+{
+	philox_block(rng->key, rng->stream, rng->block++, rng->word);
+	rng->used = 0;
+}
+
+void rng_seed(rng_t* rng, uint64_t seed, uint64_t stream)
+{
+	rng->key[0] = (uint32_t)seed;
+	rng->key[1] = (uint32_t)(seed >> 32);
+	rng->stream = stream;
+	rng->block = 0;
+	rng->used = 4;
+}
+
+void rng_seek(rng_t* rng, uint64_t index)
+{
+	rng->block = index / 4;
+	rng_refill(rng);
+	rng->used = (uint32_t)(index % 4);
+}
+
+uint32_t rng_next32(rng_t* rng)
+{
+	if (rng->used >= 4)
+		rng_refill(rng);
+	return rng->word[rng->used++];
+}
+
+uint64_t rng_next64(rng_t* rng)
+{
+	uint64_t lo = rng_next32(rng);
+
+	return lo | ((uint64_t)rng_next32(rng) << 32);
+}
+
+double rng_uniform(rng_t* rng)
+{
+	return uniform_from_bits(rng_next64(rng));
+}
+
+void rng_fill32(rng_t* rng, uint32_t* out, size_t n)
+{
+	size_t count;
+
+	for (; (n > 0) && (rng->used < 4); n--)
+		*out++ = rng->word[rng->used++];
+	count = n / 4;
+	rng_kernel->blocks(rng->key, rng->stream, rng->block, out, count);
+	rng->block += count;
+	out += 4 * count;
+	n -= 4 * count;
+	if (n > 0) {
+		rng_refill(rng);
+		memcpy(out, rng->word, n * sizeof(uint32_t));
+		rng->used = (uint32_t)n;
+	}
+}
+
+// The words of the stream, low one first, are the ones of the uniforms on a little endian CPU
+void rng_uniforms(rng_t* rng, double* out, size_t n)
+{
+	rng_fill32(rng, (uint32_t*)out, 2 * n);
+	rng_kernel->uniforms(out, n);
+}
+
+void rng_normals(rng_t* rng, double* out, size_t n)
+{
+	double u[RNG_NORMAL_BATCH], r, t;
+	size_t i, k;
+
+	while (n > 0) {
+		k = min(n + (n & 1), RNG_NORMAL_BATCH);
+		rng_uniforms(rng, u, k);
+		for (i = 0; i < k; i += 2) {
+			r = sqrt(-2.0 * log(1.0 - u[i]));
+			t = 2.0 * M_PI * u[i + 1];
+			out[i] = r * cos(t);
+			if (i + 1 < n)
+				out[i + 1] = r * sin(t);
+		}
+		if (k >= n)
+			break;
+		out += k;
+		n -= k;
+	}
+}
@@ -0,0 +1,66 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Counter-based random number streams
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Philox4x32-10: block b of a stream is the 4 words that 10 rounds of
+ * multiply and XOR turn the counter (b, stream) into, under the key that
+ * comes from the seed. Nothing carries over from one block to the next, so
+ * that a stream costs nothing to set up and any block of it can be had on
+ * its own. Keying the streams by the index of a task, rather than by the
+ * worker that runs it, gives the same numbers whatever the scheduling.
+ */
+typedef struct {
+	uint32_t key[2];
+	uint64_t stream;
+	uint64_t block;			// Next block to generate
+	uint32_t word[4];		// Current block
+	uint32_t used;			// Words of the current block that have been handed out
+} rng_t;
+
+// DetectCpuFeatures() must have been called first
+extern void rng_init(void);
+extern const char* rng_impl(void);
+
+extern void rng_seed(rng_t* rng, uint64_t seed, uint64_t stream);
+// Move to word index of the stream
+extern void rng_seek(rng_t* rng, uint64_t index);
+
+extern uint32_t rng_next32(rng_t* rng);
+extern uint64_t rng_next64(rng_t* rng);
+// Uniform in [0, 1), from 52 bits of the next 2 words
+extern double rng_uniform(rng_t* rng);
+
+/*
+ * Bulk versions of the above, that generate as many blocks at once as the
+ * vector unit has lanes. They take the words of the stream in the same
+ * order as the calls above do, so that the results are the same whichever
+ * way they get generated. The normals come in pairs, from 2 uniforms each,
+ * through the Box-Muller transform, and the second one of the last pair
+ * gets dropped when n is odd.
+ */
+extern void rng_fill32(rng_t* rng, uint32_t* out, size_t n);
+extern void rng_uniforms(rng_t* rng, double* out, size_t n);
+extern void rng_normals(rng_t* rng, double* out, size_t n);
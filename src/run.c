@@ -0,0 +1,369 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Parallel external command runner
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msapi_utf8.h"
+#include "pool.h"
+#include "run.h"
+
+// Size of the pipe buffers, and minimum amount of room we read into
+#define RUN_PIPE_SIZE		(64 * 1024)
+#define RUN_READ_SIZE		(4 * 1024)
+// How often a worker waiting on a command checks for cancellation (ms)
+#define RUN_POLL_TIME		100
+
+typedef struct {
+	HANDLE pipe;
+	OVERLAPPED ov;
+	BOOL reading;
+	char* buf;
+	size_t len;
+	size_t size;
+} run_capture_t;
+
+typedef struct {
+	run_result_t result;
+	char* out;
+	char* err;
+	BOOL done;
+} run_job_t;
+
+typedef struct {
+	pool_t* pool;
+	pool_group_t group;
+	DWORD flags;
+	run_fn fn;
+	void* ctx;
+	const char* const* commands;
+	size_t count;
+	run_job_t* job;
+	volatile LONG64 next;
+	// Only one process gets created at a time, so that it doesn't inherit the pipes of another one
+	CRITICAL_SECTION spawn_lock;
+	// The rest is only accessed under this lock
+	CRITICAL_SECTION report_lock;
+	BOOL stopped;
+	size_t reported;
+	double* time;
+	size_t num_times;
+	uint64_t completed;
+	uint64_t failed;
+	uint64_t errors;
+} run_t;
+
+static double GetTime(void)
+{
+	static LARGE_INTEGER freq = { 0 };
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart / (double)freq.QuadPart;
+}
+
+/*
+ * Anonymous pipes can't do overlapped I/O, which we need to read stdout and
+ * stderr at the same time, so we use a named pipe that only we know about.
+ */
+static BOOL OpenCapture(run_capture_t* c, const wchar_t* name)
+{
+	memset(c, 0, sizeof(*c));
+	c->pipe = CreateNamedPipeW(name, PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+		PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS, 1, 0, RUN_PIPE_SIZE, 0, NULL);
+	if (c->pipe == INVALID_HANDLE_VALUE)
+		return FALSE;
+	c->ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	return (c->ov.hEvent != NULL);
+}
+
+static void CloseCapture(run_capture_t* c)
+{
+	DWORD size;
+
+	// We can't let go of the buffer while a read may still be writing into it
+	if (c->reading) {
+		CancelIoEx(c->pipe, &c->ov);
+		GetOverlappedResult(c->pipe, &c->ov, &size, TRUE);
+		c->reading = FALSE;
+	}
+	if (c->pipe != INVALID_HANDLE_VALUE)
+		CloseHandle(c->pipe);
+	if (c->ov.hEvent != NULL)
+		CloseHandle(c->ov.hEvent);
+	c->pipe = INVALID_HANDLE_VALUE;
+	c->ov.hEvent = NULL;
+}
+
+// Queue a read at the end of what we got so far. Returns FALSE on error.
+static BOOL StartRead(run_capture_t* c)
+{
+	HANDLE event = c->ov.hEvent;
+	size_t size;
+	char* buf;
+
+	if (c->size - c->len < RUN_READ_SIZE) {
+		size = max(2 * c->size, c->len + RUN_READ_SIZE);
+		buf = (char*)realloc(c->buf, size);
+		if (buf == NULL) {
+			SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+			return FALSE;
+		}
+		c->buf = buf;
+		c->size = size;
+	}
+	memset(&c->ov, 0, sizeof(c->ov));
+	c->ov.hEvent = event;
+	c->reading = ReadFile(c->pipe, &c->buf[c->len], (DWORD)min(c->size - c->len, MAXDWORD), NULL, &c->ov) ||
+		(GetLastError() == ERROR_IO_PENDING);
+	// A broken pipe means that the command closed its end, which is how we know it's done writing
+	return c->reading || (GetLastError() == ERROR_BROKEN_PIPE);
+}
+
+// Run a command to completion, capturing its output
+static void RunCommand(run_t* run, run_job_t* job)
+{
+	SECURITY_ATTRIBUTES sa = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+	STARTUPINFOA si = { 0 };
+	PROCESS_INFORMATION pi = { 0 };
+	run_capture_t capture[2], *c;
+	HANDLE child[3] = { INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE };
+	HANDLE wait[2];
+	run_capture_t* waiting[2];
+	wchar_t name[2][64];
+	DWORD i, n, r, size, error = ERROR_SUCCESS;
+	BOOL cancelled = FALSE;
+	double start = GetTime();
+
+	for (i = 0; i < 2; i++) {
+		swprintf(name[i], ARRAYSIZE(name[i]), L"\\\\.\\pipe\\base-parallel-%lu-%p-%lu",
+			GetCurrentProcessId(), (void*)job, i);
+		if (!OpenCapture(&capture[i], name[i]) && (error == ERROR_SUCCESS))
+			error = GetLastError();
+	}
+	if (error != ERROR_SUCCESS)
+		goto out;
+
+	EnterCriticalSection(&run->spawn_lock);
+	for (i = 0; i < 2; i++)
+		child[i] = CreateFileW(name[i], GENERIC_WRITE, 0, &sa, OPEN_EXISTING, 0, NULL);
+	child[2] = CreateFileW(L"NUL", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, NULL);
+	if ((child[0] == INVALID_HANDLE_VALUE) || (child[1] == INVALID_HANDLE_VALUE) ||
+		(child[2] == INVALID_HANDLE_VALUE)) {
+		error = GetLastError();
+	} else {
+		si.cb = sizeof(si);
+		si.dwFlags = STARTF_USESTDHANDLES;
+		si.hStdInput = child[2];
+		si.hStdOutput = child[0];
+		si.hStdError = child[1];
+		if (!CreateProcessU(NULL, job->result.command, NULL, NULL, TRUE, CREATE_NO_WINDOW, NULL, NULL,
+			&si, &pi))
+			error = GetLastError();
+	}
+	// Only the child may hold these now, so that we get a broken pipe once it exits
+	for (i = 0; i < 3; i++) {
+		if (child[i] != INVALID_HANDLE_VALUE)
+			CloseHandle(child[i]);
+	}
+	LeaveCriticalSection(&run->spawn_lock);
+	if (error != ERROR_SUCCESS)
+		goto out;
+	CloseHandle(pi.hThread);
+
+	for (i = 0; i < 2; i++) {
+		if (!StartRead(&capture[i]) && (error == ERROR_SUCCESS))
+			error = GetLastError();
+	}
+	while ((error == ERROR_SUCCESS) && (capture[0].reading || capture[1].reading)) {
+		for (n = 0, i = 0; i < 2; i++) {
+			if (capture[i].reading) {
+				waiting[n] = &capture[i];
+				wait[n++] = capture[i].ov.hEvent;
+			}
+		}
+		r = WaitForMultipleObjects(n, wait, FALSE, RUN_POLL_TIME);
+		// Checked on every read too, since a chatty child never lets the wait time out.
+		// Killing the process is enough, as its pipes then get closed.
+		if (!cancelled && TaskCancelled(run->pool, &run->group)) {
+			TerminateProcess(pi.hProcess, ERROR_CANCELLED);
+			cancelled = TRUE;
+		}
+		if (r == WAIT_TIMEOUT)
+			continue;
+		if (r >= WAIT_OBJECT_0 + n) {
+			error = GetLastError();
+			break;
+		}
+		c = waiting[r - WAIT_OBJECT_0];
+		c->reading = FALSE;
+		if (!GetOverlappedResult(c->pipe, &c->ov, &size, FALSE)) {
+			if (GetLastError() != ERROR_BROKEN_PIPE)
+				error = GetLastError();
+			continue;
+		}
+		c->len += size;
+		if (!StartRead(c))
+			error = GetLastError();
+	}
+	if (error != ERROR_SUCCESS)
+		TerminateProcess(pi.hProcess, error);
+	WaitForSingleObject(pi.hProcess, INFINITE);
+	GetExitCodeProcess(pi.hProcess, &job->result.exit_code);
+	CloseHandle(pi.hProcess);
+
+out:
+	for (i = 0; i < 2; i++)
+		CloseCapture(&capture[i]);
+	job->result.error = error;
+	job->result.seconds = GetTime() - start;
+	job->out = capture[0].buf;
+	job->result.out = job->out;
+	job->result.out_len = capture[0].len;
+	job->err = capture[1].buf;
+	job->result.err = job->err;
+	job->result.err_len = capture[1].len;
+}
+
+// Called under the report lock
+static void ReportCommand(run_t* run, run_job_t* job)
+{
+	if (job->result.error != ERROR_SUCCESS) {
+		run->errors++;
+	} else {
+		run->completed++;
+		if (job->result.exit_code != 0)
+			run->failed++;
+		run->time[run->num_times++] = job->result.seconds * 1000.0;
+	}
+	if ((run->fn != NULL) && !run->stopped && !run->fn(run->ctx, &job->result)) {
+		run->stopped = TRUE;
+		CancelTaskGroup(&run->group);
+	}
+	free(job->out);
+	free(job->err);
+	job->out = NULL;
+	job->err = NULL;
+}
+
+static void RunnerTask(void* ctx, uint32_t worker)
+{
+	run_t* run = (run_t*)ctx;
+	LONG64 i;
+
+	while (!TaskCancelled(run->pool, &run->group)) {
+		i = InterlockedIncrement64(&run->next) - 1;
+		if (i >= (LONG64)run->count)
+			break;
+		RunCommand(run, &run->job[i]);
+		EnterCriticalSection(&run->report_lock);
+		run->job[i].done = TRUE;
+		if (!(run->flags & RUN_ORDERED)) {
+			ReportCommand(run, &run->job[i]);
+		} else {
+			while ((run->reported < run->count) && run->job[run->reported].done)
+				ReportCommand(run, &run->job[run->reported++]);
+		}
+		LeaveCriticalSection(&run->report_lock);
+	}
+}
+
+static int CompareTime(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+BOOL ParallelRun(pool_t* pool, const char* const* commands, size_t count, DWORD max_processes,
+	DWORD flags, run_fn fn, void* ctx, run_stats_t* stats)
+{
+	run_t run = { 0 };
+	double start = GetTime();
+	size_t i, n;
+	BOOL r = FALSE;
+
+	// So that the callers can print them whichever way we fail
+	if (stats != NULL)
+		memset(stats, 0, sizeof(*stats));
+	if ((max_processes == 0) || (max_processes > PoolSize(pool)))
+		max_processes = PoolSize(pool);
+	if (max_processes > count)
+		max_processes = (DWORD)count;
+	if (!InitTaskGroup(&run.group))
+		return FALSE;
+	InitializeCriticalSection(&run.spawn_lock);
+	InitializeCriticalSection(&run.report_lock);
+	run.pool = pool;
+	run.flags = flags;
+	run.fn = fn;
+	run.ctx = ctx;
+	run.commands = commands;
+	run.count = count;
+	run.job = (run_job_t*)calloc(max(count, 1), sizeof(run_job_t));
+	run.time = (double*)calloc(max(count, 1), sizeof(double));
+	if ((run.job == NULL) || (run.time == NULL))
+		goto out;
+	for (i = 0; i < count; i++) {
+		run.job[i].result.index = i;
+		run.job[i].result.command = commands[i];
+	}
+
+	for (i = 0; i < max_processes; i++) {
+		if (!SubmitTask(pool, &run.group, RunnerTask, &run)) {
+			CancelTaskGroup(&run.group);
+			break;
+		}
+	}
+	r = WaitTaskGroup(pool, &run.group) && (run.errors == 0) && !run.stopped;
+
+out:
+	CloseTaskGroup(&run.group);
+	if (stats != NULL) {
+		memset(stats, 0, sizeof(*stats));
+		stats->commands = run.completed;
+		stats->failed = run.failed;
+		stats->errors = run.errors;
+		stats->seconds = GetTime() - start;
+		n = run.num_times;
+		if (n != 0) {
+			qsort(run.time, n, sizeof(double), CompareTime);
+			stats->time_median = run.time[n / 2];
+			stats->time_p99 = run.time[(n * 99) / 100];
+			stats->time_max = run.time[n - 1];
+		}
+	}
+	// Ordered output may have stopped short of commands that completed
+	for (i = 0; (run.job != NULL) && (i < count); i++) {
+		free(run.job[i].out);
+		free(run.job[i].err);
+	}
+	free(run.job);
+	free(run.time);
+	DeleteCriticalSection(&run.spawn_lock);
+	DeleteCriticalSection(&run.report_lock);
+	return r;
+}
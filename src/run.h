@@ -0,0 +1,72 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Parallel external command runner
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+// Report the commands in the order they were given, rather than as they complete
+#define RUN_ORDERED			0x00000001
+
+typedef struct {
+	size_t index;				// In the commands array
+	const char* command;
+	DWORD error;				// Set if the command could not be run
+	DWORD exit_code;
+	// What the command wrote, which is not NUL terminated
+	const char* out;
+	size_t out_len;
+	const char* err;
+	size_t err_len;
+	double seconds;
+} run_result_t;
+
+typedef struct {
+	uint64_t commands;			// Run to completion
+	uint64_t failed;			// With a non zero exit code
+	uint64_t errors;			// Could not be run
+	double seconds;
+	// Time each command took, in milliseconds
+	double time_median;
+	double time_p99;
+	double time_max;
+} run_stats_t;
+
+/*
+ * Called for each command once it has completed. Calls are never concurrent,
+ * so this can write to the console, and the output buffers are freed once it
+ * returns. Return FALSE to cancel the commands that have not completed yet.
+ */
+typedef BOOL (*run_fn)(void* ctx, const run_result_t* result);
+
+/*
+ * Run count command lines through CreateProcessU(), with at most max_processes
+ * of them at a time, like xargs -P. Each process gets waited on by a worker,
+ * so 0, or more than the pool has workers, uses all the workers.
+ * The standard output and error of each command get captured into buffers of
+ * their own, and its standard input is NUL. fn can be NULL. Returns FALSE if a
+ * command could not be run or the run was cancelled, but not for commands that
+ * returned an error. stats can be NULL.
+ */
+extern BOOL ParallelRun(pool_t* pool, const char* const* commands, size_t count, DWORD max_processes,
+	DWORD flags, run_fn fn, void* ctx, run_stats_t* stats);
@@ -0,0 +1,467 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Bulk UTF-8 text scanning
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "scan.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(CPU_X86)
+#if !defined(_MSC_VER)
+#include <immintrin.h>
+#endif
+#elif defined(CPU_ARM64)
+#if defined(_MSC_VER)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
+// Bytes processed per step, so that a step yields a 64-bit mask
+#define SCAN_STEP			64
+// Number of steps we can count in 8-bit lanes before they may overflow
+#define SCAN_FLUSH			63
+
+/*
+ * A byte is looked up with its low nibble in the set, and with its high
+ * nibble in this table, that is the same for all sets. Bytes >= 0x80 get 0.
+ */
+static const uint8_t scan_hi[16] = {
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+const scan_set_t scan_digits = { {
+	0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0, 0, 0, 0, 0, 0
+} };
+
+// ' ', '\t', '\n', '\v', '\f' and '\r'
+const scan_set_t scan_spaces = { {
+	0x04, 0, 0, 0, 0, 0, 0, 0, 0, 0x01, 0x01, 0x01, 0x01, 0x01, 0, 0
+} };
+
+/*
+ * The find kernels return the offset of the first byte whose membership,
+ * XORed with flip (0 or ~0), is set, so that they can also implement span.
+ */
+typedef struct {
+	size_t (*find)(const uint8_t* buf, size_t len, const uint8_t* lo, uint64_t flip);
+	size_t (*count)(const uint8_t* buf, size_t len, const uint8_t* lo);
+	size_t (*index)(const uint8_t* buf, size_t len, const uint8_t* lo, uint32_t* index);
+} scan_kernel_t;
+
+static FORCE_INLINE uint32_t scan_ctz64(uint64_t mask)
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+	unsigned long i;
+	_BitScanForward64(&i, mask);
+	return (uint32_t)i;
+#elif defined(_MSC_VER)
+	unsigned long i;
+	if ((uint32_t)mask != 0) {
+		_BitScanForward(&i, (uint32_t)mask);
+		return (uint32_t)i;
+	}
+	_BitScanForward(&i, (uint32_t)(mask >> 32));
+	return (uint32_t)i + 32;
+#else
+	return (uint32_t)__builtin_ctzll(mask);
+#endif
+}
+
+static FORCE_INLINE int scan_is_member(uint8_t c, const uint8_t* lo)
+{
+	return (lo[c & 0x0f] & scan_hi[c >> 4]) != 0;
+}
+
+static size_t scan_find_scalar(const uint8_t* buf, size_t len, const uint8_t* lo, uint64_t flip)
+{
+	int want = (flip == 0);
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (scan_is_member(buf[i], lo) == want)
+			break;
+	}
+	return i;
+}
+
+static size_t scan_count_scalar(const uint8_t* buf, size_t len, const uint8_t* lo)
+{
+	size_t i, count = 0;
+
+	for (i = 0; i < len; i++)
+		count += scan_is_member(buf[i], lo);
+	return count;
+}
+
+static size_t scan_index_scalar(const uint8_t* buf, size_t len, const uint8_t* lo, uint32_t* index)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < len; i++) {
+		if (scan_is_member(buf[i], lo))
+			index[n++] = (uint32_t)i;
+	}
+	return n;
+}
+
+// Append the offsets of the bits set in mask, relative to base
+static FORCE_INLINE size_t scan_index_mask(uint64_t mask, size_t base, uint32_t* index, size_t n)
+{
+	while (mask != 0) {
+		index[n++] = (uint32_t)(base + scan_ctz64(mask));
+		mask &= mask - 1;
+	}
+	return n;
+}
+
+static const scan_kernel_t scan_scalar_kernel = { scan_find_scalar, scan_count_scalar, scan_index_scalar };
+
+#if defined(CPU_X86)
+// Return a vector that has a nonzero byte for each member
+static FORCE_INLINE TARGET_ATTR("ssse3") __m128i scan_lookup_sse(__m128i v, __m128i lo, __m128i hi)
+{
+	const __m128i m0f = _mm_set1_epi8(0x0f);
+
+	return _mm_and_si128(_mm_shuffle_epi8(lo, _mm_and_si128(v, m0f)),
+		_mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), m0f)));
+}
+
+static FORCE_INLINE TARGET_ATTR("ssse3") uint64_t scan_mask_sse(const uint8_t* p, __m128i lo, __m128i hi)
+{
+	const __m128i zero = _mm_setzero_si128();
+	uint64_t mask = 0;
+	int k;
+
+	for (k = 0; k < SCAN_STEP / 16; k++) {
+		__m128i m = scan_lookup_sse(_mm_loadu_si128((const __m128i*)&p[16 * k]), lo, hi);
+		mask |= (uint64_t)(uint16_t)~_mm_movemask_epi8(_mm_cmpeq_epi8(m, zero)) << (16 * k);
+	}
+	return mask;
+}
+
+static TARGET_ATTR("ssse3") size_t scan_find_ssse3(const uint8_t* buf, size_t len, const uint8_t* lo, uint64_t flip)
+{
+	const __m128i vlo = _mm_loadu_si128((const __m128i*)lo), vhi = _mm_loadu_si128((const __m128i*)scan_hi);
+	uint8_t tail[SCAN_STEP];
+	uint64_t mask;
+	size_t i;
+
+	for (i = 0; len - i >= SCAN_STEP; i += SCAN_STEP) {
+		mask = scan_mask_sse(&buf[i], vlo, vhi) ^ flip;
+		if (mask != 0)
+			return i + scan_ctz64(mask);
+	}
+	if (i == len)
+		return len;
+	// Short records are common, so we also vectorize the tail
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, &buf[i], len - i);
+	mask = (scan_mask_sse(tail, vlo, vhi) ^ flip) & ((1ULL << (len - i)) - 1);
+	return (mask != 0) ? i + scan_ctz64(mask) : len;
+}
+
+static TARGET_ATTR("ssse3") size_t scan_count_ssse3(const uint8_t* buf, size_t len, const uint8_t* lo)
+{
+	const __m128i vlo = _mm_loadu_si128((const __m128i*)lo), vhi = _mm_loadu_si128((const __m128i*)scan_hi);
+	const __m128i one = _mm_set1_epi8(1), zero = _mm_setzero_si128();
+	__m128i acc = zero, sum = zero;
+	uint64_t count;
+	size_t i, steps = 0;
+	int k;
+
+	for (i = 0; len - i >= SCAN_STEP; i += SCAN_STEP) {
+		for (k = 0; k < SCAN_STEP / 16; k++) {
+			__m128i m = scan_lookup_sse(_mm_loadu_si128((const __m128i*)&buf[i + 16 * k]), vlo, vhi);
+			acc = _mm_add_epi8(acc, _mm_min_epu8(m, one));
+		}
+		if (++steps == SCAN_FLUSH) {
+			sum = _mm_add_epi64(sum, _mm_sad_epu8(acc, zero));
+			acc = zero;
+			steps = 0;
+		}
+	}
+	sum = _mm_add_epi64(sum, _mm_sad_epu8(acc, zero));
+	sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+	_mm_storel_epi64((__m128i*)&count, sum);
+	return (size_t)count + scan_count_scalar(&buf[i], len - i, lo);
+}
+
+static TARGET_ATTR("ssse3") size_t scan_index_ssse3(const uint8_t* buf, size_t len, const uint8_t* lo, uint32_t* index)
+{
+	const __m128i vlo = _mm_loadu_si128((const __m128i*)lo), vhi = _mm_loadu_si128((const __m128i*)scan_hi);
+	uint8_t tail[SCAN_STEP];
+	size_t i, n = 0;
+
+	for (i = 0; len - i >= SCAN_STEP; i += SCAN_STEP)
+		n = scan_index_mask(scan_mask_sse(&buf[i], vlo, vhi), i, index, n);
+	if (i == len)
+		return n;
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, &buf[i], len - i);
+	return scan_index_mask(scan_mask_sse(tail, vlo, vhi) & ((1ULL << (len - i)) - 1), i, index, n);
+}
+
+static const scan_kernel_t scan_ssse3_kernel = { scan_find_ssse3, scan_count_ssse3, scan_index_ssse3 };
+
+static FORCE_INLINE TARGET_ATTR("avx2") __m256i scan_lookup_avx2(__m256i v, __m256i lo, __m256i hi)
+{
+	const __m256i m0f = _mm256_set1_epi8(0x0f);
+
+	return _mm256_and_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(v, m0f)),
+		_mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), m0f)));
+}
+
+static FORCE_INLINE TARGET_ATTR("avx2") uint64_t scan_mask_avx2(const uint8_t* p, __m256i lo, __m256i hi)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i m0 = scan_lookup_avx2(_mm256_loadu_si256((const __m256i*)p), lo, hi);
+	__m256i m1 = scan_lookup_avx2(_mm256_loadu_si256((const __m256i*)&p[32]), lo, hi);
+
+	return ~((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(m0, zero)) |
+		((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(m1, zero)) << 32));
+}
+
+static TARGET_ATTR("avx2") size_t scan_find_avx2(const uint8_t* buf, size_t len, const uint8_t* lo, uint64_t flip)
+{
+	const __m256i vlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)lo));
+	const __m256i vhi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)scan_hi));
+	uint8_t tail[SCAN_STEP];
+	uint64_t mask;
+	size_t i;
+
+	for (i = 0; len - i >= SCAN_STEP; i += SCAN_STEP) {
+		mask = scan_mask_avx2(&buf[i], vlo, vhi) ^ flip;
+		if (mask != 0)
+			return i + scan_ctz64(mask);
+	}
+	if (i == len)
+		return len;
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, &buf[i], len - i);
+	mask = (scan_mask_avx2(tail, vlo, vhi) ^ flip) & ((1ULL << (len - i)) - 1);
+	return (mask != 0) ? i + scan_ctz64(mask) : len;
+}
+
+static TARGET_ATTR("avx2") size_t scan_count_avx2(const uint8_t* buf, size_t len, const uint8_t* lo)
+{
+	const __m256i vlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)lo));
+	const __m256i vhi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)scan_hi));
+	const __m256i one = _mm256_set1_epi8(1), zero = _mm256_setzero_si256();
+	__m256i acc = zero, sum = zero;
+	__m128i sum128;
+	uint64_t count;
+	size_t i, steps = 0;
+
+	for (i = 0; len - i >= SCAN_STEP; i += SCAN_STEP) {
+		acc = _mm256_add_epi8(acc, _mm256_min_epu8(scan_lookup_avx2(
+			_mm256_loadu_si256((const __m256i*)&buf[i]), vlo, vhi), one));
+		acc = _mm256_add_epi8(acc, _mm256_min_epu8(scan_lookup_avx2(
+			_mm256_loadu_si256((const __m256i*)&buf[i + 32]), vlo, vhi), one));
+		if (++steps == SCAN_FLUSH) {
+			sum = _mm256_add_epi64(sum, _mm256_sad_epu8(acc, zero));
+			acc = zero;
+			steps = 0;
+		}
+	}
+	sum = _mm256_add_epi64(sum, _mm256_sad_epu8(acc, zero));
+	sum128 = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+	sum128 = _mm_add_epi64(sum128, _mm_unpackhi_epi64(sum128, sum128));
+	_mm_storel_epi64((__m128i*)&count, sum128);
+	return (size_t)count + scan_count_scalar(&buf[i], len - i, lo);
+}
+
+static TARGET_ATTR("avx2") size_t scan_index_avx2(const uint8_t* buf, size_t len, const uint8_t* lo, uint32_t* index)
+{
+	const __m256i vlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)lo));
+	const __m256i vhi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)scan_hi));
+	uint8_t tail[SCAN_STEP];
+	size_t i, n = 0;
+
+	for (i = 0; len - i >= SCAN_STEP; i += SCAN_STEP)
+		n = scan_index_mask(scan_mask_avx2(&buf[i], vlo, vhi), i, index, n);
+	if (i == len)
+		return n;
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, &buf[i], len - i);
+	return scan_index_mask(scan_mask_avx2(tail, vlo, vhi) & ((1ULL << (len - i)) - 1), i, index, n);
+}
+
+static const scan_kernel_t scan_avx2_kernel = { scan_find_avx2, scan_count_avx2, scan_index_avx2 };
+#endif
+
+#if defined(CPU_ARM64)
+static FORCE_INLINE uint8x16_t scan_lookup_neon(uint8x16_t v, uint8x16_t lo, uint8x16_t hi)
+{
+	return vandq_u8(vqtbl1q_u8(lo, vandq_u8(v, vdupq_n_u8(0x0f))), vqtbl1q_u8(hi, vshrq_n_u8(v, 4)));
+}
+
+/*
+ * NEON has no movemask, so we narrow each byte to a nibble instead, and
+ * produce a 64-bit mask with 4 bits per byte for each 16 byte vector.
+ */
+static FORCE_INLINE uint64_t scan_nibble_mask_neon(uint8x16_t m)
+{
+	return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(vtstq_u8(m, m)), 4)), 0);
+}
+
+static size_t scan_find_neon(const uint8_t* buf, size_t len, const uint8_t* lo, uint64_t flip)
+{
+	const uint8x16_t vlo = vld1q_u8(lo), vhi = vld1q_u8(scan_hi);
+	uint8_t tail[SCAN_STEP];
+	uint64_t mask;
+	size_t i, n;
+	int k;
+
+	for (i = 0; i < len; i += SCAN_STEP) {
+		const uint8_t* p = &buf[i];
+		n = len - i;
+		if (n < SCAN_STEP) {
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, p, n);
+			p = tail;
+		}
+		for (k = 0; k < SCAN_STEP / 16; k++) {
+			mask = scan_nibble_mask_neon(scan_lookup_neon(vld1q_u8(&p[16 * k]), vlo, vhi)) ^ flip;
+			if (mask != 0) {
+				n = 16 * k + scan_ctz64(mask) / 4;
+				return (i + n < len) ? i + n : len;
+			}
+		}
+	}
+	return len;
+}
+
+static size_t scan_count_neon(const uint8_t* buf, size_t len, const uint8_t* lo)
+{
+	const uint8x16_t vlo = vld1q_u8(lo), vhi = vld1q_u8(scan_hi), one = vdupq_n_u8(1);
+	uint8x16_t acc = vdupq_n_u8(0);
+	size_t i, steps = 0, count = 0;
+	int k;
+
+	for (i = 0; len - i >= SCAN_STEP; i += SCAN_STEP) {
+		for (k = 0; k < SCAN_STEP / 16; k++)
+			acc = vaddq_u8(acc, vminq_u8(scan_lookup_neon(vld1q_u8(&buf[i + 16 * k]), vlo, vhi), one));
+		if (++steps == SCAN_FLUSH) {
+			count += vaddlvq_u8(acc);
+			acc = vdupq_n_u8(0);
+			steps = 0;
+		}
+	}
+	return count + vaddlvq_u8(acc) + scan_count_scalar(&buf[i], len - i, lo);
+}
+
+static size_t scan_index_neon(const uint8_t* buf, size_t len, const uint8_t* lo, uint32_t* index)
+{
+	const uint8x16_t vlo = vld1q_u8(lo), vhi = vld1q_u8(scan_hi);
+	uint8_t tail[16];
+	uint64_t mask;
+	size_t i, n = 0;
+	uint32_t b;
+
+	for (i = 0; i < len; i += 16) {
+		const uint8_t* p = &buf[i];
+		if (len - i < 16) {
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, p, len - i);
+			p = tail;
+		}
+		mask = scan_nibble_mask_neon(scan_lookup_neon(vld1q_u8(p), vlo, vhi));
+		if (len - i < 16)
+			mask &= (1ULL << (4 * (len - i))) - 1;
+		while (mask != 0) {
+			b = scan_ctz64(mask);
+			index[n++] = (uint32_t)(i + b / 4);
+			mask &= ~(0x0fULL << b);
+		}
+	}
+	return n;
+}
+
+static const scan_kernel_t scan_neon_kernel = { scan_find_neon, scan_count_neon, scan_index_neon };
+#endif
+
+static const scan_kernel_t* scan_kernel = &scan_scalar_kernel;
+static const char* scan_name = "Scalar";
+
+static const cpu_variant_t scan_variant[] = {
+#if defined(CPU_X86)
+	CPU_VARIANT(CPU_FEATURE_AVX2, &scan_avx2_kernel, "AVX2"),
+	CPU_VARIANT(CPU_FEATURE_SSSE3, &scan_ssse3_kernel, "SSSE3"),
+#elif defined(CPU_ARM64)
+	CPU_VARIANT(CPU_FEATURE_NEON, &scan_neon_kernel, "NEON"),
+#endif
+	CPU_VARIANT(0, &scan_scalar_kernel, "Scalar"),
+};
+
+// DetectCpuFeatures() must have been called first
+void scan_init(void)
+{
+	const cpu_variant_t* v = SelectCpuVariant(scan_variant);
+
+	scan_kernel = (const scan_kernel_t*)v->impl;
+	scan_name = v->name;
+}
+
+const char* scan_impl(void)
+{
+	return scan_name;
+}
+
+void scan_set(scan_set_t* set, const char* members)
+{
+	memset(set, 0, sizeof(*set));
+	while (*members != 0)
+		scan_set_add(set, *members++);
+}
+
+// Non ASCII characters are ignored
+void scan_set_add(scan_set_t* set, char c)
+{
+	uint8_t u = (uint8_t)c;
+
+	set->lo[u & 0x0f] |= scan_hi[u >> 4];
+}
+
+size_t scan_find(const char* buf, size_t len, const scan_set_t* set)
+{
+	return scan_kernel->find((const uint8_t*)buf, len, set->lo, 0);
+}
+
+size_t scan_span(const char* buf, size_t len, const scan_set_t* set)
+{
+	return scan_kernel->find((const uint8_t*)buf, len, set->lo, ~0ULL);
+}
+
+size_t scan_count(const char* buf, size_t len, const scan_set_t* set)
+{
+	return scan_kernel->count((const uint8_t*)buf, len, set->lo);
+}
+
+size_t scan_index(const char* buf, size_t len, const scan_set_t* set, uint32_t* index)
+{
+	return scan_kernel->index((const uint8_t*)buf, len, set->lo, index);
+}
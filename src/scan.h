@@ -0,0 +1,66 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Bulk UTF-8 text scanning
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A set of ASCII characters, that can be looked up 16 bytes at a time.
+ * Byte (h << 4 | l) is a member if bit h of lo[l] is set. Since all the
+ * bytes of a multibyte UTF-8 sequence are >= 0x80, they are never members,
+ * so that the scans below can be used on UTF-8 input without decoding it.
+ */
+typedef struct {
+	uint8_t lo[16];
+} scan_set_t;
+
+// Same characters as the isdigitU() and isspaceU() macros
+extern const scan_set_t scan_digits;
+extern const scan_set_t scan_spaces;
+
+extern void scan_init(void);
+extern const char* scan_impl(void);
+
+// Initialize a set from a NUL terminated string of ASCII characters
+extern void scan_set(scan_set_t* set, const char* members);
+extern void scan_set_add(scan_set_t* set, char c);
+
+// Return the offset of the first byte that is (find) or isn't (span) in the set, or len
+extern size_t scan_find(const char* buf, size_t len, const scan_set_t* set);
+extern size_t scan_span(const char* buf, size_t len, const scan_set_t* set);
+// Return the number of bytes that are in the set
+extern size_t scan_count(const char* buf, size_t len, const scan_set_t* set);
+/*
+ * Write the offsets of all the bytes that are in the set to index, which
+ * must have room for len entries, and return their number. This is faster
+ * than calling scan_find() in a loop when the members are close together,
+ * as with the delimiters of short fields.
+ */
+extern size_t scan_index(const char* buf, size_t len, const scan_set_t* set, uint32_t* index);
+
+#ifdef __cplusplus
+}
+#endif
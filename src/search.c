@@ -0,0 +1,323 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Brute-force search, 64 candidates at a time
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "crc.h"
+#include "pool.h"
+#include "popcnt.h"
+#include "search.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(CPU_X86)
+#if !defined(_MSC_VER)
+#include <immintrin.h>
+#endif
+#elif defined(CPU_ARM64)
+#if defined(_MSC_VER)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
+// Spacing between the per-worker results, to avoid false sharing
+#define SEARCH_STRIDE		(64 / sizeof(uint64_t))
+
+typedef struct {
+	void (*hash32)(const search_hash32_t* h, uint64_t base, uint64_t* mask, size_t count);
+} search_kernel_t;
+
+typedef struct {
+	search_kernel_fn kernel;
+	const void* ctx;
+	uint64_t begin, end;
+	uint64_t* count;		// Per worker
+	uint64_t* first;		// Per worker
+} search_range_t;
+
+// Bit j of crc_plane[b] is bit b of crc32c(j) ^ crc32c(0), for the 4-byte j < 64
+static uint64_t crc_plane[32];
+
+static FORCE_INLINE uint32_t search_ctz64(uint64_t mask)
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+	unsigned long i;
+	_BitScanForward64(&i, mask);
+	return (uint32_t)i;
+#elif defined(_MSC_VER)
+	unsigned long i;
+	if ((uint32_t)mask != 0) {
+		_BitScanForward(&i, (uint32_t)mask);
+		return (uint32_t)i;
+	}
+	_BitScanForward(&i, (uint32_t)(mask >> 32));
+	return (uint32_t)i + 32;
+#else
+	return (uint32_t)__builtin_ctzll(mask);
+#endif
+}
+
+static void hash32_scalar(const search_hash32_t* h, uint64_t base, uint64_t* mask, size_t count)
+{
+	uint64_t m;
+	uint32_t x;
+	size_t j, k;
+
+	for (k = 0; k < count; k++, base += 64) {
+		for (m = 0, j = 0; j < 64; j++) {
+			x = (uint32_t)(base + j);
+			m |= (uint64_t)(search_hash32_value(x, h->seed) == h->target) << j;
+		}
+		mask[k] = m;
+	}
+}
+static const search_kernel_t search_scalar_kernel = { hash32_scalar };
+
+#if defined(CPU_X86)
+static TARGET_ATTR("avx2") __m256i hash32_lanes_avx2(__m256i x, __m256i seed)
+{
+	x = _mm256_xor_si256(x, seed);
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+	x = _mm256_mullo_epi32(x, _mm256_set1_epi32((int)0x85ebca6b));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 13));
+	x = _mm256_mullo_epi32(x, _mm256_set1_epi32((int)0xc2b2ae35));
+	return _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+}
+
+// Two vectors of 8 lanes at a time, so that the multiplies of one hide the latency of the other
+static TARGET_ATTR("avx2") void hash32_avx2(const search_hash32_t* h, uint64_t base, uint64_t* mask, size_t count)
+{
+	const __m256i seed = _mm256_set1_epi32((int)h->seed), target = _mm256_set1_epi32((int)h->target);
+	const __m256i step = _mm256_set1_epi32(16);
+	__m256i x0, x1, e0, e1;
+	uint64_t m;
+	size_t j, k;
+
+	for (k = 0; k < count; k++, base += 64) {
+		x0 = _mm256_add_epi32(_mm256_set1_epi32((int)(uint32_t)base), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+		x1 = _mm256_add_epi32(x0, _mm256_set1_epi32(8));
+		for (m = 0, j = 0; j < 64; j += 16) {
+			e0 = _mm256_cmpeq_epi32(hash32_lanes_avx2(x0, seed), target);
+			e1 = _mm256_cmpeq_epi32(hash32_lanes_avx2(x1, seed), target);
+			m |= (uint64_t)(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(e0)) << j;
+			m |= (uint64_t)(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(e1)) << (j + 8);
+			x0 = _mm256_add_epi32(x0, step);
+			x1 = _mm256_add_epi32(x1, step);
+		}
+		mask[k] = m;
+	}
+}
+static const search_kernel_t search_avx2_kernel = { hash32_avx2 };
+#elif defined(CPU_ARM64)
+static FORCE_INLINE uint32x4_t hash32_lanes_neon(uint32x4_t x, uint32x4_t seed)
+{
+	x = veorq_u32(x, seed);
+	x = veorq_u32(x, vshrq_n_u32(x, 16));
+	x = vmulq_u32(x, vdupq_n_u32(0x85ebca6b));
+	x = veorq_u32(x, vshrq_n_u32(x, 13));
+	x = vmulq_u32(x, vdupq_n_u32(0xc2b2ae35));
+	return veorq_u32(x, vshrq_n_u32(x, 16));
+}
+
+static void hash32_neon(const search_hash32_t* h, uint64_t base, uint64_t* mask, size_t count)
+{
+	static const uint32_t lane[4] = { 0, 1, 2, 3 }, bit[4] = { 1, 2, 4, 8 };
+	const uint32x4_t seed = vdupq_n_u32(h->seed), target = vdupq_n_u32(h->target);
+	const uint32x4_t bits = vld1q_u32(bit), step = vdupq_n_u32(8);
+	uint32x4_t x0, x1, e0, e1;
+	uint64_t m;
+	size_t j, k;
+
+	for (k = 0; k < count; k++, base += 64) {
+		x0 = vaddq_u32(vdupq_n_u32((uint32_t)base), vld1q_u32(lane));
+		x1 = vaddq_u32(x0, vdupq_n_u32(4));
+		for (m = 0, j = 0; j < 64; j += 8) {
+			e0 = vandq_u32(vceqq_u32(hash32_lanes_neon(x0, seed), target), bits);
+			e1 = vandq_u32(vceqq_u32(hash32_lanes_neon(x1, seed), target), bits);
+			m |= (uint64_t)(vaddvq_u32(e0) | (vaddvq_u32(e1) << 4)) << j;
+			x0 = vaddq_u32(x0, step);
+			x1 = vaddq_u32(x1, step);
+		}
+		mask[k] = m;
+	}
+}
+static const search_kernel_t search_neon_kernel = { hash32_neon };
+#endif
+
+static const search_kernel_t* search_kernel = &search_scalar_kernel;
+static const char* search_name = "Scalar";
+
+static const cpu_variant_t search_variant[] = {
+#if defined(CPU_X86)
+	CPU_VARIANT(CPU_FEATURE_AVX2, &search_avx2_kernel, "AVX2"),
+#elif defined(CPU_ARM64)
+	CPU_VARIANT(CPU_FEATURE_NEON, &search_neon_kernel, "NEON"),
+#endif
+	CPU_VARIANT(0, &search_scalar_kernel, "Scalar"),
+};
+
+void search_init(void)
+{
+	const cpu_variant_t* v = SelectCpuVariant(search_variant);
+	uint32_t b, j, crc0 = 0, d;
+
+	search_kernel = (const search_kernel_t*)v->impl;
+	search_name = v->name;
+
+	crc0 = crc32c(0, &crc0, sizeof(crc0));
+	memset(crc_plane, 0, sizeof(crc_plane));
+	for (j = 0; j < 64; j++) {
+		d = crc32c(0, &j, sizeof(j)) ^ crc0;
+		for (b = 0; b < 32; b++)
+			crc_plane[b] |= (uint64_t)((d >> b) & 1) << j;
+	}
+}
+
+const char* search_impl(void)
+{
+	return search_name;
+}
+
+void search_crc32c(const void* ctx, uint64_t base, uint64_t* mask, size_t count)
+{
+	const search_crc32c_t* s = (const search_crc32c_t*)ctx;
+	uint32_t b, c, x;
+	uint64_t m;
+	size_t k;
+
+	for (k = 0; k < count; k++, base += 64) {
+		// The CRC of candidate j of the block matches bit b of the target if bit b of crc_plane[b] is bit b of c
+		x = (uint32_t)base;
+		c = crc32c(0, &x, sizeof(x)) ^ s->target;
+		for (m = ~0ULL, b = 0; b < 32; b++)
+			m &= crc_plane[b] ^ (((c >> b) & 1) - 1ULL);
+		mask[k] = m;
+	}
+}
+
+void search_hash32(const void* ctx, uint64_t base, uint64_t* mask, size_t count)
+{
+	search_kernel->hash32((const search_hash32_t*)ctx, base, mask, count);
+}
+
+// Masks of the candidates [begin, end) of a chunk, which starts on a multiple of 64, without the ones outside the range
+static size_t SearchMasks(const search_range_t* range, uint64_t begin, uint64_t end, uint64_t* mask)
+{
+	size_t count = (size_t)((end - begin + 63) / 64);
+
+	range->kernel(range->ctx, begin, mask, count);
+	if (begin < range->begin)
+		mask[0] &= ~0ULL << (range->begin & 63);
+	if ((end & 63) != 0)
+		mask[count - 1] &= ~0ULL >> (64 - (end & 63));
+	return count;
+}
+
+static void SearchCountRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	search_range_t* range = (search_range_t*)ctx;
+	uint64_t mask[SEARCH_BATCH], base, last, *first = &range->first[worker * SEARCH_STRIDE];
+	size_t i, count;
+
+	for (base = begin; base < end; base = last) {
+		last = min(base + 64 * SEARCH_BATCH, end);
+		count = SearchMasks(range, base, last, mask);
+		range->count[worker * SEARCH_STRIDE] += popcount(mask, count * sizeof(uint64_t));
+		// Chunks go out in order, so the first match of a worker is the first one of its chunk
+		for (i = 0; (i < count) && (base + 64 * i < *first); i++) {
+			if (mask[i] != 0) {
+				*first = base + 64 * i + search_ctz64(mask[i]);
+				break;
+			}
+		}
+	}
+}
+
+static BOOL SearchFindRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end, uint64_t* index)
+{
+	search_range_t* range = (search_range_t*)ctx;
+	uint64_t mask[SEARCH_BATCH], base, last;
+	size_t i, count;
+
+	for (base = begin; base < end; base = last) {
+		last = min(base + 64 * SEARCH_BATCH, end);
+		count = SearchMasks(range, base, last, mask);
+		for (i = 0; i < count; i++) {
+			if (mask[i] != 0) {
+				*index = base + 64 * i + search_ctz64(mask[i]);
+				return TRUE;
+			}
+		}
+	}
+	return FALSE;
+}
+
+BOOL ParallelSearch(pool_t* pool, uint64_t begin, uint64_t end, search_kernel_fn kernel,
+	const void* ctx, BOOL count_all, search_result_t* result)
+{
+	search_range_t range;
+	size_t workers = PoolSize(pool);
+	DWORD i;
+	BOOL r;
+
+	result->matches = 0;
+	result->first = end;
+	if (begin >= end)
+		return TRUE;
+
+	range.kernel = kernel;
+	range.ctx = ctx;
+	range.begin = begin;
+	range.end = end;
+	// Chunks start on a multiple of 64 from there, so that they line up with the masks
+	begin &= ~63ULL;
+	if (!count_all) {
+		r = ParallelFind(pool, begin, end, SEARCH_CHUNK, SearchFindRange, &range, TRUE, &result->first);
+		result->matches = (result->first != end) ? 1 : 0;
+		return r;
+	}
+
+	range.count = (uint64_t*)calloc(workers * SEARCH_STRIDE, sizeof(uint64_t));
+	range.first = (uint64_t*)malloc(workers * SEARCH_STRIDE * sizeof(uint64_t));
+	if ((range.count == NULL) || (range.first == NULL)) {
+		free(range.count);
+		free(range.first);
+		return FALSE;
+	}
+	for (i = 0; i < workers; i++)
+		range.first[i * SEARCH_STRIDE] = end;
+	r = ParallelFor(pool, begin, end, SEARCH_CHUNK, SearchCountRange, &range);
+	for (i = 0; i < workers; i++) {
+		result->matches += range.count[i * SEARCH_STRIDE];
+		result->first = min(result->first, range.first[i * SEARCH_STRIDE]);
+	}
+	free(range.count);
+	free(range.first);
+	return r;
+}
@@ -0,0 +1,91 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Brute-force search, 64 candidates at a time
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+// Candidates a worker takes at once, so that it only goes back to the pool once in a while
+#define SEARCH_CHUNK		(1 << 20)
+// Masks a kernel gets asked for at once
+#define SEARCH_BATCH		64
+
+/*
+ * Set bit j of mask[k] if candidate base + 64 * k + j is a match, for the
+ * count masks from base, which is a multiple of 64. Candidates are indexes,
+ * that the kernel turns into whatever it tests, one lane each.
+ */
+typedef void (*search_kernel_fn)(const void* ctx, uint64_t base, uint64_t* mask, size_t count);
+
+typedef struct {
+	uint64_t matches;
+	uint64_t first;			// Lowest match, or the end of the range if none
+} search_result_t;
+
+// Candidates x for which crc32c(0, &x, 4) == target, with x the lower 32 bits of the index
+typedef struct {
+	uint32_t target;
+} search_crc32c_t;
+
+// Candidates x for which search_hash32_value(x, seed) == target, with x the lower 32 bits of the index
+typedef struct {
+	uint32_t target;
+	uint32_t seed;
+} search_hash32_t;
+
+// The MurmurHash3 finalizer, which is a bijection, so that every target has exactly one match
+static __inline uint32_t search_hash32_value(uint32_t x, uint32_t seed)
+{
+	x ^= seed;
+	x ^= x >> 16;
+	x *= 0x85ebca6b;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35;
+	x ^= x >> 16;
+	return x;
+}
+
+// crc_init() and DetectCpuFeatures() must have been called first
+extern void search_init(void);
+extern const char* search_impl(void);
+
+/*
+ * Built-in kernels. The CRC one is bitsliced, with the 64 candidates of a
+ * mask as the 64 bits of a word: CRC-32C is affine, so the CRC of every
+ * candidate of a block is the one of the block, XORed with the one of its
+ * offset in the block, and comparing all of them to the target only takes
+ * an operation per bit of the CRC. The hash one runs the hash on as many
+ * candidates as the vector unit has lanes.
+ */
+extern void search_crc32c(const void* ctx, uint64_t base, uint64_t* mask, size_t count);
+extern void search_hash32(const void* ctx, uint64_t base, uint64_t* mask, size_t count);
+
+/*
+ * Run kernel over the candidates of [begin, end), in chunks of SEARCH_CHUNK
+ * candidates spread across the pool. If count_all is set, every match gets
+ * counted, by adding up the bits of the masks. Otherwise the search stops
+ * at the lowest match, through ParallelFind().
+ */
+extern BOOL ParallelSearch(pool_t* pool, uint64_t begin, uint64_t end, search_kernel_fn kernel,
+	const void* ctx, BOOL count_all, search_result_t* result);
@@ -0,0 +1,437 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Radix sort and k-way merge
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "pool.h"
+#include "sort.h"
+
+// Below this, the sort runs as a single block
+#define SORT_MIN_BLOCK		4096
+
+typedef struct {
+	const uint8_t* in;
+	uint8_t* out;
+	size_t n, size, block;
+	size_t digit;			// Offset of the byte of the key the pass sorts on
+	size_t* offset;			// SORT_RADIX_SIZE counts per block, then where each bucket of it goes
+	uint8_t* stage;			// SORT_RADIX_SIZE buffers of SORT_WC_SIZE bytes per worker
+} radix_range_t;
+
+typedef struct {
+	uint64_t key;
+	size_t run;
+} merge_head_t;
+
+typedef struct {
+	const uint8_t* const* runs;
+	const size_t* counts;
+	size_t k, total, parts;
+	sort_record_t record;
+	uint8_t* out;
+	size_t* split;			// Position of every part start in each run, plus one row for the end
+	merge_head_t* heap;		// k entries per worker
+	size_t* pos;			// k entries per worker, so that the splits stay as they are for the part before
+} merge_range_t;
+
+static FORCE_INLINE uint64_t sort_key(const uint8_t* item, size_t key_offset, size_t key_size)
+{
+	uint32_t k32;
+	uint64_t k64;
+
+	if (key_size == sizeof(uint32_t)) {
+		memcpy(&k32, item + key_offset, sizeof(k32));
+		return k32;
+	}
+	memcpy(&k64, item + key_offset, sizeof(k64));
+	return k64;
+}
+
+static void RadixCountRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	radix_range_t* range = (radix_range_t*)ctx;
+	const uint8_t* digit;
+	size_t* count;
+	size_t i, last;
+	uint64_t b;
+
+	for (b = begin; b < end; b++) {
+		count = &range->offset[b * SORT_RADIX_SIZE];
+		memset(count, 0, SORT_RADIX_SIZE * sizeof(size_t));
+		last = min((size_t)(b + 1) * range->block, range->n);
+		digit = range->in + range->digit;
+		for (i = (size_t)b * range->block; i < last; i++)
+			count[digit[i * range->size]]++;
+	}
+}
+
+/*
+ * Records get staged in the buffer of their bucket, and only go out when
+ * it is full, so that the stores to out are whole lines to a few places
+ * at a time, instead of single records to up to 256 places, which would
+ * need more lines than the cache can keep open and have them read back
+ * from memory only to be partially overwritten.
+ */
+static FORCE_INLINE void radix_scatter(const uint8_t* in, uint8_t* out, size_t first, size_t last,
+	size_t size, size_t digit, size_t* pos, uint8_t* stage)
+{
+	const size_t cap = SORT_WC_SIZE / size;
+	uint32_t fill[SORT_RADIX_SIZE] = { 0 };
+	uint8_t* buf;
+	size_t i, d;
+
+	for (i = first; i < last; i++) {
+		d = in[i * size + digit];
+		buf = &stage[d * SORT_WC_SIZE];
+		memcpy(&buf[fill[d] * size], &in[i * size], size);
+		if (++fill[d] == cap) {
+			memcpy(&out[pos[d] * size], buf, cap * size);
+			pos[d] += cap;
+			fill[d] = 0;
+		}
+	}
+	for (d = 0; d < SORT_RADIX_SIZE; d++) {
+		if (fill[d] != 0) {
+			memcpy(&out[pos[d] * size], &stage[d * SORT_WC_SIZE], fill[d] * size);
+			pos[d] += fill[d];
+		}
+	}
+}
+
+static void RadixScatterRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	radix_range_t* range = (radix_range_t*)ctx;
+	uint8_t* stage = &range->stage[(size_t)worker * SORT_RADIX_SIZE * SORT_WC_SIZE];
+	size_t *pos, d, i, first, last, size = range->size;
+	uint64_t b;
+
+	for (b = begin; b < end; b++) {
+		pos = &range->offset[b * SORT_RADIX_SIZE];
+		first = (size_t)b * range->block;
+		last = min(first + range->block, range->n);
+		// Let the compiler turn memcpy() into a move for the usual sizes
+		switch (size) {
+		case 4:
+			radix_scatter(range->in, range->out, first, last, 4, range->digit, pos, stage);
+			break;
+		case 8:
+			radix_scatter(range->in, range->out, first, last, 8, range->digit, pos, stage);
+			break;
+		case 16:
+			radix_scatter(range->in, range->out, first, last, 16, range->digit, pos, stage);
+			break;
+		default:
+			if (size <= SORT_WC_SIZE / 2) {
+				radix_scatter(range->in, range->out, first, last, size, range->digit, pos, stage);
+				break;
+			}
+			// Records that big are lines of their own already
+			for (i = first; i < last; i++) {
+				d = range->in[i * size + range->digit];
+				memcpy(&range->out[pos[d]++ * size], &range->in[i * size], size);
+			}
+			break;
+		}
+	}
+}
+
+static void RadixCopyRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	radix_range_t* range = (radix_range_t*)ctx;
+	size_t first = (size_t)begin * range->block;
+	size_t last = min((size_t)end * range->block, range->n);
+
+	memcpy(&range->out[first * range->size], &range->in[first * range->size], (last - first) * range->size);
+}
+
+BOOL ParallelRadixSort(pool_t* pool, void* data, size_t n, const sort_record_t* record, void* tmp)
+{
+	radix_range_t range;
+	uint8_t *src = (uint8_t*)data, *dst = (uint8_t*)tmp, *alloc = NULL;
+	size_t b, d, p, blocks, sum, workers = PoolSize(pool);
+	BOOL r = FALSE;
+
+	if (((record->key_size != sizeof(uint32_t)) && (record->key_size != sizeof(uint64_t))) ||
+		(record->key_offset + record->key_size > record->size)) {
+		fprintf(stderr, "Unsupported sort record\n");
+		return FALSE;
+	}
+	if (n <= 1)
+		return TRUE;
+
+	range.n = n;
+	range.size = record->size;
+	range.block = max(n / (workers * SORT_BLOCKS_PER_WORKER), SORT_MIN_BLOCK);
+	blocks = (n + range.block - 1) / range.block;
+	range.offset = (size_t*)malloc(blocks * SORT_RADIX_SIZE * sizeof(size_t));
+	range.stage = (uint8_t*)malloc(workers * SORT_RADIX_SIZE * SORT_WC_SIZE);
+	if (dst == NULL)
+		dst = alloc = (uint8_t*)malloc(n * record->size);
+	if ((range.offset == NULL) || (range.stage == NULL) || (dst == NULL)) {
+		fprintf(stderr, "Could not allocate sort buffers\n");
+		goto out;
+	}
+
+	// Windows is little endian, so digit p of a key is its byte p
+	for (p = 0; p < record->key_size; p++) {
+		range.in = src;
+		range.out = dst;
+		range.digit = record->key_offset + p;
+		if (!ParallelFor(pool, 0, blocks, 1, RadixCountRange, &range))
+			goto out;
+		// Bucket d of block b goes after the ones of the lower digits, then the ones of the earlier blocks
+		for (sum = 0, d = 0; d < SORT_RADIX_SIZE; d++) {
+			for (b = 0; b < blocks; b++) {
+				sum += range.offset[b * SORT_RADIX_SIZE + d];
+				range.offset[b * SORT_RADIX_SIZE + d] = sum - range.offset[b * SORT_RADIX_SIZE + d];
+			}
+			// If all the keys have that digit, the pass would leave them as they are
+			if (sum - range.offset[d] == n)
+				break;
+		}
+		if (d < SORT_RADIX_SIZE)
+			continue;
+		if (!ParallelFor(pool, 0, blocks, 1, RadixScatterRange, &range))
+			goto out;
+		range.in = dst;
+		dst = src;
+		src = (uint8_t*)range.in;
+	}
+	r = TRUE;
+	if (src != data) {
+		range.in = src;
+		range.out = (uint8_t*)data;
+		r = ParallelFor(pool, 0, blocks, 1, RadixCopyRange, &range);
+	}
+
+out:
+	free(alloc);
+	free(range.stage);
+	free(range.offset);
+	return r;
+}
+
+BOOL ParallelRadixSort32(pool_t* pool, uint32_t* keys, size_t n)
+{
+	const sort_record_t record = { sizeof(uint32_t), 0, sizeof(uint32_t) };
+
+	return ParallelRadixSort(pool, keys, n, &record, NULL);
+}
+
+BOOL ParallelRadixSort64(pool_t* pool, uint64_t* keys, size_t n)
+{
+	const sort_record_t record = { sizeof(uint64_t), 0, sizeof(uint64_t) };
+
+	return ParallelRadixSort(pool, keys, n, &record, NULL);
+}
+
+// Number of records of the sorted run that have a key lower than (or equal to, if upper) key
+static size_t merge_bound(const uint8_t* run, size_t n, const sort_record_t* record, uint64_t key, BOOL upper)
+{
+	size_t lo = 0, hi = n, mid;
+	uint64_t k;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		k = sort_key(&run[mid * record->size], record->key_offset, record->key_size);
+		if ((k < key) || (upper && (k == key)))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Find where the first rank records of the merge end in each run: look for
+ * the lowest key that has at least rank records up to it, take everything
+ * below it, then the records that have it, from the earliest runs first.
+ */
+static void merge_split(const merge_range_t* range, size_t rank, size_t* pos)
+{
+	const sort_record_t* record = &range->record;
+	uint64_t lo = 0, hi = (record->key_size == sizeof(uint32_t)) ? UINT32_MAX : UINT64_MAX, mid;
+	size_t j, count, take;
+
+	if (rank == 0 || rank == range->total) {
+		for (j = 0; j < range->k; j++)
+			pos[j] = (rank == 0) ? 0 : range->counts[j];
+		return;
+	}
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		for (count = 0, j = 0; j < range->k; j++)
+			count += merge_bound(range->runs[j], range->counts[j], record, mid, TRUE);
+		if (count >= rank)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	for (count = 0, j = 0; j < range->k; j++) {
+		pos[j] = merge_bound(range->runs[j], range->counts[j], record, lo, FALSE);
+		count += pos[j];
+	}
+	for (j = 0; (j < range->k) && (count < rank); j++) {
+		take = min(merge_bound(range->runs[j], range->counts[j], record, lo, TRUE) - pos[j], rank - count);
+		pos[j] += take;
+		count += take;
+	}
+}
+
+static void MergeSplitRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	merge_range_t* range = (merge_range_t*)ctx;
+	uint64_t p;
+
+	for (p = begin; p < end; p++)
+		merge_split(range, (size_t)(range->total * p / range->parts), &range->split[p * range->k]);
+}
+
+// Whether head a goes before head b
+static FORCE_INLINE BOOL merge_before(const merge_head_t* a, const merge_head_t* b)
+{
+	return (a->key < b->key) || ((a->key == b->key) && (a->run < b->run));
+}
+
+static FORCE_INLINE void merge_sift(merge_head_t* heap, size_t len, size_t i)
+{
+	merge_head_t t;
+	size_t c;
+
+	for (c = 2 * i + 1; c < len; i = c, c = 2 * i + 1) {
+		if ((c + 1 < len) && merge_before(&heap[c + 1], &heap[c]))
+			c++;
+		if (!merge_before(&heap[c], &heap[i]))
+			break;
+		t = heap[i];
+		heap[i] = heap[c];
+		heap[c] = t;
+	}
+}
+
+// Merge the records of the runs from pos to last into out, through a heap of their heads
+static FORCE_INLINE void merge_part(const uint8_t* const* runs, size_t k, size_t* pos, const size_t* last,
+	merge_head_t* heap, uint8_t* out, size_t size, size_t key_offset, size_t key_size)
+{
+	merge_head_t* top = &heap[0];
+	size_t j, len;
+
+	for (len = 0, j = 0; j < k; j++) {
+		if (pos[j] < last[j]) {
+			heap[len].key = sort_key(&runs[j][pos[j] * size], key_offset, key_size);
+			heap[len++].run = j;
+		}
+	}
+	for (j = len / 2; j-- > 0; )
+		merge_sift(heap, len, j);
+	// Keep taking the lowest head, and whatever follows it in its run while it is still the lowest
+	while (len > 1) {
+		j = top->run;
+		do {
+			memcpy(out, &runs[j][pos[j] * size], size);
+			out += size;
+			if (++pos[j] == last[j])
+				break;
+			top->key = sort_key(&runs[j][pos[j] * size], key_offset, key_size);
+		} while (!merge_before(&heap[1], top) && ((len < 3) || !merge_before(&heap[2], top)));
+		if (pos[j] == last[j])
+			heap[0] = heap[--len];
+		merge_sift(heap, len, 0);
+	}
+	if (len == 1) {
+		j = top->run;
+		memcpy(out, &runs[j][pos[j] * size], (last[j] - pos[j]) * size);
+	}
+}
+
+static void MergePartRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	merge_range_t* range = (merge_range_t*)ctx;
+	const sort_record_t* record = &range->record;
+	merge_head_t* heap = &range->heap[(size_t)worker * range->k];
+	size_t* pos = &range->pos[(size_t)worker * range->k];
+	const size_t* last;
+	uint8_t* out;
+	uint64_t p;
+
+	for (p = begin; p < end; p++) {
+		memcpy(pos, &range->split[p * range->k], range->k * sizeof(size_t));
+		last = &range->split[(p + 1) * range->k];
+		out = &range->out[(size_t)(range->total * p / range->parts) * record->size];
+		// Same as the scatter, for plain keys
+		if ((record->size == 4) && (record->key_size == 4))
+			merge_part(range->runs, range->k, pos, last, heap, out, 4, 0, 4);
+		else if ((record->size == 8) && (record->key_size == 8))
+			merge_part(range->runs, range->k, pos, last, heap, out, 8, 0, 8);
+		else
+			merge_part(range->runs, range->k, pos, last, heap, out, record->size,
+				record->key_offset, record->key_size);
+	}
+}
+
+BOOL ParallelMergeRuns(pool_t* pool, const void* const* runs, const size_t* counts, size_t k,
+	const sort_record_t* record, void* out)
+{
+	merge_range_t range;
+	size_t j, workers = PoolSize(pool);
+	BOOL r = FALSE;
+
+	if (((record->key_size != sizeof(uint32_t)) && (record->key_size != sizeof(uint64_t))) ||
+		(record->key_offset + record->key_size > record->size)) {
+		fprintf(stderr, "Unsupported sort record\n");
+		return FALSE;
+	}
+
+	range.runs = (const uint8_t* const*)runs;
+	range.counts = counts;
+	range.k = k;
+	range.record = *record;
+	range.out = (uint8_t*)out;
+	for (range.total = 0, j = 0; j < k; j++)
+		range.total += counts[j];
+	if (range.total == 0)
+		return TRUE;
+	range.parts = min(workers * SORT_BLOCKS_PER_WORKER, (range.total + SORT_MIN_BLOCK - 1) / SORT_MIN_BLOCK);
+	range.split = (size_t*)malloc((range.parts + 1) * k * sizeof(size_t));
+	range.heap = (merge_head_t*)malloc(workers * k * sizeof(merge_head_t));
+	range.pos = (size_t*)malloc(workers * k * sizeof(size_t));
+	if ((range.split == NULL) || (range.heap == NULL) || (range.pos == NULL)) {
+		fprintf(stderr, "Could not allocate merge buffers\n");
+		goto out;
+	}
+
+	// The splits take binary searches over all the runs, so they are worth spreading too
+	if (!ParallelFor(pool, 0, range.parts + 1, 1, MergeSplitRange, &range))
+		goto out;
+	r = ParallelFor(pool, 0, range.parts, 1, MergePartRange, &range);
+
+out:
+	free(range.split);
+	free(range.heap);
+	free(range.pos);
+	return r;
+}
@@ -0,0 +1,67 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Radix sort and k-way merge
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+// Bits of the key sorted on per pass
+#define SORT_RADIX_BITS		8
+#define SORT_RADIX_SIZE		(1 << SORT_RADIX_BITS)
+// Size of the staging buffer of each bucket, in which records get written before going out a line at a time
+#define SORT_WC_SIZE		128
+// How many blocks/parts per worker the sort and the merge aim for
+#define SORT_BLOCKS_PER_WORKER	4
+
+/*
+ * Records are size bytes, sorted on the unsigned key of key_size (4 or 8)
+ * bytes, in native byte order, at key_offset.
+ */
+typedef struct {
+	size_t size;
+	size_t key_offset;
+	size_t key_size;
+} sort_record_t;
+
+/*
+ * Stable LSD radix sort of the n records of data, SORT_RADIX_BITS at a time.
+ * Each pass gets a histogram of every block of records from the workers, the
+ * caller turns them into where each block writes each bucket, then the
+ * workers scatter their blocks, through a staging buffer per bucket, so that
+ * the writes go out a whole line at a time rather than to 256 places at
+ * once. Passes on a digit that all the keys share get skipped. tmp must
+ * have room for n records, and can be NULL to have it allocated.
+ */
+extern BOOL ParallelRadixSort(pool_t* pool, void* data, size_t n, const sort_record_t* record, void* tmp);
+extern BOOL ParallelRadixSort32(pool_t* pool, uint32_t* keys, size_t n);
+extern BOOL ParallelRadixSort64(pool_t* pool, uint64_t* keys, size_t n);
+
+/*
+ * Merge the k sorted runs of counts[i] records at runs[i] into out, stably
+ * (on equal keys, records from the earlier runs come first). The output
+ * gets split into even parts, whose bounds in every run are found by
+ * binary searches on the key, and each part is merged by a worker.
+ */
+extern BOOL ParallelMergeRuns(pool_t* pool, const void* const* runs, const size_t* counts, size_t k,
+	const sort_record_t* record, void* out);
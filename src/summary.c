@@ -0,0 +1,355 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Top-K and quantile summaries
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "summary.h"
+
+// Items a level starts with
+#define QUANTILE_MIN_SIZE	16
+
+typedef struct {
+	topk_t topk;
+	quantile_t sketch;
+} summary_worker_t;
+
+typedef struct {
+	summary_fn fn;
+	void* ctx;
+	summary_worker_t* worker;
+	BOOL topk, sketch;
+	volatile LONG errors;
+} summary_range_t;
+
+typedef struct {
+	double value;
+	uint64_t weight;
+} quantile_item_t;
+
+// Whether a should be dropped before b
+static __inline BOOL topk_worse(const topk_item_t* a, const topk_item_t* b)
+{
+	return (a->score < b->score) || ((a->score == b->score) && (a->id > b->id));
+}
+
+static void topk_sift(topk_item_t* item, size_t count, size_t i)
+{
+	topk_item_t t;
+	size_t c;
+
+	for (c = 2 * i + 1; c < count; i = c, c = 2 * i + 1) {
+		if ((c + 1 < count) && topk_worse(&item[c + 1], &item[c]))
+			c++;
+		if (!topk_worse(&item[c], &item[i]))
+			break;
+		t = item[i];
+		item[i] = item[c];
+		item[c] = t;
+	}
+}
+
+BOOL topk_init(topk_t* topk, size_t k)
+{
+	topk->k = k;
+	topk->count = 0;
+	topk->item = (topk_item_t*)malloc(max(k, 1) * sizeof(topk_item_t));
+	return (topk->item != NULL);
+}
+
+void topk_free(topk_t* topk)
+{
+	free(topk->item);
+	topk->item = NULL;
+	topk->count = 0;
+}
+
+void topk_add(topk_t* topk, double score, uint64_t id)
+{
+	topk_item_t x = { score, id };
+	size_t i, p;
+
+	// NaNs have no rank
+	if (score != score)
+		return;
+	if (topk->count < topk->k) {
+		for (i = topk->count++; (i > 0) && topk_worse(&x, &topk->item[p = (i - 1) / 2]); i = p)
+			topk->item[i] = topk->item[p];
+		topk->item[i] = x;
+	} else if ((topk->k != 0) && topk_worse(&topk->item[0], &x)) {
+		topk->item[0] = x;
+		topk_sift(topk->item, topk->count, 0);
+	}
+}
+
+void topk_merge(topk_t* topk, const topk_t* src)
+{
+	size_t i;
+
+	for (i = 0; i < src->count; i++)
+		topk_add(topk, src->item[i].score, src->item[i].id);
+}
+
+void topk_sort(topk_t* topk)
+{
+	topk_item_t t;
+	size_t n;
+
+	// Move the worst one to the end, until the best one is left at the start
+	for (n = topk->count; n > 1; n--) {
+		t = topk->item[0];
+		topk->item[0] = topk->item[n - 1];
+		topk->item[n - 1] = t;
+		topk_sift(topk->item, n - 1, 0);
+	}
+}
+
+static int CompareValues(const void* a, const void* b)
+{
+	double va = *(const double*)a, vb = *(const double*)b;
+
+	return (va > vb) - (va < vb);
+}
+
+static int CompareItems(const void* a, const void* b)
+{
+	return CompareValues(&((const quantile_item_t*)a)->value, &((const quantile_item_t*)b)->value);
+}
+
+static uint32_t quantile_capacity(const quantile_t* sketch, uint32_t level)
+{
+	return max((uint32_t)ceil(sketch->k * pow(2.0 / 3.0, sketch->levels - 1 - level)), 2);
+}
+
+static BOOL quantile_grow(quantile_t* sketch)
+{
+	uint32_t h;
+
+	if (sketch->levels >= QUANTILE_MAX_LEVELS)
+		return FALSE;
+	sketch->levels++;
+	for (sketch->capacity = 0, h = 0; h < sketch->levels; h++)
+		sketch->capacity += quantile_capacity(sketch, h);
+	return TRUE;
+}
+
+static BOOL quantile_reserve(quantile_t* sketch, uint32_t level, uint32_t count)
+{
+	double* item;
+	uint32_t size;
+
+	if (count <= sketch->size[level])
+		return TRUE;
+	size = max(max(count, 2 * sketch->size[level]), QUANTILE_MIN_SIZE);
+	item = (double*)realloc(sketch->item[level], size * sizeof(double));
+	if (item == NULL)
+		return FALSE;
+	sketch->item[level] = item;
+	sketch->size[level] = size;
+	return TRUE;
+}
+
+// Halve the lowest level that is over its capacity, until the sketch is no longer full
+static BOOL quantile_compress(quantile_t* sketch)
+{
+	double* item;
+	uint32_t h, i, even, count;
+
+	for (h = 0; (h < sketch->levels) && (sketch->held >= sketch->capacity); h++) {
+		count = sketch->count[h];
+		if (count < quantile_capacity(sketch, h))
+			continue;
+		if ((h + 1 == sketch->levels) && !quantile_grow(sketch))
+			return FALSE;
+		even = count & ~1;
+		if (!quantile_reserve(sketch, h + 1, sketch->count[h + 1] + even / 2))
+			return FALSE;
+		item = sketch->item[h];
+		qsort(item, count, sizeof(double), CompareValues);
+		// xorshift64, for the half that moves up
+		sketch->seed ^= sketch->seed << 13;
+		sketch->seed ^= sketch->seed >> 7;
+		sketch->seed ^= sketch->seed << 17;
+		for (i = (uint32_t)(sketch->seed & 1); i < even; i += 2)
+			sketch->item[h + 1][sketch->count[h + 1]++] = item[i];
+		// An odd one out stays where it is
+		if (count != even)
+			item[0] = item[count - 1];
+		sketch->count[h] = count - even;
+		sketch->held -= even / 2;
+	}
+	return TRUE;
+}
+
+BOOL quantile_init(quantile_t* sketch, uint32_t k, uint64_t seed)
+{
+	memset(sketch, 0, sizeof(quantile_t));
+	sketch->k = (k == 0) ? QUANTILE_DEFAULT_K : k;
+	sketch->seed = (seed == 0) ? 0x2545f4914f6cdd1dULL : seed;
+	return quantile_grow(sketch) && quantile_reserve(sketch, 0, QUANTILE_MIN_SIZE);
+}
+
+void quantile_free(quantile_t* sketch)
+{
+	uint32_t h;
+
+	for (h = 0; h < QUANTILE_MAX_LEVELS; h++)
+		free(sketch->item[h]);
+	memset(sketch, 0, sizeof(quantile_t));
+}
+
+BOOL quantile_add(quantile_t* sketch, double value)
+{
+	if (value != value)
+		return TRUE;
+	if (!quantile_reserve(sketch, 0, sketch->count[0] + 1))
+		return FALSE;
+	sketch->item[0][sketch->count[0]++] = value;
+	sketch->n++;
+	sketch->held++;
+	return (sketch->held < sketch->capacity) || quantile_compress(sketch);
+}
+
+BOOL quantile_merge(quantile_t* sketch, const quantile_t* src)
+{
+	uint32_t h;
+
+	while (sketch->levels < src->levels) {
+		if (!quantile_grow(sketch))
+			return FALSE;
+	}
+	for (h = 0; h < src->levels; h++) {
+		// Empty levels may not have been allocated at all, on either side
+		if (src->count[h] == 0)
+			continue;
+		if (!quantile_reserve(sketch, h, sketch->count[h] + src->count[h]))
+			return FALSE;
+		memcpy(&sketch->item[h][sketch->count[h]], src->item[h], src->count[h] * sizeof(double));
+		sketch->count[h] += src->count[h];
+		sketch->held += src->count[h];
+	}
+	sketch->n += src->n;
+	return (sketch->held < sketch->capacity) || quantile_compress(sketch);
+}
+
+BOOL quantile_query(const quantile_t* sketch, const double* q, double* value, size_t n)
+{
+	quantile_item_t* item;
+	uint64_t rank, weight;
+	size_t i, j, count = 0;
+	uint32_t h;
+
+	if (sketch->held == 0) {
+		for (i = 0; i < n; i++)
+			value[i] = 0.0;
+		return TRUE;
+	}
+	item = (quantile_item_t*)malloc((size_t)sketch->held * sizeof(quantile_item_t));
+	if (item == NULL)
+		return FALSE;
+	// An item of level h stands for 2^h of the ones that got added
+	for (h = 0; h < sketch->levels; h++) {
+		for (j = 0; j < sketch->count[h]; j++) {
+			item[count].value = sketch->item[h][j];
+			item[count++].weight = 1ULL << h;
+		}
+	}
+	qsort(item, count, sizeof(quantile_item_t), CompareItems);
+	for (i = 0; i < n; i++) {
+		rank = (uint64_t)(min(max(q[i], 0.0), 1.0) * sketch->n);
+		for (j = 0, weight = item[0].weight; (weight <= rank) && (j + 1 < count); weight += item[++j].weight);
+		value[i] = item[j].value;
+	}
+	free(item);
+	return TRUE;
+}
+
+static void SummaryRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	summary_range_t* range = (summary_range_t*)ctx;
+	summary_worker_t* w = &range->worker[worker];
+	double score;
+	uint64_t i;
+
+	for (i = begin; i < end; i++) {
+		if (!range->fn(range->ctx, worker, i, &score))
+			continue;
+		if (range->topk)
+			topk_add(&w->topk, score, i);
+		if (range->sketch && !quantile_add(&w->sketch, score)) {
+			InterlockedIncrement(&range->errors);
+			break;
+		}
+	}
+}
+
+BOOL ParallelSummarize(pool_t* pool, uint64_t begin, uint64_t end, summary_fn fn, void* ctx,
+	topk_t* topk, quantile_t* sketch)
+{
+	summary_range_t range = { 0 };
+	DWORD i, workers = PoolSize(pool);
+	BOOL r = FALSE;
+
+	range.fn = fn;
+	range.ctx = ctx;
+	range.topk = (topk != NULL);
+	range.sketch = (sketch != NULL);
+	range.worker = (summary_worker_t*)calloc(workers, sizeof(summary_worker_t));
+	if (range.worker == NULL)
+		goto out;
+	for (i = 0; i < workers; i++) {
+		if ((range.topk && !topk_init(&range.worker[i].topk, topk->k)) ||
+			(range.sketch && !quantile_init(&range.worker[i].sketch, sketch->k, sketch->seed + i + 1))) {
+			range.errors++;
+			goto out;
+		}
+	}
+
+	if (!ParallelFor(pool, begin, end, 0, SummaryRange, &range) || (range.errors != 0))
+		goto out;
+	for (i = 0; i < workers; i++) {
+		if (range.topk)
+			topk_merge(topk, &range.worker[i].topk);
+		if (range.sketch && !quantile_merge(sketch, &range.worker[i].sketch)) {
+			range.errors++;
+			goto out;
+		}
+	}
+	r = TRUE;
+
+out:
+	if ((range.worker == NULL) || (range.errors != 0))
+		fprintf(stderr, "Could not allocate summaries\n");
+	if (range.worker != NULL) {
+		for (i = 0; i < workers; i++) {
+			topk_free(&range.worker[i].topk);
+			quantile_free(&range.worker[i].sketch);
+		}
+	}
+	free(range.worker);
+	return r;
+}
@@ -0,0 +1,89 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Top-K and quantile summaries
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+// Levels of a quantile sketch, which is enough for k << 40 items
+#define QUANTILE_MAX_LEVELS	40
+// Accuracy of the quantile sketches when none is given, for a rank error well under 1%
+#define QUANTILE_DEFAULT_K	200
+
+typedef struct {
+	double score;
+	uint64_t id;
+} topk_item_t;
+
+/*
+ * The k best items, by highest score then lowest id, in a heap that has the
+ * worst of them on top, so that an item that doesn't make it only costs a
+ * comparison.
+ */
+typedef struct {
+	topk_item_t* item;
+	size_t k, count;
+} topk_t;
+
+/*
+ * KLL sketch: items go to level 0, and when the sketch is full, the lowest
+ * level that is over its capacity gets sorted and every other item of it
+ * moves up a level, where it stands for twice as many. The capacities go
+ * down by 2/3 per level below the top one, so that it holds O(k) items.
+ */
+typedef struct {
+	double* item[QUANTILE_MAX_LEVELS];
+	uint32_t count[QUANTILE_MAX_LEVELS];
+	uint32_t size[QUANTILE_MAX_LEVELS];
+	uint32_t k, levels;
+	uint64_t n;			// Items added
+	uint64_t held, capacity;	// Items in the levels, and how many they can hold
+	uint64_t seed;			// For which half of a level moves up
+} quantile_t;
+
+// Whether index of the job has a result, and its score
+typedef BOOL (*summary_fn)(void* ctx, uint32_t worker, uint64_t index, double* score);
+
+extern BOOL topk_init(topk_t* topk, size_t k);
+extern void topk_free(topk_t* topk);
+extern void topk_add(topk_t* topk, double score, uint64_t id);
+extern void topk_merge(topk_t* topk, const topk_t* src);
+// Sort the items best first, after which the only thing that can be done is topk_free()
+extern void topk_sort(topk_t* topk);
+
+extern BOOL quantile_init(quantile_t* sketch, uint32_t k, uint64_t seed);
+extern void quantile_free(quantile_t* sketch);
+extern BOOL quantile_add(quantile_t* sketch, double value);
+extern BOOL quantile_merge(quantile_t* sketch, const quantile_t* src);
+// Set value[i] to the estimate of quantile q[i], each of which goes from 0.0 to 1.0
+extern BOOL quantile_query(const quantile_t* sketch, const double* q, double* value, size_t n);
+
+/*
+ * Run fn for [begin, end) on the workers, and add the results to topk and
+ * sketch, either of which can be NULL. Every worker gets a top-K and a
+ * sketch of its own, like the ones it gets passed, which get merged into
+ * them at the end, so that nothing gets shared while the job runs.
+ */
+extern BOOL ParallelSummarize(pool_t* pool, uint64_t begin, uint64_t end, summary_fn fn, void* ctx,
+	topk_t* topk, quantile_t* sketch);
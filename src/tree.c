@@ -0,0 +1,389 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Parallel directory tree creation and deletion
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msapi_utf8.h"
+#include "pool.h"
+#include "tree.h"
+
+// Maximum number of entries, and size of the paths (in characters), that a delete batch holds
+#define TREE_BATCH_ENTRIES	64
+#define TREE_BATCH_SIZE		(16 * 1024)
+// Number of directories that a task creates
+#define TREE_CREATE_GRAIN	16
+// How many times we try to remove a directory, whose content may not be gone just yet
+#define TREE_RMDIR_RETRIES	5
+
+typedef struct {
+	pool_t* pool;
+	pool_group_t group;
+	volatile LONG64 files;
+	volatile LONG64 directories;
+	volatile LONG64 errors;
+} tree_t;
+
+/*
+ * A directory being deleted. It gets removed once its listing, its file
+ * batches and its subdirectories are done, which then releases its parent.
+ */
+typedef struct tree_dir {
+	tree_t* tree;
+	struct tree_dir* parent;
+	volatile LONG pending;
+	DWORD attributes;
+	size_t len;
+	wchar_t path[1];
+} tree_dir_t;
+
+typedef struct {
+	tree_dir_t* dir;
+	DWORD count;
+	size_t used;
+	struct {
+		size_t offset;
+		DWORD attributes;
+	} entry[TREE_BATCH_ENTRIES];
+	wchar_t buf[TREE_BATCH_SIZE];
+} tree_batch_t;
+
+typedef struct {
+	tree_t* tree;
+	const char* const* dirs;
+} tree_create_t;
+
+static void DeleteDirectoryTask(void* ctx, uint32_t worker);
+
+static BOOL DeleteEntry(const wchar_t* path, DWORD attributes)
+{
+	int i;
+
+	// DeleteFile() and RemoveDirectory() both refuse read-only entries
+	if (attributes & FILE_ATTRIBUTE_READONLY)
+		SetFileAttributesW(path, attributes & ~FILE_ATTRIBUTE_READONLY);
+	// A directory here is either empty or a reparse point, which we don't follow
+	if (!(attributes & FILE_ATTRIBUTE_DIRECTORY))
+		return DeleteFileW(path);
+	// Files that were just deleted may still be held open by the indexer or an antivirus
+	for (i = 0; i < TREE_RMDIR_RETRIES; i++) {
+		if (RemoveDirectoryW(path))
+			return TRUE;
+		if (GetLastError() != ERROR_DIR_NOT_EMPTY)
+			break;
+		Sleep(i);
+	}
+	return FALSE;
+}
+
+static void ReleaseDirectory(tree_dir_t* dir)
+{
+	tree_t* tree = dir->tree;
+	tree_dir_t* parent;
+
+	while ((dir != NULL) && (InterlockedDecrement(&dir->pending) == 0)) {
+		parent = dir->parent;
+		if (!TaskCancelled(tree->pool, &tree->group)) {
+			if (DeleteEntry(dir->path, dir->attributes))
+				InterlockedIncrement64(&tree->directories);
+			else
+				InterlockedIncrement64(&tree->errors);
+		}
+		free(dir);
+		dir = parent;
+	}
+}
+
+static void DeleteBatchTask(void* ctx, uint32_t worker)
+{
+	tree_batch_t* batch = (tree_batch_t*)ctx;
+	tree_t* tree = batch->dir->tree;
+	LONG64 files = 0, directories = 0, errors = 0;
+	DWORD i;
+
+	for (i = 0; (i < batch->count) && !TaskCancelled(tree->pool, &tree->group); i++) {
+		if (!DeleteEntry(&batch->buf[batch->entry[i].offset], batch->entry[i].attributes))
+			errors++;
+		else if (batch->entry[i].attributes & FILE_ATTRIBUTE_DIRECTORY)
+			directories++;
+		else
+			files++;
+	}
+	InterlockedExchangeAdd64(&tree->files, files);
+	InterlockedExchangeAdd64(&tree->directories, directories);
+	InterlockedExchangeAdd64(&tree->errors, errors);
+	ReleaseDirectory(batch->dir);
+	free(batch);
+}
+
+static void QueueDeleteBatch(tree_t* tree, tree_batch_t* batch)
+{
+	if (batch == NULL)
+		return;
+	InterlockedIncrement(&batch->dir->pending);
+	if (!SubmitTask(tree->pool, &tree->group, DeleteBatchTask, batch)) {
+		InterlockedIncrement64(&tree->errors);
+		ReleaseDirectory(batch->dir);
+		free(batch);
+		CancelTaskGroup(&tree->group);
+	}
+}
+
+// Queue the deletion of parent\name, or of path alone if parent is NULL
+static void QueueDeleteDirectory(tree_t* tree, tree_dir_t* parent, const wchar_t* path, size_t path_len,
+	const wchar_t* name, DWORD attributes)
+{
+	size_t name_len = (name == NULL) ? 0 : wcslen(name);
+	size_t len = path_len + ((name == NULL) ? 0 : 1 + name_len);
+	// Leave room for the "\*" we need to list it
+	tree_dir_t* dir = (tree_dir_t*)malloc(sizeof(tree_dir_t) + (len + 2) * sizeof(wchar_t));
+
+	if (dir == NULL) {
+		InterlockedIncrement64(&tree->errors);
+		CancelTaskGroup(&tree->group);
+		return;
+	}
+	dir->tree = tree;
+	dir->parent = parent;
+	// Released by the listing task
+	dir->pending = 1;
+	dir->attributes = attributes;
+	dir->len = len;
+	memcpy(dir->path, path, path_len * sizeof(wchar_t));
+	if (name != NULL) {
+		dir->path[path_len] = L'\\';
+		memcpy(&dir->path[path_len + 1], name, name_len * sizeof(wchar_t));
+	}
+	dir->path[len] = 0;
+	if (parent != NULL)
+		InterlockedIncrement(&parent->pending);
+	if (!SubmitTask(tree->pool, &tree->group, DeleteDirectoryTask, dir)) {
+		InterlockedIncrement64(&tree->errors);
+		if (parent != NULL)
+			ReleaseDirectory(parent);
+		free(dir);
+		CancelTaskGroup(&tree->group);
+	}
+}
+
+/*
+ * Add an entry to the current batch of a directory, queuing the batch
+ * and starting a new one as needed. Returns the current batch.
+ */
+static tree_batch_t* AddDeleteEntry(tree_t* tree, tree_dir_t* dir, tree_batch_t* batch,
+	const WIN32_FIND_DATAW* fd)
+{
+	size_t name_len = wcslen(fd->cFileName);
+	wchar_t* path;
+
+	if ((batch != NULL) && ((batch->count == TREE_BATCH_ENTRIES) ||
+		(batch->used + dir->len + name_len + 2 > TREE_BATCH_SIZE))) {
+		QueueDeleteBatch(tree, batch);
+		batch = NULL;
+	}
+	if (batch == NULL) {
+		if (dir->len + name_len + 2 > TREE_BATCH_SIZE) {
+			InterlockedIncrement64(&tree->errors);
+			return NULL;
+		}
+		batch = (tree_batch_t*)malloc(sizeof(tree_batch_t));
+		if (batch == NULL) {
+			InterlockedIncrement64(&tree->errors);
+			CancelTaskGroup(&tree->group);
+			return NULL;
+		}
+		batch->dir = dir;
+		batch->count = 0;
+		batch->used = 0;
+	}
+
+	path = &batch->buf[batch->used];
+	memcpy(path, dir->path, dir->len * sizeof(wchar_t));
+	path[dir->len] = L'\\';
+	memcpy(&path[dir->len + 1], fd->cFileName, (name_len + 1) * sizeof(wchar_t));
+	batch->entry[batch->count].offset = batch->used;
+	batch->entry[batch->count].attributes = fd->dwFileAttributes;
+	batch->count++;
+	batch->used += dir->len + name_len + 2;
+	return batch;
+}
+
+static void DeleteDirectoryTask(void* ctx, uint32_t worker)
+{
+	tree_dir_t* dir = (tree_dir_t*)ctx;
+	tree_t* tree = dir->tree;
+	tree_batch_t* batch = NULL;
+	WIN32_FIND_DATAW fd;
+	HANDLE h;
+
+	if (TaskCancelled(tree->pool, &tree->group))
+		goto out;
+
+	wcscpy(&dir->path[dir->len], L"\\*");
+	h = FindFirstFileExW(dir->path, FindExInfoBasic, &fd, FindExSearchNameMatch, NULL,
+		FIND_FIRST_EX_LARGE_FETCH);
+	dir->path[dir->len] = 0;
+	if (h == INVALID_HANDLE_VALUE) {
+		InterlockedIncrement64(&tree->errors);
+		goto out;
+	}
+	do {
+		if ((wcscmp(fd.cFileName, L".") == 0) || (wcscmp(fd.cFileName, L"..") == 0))
+			continue;
+		if ((fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+			!(fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+			QueueDeleteDirectory(tree, dir, dir->path, dir->len, fd.cFileName, fd.dwFileAttributes);
+		else
+			batch = AddDeleteEntry(tree, dir, batch, &fd);
+	} while (FindNextFileW(h, &fd) && !TaskCancelled(tree->pool, &tree->group));
+	FindClose(h);
+	QueueDeleteBatch(tree, batch);
+
+out:
+	ReleaseDirectory(dir);
+}
+
+BOOL ParallelDeleteTree(pool_t* pool, const char* root, tree_stats_t* stats)
+{
+	tree_t tree = { 0 };
+	wchar_t* wroot;
+	size_t len;
+	DWORD attributes;
+	BOOL r;
+
+	if (root == NULL)
+		return FALSE;
+	wroot = utf8_to_wchar(root);
+	if (wroot == NULL)
+		return FALSE;
+	if (!InitTaskGroup(&tree.group)) {
+		free(wroot);
+		return FALSE;
+	}
+	tree.pool = pool;
+
+	len = wcslen(wroot);
+	while ((len > 0) && ((wroot[len - 1] == L'\\') || (wroot[len - 1] == L'/')))
+		wroot[--len] = 0;
+	attributes = GetFileAttributesW(wroot);
+	if (attributes == INVALID_FILE_ATTRIBUTES) {
+		tree.errors++;
+	} else if (!(attributes & FILE_ATTRIBUTE_DIRECTORY) || (attributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+		// Same as what we do for these under the root
+		if (!DeleteEntry(wroot, attributes))
+			tree.errors++;
+		else if (attributes & FILE_ATTRIBUTE_DIRECTORY)
+			tree.directories++;
+		else
+			tree.files++;
+	} else {
+		QueueDeleteDirectory(&tree, NULL, wroot, len, NULL, attributes);
+	}
+	r = WaitTaskGroup(pool, &tree.group) && (tree.errors == 0);
+	CloseTaskGroup(&tree.group);
+	free(wroot);
+
+	if (stats != NULL) {
+		stats->files = tree.files;
+		stats->directories = tree.directories;
+		stats->errors = tree.errors;
+	}
+	return r;
+}
+
+// Create path, and its parents as needed, counting the directories we created
+static BOOL CreateDirectoryTree(wchar_t* path, size_t len, LONG64* created)
+{
+	size_t i;
+	wchar_t c;
+	BOOL r;
+
+	if (CreateDirectoryW(path, NULL)) {
+		(*created)++;
+		return TRUE;
+	}
+	if (GetLastError() == ERROR_ALREADY_EXISTS)
+		return TRUE;
+	if (GetLastError() != ERROR_PATH_NOT_FOUND)
+		return FALSE;
+	// Going up one level at a time only costs extra calls for the first directories of a tree
+	for (i = len; (i > 0) && (path[i - 1] != L'\\') && (path[i - 1] != L'/'); i--);
+	// Don't try to create a drive or an UNC share
+	if ((i <= 1) || (path[i - 2] == L':') || (path[i - 2] == L'\\') || (path[i - 2] == L'/'))
+		return FALSE;
+	c = path[i - 1];
+	path[i - 1] = 0;
+	r = CreateDirectoryTree(path, i - 1, created);
+	path[i - 1] = c;
+	if (!r)
+		return FALSE;
+	if (CreateDirectoryW(path, NULL)) {
+		(*created)++;
+		return TRUE;
+	}
+	// Another worker may have created it in the meantime
+	return (GetLastError() == ERROR_ALREADY_EXISTS);
+}
+
+static void CreateDirectoryRange(void* ctx, uint32_t worker, uint64_t begin, uint64_t end)
+{
+	tree_create_t* tc = (tree_create_t*)ctx;
+	wchar_t* wdir;
+	size_t len;
+	LONG64 created = 0, errors = 0;
+	uint64_t i;
+
+	for (i = begin; i < end; i++) {
+		wdir = utf8_to_wchar(tc->dirs[i]);
+		if (wdir == NULL) {
+			errors++;
+			continue;
+		}
+		len = wcslen(wdir);
+		while ((len > 0) && ((wdir[len - 1] == L'\\') || (wdir[len - 1] == L'/')))
+			wdir[--len] = 0;
+		if (!CreateDirectoryTree(wdir, len, &created))
+			errors++;
+		free(wdir);
+	}
+	InterlockedExchangeAdd64(&tc->tree->directories, created);
+	InterlockedExchangeAdd64(&tc->tree->errors, errors);
+}
+
+BOOL ParallelCreateDirectories(pool_t* pool, const char* const* dirs, size_t count,
+	tree_stats_t* stats)
+{
+	tree_t tree = { 0 };
+	tree_create_t tc = { &tree, dirs };
+	BOOL r;
+
+	tree.pool = pool;
+	r = ParallelFor(pool, 0, count, TREE_CREATE_GRAIN, CreateDirectoryRange, &tc) && (tree.errors == 0);
+
+	if (stats != NULL) {
+		stats->files = 0;
+		stats->directories = tree.directories;
+		stats->errors = tree.errors;
+	}
+	return r;
+}
@@ -0,0 +1,52 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Parallel directory tree creation and deletion
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+typedef struct {
+	uint64_t files;				// Deleted
+	uint64_t directories;		// Created or deleted
+	uint64_t errors;
+} tree_stats_t;
+
+/*
+ * Delete root and everything under it, from all the workers of the pool,
+ * like SHDeleteDirectoryExU() does. Each directory gets listed by a task of
+ * its own, and its files get deleted in batches by other tasks, with the
+ * last of these removing the directory, so that directories go leaf first.
+ * Read-only entries are deleted too, and symlinks and junctions get removed
+ * rather than followed. Returns FALSE if anything could not be deleted, in
+ * which case the tree is left partially deleted. stats can be NULL.
+ */
+extern BOOL ParallelDeleteTree(pool_t* pool, const char* root, tree_stats_t* stats);
+
+/*
+ * Create all count directories, along with any missing parent, from all the
+ * workers of the pool, like _mkdirExU() does for a single one. Directories
+ * that already exist are not an error. Returns FALSE if any directory could
+ * not be created. stats can be NULL.
+ */
+extern BOOL ParallelCreateDirectories(pool_t* pool, const char* const* dirs, size_t count,
+	tree_stats_t* stats);
@@ -0,0 +1,1078 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * UTF-16 <-> UTF-8 transcoding
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "utf.h"
+
+#if defined(CPU_X86)
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <immintrin.h>
+#endif
+#elif defined(CPU_ARM64)
+#if defined(_MSC_VER)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
+#define UTF_REPLACEMENT		0xfffd
+// Number of vectors we can add up in 16-bit lanes before they may overflow
+#define UTF_FLUSH			4096
+
+#define UTF_MIN(a, b)		(((a) < (b)) ? (a) : (b))
+// Longest string utf_check() tries, in code points or bytes
+#define UTF_CHECK_MAX		300
+
+typedef struct {
+	size_t (*utf16_to_utf8_length)(const uint16_t* src, size_t len);
+	size_t (*utf16_to_utf8)(const uint16_t* src, size_t len, uint8_t* dst);
+	size_t (*utf8_to_utf16_length)(const uint8_t* src, size_t len);
+	size_t (*utf8_to_utf16)(const uint8_t* src, size_t len, uint16_t* dst);
+	size_t (*utf8_validate)(const uint8_t* src, size_t len);
+} utf_kernel_t;
+
+static const utf_kernel_t utf_scalar_kernel;
+static const utf_kernel_t* utf_kernel = &utf_scalar_kernel;
+static const char* utf_name = "Scalar";
+
+/*
+ * Shuffles that pack 8 UTF-16 code units, already expanded to their one
+ * or two byte UTF-8 sequence in each 16-bit lane, into contiguous UTF-8.
+ * Indexed by the mask of the lanes that hold a single (ASCII) byte.
+ */
+static uint8_t utf16_pack_shuffle[256][16];
+static uint8_t utf16_pack_length[256];
+
+/*
+ * Shuffles that keep the 16-bit lanes, among 8, that end a UTF-8 sequence.
+ * Indexed by the mask of these lanes, which also tells us how many bytes
+ * we have consumed, up to the last one that ends a sequence.
+ */
+static uint8_t utf8_unpack_shuffle[256][16];
+static uint8_t utf8_unpack_length[256];
+static uint8_t utf8_unpack_advance[256];
+
+/*
+ * UTF-8 validation lookup tables, from "Validating UTF-8 In Less Than One
+ * Instruction Per Byte" by John Keiser and Daniel Lemire. Each bit is an
+ * error, that we only get if it is set in the entries for the high and low
+ * nibbles of the previous byte and for the high nibble of the current one.
+ */
+#define UTF8_TOO_SHORT		(1 << 0)	// 11______ 0_______ or 11______ 11______
+#define UTF8_TOO_LONG		(1 << 1)	// 0_______ 10______
+#define UTF8_OVERLONG_3		(1 << 2)	// 11100000 100_____
+#define UTF8_TOO_LARGE		(1 << 3)	// 11110100 1001____ and above
+#define UTF8_SURROGATE		(1 << 4)	// 11101101 101_____
+#define UTF8_OVERLONG_2		(1 << 5)	// 1100000_ 10______
+#define UTF8_TOO_LARGE_1000	(1 << 6)	// 11110101 1000____ and above
+#define UTF8_OVERLONG_4		(1 << 6)	// 11110000 1000____
+#define UTF8_TWO_CONTS		(1 << 7)	// 10______ 10______
+#define UTF8_CARRY			(UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+static const uint8_t utf8_byte_1_high[16] = {
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+	UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+	UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+	UTF8_TOO_SHORT,
+	UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+	UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4
+};
+
+static const uint8_t utf8_byte_1_low[16] = {
+	UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+	UTF8_CARRY | UTF8_OVERLONG_2,
+	UTF8_CARRY,
+	UTF8_CARRY,
+	UTF8_CARRY | UTF8_TOO_LARGE,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000
+};
+
+static const uint8_t utf8_byte_2_high[16] = {
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT
+};
+
+// A vector that ends with any byte above these is missing continuation bytes
+static const uint8_t utf8_max_last[32] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xef, 0xdf, 0xbf
+};
+
+/*
+ * Decode one code point, replacing any invalid sequence with U+FFFD, and
+ * return the number of code units consumed. For UTF-8, we consume the
+ * maximal subpart of an invalid sequence, as recommended by Unicode.
+ */
+static FORCE_INLINE size_t utf8_decode(const uint8_t* s, size_t n, uint32_t* cp)
+{
+	uint8_t lo = 0x80, hi = 0xbf;
+	size_t i, need;
+
+	if (s[0] < 0x80) {
+		*cp = s[0];
+		return 1;
+	}
+	if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+		need = 1;
+		*cp = s[0] & 0x1f;
+	} else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+		need = 2;
+		*cp = s[0] & 0x0f;
+		// Overlong encodings and surrogates
+		if (s[0] == 0xe0)
+			lo = 0xa0;
+		else if (s[0] == 0xed)
+			hi = 0x9f;
+	} else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+		need = 3;
+		*cp = s[0] & 0x07;
+		// Overlong encodings and code points above U+10FFFF
+		if (s[0] == 0xf0)
+			lo = 0x90;
+		else if (s[0] == 0xf4)
+			hi = 0x8f;
+	} else {
+		*cp = UTF_REPLACEMENT;
+		return 1;
+	}
+	for (i = 1; i <= need; i++) {
+		if (i >= n || s[i] < lo || s[i] > hi) {
+			*cp = UTF_REPLACEMENT;
+			return i;
+		}
+		*cp = (*cp << 6) | (s[i] & 0x3f);
+		lo = 0x80;
+		hi = 0xbf;
+	}
+	return i;
+}
+
+static FORCE_INLINE size_t utf16_decode(const uint16_t* s, size_t n, uint32_t* cp)
+{
+	if ((s[0] & 0xf800) != 0xd800) {
+		*cp = s[0];
+		return 1;
+	}
+	if (s[0] < 0xdc00 && n >= 2 && (s[1] & 0xfc00) == 0xdc00) {
+		*cp = 0x10000 + (((uint32_t)s[0] - 0xd800) << 10) + (s[1] - 0xdc00);
+		return 2;
+	}
+	*cp = UTF_REPLACEMENT;
+	return 1;
+}
+
+static FORCE_INLINE size_t utf8_encode(uint32_t cp, uint8_t* d)
+{
+	if (cp < 0x80) {
+		d[0] = (uint8_t)cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		d[0] = (uint8_t)(0xc0 | (cp >> 6));
+		d[1] = (uint8_t)(0x80 | (cp & 0x3f));
+		return 2;
+	}
+	if (cp < 0x10000) {
+		d[0] = (uint8_t)(0xe0 | (cp >> 12));
+		d[1] = (uint8_t)(0x80 | ((cp >> 6) & 0x3f));
+		d[2] = (uint8_t)(0x80 | (cp & 0x3f));
+		return 3;
+	}
+	d[0] = (uint8_t)(0xf0 | (cp >> 18));
+	d[1] = (uint8_t)(0x80 | ((cp >> 12) & 0x3f));
+	d[2] = (uint8_t)(0x80 | ((cp >> 6) & 0x3f));
+	d[3] = (uint8_t)(0x80 | (cp & 0x3f));
+	return 4;
+}
+
+static FORCE_INLINE size_t utf16_encode(uint32_t cp, uint16_t* d)
+{
+	if (cp < 0x10000) {
+		d[0] = (uint16_t)cp;
+		return 1;
+	}
+	d[0] = (uint16_t)(0xd800 + ((cp - 0x10000) >> 10));
+	d[1] = (uint16_t)(0xdc00 + (cp & 0x3ff));
+	return 2;
+}
+
+/*
+ * Every UTF-16 code unit takes 1 to 3 bytes in UTF-8, depending on its
+ * value, except for a valid surrogate pair, which takes 4 rather than 6.
+ * An unpaired surrogate becomes U+FFFD, which also takes 3 bytes. This
+ * is what lets the vectorized versions count without decoding.
+ */
+static FORCE_INLINE size_t utf16_to_utf8_length_tail(const uint16_t* src, size_t len)
+{
+	size_t i, count = 0;
+
+	for (i = 0; i < len; i++) {
+		count += 1 + (src[i] >= 0x80) + (src[i] >= 0x800);
+		if ((src[i] & 0xfc00) == 0xd800 && i + 1 < len && (src[i + 1] & 0xfc00) == 0xdc00)
+			count -= 2;
+	}
+	return count;
+}
+
+static FORCE_INLINE size_t utf16_to_utf8_tail(const uint16_t* src, size_t len, uint8_t* dst)
+{
+	uint8_t* start = dst;
+	uint32_t cp;
+	size_t i = 0;
+
+	while (i < len) {
+		i += utf16_decode(&src[i], len - i, &cp);
+		dst += utf8_encode(cp, dst);
+	}
+	return dst - start;
+}
+
+static FORCE_INLINE size_t utf8_to_utf16_length_tail(const uint8_t* src, size_t len)
+{
+	uint32_t cp;
+	size_t i = 0, count = 0;
+
+	while (i < len) {
+		i += utf8_decode(&src[i], len - i, &cp);
+		count += (cp >= 0x10000) ? 2 : 1;
+	}
+	return count;
+}
+
+static FORCE_INLINE size_t utf8_to_utf16_tail(const uint8_t* src, size_t len, uint16_t* dst)
+{
+	uint16_t* start = dst;
+	uint32_t cp;
+	size_t i = 0;
+
+	while (i < len) {
+		i += utf8_decode(&src[i], len - i, &cp);
+		dst += utf16_encode(cp, dst);
+	}
+	return dst - start;
+}
+
+/*
+ * Return the offset of the first invalid sequence, or len. We can use the
+ * decoder for this, as long as we don't mistake an actual U+FFFD for one.
+ */
+static FORCE_INLINE size_t utf8_validate_tail(const uint8_t* src, size_t len)
+{
+	uint32_t cp;
+	size_t i = 0, n;
+
+	while (i < len) {
+		n = utf8_decode(&src[i], len - i, &cp);
+		if (cp == UTF_REPLACEMENT && !(n == 3 && src[i] == 0xef))
+			return i;
+		i += n;
+	}
+	return len;
+}
+
+/*
+ * Called when a vectorized validation finds an error in the block at offset
+ * i, to locate it. Everything before i is valid, except for a sequence that
+ * may have started in the last 3 bytes, so we restart from that sequence.
+ */
+static FORCE_INLINE size_t utf8_validate_from(const uint8_t* src, size_t len, size_t i)
+{
+	size_t j = (i < 3) ? 0 : i - 3;
+
+	while (j < i && (src[j] & 0xc0) == 0x80)
+		j++;
+	return j + utf8_validate_tail(&src[j], len - j);
+}
+
+static size_t utf16_to_utf8_length_scalar(const uint16_t* src, size_t len)
+{
+	return utf16_to_utf8_length_tail(src, len);
+}
+
+static size_t utf16_to_utf8_scalar(const uint16_t* src, size_t len, uint8_t* dst)
+{
+	return utf16_to_utf8_tail(src, len, dst);
+}
+
+static size_t utf8_to_utf16_length_scalar(const uint8_t* src, size_t len)
+{
+	return utf8_to_utf16_length_tail(src, len);
+}
+
+static size_t utf8_to_utf16_scalar(const uint8_t* src, size_t len, uint16_t* dst)
+{
+	return utf8_to_utf16_tail(src, len, dst);
+}
+
+static size_t utf8_validate_scalar(const uint8_t* src, size_t len)
+{
+	return utf8_validate_tail(src, len);
+}
+
+static const utf_kernel_t utf_scalar_kernel = {
+	utf16_to_utf8_length_scalar, utf16_to_utf8_scalar,
+	utf8_to_utf16_length_scalar, utf8_to_utf16_scalar,
+	utf8_validate_scalar
+};
+
+/*
+ * The vectorized versions below all work the same way:
+ * - UTF-16 length: add up the per code unit sizes and subtract the valid
+ *   surrogate pairs, by looking at each vector and the one that starts a
+ *   code unit later.
+ * - UTF-16 to UTF-8: a vector of ASCII is narrowed directly, and a vector
+ *   of code units below U+0800 is expanded to one or two bytes per lane
+ *   then packed with a shuffle. Anything else goes through the scalar code.
+ * - UTF-8: runs of ASCII are skipped or widened 16 or 32 bytes at a time,
+ *   and multibyte sequences are decoded one at a time.
+ * Since each UTF-16 code unit produces at least one byte of UTF-8 and each
+ * byte of UTF-8 at most one UTF-16 code unit, we only ever write past what
+ * we have converted so far when there is as much input left to convert.
+ */
+#if defined(CPU_X86)
+static FORCE_INLINE TARGET_ATTR("sse4.1") size_t utf16_to_utf8_length_sse(const uint16_t* src, size_t len)
+{
+	const __m128i m80 = _mm_set1_epi16((short)0xff80), m800 = _mm_set1_epi16((short)0xf800);
+	const __m128i msurr = _mm_set1_epi16((short)0xfc00), one = _mm_set1_epi16(1);
+	const __m128i high = _mm_set1_epi16((short)0xd800), low = _mm_set1_epi16((short)0xdc00);
+	__m128i v, next, pair, acc;
+	size_t i = 0, count = 0, n;
+
+	// We need one more code unit, to check for a surrogate pair at the end
+	while (len - i > 8) {
+		acc = _mm_setzero_si128();
+		n = UTF_MIN((len - i - 1) / 8, UTF_FLUSH);
+		count += 3 * 8 * n;
+		for (; n > 0; n--, i += 8) {
+			v = _mm_loadu_si128((const __m128i*)&src[i]);
+			next = _mm_loadu_si128((const __m128i*)&src[i + 1]);
+			// Each of these is -1 per lane, to subtract from 3 bytes per code unit
+			acc = _mm_add_epi16(acc, _mm_cmpeq_epi16(_mm_and_si128(v, m80), _mm_setzero_si128()));
+			acc = _mm_add_epi16(acc, _mm_cmpeq_epi16(_mm_and_si128(v, m800), _mm_setzero_si128()));
+			pair = _mm_and_si128(_mm_cmpeq_epi16(_mm_and_si128(v, msurr), high),
+				_mm_cmpeq_epi16(_mm_and_si128(next, msurr), low));
+			acc = _mm_add_epi16(acc, _mm_add_epi16(pair, pair));
+		}
+		acc = _mm_madd_epi16(acc, one);
+		acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+		acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+		count -= (size_t)-_mm_cvtsi128_si32(acc);
+	}
+	return count + utf16_to_utf8_length_tail(&src[i], len - i);
+}
+
+// Convert 8 code units if they are all below U+0800, and return the number of bytes written
+static FORCE_INLINE TARGET_ATTR("sse4.1") size_t utf16_to_utf8_block_sse(__m128i v, uint8_t* dst)
+{
+	const __m128i m80 = _mm_set1_epi16((short)0xff80), m3f = _mm_set1_epi16(0x3f);
+	const __m128i lead = _mm_set1_epi16(0xc0), cont = _mm_set1_epi16(0x80);
+	__m128i ascii, two;
+	int mask;
+
+	if (!_mm_testz_si128(v, _mm_set1_epi16((short)0xf800)))
+		return 0;
+	ascii = _mm_cmpeq_epi16(_mm_and_si128(v, m80), _mm_setzero_si128());
+	// Lead byte in the low half of each lane, continuation byte in the high half
+	two = _mm_or_si128(_mm_or_si128(_mm_srli_epi16(v, 6), lead),
+		_mm_slli_epi16(_mm_or_si128(_mm_and_si128(v, m3f), cont), 8));
+	v = _mm_blendv_epi8(two, v, ascii);
+	mask = _mm_movemask_epi8(_mm_packs_epi16(ascii, ascii)) & 0xff;
+	v = _mm_shuffle_epi8(v, _mm_loadu_si128((const __m128i*)utf16_pack_shuffle[mask]));
+	_mm_storeu_si128((__m128i*)dst, v);
+	return utf16_pack_length[mask];
+}
+
+static FORCE_INLINE TARGET_ATTR("sse4.1") size_t utf16_to_utf8_sse(const uint16_t* src, size_t len, uint8_t* dst)
+{
+	const __m128i m80 = _mm_set1_epi16((short)0xff80);
+	uint8_t* start = dst;
+	__m128i v;
+	uint32_t cp;
+	size_t i = 0, n, end;
+
+	while (len - i >= 16) {
+		v = _mm_loadu_si128((const __m128i*)&src[i]);
+		if (_mm_testz_si128(v, m80)) {
+			_mm_storel_epi64((__m128i*)dst, _mm_packus_epi16(v, v));
+			dst += 8;
+			i += 8;
+		} else if ((n = utf16_to_utf8_block_sse(v, dst)) != 0) {
+			dst += n;
+			i += 8;
+		} else {
+			end = i + 8;
+			while (i < end) {
+				i += utf16_decode(&src[i], len - i, &cp);
+				dst += utf8_encode(cp, dst);
+			}
+		}
+	}
+	return (dst - start) + utf16_to_utf8_tail(&src[i], len - i, dst);
+}
+
+/*
+ * Check that the first 8 bytes of v, which must start on a character, are
+ * well formed UTF-8 with no sequence longer than 3 bytes, and return the
+ * mask of the bytes that end a character, or -1 if they aren't.
+ * We look at 10 bytes, to make sure that characters that end at byte 7
+ * really do, and at the 2 previous bytes for each one (zero before v), so
+ * that the sequence each of them ends can be found without decoding.
+ */
+static FORCE_INLINE TARGET_ATTR("sse4.1") int utf8_block_sse(__m128i v, __m128i* ascii, __m128i* lead2)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i p1 = _mm_slli_si128(v, 1), cont, lead3, expect, bad;
+
+	*ascii = _mm_cmpgt_epi8(v, _mm_set1_epi8(-1));
+	cont = _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)0xc0)), _mm_set1_epi8((char)0x80));
+	// 0xc0 and 0xc1 can only start overlong sequences
+	*lead2 = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)0xfe)), _mm_set1_epi8((char)0xc0)),
+		_mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)0xe0)), _mm_set1_epi8((char)0xc0)));
+	lead3 = _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)0xf0)), _mm_set1_epi8((char)0xe0));
+	expect = _mm_or_si128(_mm_or_si128(_mm_slli_si128(*lead2, 1), _mm_slli_si128(lead3, 1)), _mm_slli_si128(lead3, 2));
+	bad = _mm_or_si128(_mm_xor_si128(cont, expect),
+		_mm_cmpeq_epi8(_mm_or_si128(_mm_or_si128(*ascii, cont), _mm_or_si128(*lead2, lead3)), zero));
+	// Overlong 3 byte sequences and surrogates
+	bad = _mm_or_si128(bad, _mm_and_si128(_mm_cmpeq_epi8(p1, _mm_set1_epi8((char)0xe0)),
+		_mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8((char)0x9f)), v)));
+	bad = _mm_or_si128(bad, _mm_and_si128(_mm_cmpeq_epi8(p1, _mm_set1_epi8((char)0xed)),
+		_mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8((char)0xa0)), v)));
+	if (_mm_movemask_epi8(bad) & 0x3ff)
+		return -1;
+	return ~(_mm_movemask_epi8(cont) >> 1) & 0xff;
+}
+
+static FORCE_INLINE TARGET_ATTR("sse4.1") size_t utf8_to_utf16_length_sse(const uint8_t* src, size_t len)
+{
+	__m128i v, ascii, lead2;
+	uint32_t cp;
+	size_t i = 0, count = 0;
+	int mask;
+
+	while (len - i >= 16) {
+		v = _mm_loadu_si128((const __m128i*)&src[i]);
+		if (_mm_movemask_epi8(v) == 0) {
+			count += 16;
+			i += 16;
+		} else if ((mask = utf8_block_sse(v, &ascii, &lead2)) >= 0) {
+			count += utf8_unpack_length[mask];
+			i += utf8_unpack_advance[mask];
+		} else {
+			i += utf8_decode(&src[i], len - i, &cp);
+			count += (cp >= 0x10000) ? 2 : 1;
+		}
+	}
+	return count + utf8_to_utf16_length_tail(&src[i], len - i);
+}
+
+static FORCE_INLINE TARGET_ATTR("sse4.1") size_t utf8_to_utf16_sse(const uint8_t* src, size_t len, uint16_t* dst)
+{
+	const __m128i m3f = _mm_set1_epi16(0x3f);
+	uint16_t* start = dst;
+	__m128i v, ascii, lead2, c0, c1, c2, low, cp2, cp3;
+	uint32_t cp;
+	size_t i = 0;
+	int mask;
+
+	while (len - i >= 16) {
+		v = _mm_loadu_si128((const __m128i*)&src[i]);
+		if (_mm_movemask_epi8(v) == 0) {
+			_mm_storeu_si128((__m128i*)dst, _mm_unpacklo_epi8(v, _mm_setzero_si128()));
+			_mm_storeu_si128((__m128i*)&dst[8], _mm_unpackhi_epi8(v, _mm_setzero_si128()));
+			dst += 16;
+			i += 16;
+		} else if ((len - i >= 32) && (mask = utf8_block_sse(v, &ascii, &lead2)) >= 0) {
+			// Decode the sequence that ends at each byte, as if it did, then keep the ones that do
+			c0 = _mm_cvtepu8_epi16(v);
+			c1 = _mm_cvtepu8_epi16(_mm_slli_si128(v, 1));
+			c2 = _mm_cvtepu8_epi16(_mm_slli_si128(v, 2));
+			low = _mm_and_si128(c0, m3f);
+			cp2 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(c1, _mm_set1_epi16(0x1f)), 6), low);
+			cp3 = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(c2, 12), _mm_slli_epi16(_mm_and_si128(c1, m3f), 6)), low);
+			v = _mm_blendv_epi8(cp3, cp2, _mm_cvtepi8_epi16(_mm_slli_si128(lead2, 1)));
+			v = _mm_blendv_epi8(v, c0, _mm_cvtepi8_epi16(ascii));
+			v = _mm_shuffle_epi8(v, _mm_loadu_si128((const __m128i*)utf8_unpack_shuffle[mask]));
+			_mm_storeu_si128((__m128i*)dst, v);
+			dst += utf8_unpack_length[mask];
+			i += utf8_unpack_advance[mask];
+		} else {
+			i += utf8_decode(&src[i], len - i, &cp);
+			dst += utf16_encode(cp, dst);
+		}
+	}
+	return (dst - start) + utf8_to_utf16_tail(&src[i], len - i, dst);
+}
+
+// Return the errors in v, given the vector that precedes it
+static FORCE_INLINE TARGET_ATTR("sse4.1") __m128i utf8_check_sse(__m128i v, __m128i prev)
+{
+	const __m128i m0f = _mm_set1_epi8(0x0f);
+	__m128i prev1 = _mm_alignr_epi8(v, prev, 15), sc, must23;
+
+	sc = _mm_and_si128(_mm_and_si128(
+		_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)utf8_byte_1_high), _mm_and_si128(_mm_srli_epi16(prev1, 4), m0f)),
+		_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)utf8_byte_1_low), _mm_and_si128(prev1, m0f))),
+		_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)utf8_byte_2_high), _mm_and_si128(_mm_srli_epi16(v, 4), m0f)));
+	// Bytes that must be the 2nd continuation of a 3 byte lead or the 3rd of a 4 byte one
+	must23 = _mm_or_si128(_mm_subs_epu8(_mm_alignr_epi8(v, prev, 14), _mm_set1_epi8((char)(0xe0 - 0x80))),
+		_mm_subs_epu8(_mm_alignr_epi8(v, prev, 13), _mm_set1_epi8((char)(0xf0 - 0x80))));
+	return _mm_xor_si128(_mm_and_si128(must23, _mm_set1_epi8((char)0x80)), sc);
+}
+
+static FORCE_INLINE TARGET_ATTR("sse4.1") size_t utf8_validate_sse(const uint8_t* src, size_t len)
+{
+	__m128i v[4], prev = _mm_setzero_si128(), incomplete = _mm_setzero_si128(), error;
+	size_t i;
+
+	for (i = 0; len - i >= 64; i += 64) {
+		v[0] = _mm_loadu_si128((const __m128i*)&src[i]);
+		v[1] = _mm_loadu_si128((const __m128i*)&src[i + 16]);
+		v[2] = _mm_loadu_si128((const __m128i*)&src[i + 32]);
+		v[3] = _mm_loadu_si128((const __m128i*)&src[i + 48]);
+		if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(v[0], v[1]), _mm_or_si128(v[2], v[3]))) == 0) {
+			error = incomplete;
+		} else {
+			error = _mm_or_si128(_mm_or_si128(utf8_check_sse(v[0], prev), utf8_check_sse(v[1], v[0])),
+				_mm_or_si128(utf8_check_sse(v[2], v[1]), utf8_check_sse(v[3], v[2])));
+		}
+		if (!_mm_testz_si128(error, error))
+			return utf8_validate_from(src, len, i);
+		incomplete = _mm_subs_epu8(v[3], _mm_loadu_si128((const __m128i*)&utf8_max_last[16]));
+		prev = v[3];
+	}
+	return utf8_validate_from(src, len, i);
+}
+
+static TARGET_ATTR("sse4.1") size_t utf16_to_utf8_length_sse41(const uint16_t* src, size_t len)
+{
+	return utf16_to_utf8_length_sse(src, len);
+}
+
+static TARGET_ATTR("sse4.1") size_t utf16_to_utf8_sse41(const uint16_t* src, size_t len, uint8_t* dst)
+{
+	return utf16_to_utf8_sse(src, len, dst);
+}
+
+static TARGET_ATTR("sse4.1") size_t utf8_to_utf16_length_sse41(const uint8_t* src, size_t len)
+{
+	return utf8_to_utf16_length_sse(src, len);
+}
+
+static TARGET_ATTR("sse4.1") size_t utf8_to_utf16_sse41(const uint8_t* src, size_t len, uint16_t* dst)
+{
+	return utf8_to_utf16_sse(src, len, dst);
+}
+
+static TARGET_ATTR("sse4.1") size_t utf8_validate_sse41(const uint8_t* src, size_t len)
+{
+	return utf8_validate_sse(src, len);
+}
+
+static const utf_kernel_t utf_sse41_kernel = {
+	utf16_to_utf8_length_sse41, utf16_to_utf8_sse41,
+	utf8_to_utf16_length_sse41, utf8_to_utf16_sse41,
+	utf8_validate_sse41
+};
+
+/*
+ * AVX2 doubles the width of the counting and of the ASCII paths. We fall
+ * back to the SSE code for the rest, which mostly helps short strings.
+ */
+static TARGET_ATTR("avx2") size_t utf16_to_utf8_length_avx2(const uint16_t* src, size_t len)
+{
+	const __m256i m80 = _mm256_set1_epi16((short)0xff80), m800 = _mm256_set1_epi16((short)0xf800);
+	const __m256i msurr = _mm256_set1_epi16((short)0xfc00), one = _mm256_set1_epi16(1);
+	const __m256i high = _mm256_set1_epi16((short)0xd800), low = _mm256_set1_epi16((short)0xdc00);
+	__m256i v, next, pair, acc;
+	__m128i sum;
+	size_t i = 0, count = 0, n;
+
+	while (len - i > 16) {
+		acc = _mm256_setzero_si256();
+		n = UTF_MIN((len - i - 1) / 16, UTF_FLUSH);
+		count += 3 * 16 * n;
+		for (; n > 0; n--, i += 16) {
+			v = _mm256_loadu_si256((const __m256i*)&src[i]);
+			next = _mm256_loadu_si256((const __m256i*)&src[i + 1]);
+			acc = _mm256_add_epi16(acc, _mm256_cmpeq_epi16(_mm256_and_si256(v, m80), _mm256_setzero_si256()));
+			acc = _mm256_add_epi16(acc, _mm256_cmpeq_epi16(_mm256_and_si256(v, m800), _mm256_setzero_si256()));
+			pair = _mm256_and_si256(_mm256_cmpeq_epi16(_mm256_and_si256(v, msurr), high),
+				_mm256_cmpeq_epi16(_mm256_and_si256(next, msurr), low));
+			acc = _mm256_add_epi16(acc, _mm256_add_epi16(pair, pair));
+		}
+		acc = _mm256_madd_epi16(acc, one);
+		sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+		count -= (size_t)-_mm_cvtsi128_si32(sum);
+	}
+	return count + utf16_to_utf8_length_sse(&src[i], len - i);
+}
+
+static TARGET_ATTR("avx2") size_t utf16_to_utf8_avx2(const uint16_t* src, size_t len, uint8_t* dst)
+{
+	const __m256i m80 = _mm256_set1_epi16((short)0xff80);
+	uint8_t* start = dst;
+	__m256i v;
+	size_t i = 0;
+
+	while (len - i >= 16) {
+		v = _mm256_loadu_si256((const __m256i*)&src[i]);
+		if (!_mm256_testz_si256(v, m80))
+			break;
+		v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), _MM_SHUFFLE(3, 1, 2, 0));
+		_mm_storeu_si128((__m128i*)dst, _mm256_castsi256_si128(v));
+		dst += 16;
+		i += 16;
+	}
+	return (dst - start) + utf16_to_utf8_sse(&src[i], len - i, dst);
+}
+
+static TARGET_ATTR("avx2") size_t utf8_to_utf16_length_avx2(const uint8_t* src, size_t len)
+{
+	size_t i = 0;
+
+	while (len - i >= 32 && _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i*)&src[i])) == 0)
+		i += 32;
+	return i + utf8_to_utf16_length_sse(&src[i], len - i);
+}
+
+static TARGET_ATTR("avx2") size_t utf8_to_utf16_avx2(const uint8_t* src, size_t len, uint16_t* dst)
+{
+	__m256i v;
+	size_t i = 0;
+
+	while (len - i >= 32) {
+		v = _mm256_loadu_si256((const __m256i*)&src[i]);
+		if (_mm256_movemask_epi8(v) != 0)
+			break;
+		_mm256_storeu_si256((__m256i*)&dst[i], _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v)));
+		_mm256_storeu_si256((__m256i*)&dst[i + 16], _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1)));
+		i += 32;
+	}
+	return i + utf8_to_utf16_sse(&src[i], len - i, &dst[i]);
+}
+
+static FORCE_INLINE TARGET_ATTR("avx2") __m256i utf8_check_avx2(__m256i v, __m256i prev)
+{
+	const __m256i m0f = _mm256_set1_epi8(0x0f);
+	// The byte shifts only work within 128-bit lanes, so we need the previous lane as well
+	__m256i prev_lane = _mm256_permute2x128_si256(prev, v, 0x21), prev1, sc, must23;
+
+	prev1 = _mm256_alignr_epi8(v, prev_lane, 15);
+	sc = _mm256_and_si256(_mm256_and_si256(
+		_mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)utf8_byte_1_high)),
+			_mm256_and_si256(_mm256_srli_epi16(prev1, 4), m0f)),
+		_mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)utf8_byte_1_low)),
+			_mm256_and_si256(prev1, m0f))),
+		_mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)utf8_byte_2_high)),
+			_mm256_and_si256(_mm256_srli_epi16(v, 4), m0f)));
+	must23 = _mm256_or_si256(_mm256_subs_epu8(_mm256_alignr_epi8(v, prev_lane, 14), _mm256_set1_epi8((char)(0xe0 - 0x80))),
+		_mm256_subs_epu8(_mm256_alignr_epi8(v, prev_lane, 13), _mm256_set1_epi8((char)(0xf0 - 0x80))));
+	return _mm256_xor_si256(_mm256_and_si256(must23, _mm256_set1_epi8((char)0x80)), sc);
+}
+
+static TARGET_ATTR("avx2") size_t utf8_validate_avx2(const uint8_t* src, size_t len)
+{
+	__m256i v0, v1, prev = _mm256_setzero_si256(), incomplete = _mm256_setzero_si256(), error;
+	size_t i;
+
+	for (i = 0; len - i >= 64; i += 64) {
+		v0 = _mm256_loadu_si256((const __m256i*)&src[i]);
+		v1 = _mm256_loadu_si256((const __m256i*)&src[i + 32]);
+		if (_mm256_movemask_epi8(_mm256_or_si256(v0, v1)) == 0)
+			error = incomplete;
+		else
+			error = _mm256_or_si256(utf8_check_avx2(v0, prev), utf8_check_avx2(v1, v0));
+		if (!_mm256_testz_si256(error, error))
+			return utf8_validate_from(src, len, i);
+		incomplete = _mm256_subs_epu8(v1, _mm256_loadu_si256((const __m256i*)utf8_max_last));
+		prev = v1;
+	}
+	return utf8_validate_from(src, len, i);
+}
+
+static const utf_kernel_t utf_avx2_kernel = {
+	utf16_to_utf8_length_avx2, utf16_to_utf8_avx2,
+	utf8_to_utf16_length_avx2, utf8_to_utf16_avx2,
+	utf8_validate_avx2
+};
+#endif
+
+#if defined(CPU_ARM64)
+static size_t utf16_to_utf8_length_neon(const uint16_t* src, size_t len)
+{
+	const uint16x8_t m80 = vdupq_n_u16(0xff80), m800 = vdupq_n_u16(0xf800), msurr = vdupq_n_u16(0xfc00);
+	const uint16x8_t high = vdupq_n_u16(0xd800), low = vdupq_n_u16(0xdc00);
+	uint16x8_t v, next, pair, acc;
+	size_t i = 0, count = 0, n;
+
+	while (len - i > 8) {
+		acc = vdupq_n_u16(0);
+		n = UTF_MIN((len - i - 1) / 8, UTF_FLUSH);
+		for (; n > 0; n--, i += 8) {
+			v = vld1q_u16(&src[i]);
+			next = vld1q_u16(&src[i + 1]);
+			// vtstq is all ones for a non zero lane, i.e. an extra byte
+			acc = vsubq_u16(acc, vtstq_u16(v, m80));
+			acc = vsubq_u16(acc, vtstq_u16(v, m800));
+			pair = vandq_u16(vceqq_u16(vandq_u16(v, msurr), high), vceqq_u16(vandq_u16(next, msurr), low));
+			acc = vaddq_u16(acc, vaddq_u16(pair, pair));
+			count += 8;
+		}
+		// The -2 of a pair always cancels the extra bytes of its high surrogate
+		count += vaddlvq_u16(acc);
+	}
+	return count + utf16_to_utf8_length_tail(&src[i], len - i);
+}
+
+static size_t utf16_to_utf8_neon(const uint16_t* src, size_t len, uint8_t* dst)
+{
+	const uint16x8_t m80 = vdupq_n_u16(0xff80), m800 = vdupq_n_u16(0xf800), m3f = vdupq_n_u16(0x3f);
+	const uint16x8_t lead = vdupq_n_u16(0xc0), cont = vdupq_n_u16(0x80);
+	static const uint16_t lane_bit[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+	const uint16x8_t bit = vld1q_u16(lane_bit);
+	uint8_t* start = dst;
+	uint16x8_t v, ascii, two;
+	uint32_t cp;
+	size_t i = 0, mask, end;
+
+	while (len - i >= 16) {
+		v = vld1q_u16(&src[i]);
+		if (vmaxvq_u16(vandq_u16(v, m80)) == 0) {
+			vst1_u8(dst, vmovn_u16(v));
+			dst += 8;
+			i += 8;
+		} else if (vmaxvq_u16(vandq_u16(v, m800)) == 0) {
+			ascii = vceqq_u16(vandq_u16(v, m80), vdupq_n_u16(0));
+			two = vorrq_u16(vorrq_u16(vshrq_n_u16(v, 6), lead), vshlq_n_u16(vorrq_u16(vandq_u16(v, m3f), cont), 8));
+			v = vbslq_u16(ascii, v, two);
+			mask = vaddvq_u16(vandq_u16(ascii, bit));
+			vst1q_u8(dst, vqtbl1q_u8(vreinterpretq_u8_u16(v), vld1q_u8(utf16_pack_shuffle[mask])));
+			dst += utf16_pack_length[mask];
+			i += 8;
+		} else {
+			end = i + 8;
+			while (i < end) {
+				i += utf16_decode(&src[i], len - i, &cp);
+				dst += utf8_encode(cp, dst);
+			}
+		}
+	}
+	return (dst - start) + utf16_to_utf8_tail(&src[i], len - i, dst);
+}
+
+// Same as utf8_block_sse()
+static FORCE_INLINE int utf8_block_neon(uint8x16_t v, uint8x16_t* ascii, uint8x16_t* lead2)
+{
+	static const uint8_t lane_bit[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+	static const uint8_t first_10[16] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+	const uint8x16_t zero = vdupq_n_u8(0);
+	uint8x16_t p1 = vextq_u8(zero, v, 15), cont, lead3, expect, bad;
+
+	*ascii = vcltq_u8(v, vdupq_n_u8(0x80));
+	cont = vceqq_u8(vandq_u8(v, vdupq_n_u8(0xc0)), vdupq_n_u8(0x80));
+	*lead2 = vandq_u8(vcgeq_u8(v, vdupq_n_u8(0xc2)), vcleq_u8(v, vdupq_n_u8(0xdf)));
+	lead3 = vceqq_u8(vandq_u8(v, vdupq_n_u8(0xf0)), vdupq_n_u8(0xe0));
+	expect = vorrq_u8(vorrq_u8(vextq_u8(zero, *lead2, 15), vextq_u8(zero, lead3, 15)), vextq_u8(zero, lead3, 14));
+	bad = vorrq_u8(veorq_u8(cont, expect), vceqq_u8(vorrq_u8(vorrq_u8(*ascii, cont), vorrq_u8(*lead2, lead3)), zero));
+	bad = vorrq_u8(bad, vandq_u8(vceqq_u8(p1, vdupq_n_u8(0xe0)), vcltq_u8(v, vdupq_n_u8(0xa0))));
+	bad = vorrq_u8(bad, vandq_u8(vceqq_u8(p1, vdupq_n_u8(0xed)), vcgtq_u8(v, vdupq_n_u8(0x9f))));
+	if (vmaxvq_u8(vandq_u8(bad, vld1q_u8(first_10))) != 0)
+		return -1;
+	return ~vaddv_u8(vand_u8(vget_low_u8(vextq_u8(cont, zero, 1)), vld1_u8(lane_bit))) & 0xff;
+}
+
+static size_t utf8_to_utf16_length_neon(const uint8_t* src, size_t len)
+{
+	uint8x16_t v, ascii, lead2;
+	uint32_t cp;
+	size_t i = 0, count = 0;
+	int mask;
+
+	while (len - i >= 16) {
+		v = vld1q_u8(&src[i]);
+		if (vmaxvq_u8(v) < 0x80) {
+			count += 16;
+			i += 16;
+		} else if ((mask = utf8_block_neon(v, &ascii, &lead2)) >= 0) {
+			count += utf8_unpack_length[mask];
+			i += utf8_unpack_advance[mask];
+		} else {
+			i += utf8_decode(&src[i], len - i, &cp);
+			count += (cp >= 0x10000) ? 2 : 1;
+		}
+	}
+	return count + utf8_to_utf16_length_tail(&src[i], len - i);
+}
+
+static size_t utf8_to_utf16_neon(const uint8_t* src, size_t len, uint16_t* dst)
+{
+	const uint8x16_t zero = vdupq_n_u8(0);
+	const uint16x8_t m3f = vdupq_n_u16(0x3f);
+	uint16_t* start = dst;
+	uint8x16_t v, ascii, lead2;
+	uint16x8_t c0, c1, c2, low, cp2, cp3, w;
+	uint32_t cp;
+	size_t i = 0;
+	int mask;
+
+	while (len - i >= 16) {
+		v = vld1q_u8(&src[i]);
+		if (vmaxvq_u8(v) < 0x80) {
+			vst1q_u16(dst, vmovl_u8(vget_low_u8(v)));
+			vst1q_u16(&dst[8], vmovl_high_u8(v));
+			dst += 16;
+			i += 16;
+		} else if ((len - i >= 32) && (mask = utf8_block_neon(v, &ascii, &lead2)) >= 0) {
+			c0 = vmovl_u8(vget_low_u8(v));
+			c1 = vmovl_u8(vget_low_u8(vextq_u8(zero, v, 15)));
+			c2 = vmovl_u8(vget_low_u8(vextq_u8(zero, v, 14)));
+			low = vandq_u16(c0, m3f);
+			cp2 = vorrq_u16(vshlq_n_u16(vandq_u16(c1, vdupq_n_u16(0x1f)), 6), low);
+			cp3 = vorrq_u16(vorrq_u16(vshlq_n_u16(c2, 12), vshlq_n_u16(vandq_u16(c1, m3f), 6)), low);
+			// Widen the byte masks with sign extension, so that they cover all 16 bits
+			w = vbslq_u16(vreinterpretq_u16_s16(vmovl_s8(vreinterpret_s8_u8(vget_low_u8(vextq_u8(zero, lead2, 15))))), cp2, cp3);
+			w = vbslq_u16(vreinterpretq_u16_s16(vmovl_s8(vreinterpret_s8_u8(vget_low_u8(ascii)))), c0, w);
+			vst1q_u8((uint8_t*)dst, vqtbl1q_u8(vreinterpretq_u8_u16(w), vld1q_u8(utf8_unpack_shuffle[mask])));
+			dst += utf8_unpack_length[mask];
+			i += utf8_unpack_advance[mask];
+		} else {
+			i += utf8_decode(&src[i], len - i, &cp);
+			dst += utf16_encode(cp, dst);
+		}
+	}
+	return (dst - start) + utf8_to_utf16_tail(&src[i], len - i, dst);
+}
+
+static FORCE_INLINE uint8x16_t utf8_check_neon(uint8x16_t v, uint8x16_t prev)
+{
+	const uint8x16_t m0f = vdupq_n_u8(0x0f);
+	uint8x16_t prev1 = vextq_u8(prev, v, 15), sc, must23;
+
+	sc = vandq_u8(vandq_u8(vqtbl1q_u8(vld1q_u8(utf8_byte_1_high), vshrq_n_u8(prev1, 4)),
+		vqtbl1q_u8(vld1q_u8(utf8_byte_1_low), vandq_u8(prev1, m0f))),
+		vqtbl1q_u8(vld1q_u8(utf8_byte_2_high), vshrq_n_u8(v, 4)));
+	must23 = vorrq_u8(vqsubq_u8(vextq_u8(prev, v, 14), vdupq_n_u8(0xe0 - 0x80)),
+		vqsubq_u8(vextq_u8(prev, v, 13), vdupq_n_u8(0xf0 - 0x80)));
+	return veorq_u8(vandq_u8(must23, vdupq_n_u8(0x80)), sc);
+}
+
+static size_t utf8_validate_neon(const uint8_t* src, size_t len)
+{
+	uint8x16_t v[4], prev = vdupq_n_u8(0), incomplete = vdupq_n_u8(0), error;
+	size_t i;
+
+	for (i = 0; len - i >= 64; i += 64) {
+		v[0] = vld1q_u8(&src[i]);
+		v[1] = vld1q_u8(&src[i + 16]);
+		v[2] = vld1q_u8(&src[i + 32]);
+		v[3] = vld1q_u8(&src[i + 48]);
+		if (vmaxvq_u8(vorrq_u8(vorrq_u8(v[0], v[1]), vorrq_u8(v[2], v[3]))) < 0x80) {
+			error = incomplete;
+		} else {
+			error = vorrq_u8(vorrq_u8(utf8_check_neon(v[0], prev), utf8_check_neon(v[1], v[0])),
+				vorrq_u8(utf8_check_neon(v[2], v[1]), utf8_check_neon(v[3], v[2])));
+		}
+		if (vmaxvq_u8(error) != 0)
+			return utf8_validate_from(src, len, i);
+		incomplete = vqsubq_u8(v[3], vld1q_u8(&utf8_max_last[16]));
+		prev = v[3];
+	}
+	return utf8_validate_from(src, len, i);
+}
+
+static const utf_kernel_t utf_neon_kernel = {
+	utf16_to_utf8_length_neon, utf16_to_utf8_neon,
+	utf8_to_utf16_length_neon, utf8_to_utf16_neon,
+	utf8_validate_neon
+};
+#endif
+
+static const cpu_variant_t utf_variant[] = {
+#if defined(CPU_X86)
+	CPU_VARIANT(CPU_FEATURE_AVX2 | CPU_FEATURE_SSE41, &utf_avx2_kernel, "AVX2"),
+	CPU_VARIANT(CPU_FEATURE_SSE41 | CPU_FEATURE_SSSE3, &utf_sse41_kernel, "SSE4.1"),
+#elif defined(CPU_ARM64)
+	CPU_VARIANT(CPU_FEATURE_NEON, &utf_neon_kernel, "NEON"),
+#endif
+	CPU_VARIANT(0, &utf_scalar_kernel, "Scalar"),
+};
+
+/*
+ * Build the tables and select the fastest implementation for this CPU.
+ * DetectCpuFeatures() must have been called first.
+ */
+void utf_init(void)
+{
+	const cpu_variant_t* v;
+	int mask, lane, n;
+
+	for (mask = 0; mask < 256; mask++) {
+		memset(utf16_pack_shuffle[mask], 0x80, sizeof(utf16_pack_shuffle[mask]));
+		for (n = 0, lane = 0; lane < 8; lane++) {
+			utf16_pack_shuffle[mask][n++] = (uint8_t)(2 * lane);
+			if (!(mask & (1 << lane)))
+				utf16_pack_shuffle[mask][n++] = (uint8_t)(2 * lane + 1);
+		}
+		utf16_pack_length[mask] = (uint8_t)n;
+
+		memset(utf8_unpack_shuffle[mask], 0x80, sizeof(utf8_unpack_shuffle[mask]));
+		utf8_unpack_advance[mask] = 0;
+		for (n = 0, lane = 0; lane < 8; lane++) {
+			if (!(mask & (1 << lane)))
+				continue;
+			utf8_unpack_shuffle[mask][n++] = (uint8_t)(2 * lane);
+			utf8_unpack_shuffle[mask][n++] = (uint8_t)(2 * lane + 1);
+			utf8_unpack_advance[mask] = (uint8_t)(lane + 1);
+		}
+		utf8_unpack_length[mask] = (uint8_t)(n / 2);
+	}
+
+	v = SelectCpuVariant(utf_variant);
+	utf_kernel = (const utf_kernel_t*)v->impl;
+	utf_name = v->name;
+}
+
+const char* utf_impl(void)
+{
+	return utf_name;
+}
+
+size_t utf16_to_utf8_length(const uint16_t* src, size_t len)
+{
+	return utf_kernel->utf16_to_utf8_length(src, len);
+}
+
+size_t utf8_to_utf16_length(const char* src, size_t len)
+{
+	return utf_kernel->utf8_to_utf16_length((const uint8_t*)src, len);
+}
+
+size_t utf16_to_utf8(const uint16_t* src, size_t len, char* dst)
+{
+	return utf_kernel->utf16_to_utf8(src, len, (uint8_t*)dst);
+}
+
+size_t utf8_to_utf16(const char* src, size_t len, uint16_t* dst)
+{
+	return utf_kernel->utf8_to_utf16((const uint8_t*)src, len, dst);
+}
+
+size_t utf8_validate(const char* src, size_t len)
+{
+	return utf_kernel->utf8_validate((const uint8_t*)src, len);
+}
+
+static uint64_t utf_random(uint64_t* seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+	return *seed;
+}
+
+// A code point from every range the kernels handle differently, or a lone surrogate, which they must replace
+static uint32_t utf_random_cp(uint64_t* seed)
+{
+	uint64_t r = utf_random(seed);
+
+	switch (r % 8) {
+	case 0: case 1: case 2:
+		return (uint32_t)(r >> 8) % 0x80;
+	case 3:
+		return 0x80 + (uint32_t)(r >> 8) % (0x800 - 0x80);
+	case 4:
+		return 0x800 + (uint32_t)(r >> 8) % (0xd800 - 0x800);
+	case 5:
+		return 0xe000 + (uint32_t)(r >> 8) % (0x10000 - 0xe000);
+	case 6:
+		return 0x10000 + (uint32_t)(r >> 8) % (0x110000 - 0x10000);
+	default:
+		return 0xd800 + (uint32_t)(r >> 8) % 0x800;
+	}
+}
+
+size_t utf_check(uint64_t seed, size_t rounds)
+{
+	static uint16_t w[2 * UTF_CHECK_MAX], w1[4 * UTF_CHECK_MAX], w2[4 * UTF_CHECK_MAX];
+	static uint8_t u[4 * UTF_CHECK_MAX], u1[4 * UTF_CHECK_MAX], u2[4 * UTF_CHECK_MAX];
+	const utf_kernel_t* k = utf_kernel;
+	const utf_kernel_t* ref = &utf_scalar_kernel;
+	size_t i, j, n, wlen, ulen, l1, l2, errors = 0;
+	uint32_t cp;
+
+	if (seed == 0)
+		seed = 0x2545f4914f6cdd1dULL;
+	for (i = 0; i < rounds; i++) {
+		n = (size_t)(utf_random(&seed) % UTF_CHECK_MAX);
+		for (wlen = 0, ulen = 0, j = 0; j < n; j++) {
+			cp = utf_random_cp(&seed);
+			if (cp >= 0x10000) {
+				w[wlen++] = (uint16_t)(0xd800 + ((cp - 0x10000) >> 10));
+				w[wlen++] = (uint16_t)(0xdc00 + ((cp - 0x10000) & 0x3ff));
+			} else {
+				w[wlen++] = (uint16_t)cp;
+			}
+			// Encode the surrogates as is too, which is one way of getting malformed UTF-8
+			ulen += utf8_encode(cp, &u[ulen]);
+		}
+		// And some random bytes, for the rest of the ways
+		for (j = utf_random(&seed) % 4; j > 0 && ulen > 0; j--)
+			u[utf_random(&seed) % ulen] = (uint8_t)utf_random(&seed);
+
+		l1 = k->utf16_to_utf8(w, wlen, u1);
+		l2 = ref->utf16_to_utf8(w, wlen, u2);
+		if ((k->utf16_to_utf8_length(w, wlen) != l2) || (l1 != l2) || (memcmp(u1, u2, l2) != 0)) {
+			errors++;
+			continue;
+		}
+		l1 = k->utf8_to_utf16(u, ulen, w1);
+		l2 = ref->utf8_to_utf16(u, ulen, w2);
+		if ((k->utf8_to_utf16_length(u, ulen) != l2) || (l1 != l2) ||
+			(memcmp(w1, w2, l2 * sizeof(uint16_t)) != 0) ||
+			(k->utf8_validate(u, ulen) != ref->utf8_validate(u, ulen)))
+			errors++;
+	}
+	return errors;
+}
@@ -0,0 +1,60 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * UTF-16 <-> UTF-8 transcoding
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * These do not depend on Windows, so that they can be tested anywhere.
+ * Lengths are in code units and do not include a NUL terminator. Like
+ * Windows does, invalid sequences (unpaired surrogates, malformed UTF-8)
+ * are replaced with U+FFFD, one per maximal invalid subpart.
+ * Until utf_init() has been called, the scalar implementation is used.
+ */
+extern void utf_init(void);
+extern const char* utf_impl(void);
+
+// Return the exact size of the output of the matching conversion below
+extern size_t utf16_to_utf8_length(const uint16_t* src, size_t len);
+extern size_t utf8_to_utf16_length(const char* src, size_t len);
+
+// Convert len code units, and return the number of code units written
+extern size_t utf16_to_utf8(const uint16_t* src, size_t len, char* dst);
+extern size_t utf8_to_utf16(const char* src, size_t len, uint16_t* dst);
+
+// Return the offset of the first invalid UTF-8 sequence, or len if there are none
+extern size_t utf8_validate(const char* src, size_t len);
+
+/*
+ * Check the implementation utf_init() selected against the scalar one, on
+ * rounds strings of random code points, unpaired surrogates and malformed
+ * UTF-8, from seed. Returns the number of strings they disagree on.
+ */
+extern size_t utf_check(uint64_t seed, size_t rounds);
+
+#ifdef __cplusplus
+}
+#endif
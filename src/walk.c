@@ -0,0 +1,265 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Parallel directory traversal
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "msapi_utf8.h"
+#include "pool.h"
+#include "walk.h"
+
+// Maximum number of entries, and size of the paths, that a file batch holds
+#define WALK_BATCH_ENTRIES	64
+#define WALK_BATCH_SIZE		(32 * 1024)
+// Worst case size of the UTF-8 version of a file name, with its separator and NUL
+#define WALK_NAME_MAX		(3 * MAX_PATH + 2)
+
+typedef struct {
+	pool_t* pool;
+	pool_group_t group;
+	DWORD flags;
+	walk_fn fn;
+	void* ctx;
+	volatile LONG root_error;
+	volatile LONG64 files;
+	volatile LONG64 directories;
+	volatile LONG64 bytes;
+	volatile LONG64 errors;
+} walk_t;
+
+typedef struct {
+	walk_t* walk;
+	BOOL root;
+	size_t len;
+	wchar_t path[1];
+} walk_dir_t;
+
+typedef struct {
+	walk_t* walk;
+	DWORD count;
+	size_t used, size;
+	walk_entry_t entry[WALK_BATCH_ENTRIES];
+	// WALK_BATCH_SIZE, or room for a single entry if the directory is longer than that
+	char buf[1];
+} walk_batch_t;
+
+static void WalkDirectoryTask(void* ctx, uint32_t worker);
+
+static void WalkBatchTask(void* ctx, uint32_t worker)
+{
+	walk_batch_t* batch = (walk_batch_t*)ctx;
+	walk_t* walk = batch->walk;
+	DWORD i;
+
+	for (i = 0; (i < batch->count) && !TaskCancelled(walk->pool, &walk->group); i++) {
+		if (!walk->fn(walk->ctx, worker, &batch->entry[i])) {
+			CancelTaskGroup(&walk->group);
+			break;
+		}
+	}
+	free(batch);
+}
+
+static void QueueBatch(walk_t* walk, walk_batch_t* batch)
+{
+	if (batch == NULL)
+		return;
+	if (!SubmitTask(walk->pool, &walk->group, WalkBatchTask, batch)) {
+		free(batch);
+		CancelTaskGroup(&walk->group);
+	}
+}
+
+// Queue the listing of parent\name, or of parent alone if name is NULL
+static void QueueDirectory(walk_t* walk, const wchar_t* parent, size_t parent_len, const wchar_t* name)
+{
+	size_t name_len = (name == NULL) ? 0 : wcslen(name);
+	size_t len = parent_len + ((name == NULL) ? 0 : 1 + name_len);
+	// Leave room for the "\*" we need to list it
+	walk_dir_t* dir = (walk_dir_t*)malloc(sizeof(walk_dir_t) + (len + 2) * sizeof(wchar_t));
+
+	if (dir == NULL) {
+		CancelTaskGroup(&walk->group);
+		return;
+	}
+	dir->walk = walk;
+	dir->root = (name == NULL);
+	dir->len = len;
+	memcpy(dir->path, parent, parent_len * sizeof(wchar_t));
+	if (name != NULL) {
+		dir->path[parent_len] = L'\\';
+		memcpy(&dir->path[parent_len + 1], name, name_len * sizeof(wchar_t));
+	}
+	dir->path[len] = 0;
+	if (!SubmitTask(walk->pool, &walk->group, WalkDirectoryTask, dir)) {
+		free(dir);
+		CancelTaskGroup(&walk->group);
+	}
+}
+
+/*
+ * Add an entry to the current batch of a directory, queuing the batch
+ * and starting a new one as needed. Returns the current batch.
+ */
+static walk_batch_t* AddEntry(walk_t* walk, walk_batch_t* batch, const char* dir, size_t dir_len,
+	const WIN32_FIND_DATAW* fd)
+{
+	walk_entry_t* entry;
+	char* path;
+	size_t buf_size = max((size_t)WALK_BATCH_SIZE, dir_len + WALK_NAME_MAX);
+	int size;
+
+	if ((batch != NULL) && ((batch->count == WALK_BATCH_ENTRIES) ||
+		(batch->used + dir_len + WALK_NAME_MAX > batch->size))) {
+		QueueBatch(walk, batch);
+		batch = NULL;
+	}
+	if (batch == NULL) {
+		batch = (walk_batch_t*)malloc(sizeof(walk_batch_t) + buf_size);
+		if (batch == NULL) {
+			CancelTaskGroup(&walk->group);
+			return NULL;
+		}
+		batch->walk = walk;
+		batch->count = 0;
+		batch->used = 0;
+		batch->size = buf_size;
+	}
+
+	path = &batch->buf[batch->used];
+	memcpy(path, dir, dir_len);
+	path[dir_len] = '\\';
+	size = wchar_to_utf8_no_alloc(fd->cFileName, &path[dir_len + 1], WALK_NAME_MAX - 1);
+	if (size == 0)
+		return batch;
+	entry = &batch->entry[batch->count++];
+	entry->path = path;
+	entry->name = &path[dir_len + 1];
+	entry->attributes = fd->dwFileAttributes;
+	entry->size = ((uint64_t)fd->nFileSizeHigh << 32) | fd->nFileSizeLow;
+	entry->last_write_time = fd->ftLastWriteTime;
+	batch->used += dir_len + 1 + size;
+	return batch;
+}
+
+static void WalkDirectoryTask(void* ctx, uint32_t worker)
+{
+	walk_dir_t* dir = (walk_dir_t*)ctx;
+	walk_t* walk = dir->walk;
+	walk_batch_t* batch = NULL;
+	WIN32_FIND_DATAW fd;
+	HANDLE h;
+	char* udir = NULL;
+	size_t udir_len;
+	LONG64 files = 0, directories = 0, bytes = 0;
+	BOOL is_dir;
+
+	if (TaskCancelled(walk->pool, &walk->group))
+		goto out;
+
+	// The basic info level skips the 8.3 name, and large fetch gets more entries per call
+	wcscpy(&dir->path[dir->len], L"\\*");
+	h = FindFirstFileExW(dir->path, FindExInfoBasic, &fd, FindExSearchNameMatch, NULL,
+		FIND_FIRST_EX_LARGE_FETCH);
+	dir->path[dir->len] = 0;
+	if (h == INVALID_HANDLE_VALUE) {
+		InterlockedIncrement64(&walk->errors);
+		if (dir->root)
+			walk->root_error = TRUE;
+		goto out;
+	}
+	udir = wchar_to_utf8(dir->path);
+	if (udir == NULL) {
+		InterlockedIncrement64(&walk->errors);
+		FindClose(h);
+		goto out;
+	}
+	udir_len = strlen(udir);
+
+	do {
+		if ((wcscmp(fd.cFileName, L".") == 0) || (wcscmp(fd.cFileName, L"..") == 0))
+			continue;
+		is_dir = (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+		if (is_dir) {
+			directories++;
+			if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) ||
+				(walk->flags & WALK_FOLLOW_REPARSE_POINTS))
+				QueueDirectory(walk, dir->path, dir->len, fd.cFileName);
+			if (!(walk->flags & WALK_REPORT_DIRECTORIES))
+				continue;
+		} else {
+			files++;
+			bytes += ((LONG64)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+		}
+		batch = AddEntry(walk, batch, udir, udir_len, &fd);
+	} while (FindNextFileW(h, &fd) && !TaskCancelled(walk->pool, &walk->group));
+	FindClose(h);
+	QueueBatch(walk, batch);
+
+	InterlockedExchangeAdd64(&walk->files, files);
+	InterlockedExchangeAdd64(&walk->directories, directories);
+	InterlockedExchangeAdd64(&walk->bytes, bytes);
+
+out:
+	free(udir);
+	free(dir);
+}
+
+BOOL ParallelWalk(pool_t* pool, const char* root, DWORD flags, walk_fn fn, void* ctx,
+	walk_stats_t* stats)
+{
+	walk_t walk = { 0 };
+	wchar_t* wroot;
+	size_t len;
+	BOOL r;
+
+	if ((root == NULL) || (fn == NULL))
+		return FALSE;
+	wroot = utf8_to_wchar(root);
+	if (wroot == NULL)
+		return FALSE;
+	if (!InitTaskGroup(&walk.group)) {
+		free(wroot);
+		return FALSE;
+	}
+	walk.pool = pool;
+	walk.flags = flags;
+	walk.fn = fn;
+	walk.ctx = ctx;
+
+	len = wcslen(wroot);
+	while ((len > 0) && ((wroot[len - 1] == L'\\') || (wroot[len - 1] == L'/')))
+		len--;
+	QueueDirectory(&walk, wroot, len, NULL);
+	r = WaitTaskGroup(pool, &walk.group) && !walk.root_error;
+	CloseTaskGroup(&walk.group);
+	free(wroot);
+
+	if (stats != NULL) {
+		stats->files = walk.files;
+		stats->directories = walk.directories;
+		stats->bytes = walk.bytes;
+		stats->errors = walk.errors;
+	}
+	return r;
+}
@@ -0,0 +1,64 @@
+/*
+ * base-parallel - A base console application for multithreaded parallel processing
+ * Parallel directory traversal
+ *
+ * Copyright © 2020 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+// Also descend into directory symlinks and junctions, which may create cycles
+#define WALK_FOLLOW_REPARSE_POINTS	0x00000001
+// Also report directories to the callback (in no particular order with their content)
+#define WALK_REPORT_DIRECTORIES		0x00000002
+
+/*
+ * What the directory listing tells us about an entry, so that there
+ * should be no need to query the file system again for it.
+ */
+typedef struct {
+	const char* path;			// UTF-8
+	const char* name;			// Points to the last component of path
+	DWORD attributes;
+	uint64_t size;
+	FILETIME last_write_time;
+} walk_entry_t;
+
+typedef struct {
+	uint64_t files;
+	uint64_t directories;
+	uint64_t bytes;
+	uint64_t errors;			// Directories that could not be listed
+} walk_stats_t;
+
+// Return FALSE to stop the walk
+typedef BOOL (*walk_fn)(void* ctx, uint32_t worker, const walk_entry_t* entry);
+
+/*
+ * Call fn for every file under root, from all the workers of the pool.
+ * Each directory gets listed by a task of its own, which queues tasks for
+ * its subdirectories, as well as tasks that process the files it found in
+ * batches, so that processing starts while the walk is still going.
+ * Returns FALSE if fn stopped the walk, the pool got cancelled or root
+ * could not be listed. stats can be NULL.
+ */
+extern BOOL ParallelWalk(pool_t* pool, const char* root, DWORD flags, walk_fn fn, void* ctx,
+	walk_stats_t* stats);